@@ -0,0 +1,521 @@
+#include "SpectraSTBench.hpp"
+#include "SpectraSTCreateParams.hpp"
+#include "SpectraSTLib.hpp"
+#include "SpectraSTLibEntry.hpp"
+#include "SpectraSTQuery.hpp"
+#include "SpectraSTSearch.hpp"
+#include "SpectraSTSearchMetrics.hpp"
+#include "SpectraSTLog.hpp"
+#include "FileUtils.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTBench
+ *
+ * The benchmark suite.
+ */
+
+extern SpectraSTLog* g_log;
+
+// FORMAT_VERSION - the version of the result format. Bump it when a column or a benchmark is changed or removed.
+const unsigned int SpectraSTBench::FORMAT_VERSION = 1;
+
+// the size of the data per unit of scale
+static const unsigned int BENCH_PEPTIDES_PER_SCALE = 1000;
+static const unsigned int BENCH_REPLICATES = 3;
+
+// BENCH_SEARCH_BLOCK_OPTION, BENCH_SEARCH_SKETCH_OPTION, BENCH_SEARCH_OPEN_MOD_OPTION - the search options of the
+// search benchmarks other than macro.search (block search, the sketch filter, and the open modification search)
+static const char* BENCH_SEARCH_BLOCK_OPTION = "_BLK16";
+static const char* BENCH_SEARCH_SKETCH_OPTION = "_SKD0.1";
+static const char* BENCH_SEARCH_OPEN_MOD_OPTION = "_OMT";
+
+// BENCH_NUM_NEIGHBORS - each query is compared to this many library spectra closest to it in m/z, like the candidates of a search
+static const unsigned int BENCH_NUM_NEIGHBORS = 8;
+
+// constructor
+SpectraSTBench::SpectraSTBench(string workDir, unsigned int scale, unsigned int numRepeats, string filter, unsigned long long seed, bool isVerbose) :
+  m_workDir(workDir),
+  m_scale(scale),
+  m_numRepeats(numRepeats),
+  m_filter(filter),
+  m_seed(seed),
+  m_isVerbose(isVerbose),
+  m_data(NULL),
+  m_searchParams(),
+  m_numQueries(scale * BENCH_PEPTIDES_PER_SCALE),
+  m_numReplicates(BENCH_REPLICATES),
+  m_consensusLibFileName(""),
+  m_results(),
+  m_sink(0.0) {
+
+  m_data = new SpectraSTBenchData(m_seed, m_scale * BENCH_PEPTIDES_PER_SCALE);
+  m_searchParams.finalizeOptions();
+}
+
+// destructor
+SpectraSTBench::~SpectraSTBench() {
+
+  if (m_data) delete (m_data);
+}
+
+// run - runs all selected benchmarks
+void SpectraSTBench::run() {
+
+  if (isSelected("micro.binPeaks")) benchBinPeaks();
+  if (isSelected("micro.rankTransform")) benchRankTransform();
+  if (isSelected("micro.calcDot") || isSelected("micro.calcDotNoBinning") || isSelected("micro.calcDotTierwiseOpenModSearch")) benchDots();
+  if (isSelected("micro.readFromBinaryFile")) benchReadFromBinaryFile();
+  if (isSelected("macro.createRaw") || isSelected("macro.createConsensus")) benchCreate();
+  if (isSelected("micro.indexLookup")) benchIndexLookup();
+  if (isSelected("macro.loadLibrary") || isSelected("macro.search")) benchSearch("macro.search", "");
+  if (isSelected("macro.searchBlock")) benchSearch("macro.searchBlock", BENCH_SEARCH_BLOCK_OPTION);
+  if (isSelected("macro.searchSketch")) benchSearch("macro.searchSketch", BENCH_SEARCH_SKETCH_OPTION);
+  if (isSelected("macro.searchOpenMod")) benchSearch("macro.searchOpenMod", BENCH_SEARCH_OPEN_MOD_OPTION);
+  if (isSelected("macro.searchOpenModSketch")) benchSearch("macro.searchOpenModSketch", string(BENCH_SEARCH_OPEN_MOD_OPTION) + " " + BENCH_SEARCH_SKETCH_OPTION);
+}
+
+// printResults - prints the results in the stable, tab-delimited format
+void SpectraSTBench::printResults(ostream& out) {
+
+  out << "# spectrast-bench format " << FORMAT_VERSION << '\n';
+  out << "# seed=" << m_seed << " scale=" << m_scale << " repeats=" << m_numRepeats;
+  out << " peptides=" << m_data->getNumPeptides() << " replicates=" << m_numReplicates << " queries=" << m_numQueries << '\n';
+  out << "benchmark\tunit\tops\trepeats\tbest_s\tmedian_s\tper_op_us\tops_per_s" << '\n';
+
+  out.setf(ios::fixed);
+  for (vector<benchResult>::iterator r = m_results.begin(); r != m_results.end(); r++) {
+
+    double best = calcBest(r->runTimes);
+    double median = calcMedian(r->runTimes);
+    double numOps = (double)(r->numOps);
+
+    out << r->name << '\t' << r->unit << '\t' << r->numOps << '\t' << r->runTimes.size() << '\t';
+    out.precision(6);
+    out << best << '\t' << median << '\t';
+    out.precision(3);
+    out << (numOps > 0.0 ? median * 1000000.0 / numOps : 0.0) << '\t';
+    out.precision(1);
+    out << (median > 0.0 ? numOps / median : 0.0) << '\n';
+  }
+
+  out.flush();
+}
+
+// isSelected - whether a benchmark is selected by the filter. The filter selects all benchmarks whose name contains it.
+bool SpectraSTBench::isSelected(string name) {
+
+  return (m_filter.empty() || name.find(m_filter) != string::npos);
+}
+
+// addResult - records the timings of a benchmark, if it is selected
+void SpectraSTBench::addResult(string name, string unit, unsigned long long numOps, vector<double>& runTimes) {
+
+  if (!isSelected(name)) return;
+
+  benchResult result;
+  result.name = name;
+  result.unit = unit;
+  result.numOps = numOps;
+  result.runTimes = runTimes;
+  m_results.push_back(result);
+
+  if (m_isVerbose) {
+    cerr << name << ": " << calcMedian(runTimes) << " s" << endl;
+  }
+}
+
+// benchBinPeaks - times binning the peaks of library-like spectra
+void SpectraSTBench::benchBinPeaks() {
+
+  vector<SpectraSTPeakList*> peakLists;
+  createLibPeakLists(peakLists, m_seed + 1);
+
+  vector<double> runTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+    double start = SpectraSTSearchMetrics::now();
+    for (vector<SpectraSTPeakList*>::iterator pl = peakLists.begin(); pl != peakLists.end(); pl++) {
+      (*pl)->binPeaks(m_searchParams.peakBinningNumBinsPerMzUnit, m_searchParams.peakBinningFractionToNeighbor, true);
+    }
+    runTimes.push_back(SpectraSTSearchMetrics::now() - start);
+  }
+  addResult("micro.binPeaks", "spectrum", peakLists.size(), runTimes);
+
+  for (vector<SpectraSTPeakList*>::iterator pl = peakLists.begin(); pl != peakLists.end(); pl++) {
+    delete (*pl);
+  }
+}
+
+// benchRankTransform - times the rank transform of library-like spectra. It changes the peaks, so each run works on fresh copies.
+void SpectraSTBench::benchRankTransform() {
+
+  vector<SpectraSTPeakList*> peakLists;
+  createLibPeakLists(peakLists, m_seed + 1);
+
+  vector<double> runTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+
+    vector<SpectraSTPeakList*> copies;
+    for (vector<SpectraSTPeakList*>::iterator pl = peakLists.begin(); pl != peakLists.end(); pl++) {
+      copies.push_back(new SpectraSTPeakList(**pl));
+    }
+
+    double start = SpectraSTSearchMetrics::now();
+    for (vector<SpectraSTPeakList*>::iterator pl = copies.begin(); pl != copies.end(); pl++) {
+      (*pl)->rankTransform(m_searchParams.filterLibMaxPeaksUsed, true, m_searchParams.filterLightIonsMzThreshold);
+    }
+    runTimes.push_back(SpectraSTSearchMetrics::now() - start);
+
+    for (vector<SpectraSTPeakList*>::iterator pl = copies.begin(); pl != copies.end(); pl++) {
+      delete (*pl);
+    }
+  }
+  addResult("micro.rankTransform", "spectrum", peakLists.size(), runTimes);
+
+  for (vector<SpectraSTPeakList*>::iterator pl = peakLists.begin(); pl != peakLists.end(); pl++) {
+    delete (*pl);
+  }
+}
+
+// benchDots - times the three dot products, comparing each query to the library spectra of its neighbors in m/z.
+// The spectra are prepared for search as in a real search: binned for calcDot, unbinned for the other two.
+void SpectraSTBench::benchDots() {
+
+  SpectraSTSearchParams noBinningParams(m_searchParams);
+  noBinningParams.peakNoBinning = true;
+
+  vector<SpectraSTPeakList*> libBinned;
+  vector<SpectraSTPeakList*> queryBinned;
+  vector<SpectraSTPeakList*> libUnbinned;
+  vector<SpectraSTPeakList*> queryUnbinned;
+  createLibPeakLists(libBinned, m_seed + 1);
+  createQueryPeakLists(queryBinned, m_seed + 2);
+  createLibPeakLists(libUnbinned, m_seed + 1);
+  createQueryPeakLists(queryUnbinned, m_seed + 2);
+
+  for (unsigned int i = 0; i < (unsigned int)(libBinned.size()); i++) {
+    libBinned[i]->prepareForSearch(m_searchParams, true);
+    libUnbinned[i]->prepareForSearch(noBinningParams, true);
+  }
+  for (unsigned int i = 0; i < (unsigned int)(queryBinned.size()); i++) {
+    queryBinned[i]->prepareForSearch(m_searchParams, false);
+    queryUnbinned[i]->prepareForSearch(noBinningParams, false);
+  }
+
+  // the pairs to compare: each query with the library spectra of the peptide ions nearest in m/z, including its own
+  vector<pair<unsigned int, unsigned int> > pairs;
+  unsigned int numLib = (unsigned int)(libBinned.size());
+  for (unsigned int q = 0; q < (unsigned int)(queryBinned.size()); q++) {
+    unsigned int first = (q >= BENCH_NUM_NEIGHBORS / 2 ? q - BENCH_NUM_NEIGHBORS / 2 : 0);
+    if (first + BENCH_NUM_NEIGHBORS > numLib) first = (numLib > BENCH_NUM_NEIGHBORS ? numLib - BENCH_NUM_NEIGHBORS : 0);
+    for (unsigned int l = first; l < first + BENCH_NUM_NEIGHBORS && l < numLib; l++) {
+      pairs.push_back(pair<unsigned int, unsigned int>(q, l));
+    }
+  }
+
+  float mzTolerance = (float)(0.5 / (double)(m_searchParams.peakBinningNumBinsPerMzUnit));
+
+  vector<double> dotTimes;
+  vector<double> noBinningTimes;
+  vector<double> tierwiseTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+
+    double start = SpectraSTSearchMetrics::now();
+    for (vector<pair<unsigned int, unsigned int> >::iterator p = pairs.begin(); p != pairs.end(); p++) {
+      m_sink += queryBinned[p->first]->calcDot(libBinned[p->second]);
+    }
+    dotTimes.push_back(SpectraSTSearchMetrics::now() - start);
+
+    start = SpectraSTSearchMetrics::now();
+    for (vector<pair<unsigned int, unsigned int> >::iterator p = pairs.begin(); p != pairs.end(); p++) {
+      m_sink += queryUnbinned[p->first]->calcDotNoBinning(libUnbinned[p->second], mzTolerance);
+    }
+    noBinningTimes.push_back(SpectraSTSearchMetrics::now() - start);
+
+    start = SpectraSTSearchMetrics::now();
+    for (vector<pair<unsigned int, unsigned int> >::iterator p = pairs.begin(); p != pairs.end(); p++) {
+      pair<double, string> openMod;
+      int numTiersUsed = 0;
+      m_sink += queryUnbinned[p->first]->calcDotTierwiseOpenModSearch(libUnbinned[p->second], mzTolerance, openMod, numTiersUsed);
+    }
+    tierwiseTimes.push_back(SpectraSTSearchMetrics::now() - start);
+  }
+  addResult("micro.calcDot", "pair", pairs.size(), dotTimes);
+  addResult("micro.calcDotNoBinning", "pair", pairs.size(), noBinningTimes);
+  addResult("micro.calcDotTierwiseOpenModSearch", "pair", pairs.size(), tierwiseTimes);
+
+  for (unsigned int i = 0; i < (unsigned int)(libBinned.size()); i++) {
+    delete (libBinned[i]);
+    delete (libUnbinned[i]);
+  }
+  for (unsigned int i = 0; i < (unsigned int)(queryBinned.size()); i++) {
+    delete (queryBinned[i]);
+    delete (queryUnbinned[i]);
+  }
+}
+
+// benchReadFromBinaryFile - times reading library entries in the binary format, as the library index does for a search
+void SpectraSTBench::benchReadFromBinaryFile() {
+
+  string entryFileName = m_workDir + "/bench_entries.bin";
+
+  // write the entries once
+  ofstream fout(entryFileName.c_str(), ios::binary);
+  if (!fout.good()) {
+    g_log->error("BENCH", "Cannot open " + entryFileName + " for writing.");
+    g_log->crash();
+  }
+
+  SpectraSTBenchRandom rng(m_seed + 1);
+  unsigned int numEntries = m_data->getNumPeptides();
+  for (unsigned int index = 0; index < numEntries; index++) {
+    Peptide* pep = new Peptide(*(m_data->getPeptidePtr(index)));
+    SpectraSTPeakList* peakList = m_data->createLibPeakList(index, rng);
+    peakList->setPeptidePtr(pep);
+    SpectraSTLibEntry* entry = new SpectraSTLibEntry(pep, "", "Normal", peakList);
+    entry->writeToBinaryFile(fout);
+    delete (entry);
+  }
+  fout.close();
+
+  vector<double> runTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+
+    ifstream fin(entryFileName.c_str(), ios::binary);
+
+    double start = SpectraSTSearchMetrics::now();
+    for (unsigned int index = 0; index < numEntries; index++) {
+      SpectraSTLibEntry* entry = new SpectraSTLibEntry(fin, true, true);
+      m_sink += entry->getPrecursorMz();
+      delete (entry);
+    }
+    runTimes.push_back(SpectraSTSearchMetrics::now() - start);
+  }
+  addResult("micro.readFromBinaryFile", "entry", numEntries, runTimes);
+
+  removeFile(entryFileName);
+}
+
+// benchCreate - times importing the synthetic replicates into a library, and building a consensus library from that
+void SpectraSTBench::benchCreate() {
+
+  vector<double> rawTimes;
+  vector<double> consensusTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+    double rawTime = 0.0;
+    double consensusTime = 0.0;
+    buildLibraries(rawTime, consensusTime);
+    rawTimes.push_back(rawTime);
+    consensusTimes.push_back(consensusTime);
+  }
+  addResult("macro.createRaw", "spectrum", (unsigned long long)(m_data->getNumPeptides()) * m_numReplicates, rawTimes);
+  addResult("macro.createConsensus", "ion", m_data->getNumPeptides(), consensusTimes);
+}
+
+// benchIndexLookup - times retrieving (and releasing) the library entries around the precursor m/z of each query
+void SpectraSTBench::benchIndexLookup() {
+
+  if (m_consensusLibFileName.empty()) {
+    double rawTime = 0.0;
+    double consensusTime = 0.0;
+    buildLibraries(rawTime, consensusTime);
+  }
+
+  double tolerance = m_searchParams.precursorMzTolerance;
+
+  vector<double> runTimes;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+
+    SpectraSTLib* lib = new SpectraSTLib(m_consensusLibFileName, &m_searchParams);
+
+    double start = SpectraSTSearchMetrics::now();
+    for (unsigned int q = 0; q < m_numQueries; q++) {
+      double precursorMz = m_data->getPrecursorMz(q % m_data->getNumPeptides());
+      vector<SpectraSTLibEntry*> hits;
+      lib->retrieve(hits, precursorMz - tolerance, precursorMz + tolerance);
+      m_sink += (double)(hits.size());
+      lib->release(precursorMz - tolerance, precursorMz + tolerance);
+    }
+    runTimes.push_back(SpectraSTSearchMetrics::now() - start);
+
+    delete (lib);
+  }
+  addResult("micro.indexLookup", "query", m_numQueries, runTimes);
+}
+
+// benchSearch - times loading the consensus library, and searching the queries against it end-to-end, with the given
+// search options (space-separated, as on the command line but without the "-s"). With a block size (-s_BLK) above 1,
+// the queries (which come sorted by precursor m/z) are searched in blocks.
+void SpectraSTBench::benchSearch(string name, string options) {
+
+  if (m_consensusLibFileName.empty()) {
+    double rawTime = 0.0;
+    double consensusTime = 0.0;
+    buildLibraries(rawTime, consensusTime);
+  }
+
+  SpectraSTSearchParams params;
+  stringstream optionss(options);
+  string option;
+  while (optionss >> option) {
+    params.addOption(option);
+  }
+  params.finalizeOptions();
+  unsigned int blockSize = (params.searchBlockSize > 1 ? params.searchBlockSize : 1);
+
+  vector<double> loadTimes;
+  vector<double> searchTimes;
+  unsigned long long numSearched = 0;
+  for (unsigned int run = 0; run < m_numRepeats; run++) {
+
+    double start = SpectraSTSearchMetrics::now();
+    SpectraSTLib* lib = new SpectraSTLib(m_consensusLibFileName, &params);
+    loadTimes.push_back(SpectraSTSearchMetrics::now() - start);
+
+    // the queries are read before the clock starts, as a search task would have done; the searches own (and delete) them
+    vector<SpectraSTPeakList*> peakLists;
+    createQueryPeakLists(peakLists, m_seed + 2);
+    vector<SpectraSTQuery*> queries;
+    for (unsigned int q = 0; q < (unsigned int)(peakLists.size()); q++) {
+      if (!peakLists[q]->passFilter(params)) {
+        delete (peakLists[q]);
+        continue;
+      }
+      stringstream namess;
+      namess << "bench." << q;
+      queries.push_back(new SpectraSTQuery(namess.str(), peakLists[q]->getParentMz(), peakLists[q]->getParentCharge(), "", peakLists[q]));
+    }
+
+    start = SpectraSTSearchMetrics::now();
+    vector<SpectraSTSearch*> block;
+    unsigned int blockStart = 0;
+    for (unsigned int q = 0; q <= (unsigned int)(queries.size()); q++) {
+      // a block ends when full, or when the next query's precursor m/z window does not overlap the first one's
+      if (!block.empty() && (q == (unsigned int)(queries.size()) || block.size() >= blockSize ||
+          queries[q]->getPrecursorMz() - queries[blockStart]->getPrecursorMz() > 2.0 * params.precursorMzTolerance)) {
+        SpectraSTSearch::searchBlock(block, lib);
+        for (vector<SpectraSTSearch*>::iterator s = block.begin(); s != block.end(); s++) {
+          if ((*s)->getTopHit()) m_sink += (*s)->getTopHit()->getPrecursorMz();
+          delete (*s);
+        }
+        block.clear();
+      }
+      if (q < (unsigned int)(queries.size())) {
+        if (block.empty()) blockStart = q;
+        block.push_back(new SpectraSTSearch(queries[q], params, NULL));
+      }
+    }
+    searchTimes.push_back(SpectraSTSearchMetrics::now() - start);
+    numSearched = queries.size();
+
+    delete (lib);
+  }
+  if (name == "macro.search") {
+    addResult("macro.loadLibrary", "library", 1, loadTimes);
+  }
+  addResult(name, "query", numSearched, searchTimes);
+}
+
+// buildLibraries - writes the synthetic replicates to an .msp file (once), imports them into a library, and builds
+// the consensus library from that, timing the last two steps
+void SpectraSTBench::buildLibraries(double& rawTime, double& consensusTime) {
+
+  string mspFileName = m_workDir + "/bench_replicates.msp";
+  string rawLibName = m_workDir + "/bench_raw";
+  string consensusLibName = m_workDir + "/bench_consensus";
+
+  if (m_consensusLibFileName.empty()) {
+    m_data->writeMspFile(mspFileName, m_numReplicates, m_seed + 3);
+  }
+
+  SpectraSTCreateParams rawParams;
+  rawParams.addOption("N" + rawLibName);
+  rawParams.finalizeOptions();
+
+  vector<string> rawInput(1, mspFileName);
+  double start = SpectraSTSearchMetrics::now();
+  SpectraSTLib* rawLib = new SpectraSTLib(rawInput, &rawParams);
+  delete (rawLib);
+  rawTime = SpectraSTSearchMetrics::now() - start;
+
+  SpectraSTCreateParams consensusParams;
+  consensusParams.addOption("N" + consensusLibName);
+  consensusParams.addOption("AC");
+  consensusParams.finalizeOptions();
+
+  vector<string> consensusInput(1, rawLibName + ".splib");
+  start = SpectraSTSearchMetrics::now();
+  SpectraSTLib* consensusLib = new SpectraSTLib(consensusInput, &consensusParams);
+  delete (consensusLib);
+  consensusTime = SpectraSTSearchMetrics::now() - start;
+
+  m_consensusLibFileName = consensusLibName + ".splib";
+}
+
+// createLibPeakLists - creates a library-like peak list for each peptide ion
+void SpectraSTBench::createLibPeakLists(vector<SpectraSTPeakList*>& peakLists, unsigned long long seed) {
+
+  SpectraSTBenchRandom rng(seed);
+  for (unsigned int index = 0; index < m_data->getNumPeptides(); index++) {
+    peakLists.push_back(m_data->createLibPeakList(index, rng));
+  }
+}
+
+// createQueryPeakLists - creates the query peak lists, one per query, cycling through the peptide ions
+void SpectraSTBench::createQueryPeakLists(vector<SpectraSTPeakList*>& peakLists, unsigned long long seed) {
+
+  SpectraSTBenchRandom rng(seed);
+  for (unsigned int q = 0; q < m_numQueries; q++) {
+    peakLists.push_back(m_data->createQueryPeakList(q % m_data->getNumPeptides(), rng));
+  }
+}
+
+// calcMedian - the median of the run times
+double SpectraSTBench::calcMedian(vector<double> times) {
+
+  if (times.empty()) return (0.0);
+  sort(times.begin(), times.end());
+  unsigned int mid = (unsigned int)(times.size() / 2);
+  if (times.size() % 2 == 1) return (times[mid]);
+  return ((times[mid - 1] + times[mid]) / 2.0);
+}
+
+// calcBest - the shortest of the run times
+double SpectraSTBench::calcBest(vector<double>& times) {
+
+  if (times.empty()) return (0.0);
+  return (*(min_element(times.begin(), times.end())));
+}
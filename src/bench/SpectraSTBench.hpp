@@ -0,0 +1,127 @@
+#ifndef SPECTRASTBENCH_HPP
+#define SPECTRASTBENCH_HPP
+
+#include "SpectraSTBenchData.hpp"
+#include "SpectraSTSearchParams.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTBench
+ *
+ * The benchmark suite (make bench). Times the core routines on synthetic data (see SpectraSTBenchData):
+ *
+ * micro.* - the peak list operations of a search: binPeaks, rankTransform, the three dot products, reading a
+ *           library entry from the binary format, and the m/z index lookup of a library.
+ * macro.* - importing an .msp file into a library, building a consensus library from it (-cAC), loading the
+ *           consensus library for search, and searching it end-to-end: one query at a time, in blocks
+ *           (SpectraSTSearch::searchBlock), with the sketch filter (-s_SKD), and as an open modification search
+ *           (-s_OMT) with and without the sketch filter.
+ *
+ * Every benchmark is run a number of times; the best and the median times are reported. Each run of an index lookup
+ * or a search starts from a freshly loaded library, so that all runs see the same (cold) cache.
+ *
+ * The results are printed as tab-delimited text, one line per benchmark after a "#" header and a column header line.
+ * The columns and the benchmark names are kept stable, so that results of different releases can be compared directly.
+ */
+
+using namespace std;
+
+// benchResult - the timings of one benchmark
+struct benchResult {
+  string name;
+  string unit;
+  unsigned long long numOps;
+  vector<double> runTimes;
+};
+
+class SpectraSTBench {
+
+public:
+
+  SpectraSTBench(string workDir, unsigned int scale, unsigned int numRepeats, string filter, unsigned long long seed, bool isVerbose = false);
+  ~SpectraSTBench();
+
+  void run();
+  void printResults(ostream& out);
+
+  static const unsigned int FORMAT_VERSION;
+
+private:
+
+  string m_workDir;
+  unsigned int m_scale;
+  unsigned int m_numRepeats;
+  string m_filter;
+  unsigned long long m_seed;
+
+  // m_isVerbose - print the time of each benchmark to stderr as it finishes
+  bool m_isVerbose;
+
+  SpectraSTBenchData* m_data;
+  SpectraSTSearchParams m_searchParams;
+
+  unsigned int m_numQueries;
+  unsigned int m_numReplicates;
+
+  // m_consensusLibFileName - the library searched by the index lookup and search benchmarks; empty until it is built
+  string m_consensusLibFileName;
+
+  vector<benchResult> m_results;
+
+  // m_sink - the results of the benchmarked calls are added up here, so that the compiler cannot optimize them away
+  double m_sink;
+
+  bool isSelected(string name);
+  void addResult(string name, string unit, unsigned long long numOps, vector<double>& runTimes);
+
+  void benchBinPeaks();
+  void benchRankTransform();
+  void benchDots();
+  void benchReadFromBinaryFile();
+  void benchCreate();
+  void benchIndexLookup();
+  void benchSearch(string name, string options);
+
+  void buildLibraries(double& rawTime, double& consensusTime);
+  void createLibPeakLists(vector<SpectraSTPeakList*>& peakLists, unsigned long long seed);
+  void createQueryPeakLists(vector<SpectraSTPeakList*>& peakLists, unsigned long long seed);
+
+  static double calcMedian(vector<double> times);
+  static double calcBest(vector<double>& times);
+
+};
+
+#endif
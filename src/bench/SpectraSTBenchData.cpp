@@ -0,0 +1,299 @@
+#include "SpectraSTBenchData.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <cstring>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTBenchData
+ *
+ * Deterministic synthetic data for the benchmarks.
+ */
+
+extern SpectraSTLog* g_log;
+
+// residues used for the synthetic peptides, except for the C-terminal K or R. No C, so that no fixed modification is implied.
+static const char* BENCH_RESIDUES = "ADEFGHILMNPQSTVWY";
+
+// the m/z range of the synthetic spectra
+static const double BENCH_MIN_MZ = 100.0;
+static const double BENCH_MAX_MZ = 2000.0;
+
+// constructor
+SpectraSTBenchRandom::SpectraSTBenchRandom(unsigned long long seed) :
+  m_state(seed ^ 0x9E3779B97F4A7C15ULL) {
+
+  if (m_state == 0) m_state = 0x9E3779B97F4A7C15ULL; // xorshift cannot leave 0
+}
+
+// next - the next 64 random bits
+unsigned long long SpectraSTBenchRandom::next() {
+
+  m_state ^= m_state >> 12;
+  m_state ^= m_state << 25;
+  m_state ^= m_state >> 27;
+  return (m_state * 2685821657736338717ULL);
+}
+
+// uniform - a random number in [0, 1)
+double SpectraSTBenchRandom::uniform() {
+
+  return ((double)(next() >> 11) / 9007199254740992.0);
+}
+
+// uniform - a random number in [low, high)
+double SpectraSTBenchRandom::uniform(double low, double high) {
+
+  return (low + (high - low) * uniform());
+}
+
+// uniformInt - a random integer in [0, n)
+unsigned int SpectraSTBenchRandom::uniformInt(unsigned int n) {
+
+  return ((unsigned int)(uniform() * (double)n));
+}
+
+// gaussian - a random number from the standard normal distribution (Box-Muller)
+double SpectraSTBenchRandom::gaussian() {
+
+  double u1 = 1.0 - uniform(); // in (0, 1], so the log is finite
+  double u2 = uniform();
+  return (sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2));
+}
+
+// constructor - generates numPeptides distinct peptide ions and their spectra
+SpectraSTBenchData::SpectraSTBenchData(unsigned long long seed, unsigned int numPeptides) :
+  m_peptides(),
+  m_precursorMzs(),
+  m_templates() {
+
+  SpectraSTBenchRandom rng(seed);
+
+  // generate the peptide ions first, then sort them by m/z, so that neighbors are also close in m/z
+  set<string> seen;
+  map<double, Peptide*> byMz;
+  while (byMz.size() < numPeptides) {
+    string seq = generateSequence(rng);
+    int charge = (rng.uniform() < 0.7 ? 2 : 3);
+    stringstream keyss;
+    keyss << seq << '/' << charge;
+    if (seen.find(keyss.str()) != seen.end()) continue;
+
+    Peptide* pep = new Peptide(seq, charge);
+    double mz = pep->monoisotopicMZ();
+    if (byMz.find(mz) != byMz.end()) {
+      // a different sequence of the same composition; keep only one
+      delete (pep);
+      continue;
+    }
+    seen.insert(keyss.str());
+    byMz[mz] = pep;
+  }
+
+  for (map<double, Peptide*>::iterator i = byMz.begin(); i != byMz.end(); i++) {
+    m_peptides.push_back(i->second);
+    m_precursorMzs.push_back(i->first);
+  }
+
+  m_templates.resize(m_peptides.size());
+  for (unsigned int index = 0; index < (unsigned int)(m_peptides.size()); index++) {
+    generateTemplate(index, rng);
+  }
+}
+
+// destructor
+SpectraSTBenchData::~SpectraSTBenchData() {
+
+  for (vector<Peptide*>::iterator i = m_peptides.begin(); i != m_peptides.end(); i++) {
+    delete (*i);
+  }
+}
+
+// generateReplicate - draws a library-quality replicate spectrum of a peptide ion: a few peaks lost, a little noise
+void SpectraSTBenchData::generateReplicate(unsigned int index, SpectraSTBenchRandom& rng, vector<benchPeak>& peaks) {
+
+  perturb(index, rng, 0.15, 0.25, 0.02, 15, peaks);
+}
+
+// generateQuery - draws a query spectrum of a peptide ion: more peaks lost, more intensity and m/z error, many noise peaks
+void SpectraSTBenchData::generateQuery(unsigned int index, SpectraSTBenchRandom& rng, vector<benchPeak>& peaks) {
+
+  perturb(index, rng, 0.30, 0.40, 0.10, 60, peaks);
+}
+
+// createLibPeakList - creates an annotated, library-like peak list of a peptide ion, with the peptide set. The caller owns
+// the peak list, but not the peptide.
+SpectraSTPeakList* SpectraSTBenchData::createLibPeakList(unsigned int index, SpectraSTBenchRandom& rng) {
+
+  vector<benchPeak> peaks;
+  generateReplicate(index, rng, peaks);
+
+  SpectraSTPeakList* peakList = new SpectraSTPeakList(m_precursorMzs[index], m_peptides[index]->charge, (unsigned int)(peaks.size()));
+  for (vector<benchPeak>::iterator p = peaks.begin(); p != peaks.end(); p++) {
+    peakList->insert(p->mz, p->intensity, p->annotation, "");
+  }
+  peakList->setPeptidePtr(m_peptides[index]);
+  return (peakList);
+}
+
+// createQueryPeakList - creates an unannotated query peak list of a peptide ion, read in the same way as a search task does.
+// The precursor m/z is off by a little as well.
+SpectraSTPeakList* SpectraSTBenchData::createQueryPeakList(unsigned int index, SpectraSTBenchRandom& rng) {
+
+  vector<benchPeak> peaks;
+  generateQuery(index, rng, peaks);
+
+  double precursorMz = m_precursorMzs[index] + 0.05 * rng.gaussian();
+  SpectraSTPeakList* peakList = new SpectraSTPeakList(precursorMz, m_peptides[index]->charge, (unsigned int)(peaks.size()));
+  for (vector<benchPeak>::iterator p = peaks.begin(); p != peaks.end(); p++) {
+    peakList->insertForSearch(p->mz, p->intensity, "");
+  }
+  return (peakList);
+}
+
+// writeMspFile - writes numReplicates replicates of every peptide ion to an .msp file, as input for library creation
+void SpectraSTBenchData::writeMspFile(string fileName, unsigned int numReplicates, unsigned long long seed) {
+
+  ofstream fout(fileName.c_str());
+  if (!fout.good()) {
+    g_log->error("BENCH", "Cannot open " + fileName + " for writing.");
+    g_log->crash();
+  }
+
+  SpectraSTBenchRandom rng(seed);
+  fout.setf(ios::fixed);
+
+  for (unsigned int index = 0; index < (unsigned int)(m_peptides.size()); index++) {
+    Peptide* pep = m_peptides[index];
+    for (unsigned int rep = 0; rep < numReplicates; rep++) {
+
+      vector<benchPeak> peaks;
+      generateReplicate(index, rng, peaks);
+
+      fout.precision(4);
+      fout << "Name: " << pep->stripped << '/' << pep->charge << '\n';
+      fout << "MW: " << pep->monoisotopicNeutralM() << '\n';
+      fout << "Comment: Mods=0 Parent=" << m_precursorMzs[index] << " Nreps=1/1 Prob=1.0000 Spec=Raw" << '\n';
+      fout << "Num peaks: " << peaks.size() << '\n';
+      for (vector<benchPeak>::iterator p = peaks.begin(); p != peaks.end(); p++) {
+        fout.precision(4);
+        fout << p->mz << '\t';
+        fout.precision(1);
+        fout << p->intensity << '\t' << '"' << p->annotation << '"' << '\n';
+      }
+      fout << '\n';
+    }
+  }
+}
+
+// generateSequence - a random tryptic peptide of 7 to 20 residues
+string SpectraSTBenchData::generateSequence(SpectraSTBenchRandom& rng) {
+
+  unsigned int numResidues = (unsigned int)strlen(BENCH_RESIDUES);
+  unsigned int length = 7 + rng.uniformInt(14);
+
+  string seq("");
+  for (unsigned int i = 0; i < length - 1; i++) {
+    seq += BENCH_RESIDUES[rng.uniformInt(numResidues)];
+  }
+  seq += (rng.uniform() < 0.5 ? 'K' : 'R');
+  return (seq);
+}
+
+// generateTemplate - makes the "true" spectrum of a peptide ion from its more prominent fragment ions. The more prominent
+// the ion, the more intense the peak tends to be.
+void SpectraSTBenchData::generateTemplate(unsigned int index, SpectraSTBenchRandom& rng) {
+
+  vector<FragmentIon*> ions;
+  m_peptides[index]->generateFragmentIons(ions);
+
+  vector<benchPeak>& peaks = m_templates[index];
+  for (vector<FragmentIon*>::iterator fi = ions.begin(); fi != ions.end(); fi++) {
+    if ((*fi)->m_prominence >= 5 && (*fi)->m_isotope == 0 && (*fi)->m_mz >= BENCH_MIN_MZ && (*fi)->m_mz <= BENCH_MAX_MZ) {
+      benchPeak peak;
+      peak.mz = (*fi)->m_mz;
+      peak.intensity = (float)(pow(2.0, (double)((*fi)->m_prominence)) * 100.0 * rng.uniform(0.05, 1.0));
+      peak.annotation = (*fi)->getAnnotation();
+      peaks.push_back(peak);
+    }
+    delete (*fi);
+  }
+
+  sort(peaks.begin(), peaks.end(), SpectraSTBenchData::sortBenchPeaksByMzAsc);
+}
+
+// perturb - draws a noisy copy of the "true" spectrum of a peptide ion: each peak is lost with probability dropRate,
+// has its intensity scaled by a log-normal factor and its m/z shifted by a gaussian error; numNoisePeaks unannotated
+// peaks of up to 5% of the base peak are added.
+void SpectraSTBenchData::perturb(unsigned int index, SpectraSTBenchRandom& rng, double dropRate, double intensityNoise, double mzJitter,
+                                 unsigned int numNoisePeaks, vector<benchPeak>& peaks) {
+
+  peaks.clear();
+  float maxIntensity = 0.0;
+
+  vector<benchPeak>& tmpl = m_templates[index];
+  for (vector<benchPeak>::iterator t = tmpl.begin(); t != tmpl.end(); t++) {
+    if (rng.uniform() < dropRate) continue;
+    benchPeak peak;
+    peak.mz = t->mz + mzJitter * rng.gaussian();
+    peak.intensity = (float)((double)(t->intensity) * exp(intensityNoise * rng.gaussian()));
+    peak.annotation = t->annotation;
+    if (peak.intensity > maxIntensity) maxIntensity = peak.intensity;
+    peaks.push_back(peak);
+  }
+
+  if (maxIntensity <= 0.0) maxIntensity = 1000.0;
+
+  double maxMz = m_precursorMzs[index] * (double)(m_peptides[index]->charge);
+  if (maxMz > BENCH_MAX_MZ) maxMz = BENCH_MAX_MZ;
+  for (unsigned int n = 0; n < numNoisePeaks; n++) {
+    benchPeak peak;
+    peak.mz = rng.uniform(BENCH_MIN_MZ, maxMz);
+    peak.intensity = (float)((double)maxIntensity * rng.uniform(0.001, 0.05));
+    peak.annotation = "?";
+    peaks.push_back(peak);
+  }
+
+  sort(peaks.begin(), peaks.end(), SpectraSTBenchData::sortBenchPeaksByMzAsc);
+}
+
+// sortBenchPeaksByMzAsc - comparison function used by sort() to sort peaks by m/z
+bool SpectraSTBenchData::sortBenchPeaksByMzAsc(const benchPeak& a, const benchPeak& b) {
+
+  return (a.mz < b.mz);
+}
@@ -0,0 +1,112 @@
+#ifndef SPECTRASTBENCHDATA_HPP
+#define SPECTRASTBENCHDATA_HPP
+
+#include "Peptide.hpp"
+#include "SpectraSTPeakList.hpp"
+
+#include <string>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTBenchData
+ *
+ * Deterministic synthetic data for the benchmarks (see SpectraSTBench): a set of random tryptic peptides, each with
+ * a "true" spectrum made from its fragment ions (Peptide::generateFragmentIons), from which any number of replicate
+ * library spectra and noisy query spectra can be drawn. Everything is generated from a fixed seed, so the same seed
+ * and size always give the same peptides and spectra, on any machine.
+ */
+
+using namespace std;
+
+// SpectraSTBenchRandom - a small xorshift64* generator. Used instead of rand() so that the data do not depend on the C library.
+class SpectraSTBenchRandom {
+
+public:
+
+  SpectraSTBenchRandom(unsigned long long seed);
+
+  unsigned long long next();
+  double uniform();
+  double uniform(double low, double high);
+  unsigned int uniformInt(unsigned int n);
+  double gaussian();
+
+private:
+
+  unsigned long long m_state;
+
+};
+
+// benchPeak - a peak of a synthetic spectrum
+struct benchPeak {
+  double mz;
+  float intensity;
+  string annotation;
+};
+
+class SpectraSTBenchData {
+
+public:
+
+  SpectraSTBenchData(unsigned long long seed, unsigned int numPeptides);
+  ~SpectraSTBenchData();
+
+  unsigned int getNumPeptides() { return ((unsigned int)(m_peptides.size())); }
+  Peptide* getPeptidePtr(unsigned int index) { return (m_peptides[index]); }
+  double getPrecursorMz(unsigned int index) { return (m_precursorMzs[index]); }
+
+  void generateReplicate(unsigned int index, SpectraSTBenchRandom& rng, vector<benchPeak>& peaks);
+  void generateQuery(unsigned int index, SpectraSTBenchRandom& rng, vector<benchPeak>& peaks);
+
+  SpectraSTPeakList* createLibPeakList(unsigned int index, SpectraSTBenchRandom& rng);
+  SpectraSTPeakList* createQueryPeakList(unsigned int index, SpectraSTBenchRandom& rng);
+
+  void writeMspFile(string fileName, unsigned int numReplicates, unsigned long long seed);
+
+private:
+
+  // m_peptides, m_precursorMzs, m_templates - the peptide ions, their precursor m/z and their "true" spectra, sorted by m/z
+  vector<Peptide*> m_peptides;
+  vector<double> m_precursorMzs;
+  vector<vector<benchPeak> > m_templates;
+
+  string generateSequence(SpectraSTBenchRandom& rng);
+  void generateTemplate(unsigned int index, SpectraSTBenchRandom& rng);
+  void perturb(unsigned int index, SpectraSTBenchRandom& rng, double dropRate, double intensityNoise, double mzJitter,
+               unsigned int numNoisePeaks, vector<benchPeak>& peaks);
+
+  static bool sortBenchPeaksByMzAsc(const benchPeak& a, const benchPeak& b);
+
+};
+
+#endif
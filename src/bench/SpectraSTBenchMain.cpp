@@ -0,0 +1,172 @@
+#include "SpectraSTBench.hpp"
+#include "SpectraSTLog.hpp"
+#include "FileUtils.hpp"
+#include "Peptide.hpp"
+#include "Glycan.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTBenchMain
+ *
+ * main function for the SpectraST benchmark suite (spectrast_bench). Usage:
+ *
+ *   spectrast_bench [-d<work dir>] [-n<scale>] [-r<repeats>] [-f<filter>] [-S<seed>] [-o<output file>]
+ *
+ * -d  Directory for the files made by the benchmarks (the synthetic .msp file and libraries). Default: bench_work
+ * -n  Size of the synthetic data: 1000 peptide ions (and 1000 queries) per unit. Default: 1
+ * -r  Number of runs of each benchmark. Default: 5
+ * -f  Only run the benchmarks whose name contains this, e.g. -fmicro. or -fcalcDot. Default: all
+ * -S  Seed of the synthetic data. Default: 1
+ * -o  Write the results to this file instead of the standard output
+ */
+
+using namespace std;
+
+// the same globals as SpectraSTMain.cpp, which the rest of SpectraST expects
+bool g_verbose;
+bool g_quiet;
+SpectraSTLog* g_log;
+
+static void printUsage();
+
+// main
+int main(int argc, char* argv[]) {
+
+  string workDir("bench_work");
+  unsigned int scale = 1;
+  unsigned int numRepeats = 5;
+  string filter("");
+  unsigned long long seed = 1;
+  string outputFileName("");
+  bool isVerbose = false;
+
+  for (int i = 1; i < argc; i++) {
+
+    if (strcmp(argv[i], "-v") == 0) {
+      isVerbose = true;
+      continue;
+    }
+
+    if (argv[i][0] != '-' || strlen(argv[i]) < 3) {
+      printUsage();
+      return (1);
+    }
+
+    string value(argv[i] + 2);
+    switch (argv[i][1]) {
+      case 'd' :
+        workDir = value;
+        break;
+      case 'n' :
+        scale = (unsigned int)(atoi(value.c_str()));
+        break;
+      case 'r' :
+        numRepeats = (unsigned int)(atoi(value.c_str()));
+        break;
+      case 'f' :
+        filter = value;
+        break;
+      case 'S' :
+        seed = strtoull(value.c_str(), NULL, 10);
+        break;
+      case 'o' :
+        outputFileName = value;
+        break;
+      default :
+        printUsage();
+        return (1);
+    }
+  }
+
+  if (scale < 1 || numRepeats < 1) {
+    printUsage();
+    return (1);
+  }
+
+  // the library code reports its progress unless told to be quiet
+  g_verbose = false;
+  g_quiet = true;
+
+  makeDir(workDir);
+  g_log = new SpectraSTLog(workDir + "/spectrast_bench.log");
+
+  Analyte::defaultTables();
+  Peptide::defaultTables();
+  Glycan::defaultTables();
+
+  SpectraSTBench* bench = new SpectraSTBench(workDir, scale, numRepeats, filter, seed, isVerbose);
+  bench->run();
+
+  if (outputFileName.empty()) {
+    bench->printResults(cout);
+  } else {
+    ofstream fout(outputFileName.c_str());
+    if (!fout.good()) {
+      g_log->error("BENCH", "Cannot open " + outputFileName + " for writing.");
+      g_log->crash();
+    }
+    bench->printResults(fout);
+  }
+
+  delete (bench);
+
+  Glycan::deleteTables();
+  Peptide::deleteTables();
+  Analyte::deleteTables();
+
+  unsigned int numError = g_log->getNumError();
+  if (numError > 0) {
+    g_log->printErrors();
+  }
+  delete (g_log);
+
+  return (numError > 0 ? 1 : 0);
+}
+
+// printUsage - prints the usage
+void printUsage() {
+
+  cerr << "Usage: spectrast_bench [-d<work dir>] [-n<scale>] [-r<repeats>] [-f<filter>] [-S<seed>] [-o<output file>] [-v]" << endl;
+  cerr << "  -d  Directory for the files made by the benchmarks. Default: bench_work" << endl;
+  cerr << "  -n  Size of the synthetic data, in units of 1000 peptide ions and 1000 queries. Default: 1" << endl;
+  cerr << "  -r  Number of runs of each benchmark; the best and the median are reported. Default: 5" << endl;
+  cerr << "  -f  Only run the benchmarks whose name contains this string (e.g. -fmicro.). Default: all" << endl;
+  cerr << "  -S  Seed of the synthetic data. Default: 1" << endl;
+  cerr << "  -o  Write the results to this file instead of the standard output" << endl;
+  cerr << "  -v  Print the time of each benchmark to the standard error as it finishes" << endl;
+}
@@ -446,6 +446,7 @@ private:
 //------------------------------------------------
 
 int b64_decode_mio (char *dest, char *src, size_t size);
+int b64_decode_fast (char *dest, const char *src, size_t srcLen, size_t size);
 int b64_encode (char *dest, const char *src, int len);
 
 class mzpSAXHandler{
@@ -494,6 +495,17 @@ protected:
   FILE* fptr;
   Czran gzObj;
 
+  //  SAXHandler peak data decoding. The buffers and the inflate stream are kept from one spectrum
+  //  to the next, instead of being allocated again for each.
+  char* decodeBase64(const string& s, size_t minLen, int& decodedLen);
+  uLong inflateData(Bytef* dest, uLong destLen, const Bytef* src, uLong srcLen);
+  char* inflateBuffer(size_t len);
+
+  vector<char> m_vDecoded;
+  vector<char> m_vInflated;
+  z_stream m_zStream;
+  bool m_bZStreamInit;
+
 };
 
 class mzpSAXMzmlHandler : public mzpSAXHandler {
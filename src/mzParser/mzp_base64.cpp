@@ -12,6 +12,38 @@ inline int getPosition( char buf );
 static const unsigned char *b64_tbl = (const unsigned char*) "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const unsigned char b64_pad = '=';
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MZP_B64_SSSE3
+#include <tmmintrin.h>
+#endif
+
+// The value b64_decode_mio takes for each character. Characters outside the base64 alphabet get
+// whatever the original range tests gave them (see b64_char_value), so that any input decodes as before.
+static unsigned char b64_val[256];
+
+static int b64_char_value( int t )
+{
+	if( t > 96 )		// [a-z]
+		return (t - 71);
+	else if( t > 64 )		// [A-Z]
+		return (t - 65);
+	else if( t > 47 )		// [0-9]
+		return (t + 4);
+	else if( t == 43 )
+		return 62;
+	else				// t == '/'
+		return 63;
+}
+
+static bool b64_fill_values()
+{
+	for (int i = 0; i < 256; i++)
+		b64_val[i] = (unsigned char)b64_char_value((char)i);
+	return true;
+}
+
+static const bool b64_val_filled = b64_fill_values();
+
 /* base64 encode a group of between 1 and 3 input chars into a group of  4 output chars */
 static void encode_group (unsigned char output[],
 						  const unsigned char input[],
@@ -109,61 +141,100 @@ int b64_decode_mio ( char *dest,  char *src, size_t size )
 		if (t1 == 61 || temp >= end)		// if == '='
 			return(int)(temp-dest);
 
-		if( t1 > 96 )		// [a-z]
-			a = (t1 - 71);
-		else if( t1 > 64 )		// [A-Z]
-			a = (t1 - 65);
-		else if( t1 > 47 )		// [0-9]
-			a = (t1 + 4);
-		else if( t1 == 43 )
-			a = 62;
-		else				// src[0] == '/'
-			a = 63;     
-
-
-		if( t2 > 96 )		// [a-z]
-			b = (t2 - 71);
-		else if( t2 > 64 )		// [A-Z]
-			b = (t2 - 65);
-		else if( t2 > 47 )		// [0-9]
-			b = (t2 + 4);
-		else if( t2 == 43 )
-			b = 62;
-		else				// src[0] == '/'
-			b = 63;     
+		a = b64_val[(unsigned char)t1];
+		b = b64_val[(unsigned char)t2];
 
 		*temp++ = ( a << 2) | ( b >> 4);
 
 		if (t3 == 61 || temp >= end)
 			return (int)(temp-dest);;
 
-		if( t3 > 96 )		// [a-z]
-			a = (t3 - 71);
-		else if( t3 > 64 )		// [A-Z]
-			a = (t3 - 65);
-		else if( t3 > 47 )		// [0-9]
-			a = (t3 + 4);
-		else if( t3 == 43 )
-			a = 62;
-		else				// src[0] == '/'
-			a = 63;     
+		a = b64_val[(unsigned char)t3];
 
 		*temp++ = ( b << 4) | ( a >> 2);
 
 		if (t4 == 61 || temp >= end)
 			return (int)(temp-dest);;
 
-		if( t4 > 96 )		// [a-z]
-			b = (t4 - 71);
-		else if( t4 > 64 )		// [A-Z]
-			b = (t4 - 65);
-		else if( t4 > 47 )		// [0-9]
-			b = (t4 + 4);
-		else if( t4 == 43 )
-			b = 62;
-		else				// src[0] == '/'
-			b = 63;    
+		b = b64_val[(unsigned char)t4];
 
 		*temp++ = ( a << 6) | ( b );
 	}
 }
+
+#ifdef MZP_B64_SSSE3
+
+// Decodes 16 characters into 12 bytes at a time, as long as the 16 characters are all in the base64
+// alphabet (so no '=', no terminating NUL) and the 12 bytes fit. Returns the number of bytes decoded;
+// srcUsed is set to the number of characters decoded.
+__attribute__((target("ssse3")))
+static size_t b64_decode_blocks_ssse3 ( char *dest, size_t destLen, const char *src, size_t srcLen, size_t *srcUsed )
+{
+	const __m128i upperLow = _mm_set1_epi8('A' - 1);
+	const __m128i upperHigh = _mm_set1_epi8('Z' + 1);
+	const __m128i lowerLow = _mm_set1_epi8('a' - 1);
+	const __m128i lowerHigh = _mm_set1_epi8('z' + 1);
+	const __m128i digitLow = _mm_set1_epi8('0' - 1);
+	const __m128i digitHigh = _mm_set1_epi8('9' + 1);
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i packPairs = _mm_set1_epi32(0x01400140);
+	const __m128i packQuads = _mm_set1_epi32(0x00011000);
+	const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t in = 0;
+	size_t out = 0;
+	while (in + 16 <= srcLen && out + 12 <= destLen) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)(src + in));
+
+		// bytes above 127 compare as negative, so they fall in none of the ranges
+		__m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(chars, upperLow), _mm_cmplt_epi8(chars, upperHigh));
+		__m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(chars, lowerLow), _mm_cmplt_epi8(chars, lowerHigh));
+		__m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(chars, digitLow), _mm_cmplt_epi8(chars, digitHigh));
+		__m128i isPlus = _mm_cmpeq_epi8(chars, plus);
+		__m128i isSlash = _mm_cmpeq_epi8(chars, slash);
+
+		__m128i isValid = _mm_or_si128(_mm_or_si128(isUpper, isLower), _mm_or_si128(_mm_or_si128(isDigit, isPlus), isSlash));
+		if (_mm_movemask_epi8(isValid) != 0xFFFF) break;
+
+		// 'A'-'Z' -> 0-25, 'a'-'z' -> 26-51, '0'-'9' -> 52-61, '+' -> 62, '/' -> 63
+		__m128i shift = _mm_or_si128(_mm_and_si128(isUpper, _mm_set1_epi8(-65)), _mm_and_si128(isLower, _mm_set1_epi8(-71)));
+		shift = _mm_or_si128(shift, _mm_and_si128(isDigit, _mm_set1_epi8(4)));
+		shift = _mm_or_si128(shift, _mm_and_si128(isPlus, _mm_set1_epi8(19)));
+		shift = _mm_or_si128(shift, _mm_and_si128(isSlash, _mm_set1_epi8(16)));
+		__m128i values = _mm_add_epi8(chars, shift);
+
+		// each group of four 6-bit values becomes 24 bits, then three bytes, most significant first
+		__m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, packPairs), packQuads);
+		__m128i bytes = _mm_shuffle_epi8(merged, order);
+
+		_mm_storel_epi64((__m128i*)(dest + out), bytes);
+		int last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+		memcpy(dest + out + 8, &last, 4);
+
+		in += 16;
+		out += 12;
+	}
+
+	*srcUsed = in;
+	return out;
+}
+
+#endif
+
+// Same as b64_decode_mio (the result is identical), but decodes the bulk of the data 16 characters at a time
+// with SSSE3 where the CPU has it. srcLen is the length of src, which must be NUL-terminated as for b64_decode_mio.
+int b64_decode_fast ( char *dest, const char *src, size_t srcLen, size_t size )
+{
+	size_t decoded = 0;
+	size_t used = 0;
+
+#ifdef MZP_B64_SSSE3
+	static const bool hasSSSE3 = (__builtin_cpu_supports("ssse3") != 0);
+	if (hasSSSE3) {
+		decoded = b64_decode_blocks_ssse3(dest, size, src, srcLen, &used);
+	}
+#endif
+
+	return (int)decoded + b64_decode_mio(dest + decoded, (char*)(src + used), size - decoded);
+}
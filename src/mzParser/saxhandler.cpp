@@ -151,6 +151,7 @@ mzpSAXHandler::mzpSAXHandler()
 	fptr = NULL;
 	m_bGZCompression = false;
 	fptr = NULL;
+	m_bZStreamInit = false;
 	m_parser = XML_ParserCreate(NULL);
 	XML_SetUserData(m_parser, this);
 	XML_SetElementHandler(m_parser, mzp_startElementCallback, mzp_endElementCallback);
@@ -163,6 +164,7 @@ mzpSAXHandler::~mzpSAXHandler()
 	if(fptr!=NULL) fclose(fptr);
 	fptr = NULL;
 	XML_ParserFree(m_parser);
+	if(m_bZStreamInit) inflateEnd(&m_zStream);
 }
 
 void mzpSAXHandler::startElement(const XML_Char *el, const XML_Char **attr)
@@ -338,3 +340,42 @@ bool mzpSAXHandler::parseOffset(f_off offset){
 void mzpSAXHandler::setGZCompression(bool b){
 	m_bGZCompression=b;
 }
+
+//Decodes the base64 string s into the decoding buffer, which is made at least minLen bytes long.
+//As with b64_decode_mio, the string length is the limit of the decoded length.
+char* mzpSAXHandler::decodeBase64(const string& s, size_t minLen, int& decodedLen){
+	size_t len = s.size() / 4 * 3 + 3;
+	if(len < minLen) len = minLen;
+	if(m_vDecoded.size() < len) m_vDecoded.resize(len);
+	decodedLen = b64_decode_fast(&m_vDecoded[0], s.c_str(), s.size(), s.size());
+	return &m_vDecoded[0];
+}
+
+//Returns the inflating buffer, made at least len bytes long.
+char* mzpSAXHandler::inflateBuffer(size_t len){
+	if(len < 1) len = 1;
+	if(m_vInflated.size() < len) m_vInflated.resize(len);
+	return &m_vInflated[0];
+}
+
+//Same as zlib's uncompress(), but resets one inflate stream instead of setting up a new one every time.
+//Returns the number of bytes inflated.
+uLong mzpSAXHandler::inflateData(Bytef* dest, uLong destLen, const Bytef* src, uLong srcLen){
+	if(!m_bZStreamInit){
+		m_zStream.zalloc = Z_NULL;
+		m_zStream.zfree = Z_NULL;
+		m_zStream.opaque = Z_NULL;
+		m_zStream.next_in = Z_NULL;
+		m_zStream.avail_in = 0;
+		if(inflateInit(&m_zStream) != Z_OK) return 0;
+		m_bZStreamInit = true;
+	} else {
+		inflateReset(&m_zStream);
+	}
+	m_zStream.next_in = (Bytef*)src;
+	m_zStream.avail_in = (uInt)srcLen;
+	m_zStream.next_out = dest;
+	m_zStream.avail_out = (uInt)destLen;
+	inflate(&m_zStream, Z_FINISH);
+	return m_zStream.total_out;
+}
@@ -637,18 +637,15 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
     uint64_t i;  
   } uData64; 
 
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
-
-  char* decoded = new char[m_encodedLen];  //array for decoded base64 string
+  char* decoded;  //decoded base64 string, in the reused decoding buffer
   int decodeLen;
-  Bytef* unzipped;
-  uLong unzippedLen;
+  Bytef* unzipped=NULL;
+  uLong unzippedLen=0;
 
   int i;
 
   //Base64 decoding
-  decodeLen = b64_decode_mio(decoded,(char*)pData,stringSize);
+  decoded = decodeBase64(m_strData, (m_encodedLen > 0 ? (size_t)m_encodedLen : 0), decodeLen);
 
   //zlib decompression
   if(m_bZlib) {
@@ -666,15 +663,15 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
     unzippedLen = m_peaksCount*sizeof(uint64_t);
     }
 
-    unzipped = new Bytef[unzippedLen];
-    uncompress((Bytef*)unzipped, &unzippedLen, (const Bytef*)decoded, (uLong)decodeLen);
-    delete [] decoded;
+    unzipped = (Bytef*)inflateBuffer(unzippedLen);
+    unzippedLen = inflateData(unzipped, unzippedLen, (const Bytef*)decoded, (uLong)decodeLen);
 
   }
 
-  //Numpress decompression
+  //Numpress decompression, straight into the peak list vector
   if(m_bNumpressLinear || m_bNumpressSlof || m_bNumpressPic){
-    double* unpressed=new double[m_peaksCount];
+    d.resize(m_peaksCount); //m_peaksCount is at least 1 here, see above, so d.data() is writable
+    double* unpressed=d.data();
   
     try{
         if(m_bNumpressLinear){
@@ -692,44 +689,39 @@ void mzpSAXMzmlHandler::decode(vector<double>& d){
       exit(EXIT_FAILURE);
     }
 
-    if(m_bZlib) delete [] unzipped;
-    else delete [] decoded;
-    for(i=0;i<m_peaksCount;i++) d.push_back(unpressed[i]);
-    delete [] unpressed;
     return;
   }
 
   //Byte order correction
+  if(m_iDataType==1 || m_iDataType==2) d.resize(m_peaksCount);
   if(m_bZlib){
     if(m_iDataType==1){
       uint32_t* unzipped32 = (uint32_t*)unzipped;
       for(i=0;i<m_peaksCount;i++){
         uData32.i = dtohl(unzipped32[i], m_bNetworkData);
-        d.push_back(uData32.d);
+        d[i] = uData32.d;
       }
     } else if(m_iDataType==2) {
       uint64_t* unzipped64 = (uint64_t*)unzipped;
       for(i=0;i<m_peaksCount;i++){
         uData64.i = dtohl(unzipped64[i], m_bNetworkData);
-        d.push_back(uData64.d);
+        d[i] = uData64.d;
       }
     }
-    delete [] unzipped;
   } else {
     if(m_iDataType==1){
       uint32_t* decoded32 = (uint32_t*)decoded;
       for(i=0;i<m_peaksCount;i++){
         uData32.i = dtohl(decoded32[i], m_bNetworkData);
-        d.push_back(uData32.d);
+        d[i] = uData32.d;
       }
     } else if(m_iDataType==2) {
       uint64_t* decoded64 = (uint64_t*)decoded;
       for(i=0;i<m_peaksCount;i++){
         uData64.i = dtohl(decoded64[i], m_bNetworkData);
-        d.push_back(uData64.d);
+        d[i] = uData64.d;
       }
     }
-    delete [] decoded;
   }
 
 }
@@ -346,30 +346,25 @@ void mzpSAXMzxmlHandler::decompress32(){
   uLong uncomprLen;
   uint32_t* data;
   int length;
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
   
   //Decode base64
-  char* pDecoded = (char*) new char[m_compressLen];
-  memset(pDecoded, 0, m_compressLen);
-  length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-  pData=NULL;
+  char* pDecoded = decodeBase64(m_strData, m_compressLen, length);
 
   //zLib decompression
-  data = new uint32_t[m_peaksCount*2];
   uncomprLen = m_peaksCount * 2 * sizeof(uint32_t);
-  uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
-  delete [] pDecoded;
+  data = (uint32_t*)inflateBuffer(uncomprLen);
+  inflateData((Bytef*)data, uncomprLen, (const Bytef*)pDecoded, length);
 
   //write data to arrays
+  vdM.resize(m_peaksCount);
+  vdI.resize(m_peaksCount);
   int n = 0;
   for(int i=0;i<m_peaksCount;i++){
     uData.i = dtohl(data[n++], m_bNetworkData);
-    vdM.push_back((double)uData.f);
+    vdM[i] = (double)uData.f;
     uData.i = dtohl(data[n++], m_bNetworkData);
-    vdI.push_back((double)uData.f);
+    vdI[i] = (double)uData.f;
   }
-  delete [] data;
 }
 
 void mzpSAXMzxmlHandler::decompress64(){
@@ -386,30 +381,25 @@ void mzpSAXMzxmlHandler::decompress64(){
   uLong uncomprLen;
   uint64_t* data;
   int length;
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
   
   //Decode base64
-  char* pDecoded = (char*) new char[m_compressLen];
-  memset(pDecoded, 0, m_compressLen);
-  length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
-  pData=NULL;
+  char* pDecoded = decodeBase64(m_strData, m_compressLen, length);
 
   //zLib decompression
-  data = new uint64_t[m_peaksCount*2];
   uncomprLen = m_peaksCount * 2 * sizeof(uint64_t);
-  uncompress((Bytef*)data, &uncomprLen, (const Bytef*)pDecoded, length);
-  delete [] pDecoded;
+  data = (uint64_t*)inflateBuffer(uncomprLen);
+  inflateData((Bytef*)data, uncomprLen, (const Bytef*)pDecoded, length);
 
   //write data to arrays
+  vdM.resize(m_peaksCount);
+  vdI.resize(m_peaksCount);
   int n = 0;
   for(int i=0;i<m_peaksCount;i++){
     uData.i = dtohl(data[n++], m_bNetworkData);
-    vdM.push_back(uData.d);
+    vdM[i] = uData.d;
     uData.i = dtohl(data[n++], m_bNetworkData);
-    vdI.push_back(uData.d);
+    vdI[i] = uData.d;
   }
-  delete [] data;
 
 }
 
@@ -418,18 +408,15 @@ void mzpSAXMzxmlHandler::decode32(){
 // This code block was revised so that it packs floats correctly
 // on both 64 and 32 bit machines, by making use of the uint32_t
 // data type. -S. Wiley
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
-  
   size_t size = m_peaksCount * 2 * sizeof(uint32_t);
-  char* pDecoded = (char *) new char[size];
-  memset(pDecoded, 0, size);
+  char* pDecoded = NULL;
 
   if(m_peaksCount > 0) {
     // Base64 decoding
     // By comparing the size of the unpacked data and the expected size
     // an additional check of the data file integrity can be performed
-    int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
+    int length;
+    pDecoded = decodeBase64(m_strData, size, length);
     if(length != size) {
       cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
       cout << " Cause: possible corrupted file.\n";
@@ -443,19 +430,16 @@ void mzpSAXMzxmlHandler::decode32(){
     uint32_t iData;  
   } uData; 
 
-  vdM.clear();
-  vdI.clear();
+  vdM.resize(m_peaksCount);
+  vdI.resize(m_peaksCount);
   int n = 0;
   uint32_t* pDecodedInts = (uint32_t*)pDecoded; // cast to uint_32 for reading int sized chunks
   for(int i = 0; i < m_peaksCount; i++) {
     uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdM.push_back((double)uData.fData);
+    vdM[i] = (double)uData.fData;
     uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdI.push_back((double)uData.fData);
+    vdI[i] = (double)uData.fData;
   }
-
-  // Free allocated memory
-  delete[] pDecoded;
 }
 
 void mzpSAXMzxmlHandler::decode64(){
@@ -463,18 +447,15 @@ void mzpSAXMzxmlHandler::decode64(){
 // This code block was revised so that it packs floats correctly
 // on both 64 and 32 bit machines, by making use of the uint32_t
 // data type. -S. Wiley
-  const char* pData = m_strData.data();
-  size_t stringSize = m_strData.size();
-
   size_t size = m_peaksCount * 2 * sizeof(uint64_t);
-  char* pDecoded = (char *) new char[size];
-  memset(pDecoded, 0, size);
+  char* pDecoded = NULL;
 
   if(m_peaksCount > 0) {
     // Base64 decoding
     // By comparing the size of the unpacked data and the expected size
     // an additional check of the data file integrity can be performed
-    int length = b64_decode_mio( (char*) pDecoded , (char*) pData, stringSize );
+    int length;
+    pDecoded = decodeBase64(m_strData, size, length);
     if(length != size) {
       cout << " decoded size " << length << " and required size " << (unsigned long)size << " dont match:\n";
       cout << " Cause: possible corrupted file.\n";
@@ -488,19 +469,16 @@ void mzpSAXMzxmlHandler::decode64(){
     uint64_t iData;  
   } uData; 
 
-  vdM.clear();
-  vdI.clear();
+  vdM.resize(m_peaksCount);
+  vdI.resize(m_peaksCount);
   int n = 0;
   uint64_t* pDecodedInts = (uint64_t*)pDecoded; // cast to uint_64 for reading int sized chunks
   for(int i = 0; i < m_peaksCount; i++) {
     uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdM.push_back(uData.fData);
+    vdM[i] = uData.fData;
     uData.iData = dtohl(pDecodedInts[n++], m_bNetworkData);
-    vdI.push_back(uData.fData);
+    vdI[i] = uData.fData;
   }
-
-  // Free allocated memory
-  delete[] pDecoded;
 }
 
 unsigned long mzpSAXMzxmlHandler::dtohl(uint32_t l, bool bNet) {
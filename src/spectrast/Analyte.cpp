@@ -117,7 +117,7 @@ void Analyte::deleteTables() {
   groupMonoisotopicMassTable = NULL;
 }
 
-FragmentIon::FragmentIon(double mz, string& annotation, unsigned int curIsotope) :
+FragmentIon::FragmentIon(double mz, const string& annotation, unsigned int curIsotope) :
   m_ion(""),
   m_mz(mz),
   m_pos(0),
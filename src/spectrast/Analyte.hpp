@@ -48,7 +48,7 @@ class FragmentIon {
 public:  
   
 
-  FragmentIon(double mz, string& annotation, unsigned int curIsotope = 0);  
+  FragmentIon(double mz, const string& annotation, unsigned int curIsotope = 0);  
   FragmentIon(string ionType, int position, int loss, double mz, int ch, unsigned int prom, unsigned int isotope = 0, double mzDiff = 0.0, bool bracket = false);
 
   string m_ion;
@@ -9,6 +9,9 @@
 #include <iostream>
 #include <sstream>
 #include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 /*
@@ -101,6 +104,29 @@ void removeDir(string dir) {
   int ret=system(rmCommand.c_str());
 }
 
+// renameFile - renames a file, replacing any file already at the new name. Done in one step where the file system allows,
+// so that a reader never sees a half-written file at the new name. Returns false if the file cannot be renamed.
+bool renameFile(string fromFileName, string toFileName) {
+#ifdef MSVC
+  // rename() does not replace an existing file on Windows
+  remove(toFileName.c_str());
+#endif
+  return (rename(fromFileName.c_str(), toFileName.c_str()) == 0);
+}
+
+// getFileStamp - gets the size and modification time of a file (both 0 if there is no such file)
+void getFileStamp(string fileName, unsigned long long& size, unsigned long long& modTime) {
+  
+  size = 0;
+  modTime = 0;
+  
+  struct stat st;
+  if (stat(fileName.c_str(), &st) == 0) {
+    size = (unsigned long long)(st.st_size);
+    modTime = (unsigned long long)(st.st_mtime);
+  }
+}
+
 // makeDir - creates a directory -- this is UNIX, change for Windows
 void makeDir(string dir) {
   string mkdirCommand("mkdir -p ");
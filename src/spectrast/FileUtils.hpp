@@ -94,6 +94,12 @@ bool myFileOpen(ofstream& fout, string fullFileName, bool binary = false);
 void removeFile(string fileName);
 void removeDir(string dir);
 
+// renaming files, replacing any file already there
+bool renameFile(string fromFileName, string toFileName);
+
+// getting the size and modification time of a file, to tell if it has changed
+void getFileStamp(string fileName, unsigned long long& size, unsigned long long& modTime);
+
 // making new directory
 void makeDir(string dir);
 
@@ -0,0 +1,315 @@
+#include "SpectraSTBuildScheduler.hpp"
+#include "SpectraSTReplicates.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+
+/* Class: SpectraSTBuildScheduler
+ *
+ * Builds the consensus or best-replicate spectra of individual peptide ions on a pool of worker threads,
+ * handing the built entries back in submission order.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+// constructor - spawns the worker threads
+SpectraSTBuildScheduler::SpectraSTBuildScheduler(SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers, string plotPath,
+						 unsigned int numWorkers, unsigned int maxNumPending) :
+  m_params(params),
+  m_denoisers(denoisers),
+  m_plotPath(plotPath),
+  m_numWorkers(numWorkers),
+  m_maxNumPending(maxNumPending),
+  m_queue(),
+  m_finished(maxNumPending, NULL),
+  m_numSubmitted(0),
+  m_numRetrieved(0),
+  m_stop(false),
+  m_workerData(NULL),
+  m_threads(NULL) {
+
+  if (m_numWorkers < 1) {
+    m_numWorkers = 1;
+  }
+  if (m_maxNumPending < m_numWorkers) {
+    m_maxNumPending = m_numWorkers;
+    m_finished.assign(m_maxNumPending, NULL);
+  }
+
+#ifdef MSVC
+  InitializeCriticalSection(&m_stateLock);
+  InitializeConditionVariable(&m_workAvailable);
+  InitializeConditionVariable(&m_buildFinished);
+  m_threads = new HANDLE[m_numWorkers];
+#else
+  pthread_mutex_init(&m_stateLock, NULL);
+  pthread_cond_init(&m_workAvailable, NULL);
+  pthread_cond_init(&m_buildFinished, NULL);
+  m_threads = new pthread_t[m_numWorkers];
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+#endif
+
+  m_workerData = new struct buildWorkerData[m_numWorkers];
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+    m_workerData[ti].schedulerPtr = this;
+    m_workerData[ti].workerIndex = ti;
+
+#ifdef MSVC
+    int returnCode = 0;
+    m_threads[ti] = CreateThread(NULL, 0, runWorkerThread, (void*)&m_workerData[ti], 0, NULL);
+    if (!m_threads[ti]) {
+      returnCode = ti + 1;
+    }
+#else
+    int returnCode = pthread_create(&m_threads[ti], &attr, runWorkerThread, (void*)(&(m_workerData[ti])));
+#endif
+
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
+      g_log->error("CREATE", msg.str());
+      g_log->crash();
+    }
+  }
+
+#ifndef MSVC
+  pthread_attr_destroy(&attr);
+#endif
+
+}
+
+// destructor - tells the workers to quit once the queue is empty, and waits for them
+SpectraSTBuildScheduler::~SpectraSTBuildScheduler() {
+
+  lockState();
+  m_stop = true;
+#ifdef MSVC
+  WakeAllConditionVariable(&m_workAvailable);
+#else
+  pthread_cond_broadcast(&m_workAvailable);
+#endif
+  unlockState();
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+#ifdef MSVC
+    WaitForSingleObject(m_threads[ti], INFINITE);
+    CloseHandle(m_threads[ti]);
+#else
+    void* status;
+    int returnCode = pthread_join(m_threads[ti], &status);
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
+      g_log->error("CREATE", msg.str());
+      g_log->crash();
+    }
+#endif
+
+  }
+
+  // normally the caller retrieves everything before destroying the scheduler; just in case
+  for (vector<replicateGroup*>::iterator i = m_finished.begin(); i != m_finished.end(); i++) {
+    if (*i) {
+      for (vector<SpectraSTLibEntry*>::iterator en = (*i)->entries.begin(); en != (*i)->entries.end(); en++) {
+	delete (*en);
+      }
+      delete (*i);
+    }
+  }
+
+#ifdef MSVC
+  DeleteCriticalSection(&m_stateLock);
+#else
+  pthread_cond_destroy(&m_buildFinished);
+  pthread_cond_destroy(&m_workAvailable);
+  pthread_mutex_destroy(&m_stateLock);
+#endif
+
+  delete[] m_threads;
+  delete[] m_workerData;
+
+}
+
+// submit - queues up the replicates of a peptide ion to be built. The scheduler takes ownership of them until they are
+// retrieved. The caller must not submit when isFull() -- retrieve() something first.
+void SpectraSTBuildScheduler::submit(vector<SpectraSTLibEntry*>& entries) {
+
+  replicateGroup* group = new replicateGroup;
+  group->entries = entries;
+  group->built = NULL;
+
+  lockState();
+  m_queue.push_back(pair<unsigned long, replicateGroup*>(m_numSubmitted, group));
+#ifdef MSVC
+  WakeConditionVariable(&m_workAvailable);
+#else
+  pthread_cond_signal(&m_workAvailable);
+#endif
+  unlockState();
+
+  m_numSubmitted++;
+}
+
+// retrieve - returns the earliest-submitted group that has not yet been retrieved, if it is built.
+// If wait is true, blocks until it is built. Returns NULL if there is nothing (built) to retrieve.
+// The caller then owns the group, and the replicates in it.
+replicateGroup* SpectraSTBuildScheduler::retrieve(bool wait) {
+
+  if (isEmpty()) return (NULL);
+
+  unsigned int slot = (unsigned int)(m_numRetrieved % m_maxNumPending);
+
+  lockState();
+  while (wait && !m_finished[slot]) {
+#ifdef MSVC
+    SleepConditionVariableCS(&m_buildFinished, &m_stateLock, INFINITE);
+#else
+    pthread_cond_wait(&m_buildFinished, &m_stateLock);
+#endif
+  }
+  replicateGroup* group = m_finished[slot];
+  m_finished[slot] = NULL;
+  unlockState();
+
+  if (group) m_numRetrieved++;
+  return (group);
+}
+
+// build - builds the consensus or picks the best replicate (according to params.buildAction) of the replicates
+// of one peptide ion. Returns one of the replicates (with the consensus peak list, if applicable), or NULL.
+// The work on the replicates is shared out among at most numThreads threads; the workers of the scheduler pass 1.
+SpectraSTLibEntry* SpectraSTBuildScheduler::build(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params,
+						  vector<SpectraSTDenoiser*>* denoisers, string plotPath, unsigned int numThreads) {
+
+  SpectraSTLibEntry* built = NULL;
+
+  if (params.buildAction == "BEST_REPLICATE") {
+
+    SpectraSTReplicates replicates(entries, params, NULL, numThreads);
+    replicates.setPlotPath(plotPath);
+    built = replicates.findBestReplicate();
+
+  } else if (params.buildAction == "CONSENSUS") {
+
+    SpectraSTReplicates replicates(entries, params, denoisers, numThreads);
+    replicates.setPlotPath(plotPath);
+    built = replicates.makeConsensusSpectrum();
+  }
+
+  return (built);
+}
+
+#ifdef MSVC
+DWORD WINAPI SpectraSTBuildScheduler::runWorkerThread(LPVOID threadArg) {
+#else
+void* SpectraSTBuildScheduler::runWorkerThread(void* threadArg) {
+#endif
+
+  struct buildWorkerData* workerData = (struct buildWorkerData*)threadArg;
+
+  workerData->schedulerPtr->workerLoop();
+
+  long ti = (long)(workerData->workerIndex);
+
+#ifdef MSVC
+  ExitThread(0);
+#else
+  pthread_exit((void*)ti);
+#endif
+
+}
+
+// workerLoop - takes one queued group at a time, builds it, and files the result
+void SpectraSTBuildScheduler::workerLoop() {
+
+  while (true) {
+
+    lockState();
+    while (m_queue.empty() && !m_stop) {
+#ifdef MSVC
+      SleepConditionVariableCS(&m_workAvailable, &m_stateLock, INFINITE);
+#else
+      pthread_cond_wait(&m_workAvailable, &m_stateLock);
+#endif
+    }
+    if (m_queue.empty()) {
+      // told to stop, and nothing left to do
+      unlockState();
+      return;
+    }
+    pair<unsigned long, replicateGroup*> job = m_queue.front();
+    m_queue.pop_front();
+    unlockState();
+
+    // one thread per peptide ion -- the other workers are busy with theirs
+    job.second->built = build(job.second->entries, m_params, m_denoisers, m_plotPath, 1);
+
+    lockState();
+    m_finished[job.first % m_maxNumPending] = job.second;
+#ifdef MSVC
+    WakeConditionVariable(&m_buildFinished);
+#else
+    pthread_cond_signal(&m_buildFinished);
+#endif
+    unlockState();
+
+  }
+
+}
+
+// lockState - locks the queue and the finished list
+void SpectraSTBuildScheduler::lockState() {
+#ifdef MSVC
+  EnterCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_lock(&m_stateLock);
+#endif
+}
+
+// unlockState - unlocks the queue and the finished list
+void SpectraSTBuildScheduler::unlockState() {
+#ifdef MSVC
+  LeaveCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_unlock(&m_stateLock);
+#endif
+}
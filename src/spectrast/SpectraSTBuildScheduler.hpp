@@ -0,0 +1,148 @@
+#ifndef SPECTRASTBUILDSCHEDULER_HPP_
+#define SPECTRASTBUILDSCHEDULER_HPP_
+
+#include "SpectraSTLibEntry.hpp"
+#include "SpectraSTCreateParams.hpp"
+#include "SpectraSTDenoiser.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+
+/* Class: SpectraSTBuildScheduler
+ *
+ * Builds the consensus or best-replicate spectra (-cAC, -cAB) of individual peptide ions on a pool of worker threads.
+ * The reader (the thread walking the peptide indices) submits the replicates of each peptide ion; a worker runs
+ * SpectraSTReplicates on them, which includes denoising when the Bayesian denoiser is used. The built entries are
+ * handed back to the reader strictly in submission order, so that the quality filters and the writing to the library
+ * remain single-threaded and the library created is identical to that of a single-threaded build.
+ *
+ * The number of peptide ions in flight is bounded, so that the reader does not load the whole library into memory.
+ *
+ */
+
+using namespace std;
+
+// replicateGroup - the replicates of one peptide ion, and the entry built from them: one of the replicates, or NULL if
+// nothing could be built. The replicates are NOT deleted by the scheduler.
+struct replicateGroup {
+  vector<SpectraSTLibEntry*> entries;
+  SpectraSTLibEntry* built;
+};
+
+struct buildWorkerData;
+
+class SpectraSTBuildScheduler {
+
+public:
+  SpectraSTBuildScheduler(SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers, string plotPath,
+			  unsigned int numWorkers, unsigned int maxNumPending);
+  ~SpectraSTBuildScheduler();
+
+  void submit(vector<SpectraSTLibEntry*>& entries);
+  replicateGroup* retrieve(bool wait);
+
+  bool isFull() { return (m_numSubmitted - m_numRetrieved >= m_maxNumPending); }
+  bool isEmpty() { return (m_numSubmitted == m_numRetrieved); }
+
+  static SpectraSTLibEntry* build(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params,
+				  vector<SpectraSTDenoiser*>* denoisers, string plotPath, unsigned int numThreads = 1);
+
+#ifdef MSVC
+  static DWORD WINAPI runWorkerThread(LPVOID threadArg);
+#else
+  static void* runWorkerThread(void* threadArg);
+#endif
+
+private:
+
+  // the create params and the denoisers - NOT properties of this class. The denoisers must be ready to filter
+  // (not in training), since the workers share them.
+  SpectraSTCreateParams& m_params;
+  vector<SpectraSTDenoiser*>* m_denoisers;
+  string m_plotPath;
+
+  unsigned int m_numWorkers;
+  unsigned int m_maxNumPending;
+
+  // the queue of (sequence number, group) waiting for a worker
+  deque<pair<unsigned long, replicateGroup*> > m_queue;
+
+  // finished groups waiting to be retrieved, indexed by sequence number modulo m_maxNumPending
+  vector<replicateGroup*> m_finished;
+
+  // counters - m_numSubmitted and m_numRetrieved are only touched by the reader,
+  // the queue, the finished list and m_stop are guarded by the state lock
+  unsigned long m_numSubmitted;
+  unsigned long m_numRetrieved;
+  bool m_stop;
+
+  struct buildWorkerData* m_workerData;
+
+  void workerLoop();
+
+  void lockState();
+  void unlockState();
+
+#ifdef MSVC
+  CRITICAL_SECTION m_stateLock;
+  CONDITION_VARIABLE m_workAvailable;
+  CONDITION_VARIABLE m_buildFinished;
+  HANDLE* m_threads;
+#else
+  pthread_mutex_t m_stateLock;
+  pthread_cond_t m_workAvailable;
+  pthread_cond_t m_buildFinished;
+  pthread_t* m_threads;
+#endif
+
+};
+
+struct buildWorkerData {
+  SpectraSTBuildScheduler* schedulerPtr;
+  unsigned int workerIndex;
+};
+
+#endif /*SPECTRASTBUILDSCHEDULER_HPP_*/
@@ -27,6 +27,20 @@
 // but opening too many files can bog down the file system, and may not be efficient. 
 #define MAX_NUM_OPEN_FILES 50
 
+// this is the maximum number of queries read ahead (per search thread) in a multi-threaded .mgf/.msp search
+// the queries are searched out of order by the worker threads, but their results are held back until they can be printed in order
+#define MAX_NUM_PENDING_QUERIES_PER_THREAD 16
+
+// this is the maximum number of peptide ions read ahead (per build thread) in a multi-threaded consensus/best-replicate build (-c_THR)
+#define MAX_NUM_PENDING_BUILDS_PER_THREAD 8
+
+// this is the minimum number of replicates per thread when the replicates of one peptide ion are compared on several threads (-c_THR)
+// smaller replicate sets are done on the calling thread
+#define MIN_NUM_REPLICATES_PER_THREAD 32
+
+// this is the maximum number of scans read ahead (per prefetch thread) from the mzXML files by the background readers (-s_PRF, -c_PRF)
+#define MAX_NUM_PREFETCHED_SCANS_PER_THREAD 16
+
 //#define DECOY_BATCH_SIZE 100
 //#define DECOY_PIECE_SIZE 200
 
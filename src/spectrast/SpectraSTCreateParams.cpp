@@ -72,6 +72,7 @@ SpectraSTCreateParams& SpectraSTCreateParams::operator=(SpectraSTCreateParams& s
   this->paramsFileName = s.paramsFileName;
   this->outputFileName = s.outputFileName;
   this->binaryFormat = s.binaryFormat;
+  this->mappableFormat = s.mappableFormat;
   this->reannotatePeaks = s.reannotatePeaks;
   this->remark = s.remark;  
   this->writeDtaFiles = s.writeDtaFiles;
@@ -118,6 +119,9 @@ SpectraSTCreateParams& SpectraSTCreateParams::operator=(SpectraSTCreateParams& s
   this->replicateWeight = s.replicateWeight;
   this->maximumNumPeaksKept = s.maximumNumPeaksKept;
   this->recordRawSpectra = s.recordRawSpectra;
+  this->numThreadsUsed = s.numThreadsUsed;
+  this->numPrefetchThreads = s.numPrefetchThreads;
+  this->useScanHeaderIndex = s.useScanHeaderIndex;
   
   this->useBayesianDenoiser = s.useBayesianDenoiser;
   this->trainBayesianDenoiser = s.trainBayesianDenoiser; 
@@ -532,6 +536,16 @@ void SpectraSTCreateParams::finalizeAdvancedOption(string option) {
       valid = true;
     } 	
     
+  } else if (optionType == "MAP") {  
+      
+    if (optionValue.empty()) {
+      mappableFormat = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      mappableFormat = false;
+      valid = true;
+    } 	
+    
   } else if (optionType == "DTA") {
       
     if (optionValue.empty()) {
@@ -793,6 +807,35 @@ void SpectraSTCreateParams::finalizeAdvancedOption(string option) {
       valid = true;
     }
 
+  } else if (optionType == "THR") {
+
+    if (!optionValue.empty()) {
+      k = atoi(optionValue.c_str());
+      if (k > 0) {
+	numThreadsUsed = k;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "PRF") {
+
+    if (!optionValue.empty()) {
+      k = atoi(optionValue.c_str());
+      if (k >= 0) {
+	numPrefetchThreads = k;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "SCN") {
+    if (optionValue.empty()) {
+      useScanHeaderIndex = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      useScanHeaderIndex = false;
+      valid = true;
+    }
+
   } else if (optionType == "BDU") {
     if (optionValue.empty()) {
       useBayesianDenoiser = true;
@@ -1035,6 +1078,7 @@ void SpectraSTCreateParams::setDefault() {
   outputFileName = "";
   reannotatePeaks = false;
   binaryFormat = true;
+  mappableFormat = false;
   writeDtaFiles = false;
   writeMgfFile = false;
   writePAIdent = false;
@@ -1082,6 +1126,9 @@ void SpectraSTCreateParams::setDefault() {
   replicateWeight = "SN";
   maximumNumPeaksKept = 150;
   recordRawSpectra = false;
+  numThreadsUsed = 1; // no multi-threading
+  numPrefetchThreads = 0; // .mzXML spectra read on the importing thread
+  useScanHeaderIndex = false; // .mzXML scan headers read again every time, not saved in a .spscan file
   
   // DENOISER
   useBayesianDenoiser = false;
@@ -1172,6 +1219,9 @@ void SpectraSTCreateParams::readFromFile() {
     } else if (param == "binaryFormat") {
       binaryFormat = (value == "true");
       valid = true;
+    } else if (param == "mappableFormat") {
+      mappableFormat = (value == "true");
+      valid = true;
     } else if (param == "remark") {
       if (!value.empty()) {
         remark = value;
@@ -1412,6 +1462,25 @@ void SpectraSTCreateParams::readFromFile() {
     } else if (param == "recordRawSpectra") {
       recordRawSpectra = (value == "true");
       valid = true;
+    } else if (param == "numThreadsUsed") {
+      if (!value.empty()) {
+	k = atoi(value.c_str());
+	if (k > 0) {
+	  numThreadsUsed = k;
+	  valid = true;
+	}
+      }
+    } else if (param == "numPrefetchThreads") {
+      if (!value.empty()) {
+	k = atoi(value.c_str());
+	if (k >= 0) {
+	  numPrefetchThreads = k;
+	  valid = true;
+	}
+      }
+    } else if (param == "useScanHeaderIndex") {
+      useScanHeaderIndex = (value == "true");
+      valid = true;
     
     // DENOISER
     } else if (param == "useBayesianDenoiser") {
@@ -1660,6 +1729,8 @@ void SpectraSTCreateParams::printAdvancedOptions(ostream& out) {
   out << "GENERAL OPTIONS:" << endl;
   out << "         -c_BIN          Write library in binary format (Enables quicker search). (Turn off with -c_BIN!) " << endl;
   out << "                           A human-readable text-format library file will also be created." << endl;
+  out << "         -c_MAP          Write binary library in the memory-mappable format (Enables quicker loading). (Turn off with -c_MAP!) " << endl;
+  out << "                           To convert an existing .splib file, simply import it with this option." << endl;
   out << "         -c_DTA          Write all library spectra as .dta files. (Turn off with -c_DTA!) " << endl;
   out << "         -c_MGF          Write all library spectra as .mgf files. (Turn off with -c_MGF!) " << endl;
   out << "         -c_RDY<prefix>  Remove spectra of decoys, for which all proteins have names starting with <prefix>." << endl;
@@ -1703,6 +1774,12 @@ void SpectraSTCreateParams::printAdvancedOptions(ostream& out) {
   out << "                           <score> = 'I': will use a function of the precursor intensity as the weight." << endl;
   out << "                           <score> = everything else: all replicates will be weighted equally and ranked randomly." << endl;
   out << "         -c_RRS          Record all raw spectra (in the format file.scan.scan) used to build the consensus in the Comment." << endl;
+  out << "         -c_THR<num>     Build the consensus/best-replicate spectra on <num> threads. The library written is the same." << endl;
+  out << "                           Ignored when training the Bayesian denoiser (-c_BDT). Default is 1 (single-threaded)." << endl;
+  out << "         -c_PRF<num>     Read and decode the spectra of .mzXML files ahead of the import on <num> background threads" << endl;
+  out << "                           (0 = off). The library written is the same." << endl;
+  out << "         -c_SCN          Save the scan headers of .mzXML files in a .spscan file next to each, and reuse them. (Turn off with -c_SCN!)" << endl;
+  out << "                           The file is re-created whenever the .mzXML file changes." << endl;
   
   out << "BAYESIAN DENOISER OPTIONS" << endl;
   out << "         -c_BDU          Use Bayesian denoiser. Default parameters are used unless trained on the fly with -c_BDT. (Turn off with -c_BDU!)" << endl;
@@ -65,6 +65,7 @@ public:
   string paramsFileName; // -cF
   string outputFileName; // -cN
   bool binaryFormat; // -cb  -c_BIN
+  bool mappableFormat; // -c_MAP
   bool writeDtaFiles; // -cD  -c_DTA
   bool writeMgfFile; // -c_MGF
   bool writePAIdent; // -c_PAI
@@ -113,6 +114,9 @@ public:
   unsigned int maximumNumPeaksUsed; // -cp  -c_XPU
   unsigned int maximumNumPeaksKept; // -cd  -c_XPK
   bool recordRawSpectra; // -c_RRS
+  unsigned int numThreadsUsed; // -c_THR
+  unsigned int numPrefetchThreads; // -c_PRF
+  bool useScanHeaderIndex; // -c_SCN
   
   // DENOISER
   bool useBayesianDenoiser; // -c_BDU (this will be done for consensus, best-replicate, and similarity clustering)
@@ -0,0 +1,417 @@
+#include "SpectraSTDotKernel.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPECTRAST_DOT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(SPECTRAST_DOT_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPECTRAST_DOT_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTDotKernel
+ *
+ * The inner loops of the dot product between two binned spectra, with run-time choice of instruction set.
+ * See the header for how the summation order is kept the same for all versions.
+ *
+ */
+
+SpectraSTDotKernel::KernelType SpectraSTDotKernel::m_bestKernelType = SpectraSTDotKernel::detectKernelType();
+SpectraSTDotKernel::KernelType SpectraSTDotKernel::m_kernelType = SpectraSTDotKernel::m_bestKernelType;
+
+// addLanes - adds up the partial sums, always in the same order
+static inline float addLanes(const float* lanes) {
+  return (((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])));
+}
+
+// REFERENCE VERSIONS
+
+template <bool withSquares>
+static float refDenseDense(const float* a, const float* b, unsigned int n, float* sumOfSquares) {
+
+  float lanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+  float squareLanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+  for (unsigned int k = 0; k < n; k++) {
+    float d = a[k] * b[k];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+template <bool withSquares, typename Index>
+static float refDenseSparse(const float* dense, const float* sparse, const Index* sparseIndex, unsigned int n, float* sumOfSquares) {
+
+  float lanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+  float squareLanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+  for (unsigned int k = 0; k < n; k++) {
+    float d = sparse[k] * dense[sparseIndex[k]];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+// mergeTail - the see-saw merge of two sparse bin lists from positions i and j onwards, adding
+// the product for entry i of the first list to partial sum i % 8. Shared by all versions.
+template <bool withSquares>
+static void mergeTail(const float* a, const unsigned int* aIndex, unsigned int na, unsigned int i,
+		      const float* b, const unsigned int* bIndex, unsigned int nb, unsigned int j,
+		      float* lanes, float* squareLanes) {
+
+  while (i < na && j < nb) {
+    if (aIndex[i] == bIndex[j]) {
+      float d = a[i] * b[j];
+      lanes[i & 7] += d;
+      if (withSquares) squareLanes[i & 7] += d * d;
+      i++;
+      j++;
+    } else if (aIndex[i] < bIndex[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+}
+
+template <bool withSquares>
+static float refSparseSparse(const float* a, const unsigned int* aIndex, unsigned int na,
+			     const float* b, const unsigned int* bIndex, unsigned int nb, float* sumOfSquares) {
+
+  float lanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+  float squareLanes[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+  mergeTail<withSquares>(a, aIndex, na, 0, b, bIndex, nb, 0, lanes, squareLanes);
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+// SSE2 VERSIONS - two registers of four partial sums each
+
+#ifdef SPECTRAST_DOT_SSE2
+
+template <bool withSquares>
+static float sse2DenseDense(const float* a, const float* b, unsigned int n, float* sumOfSquares) {
+
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 sq0 = _mm_setzero_ps();
+  __m128 sq1 = _mm_setzero_ps();
+
+  unsigned int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m128 d0 = _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k));
+    __m128 d1 = _mm_mul_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4));
+    acc0 = _mm_add_ps(acc0, d0);
+    acc1 = _mm_add_ps(acc1, d1);
+    if (withSquares) sq0 = _mm_add_ps(sq0, _mm_mul_ps(d0, d0));
+    if (withSquares) sq1 = _mm_add_ps(sq1, _mm_mul_ps(d1, d1));
+  }
+
+  float lanes[8];
+  float squareLanes[8];
+  _mm_storeu_ps(lanes, acc0);
+  _mm_storeu_ps(lanes + 4, acc1);
+  _mm_storeu_ps(squareLanes, sq0);
+  _mm_storeu_ps(squareLanes + 4, sq1);
+
+  for (; k < n; k++) {
+    float d = a[k] * b[k];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+template <bool withSquares, typename Index>
+static float sse2DenseSparse(const float* dense, const float* sparse, const Index* sparseIndex, unsigned int n, float* sumOfSquares) {
+
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 sq0 = _mm_setzero_ps();
+  __m128 sq1 = _mm_setzero_ps();
+
+  unsigned int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    const Index* ix = sparseIndex + k;
+    __m128 g0 = _mm_setr_ps(dense[ix[0]], dense[ix[1]], dense[ix[2]], dense[ix[3]]);
+    __m128 g1 = _mm_setr_ps(dense[ix[4]], dense[ix[5]], dense[ix[6]], dense[ix[7]]);
+    __m128 d0 = _mm_mul_ps(_mm_loadu_ps(sparse + k), g0);
+    __m128 d1 = _mm_mul_ps(_mm_loadu_ps(sparse + k + 4), g1);
+    acc0 = _mm_add_ps(acc0, d0);
+    acc1 = _mm_add_ps(acc1, d1);
+    if (withSquares) sq0 = _mm_add_ps(sq0, _mm_mul_ps(d0, d0));
+    if (withSquares) sq1 = _mm_add_ps(sq1, _mm_mul_ps(d1, d1));
+  }
+
+  float lanes[8];
+  float squareLanes[8];
+  _mm_storeu_ps(lanes, acc0);
+  _mm_storeu_ps(lanes + 4, acc1);
+  _mm_storeu_ps(squareLanes, sq0);
+  _mm_storeu_ps(squareLanes + 4, sq1);
+
+  for (; k < n; k++) {
+    float d = sparse[k] * dense[sparseIndex[k]];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+// sse2SparseSparse - compares blocks of four bin numbers from each list against each other
+// (all 16 pairs, by rotating the second block), and advances whichever block ends lower.
+// Since bin numbers are unique, an entry of the first list gets at most one non-zero product
+// over the whole run, so adding the zeros of the non-matching pairs does not change the sums.
+template <bool withSquares>
+static float sse2SparseSparse(const float* a, const unsigned int* aIndex, unsigned int na,
+			      const float* b, const unsigned int* bIndex, unsigned int nb, float* sumOfSquares) {
+
+  __m128 acc[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+  __m128 sq[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+
+  unsigned int i = 0;
+  unsigned int j = 0;
+
+  while (i + 4 <= na && j + 4 <= nb) {
+
+    __m128i ai = _mm_loadu_si128((const __m128i*)(aIndex + i));
+    __m128 av = _mm_loadu_ps(a + i);
+    __m128i bi = _mm_loadu_si128((const __m128i*)(bIndex + j));
+    __m128 bv = _mm_loadu_ps(b + j);
+
+    unsigned int g = (i >> 2) & 1; // entries i..i+3 belong to partial sums 0-3 or 4-7
+
+    for (int r = 0; r < 4; r++) {
+      __m128 match = _mm_castsi128_ps(_mm_cmpeq_epi32(ai, bi));
+      __m128 d = _mm_and_ps(match, _mm_mul_ps(av, bv));
+      acc[g] = _mm_add_ps(acc[g], d);
+      if (withSquares) sq[g] = _mm_add_ps(sq[g], _mm_mul_ps(d, d));
+      bi = _mm_shuffle_epi32(bi, _MM_SHUFFLE(0, 3, 2, 1));
+      bv = _mm_shuffle_ps(bv, bv, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+    unsigned int aMax = aIndex[i + 3];
+    unsigned int bMax = bIndex[j + 3];
+    if (aMax <= bMax) i += 4;
+    if (bMax <= aMax) j += 4;
+  }
+
+  float lanes[8];
+  float squareLanes[8];
+  _mm_storeu_ps(lanes, acc[0]);
+  _mm_storeu_ps(lanes + 4, acc[1]);
+  _mm_storeu_ps(squareLanes, sq[0]);
+  _mm_storeu_ps(squareLanes + 4, sq[1]);
+
+  // the blocks left behind cannot match anything already passed, so finish off the old way
+  mergeTail<withSquares>(a, aIndex, na, i, b, bIndex, nb, j, lanes, squareLanes);
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+#endif
+
+// AVX2 VERSIONS - one register of eight partial sums. Compiled for AVX2 regardless of the
+// compiler flags, but only called if the CPU supports it. (No FMA -- that would change the rounding.)
+
+#ifdef SPECTRAST_DOT_AVX2
+
+// avx2LoadIndex - loads eight bin numbers as 32-bit integers, for use by the gather
+__attribute__((target("avx2")))
+static inline __m256i avx2LoadIndex(const unsigned int* index) {
+  return (_mm256_loadu_si256((const __m256i*)index));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2LoadIndex(const unsigned short* index) {
+  return (_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)index)));
+}
+
+template <bool withSquares>
+__attribute__((target("avx2")))
+static float avx2DenseDense(const float* a, const float* b, unsigned int n, float* sumOfSquares) {
+
+  __m256 acc = _mm256_setzero_ps();
+  __m256 sq = _mm256_setzero_ps();
+
+  unsigned int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 d = _mm256_mul_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k));
+    acc = _mm256_add_ps(acc, d);
+    if (withSquares) sq = _mm256_add_ps(sq, _mm256_mul_ps(d, d));
+  }
+
+  float lanes[8];
+  float squareLanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  _mm256_storeu_ps(squareLanes, sq);
+
+  for (; k < n; k++) {
+    float d = a[k] * b[k];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+template <bool withSquares, typename Index>
+__attribute__((target("avx2")))
+static float avx2DenseSparse(const float* dense, const float* sparse, const Index* sparseIndex, unsigned int n, float* sumOfSquares) {
+
+  __m256 acc = _mm256_setzero_ps();
+  __m256 sq = _mm256_setzero_ps();
+
+  unsigned int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256i ix = avx2LoadIndex(sparseIndex + k);
+    __m256 d = _mm256_mul_ps(_mm256_loadu_ps(sparse + k), _mm256_i32gather_ps(dense, ix, 4));
+    acc = _mm256_add_ps(acc, d);
+    if (withSquares) sq = _mm256_add_ps(sq, _mm256_mul_ps(d, d));
+  }
+
+  float lanes[8];
+  float squareLanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  _mm256_storeu_ps(squareLanes, sq);
+
+  for (; k < n; k++) {
+    float d = sparse[k] * dense[sparseIndex[k]];
+    lanes[k & 7] += d;
+    if (withSquares) squareLanes[k & 7] += d * d;
+  }
+
+  if (withSquares) *sumOfSquares = addLanes(squareLanes);
+  return (addLanes(lanes));
+}
+
+#endif
+
+// detectKernelType - finds the best instruction set supported by both the build and the CPU
+SpectraSTDotKernel::KernelType SpectraSTDotKernel::detectKernelType() {
+
+#ifdef SPECTRAST_DOT_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return (AVX2);
+  }
+#endif
+
+#ifdef SPECTRAST_DOT_SSE2
+  return (SSE2);
+#else
+  return (REFERENCE);
+#endif
+
+}
+
+// setReferenceMode - forces the use of the reference versions (or goes back to the best available)
+void SpectraSTDotKernel::setReferenceMode(bool useReference) {
+  m_kernelType = (useReference ? REFERENCE : m_bestKernelType);
+}
+
+// getKernelName - the name of the instruction set in use
+string SpectraSTDotKernel::getKernelName() {
+
+  switch (m_kernelType) {
+  case AVX2 :
+    return ("AVX2");
+  case SSE2 :
+    return ("SSE2");
+  default :
+    return ("reference");
+  }
+}
+
+// denseDense - dot product of two dense bin arrays
+float SpectraSTDotKernel::denseDense(const float* a, const float* b, unsigned int n, float* sumOfSquares) {
+
+#ifdef SPECTRAST_DOT_AVX2
+  if (m_kernelType == AVX2) return (sumOfSquares ? avx2DenseDense<true>(a, b, n, sumOfSquares) : avx2DenseDense<false>(a, b, n, NULL));
+#endif
+#ifdef SPECTRAST_DOT_SSE2
+  if (m_kernelType != REFERENCE) return (sumOfSquares ? sse2DenseDense<true>(a, b, n, sumOfSquares) : sse2DenseDense<false>(a, b, n, NULL));
+#endif
+  return (sumOfSquares ? refDenseDense<true>(a, b, n, sumOfSquares) : refDenseDense<false>(a, b, n, NULL));
+}
+
+// denseSparse - dot product of a dense bin array and a sparse bin list
+float SpectraSTDotKernel::denseSparse(const float* dense, const float* sparse, const unsigned int* sparseIndex, unsigned int n, float* sumOfSquares) {
+
+#ifdef SPECTRAST_DOT_AVX2
+  if (m_kernelType == AVX2) return (sumOfSquares ? avx2DenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : avx2DenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+#endif
+#ifdef SPECTRAST_DOT_SSE2
+  if (m_kernelType != REFERENCE) return (sumOfSquares ? sse2DenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : sse2DenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+#endif
+  return (sumOfSquares ? refDenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : refDenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+}
+
+// denseSparse - same, with 16-bit bin numbers (packed library spectra)
+float SpectraSTDotKernel::denseSparse(const float* dense, const float* sparse, const unsigned short* sparseIndex, unsigned int n, float* sumOfSquares) {
+
+#ifdef SPECTRAST_DOT_AVX2
+  if (m_kernelType == AVX2) return (sumOfSquares ? avx2DenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : avx2DenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+#endif
+#ifdef SPECTRAST_DOT_SSE2
+  if (m_kernelType != REFERENCE) return (sumOfSquares ? sse2DenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : sse2DenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+#endif
+  return (sumOfSquares ? refDenseSparse<true>(dense, sparse, sparseIndex, n, sumOfSquares) : refDenseSparse<false>(dense, sparse, sparseIndex, n, NULL));
+}
+
+// sparseSparse - dot product of two sparse bin lists. There is no AVX2 version; the lists are short
+// (at most a few hundred entries), and the SSE2 block merge is already limited by the branches, not the width.
+float SpectraSTDotKernel::sparseSparse(const float* a, const unsigned int* aIndex, unsigned int na,
+				       const float* b, const unsigned int* bIndex, unsigned int nb, float* sumOfSquares) {
+
+#ifdef SPECTRAST_DOT_SSE2
+  if (m_kernelType != REFERENCE) return (sumOfSquares ? sse2SparseSparse<true>(a, aIndex, na, b, bIndex, nb, sumOfSquares) : sse2SparseSparse<false>(a, aIndex, na, b, bIndex, nb, NULL));
+#endif
+  return (sumOfSquares ? refSparseSparse<true>(a, aIndex, na, b, bIndex, nb, sumOfSquares) : refSparseSparse<false>(a, aIndex, na, b, bIndex, nb, NULL));
+}
@@ -0,0 +1,93 @@
+#ifndef SPECTRASTDOTKERNEL_HPP_
+#define SPECTRASTDOTKERNEL_HPP_
+
+#include <string>
+#include <cstddef>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTDotKernel
+ *
+ * The inner loops of the dot product between two binned spectra (see SpectraSTPeakList::calcDot
+ * and SpectraSTPeakList::calcDotAndDotBias). A binned spectrum is either dense (one float per bin)
+ * or sparse (a float per occupied bin plus a sorted list of bin numbers), so there are three shapes:
+ * dense-dense, dense-sparse (a gather) and sparse-sparse (a merge).
+ *
+ * Each shape has a plain C++ reference version, an SSE2 version and (dense-dense and dense-sparse only)
+ * an AVX2 version; the fastest one the CPU supports is picked at run time. To make the choice invisible
+ * to the scores, all versions sum the products in the same order: product number k (counting bins for
+ * dense-dense, sparse entries for dense-sparse, and entries of the first spectrum for sparse-sparse) is
+ * added to partial sum k % NUM_LANES, and the partial sums are added up in a fixed pairwise order at the end.
+ * No fused multiply-adds are used. The result is therefore bit-for-bit identical whichever version runs.
+ *
+ */
+
+using namespace std;
+
+class SpectraSTDotKernel {
+
+public:
+
+  // number of partial sums - the width of an AVX2 register, and two SSE2 registers
+  static const unsigned int NUM_LANES = 8;
+
+  // the dot product of two dense bin arrays of length n. If sumOfSquares is not NULL,
+  // the sum of squares of the products is also returned through it (needed for the dot bias).
+  static float denseDense(const float* a, const float* b, unsigned int n, float* sumOfSquares = NULL);
+
+  // the dot product of a dense bin array with n sparse bins
+  static float denseSparse(const float* dense, const float* sparse, const unsigned int* sparseIndex, unsigned int n, float* sumOfSquares = NULL);
+  static float denseSparse(const float* dense, const float* sparse, const unsigned short* sparseIndex, unsigned int n, float* sumOfSquares = NULL);
+
+  // the dot product of two sparse bin lists. Bin numbers must be strictly increasing in both.
+  static float sparseSparse(const float* a, const unsigned int* aIndex, unsigned int na,
+			    const float* b, const unsigned int* bIndex, unsigned int nb, float* sumOfSquares = NULL);
+
+  // forces the use of the reference versions. For verification only; the scores do not change.
+  static void setReferenceMode(bool useReference);
+
+  // the name of the instruction set in use, for logging
+  static string getKernelName();
+
+  // the instruction set - determined once, at program start
+  enum KernelType { REFERENCE, SSE2, AVX2 };
+
+private:
+
+  static KernelType detectKernelType();
+
+  static KernelType m_kernelType;
+  static KernelType m_bestKernelType;
+
+};
+
+#endif /*SPECTRASTDOTKERNEL_HPP_*/
@@ -76,6 +76,9 @@ void SpectraSTDtaSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
   
   string searchFileName(m_searchFileNames[fileIndex]);
   
+  // for the search metrics, the time to read and parse the file
+  double readStart = SpectraSTSearchMetrics::now();
+  
   ifstream fin;
   if (!myFileOpen(fin, searchFileName)) {
     g_log->error("SEARCH", "Cannot open DTA file \"" + m_searchFileNames[fileIndex] + "\" for reading. File skipped.");
@@ -141,6 +144,7 @@ void SpectraSTDtaSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     
     // create the search based on what is read, then search
     SpectraSTSearch* s = new SpectraSTSearch(query, m_params, m_outputs[fileIndex]);
+    s->getMetricsSampleRef().endStage(SpectraSTSearchMetrics::READ_QUERY, readStart);
     s->search(m_lib);
     
     m_searchCount++; // counting searches in all dta files
@@ -152,7 +156,9 @@ void SpectraSTDtaSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     m_searchTaskStats[fileIndex]->processSearchResult(s);
     
     // print search result
+    double printStart = SpectraSTSearchMetrics::now();
     s->print();
+    m_searchTaskStats[fileIndex]->m_metrics.addStageTime(SpectraSTSearchMetrics::OUTPUT, SpectraSTSearchMetrics::now() - printStart);
     delete s;
   }
   
@@ -0,0 +1,94 @@
+#include "SpectraSTFingerprintCounts.hpp"
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>                                                       
+Date          : 03.06.06 
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North 
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTFingerprintCounts
+ * 
+ * Class to accumulate the top hits of a search task for fingerprinting
+ */
+
+// constructor - numSlots is the number of threads that will record searches concurrently
+SpectraSTFingerprintCounts::SpectraSTFingerprintCounts(unsigned int numSlots, unsigned int noHitLibId) :
+  m_noHitLibId(noHitLibId),
+  m_hitCounts(numSlots > 0 ? numSlots : 1),
+  m_topHits(numSlots > 0 ? numSlots : 1) {
+  
+}
+
+// destructor
+SpectraSTFingerprintCounts::~SpectraSTFingerprintCounts() {
+  
+}
+
+// add - records the top hit of a finished search. Only the thread owning the slot may call this with that slot.
+void SpectraSTFingerprintCounts::add(unsigned int slot, SpectraSTSearch* s) {
+  
+  if (s->isLikelyGood()) {
+    unsigned int libId = s->getTopHit()->getLibId();
+    m_hitCounts[slot][libId]++;
+    m_topHits[slot].push_back(libId);
+  } else {
+    m_topHits[slot].push_back(m_noHitLibId);
+  }
+  
+}
+
+// getSearchCount - returns the number of searches recorded in all slots
+unsigned int SpectraSTFingerprintCounts::getSearchCount() {
+  
+  unsigned int count = 0;
+  for (unsigned int slot = 0; slot < (unsigned int)m_topHits.size(); slot++) {
+    count += (unsigned int)m_topHits[slot].size();
+  }
+  return (count);
+}
+
+// mergeCounts - adds up the hit counts of all slots into countsByLibId, which must be large enough to be indexed by all library IDs
+void SpectraSTFingerprintCounts::mergeCounts(vector<float>& countsByLibId) {
+  
+  for (unsigned int slot = 0; slot < (unsigned int)m_hitCounts.size(); slot++) {
+    for (map<unsigned int, unsigned int>::iterator i = m_hitCounts[slot].begin(); i != m_hitCounts[slot].end(); i++) {
+      countsByLibId[i->first] += (float)(i->second);
+    }
+  }
+  
+}
+
+// mergeTopHits - appends the top hits of all searches to topHitsBySearchId, slot by slot
+void SpectraSTFingerprintCounts::mergeTopHits(vector<unsigned int>& topHitsBySearchId) {
+  
+  topHitsBySearchId.reserve(topHitsBySearchId.size() + getSearchCount());
+  for (unsigned int slot = 0; slot < (unsigned int)m_topHits.size(); slot++) {
+    topHitsBySearchId.insert(topHitsBySearchId.end(), m_topHits[slot].begin(), m_topHits[slot].end());
+  }
+  
+}
@@ -0,0 +1,78 @@
+#ifndef SPECTRASTFINGERPRINTCOUNTS_HPP
+#define SPECTRASTFINGERPRINTCOUNTS_HPP
+
+#include "SpectraSTSearch.hpp"
+
+#include <map>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>                                                       
+Date          : 03.06.06 
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North 
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTFingerprintCounts
+ * 
+ * Class to accumulate the top hits of a search task for fingerprinting (-s_FIN). 
+ * Each search thread records into its own slot, so no locking is needed while searching; the slots
+ * are only merged when the fingerprinting summary is written. A slot holds the hit counts sparsely
+ * (only the library entries actually hit), plus the top hit of each search for bootstrapping.
+ */
+
+
+using namespace std;
+
+class SpectraSTFingerprintCounts {
+  
+public:
+  
+  SpectraSTFingerprintCounts(unsigned int numSlots, unsigned int noHitLibId);
+  ~SpectraSTFingerprintCounts();
+  
+  void add(unsigned int slot, SpectraSTSearch* s);
+  
+  unsigned int getSearchCount();
+  
+  void mergeCounts(vector<float>& countsByLibId);
+  void mergeTopHits(vector<unsigned int>& topHitsBySearchId);
+  
+private:
+  
+  // m_noHitLibId - the value recorded as the top hit of a search without a likely good hit
+  unsigned int m_noHitLibId;
+  
+  // m_hitCounts - for each slot, the number of likely good top hits, keyed by library ID
+  vector<map<unsigned int, unsigned int> > m_hitCounts;
+  
+  // m_topHits - for each slot, the top hit library ID of every search, in the order searched
+  vector<vector<unsigned int> > m_topHits;
+  
+};
+
+#endif
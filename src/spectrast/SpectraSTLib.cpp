@@ -1,6 +1,7 @@
 #include "SpectraSTLib.hpp"
 #include "SpectraSTLibImporter.hpp"
 #include "SpectraSTLog.hpp"
+#include "SpectraSTDotKernel.hpp"
 #include "SpectraSTConstants.hpp"
 
 #include "Peptide.hpp"
@@ -72,6 +73,8 @@ SpectraSTLib::SpectraSTLib(vector<string>& impFileNames, SpectraSTCreateParams*
   m_pepIndex(NULL),
   m_searchParams(NULL),
   m_createParams(createParams),
+  m_mappedLib(NULL),
+  m_preparedLib(NULL),
   m_count(0),
   m_noSptxt(false),
   m_mrmFout(NULL),
@@ -94,6 +97,8 @@ SpectraSTLib::SpectraSTLib(string fullFileName, SpectraSTSearchParams* searchPar
   m_pepIndex(NULL),
   m_searchParams(searchParams),
   m_createParams(NULL),
+  m_mappedLib(NULL),
+  m_preparedLib(NULL),
   m_count(0),
   m_noSptxt(false),
   m_mrmFout(NULL),
@@ -114,6 +119,12 @@ SpectraSTLib::~SpectraSTLib() {
   if (m_pepIndex) {
     delete m_pepIndex;
   }
+  if (m_mappedLib) {
+    delete m_mappedLib;
+  }
+  if (m_preparedLib) {
+    delete m_preparedLib;
+  }
   if (m_mrmFout) {
     delete m_mrmFout;
   }
@@ -149,6 +160,11 @@ void SpectraSTLib::initializeLibSearchMode(bool loadPeptideIndex) {
     binary = false;
   }
   
+  // a library in the mappable binary format is mapped into memory; entries are then read straight from there
+  if (binary && SpectraSTMappedLibFile::skipHeader(m_libFin)) {
+    m_mappedLib = new SpectraSTMappedLibFile(m_libFileName);
+  }
+  
   if (m_searchParams->databaseFile.empty()) {
     extractDatabaseFileFromPreamble(binary);
   }
@@ -163,17 +179,38 @@ void SpectraSTLib::initializeLibSearchMode(bool loadPeptideIndex) {
   bool useMTSearch = false;
   if (m_searchParams->numThreadsUsed > 1) useMTSearch = true;
   
+  SpectraSTDotKernel::setReferenceMode(m_searchParams->useReferenceDotKernel);
+  g_log->log("SEARCH", "Dot products computed with " + SpectraSTDotKernel::getKernelName() + " code.");
+  
+  // if asked, limit the memory used to cache library entries. Multi-threaded searches otherwise keep the entire library in memory.
+  unsigned long long cacheMemoryLimit = (unsigned long long)(m_searchParams->indexCacheMemoryMB) * 1024 * 1024;
+  
   // read the m/z index into memory for speedy lookup
-  if (m_searchParams->indexCacheAll) {
-    m_mzIndex = new SpectraSTMzLibIndex(m_mzIdxFileName, &m_libFin, SpectraSTMzLibIndex::CACHE_ALL, binary, useMTSearch);
+  if (cacheMemoryLimit > 0) {
+    stringstream cacheSs;
+    cacheSs << "Library entries cached in at most " << m_searchParams->indexCacheMemoryMB << " MB of memory.";
+    g_log->log("SEARCH", cacheSs.str());
+    m_mzIndex = new SpectraSTMzLibIndex(m_mzIdxFileName, &m_libFin, indexRetrievalRange, binary, useMTSearch, m_mappedLib, cacheMemoryLimit);
+  } else if (m_searchParams->indexCacheAll) {
+    m_mzIndex = new SpectraSTMzLibIndex(m_mzIdxFileName, &m_libFin, SpectraSTMzLibIndex::CACHE_ALL, binary, useMTSearch, m_mappedLib);
   } else {
-    m_mzIndex = new SpectraSTMzLibIndex(m_mzIdxFileName, &m_libFin, indexRetrievalRange, binary, false);
+    m_mzIndex = new SpectraSTMzLibIndex(m_mzIdxFileName, &m_libFin, indexRetrievalRange, binary, false, m_mappedLib);
+  }
+  
+  // searches in blocks (-s_BLK) retrieve the candidates of all queries in a block before scoring any of them
+  if (m_searchParams->searchBlockSize > 1) {
+    m_mzIndex->setPinUntilRelease(true);
   }
 
+  // if asked, use (or create) the search-ready library spectra
+  if (m_searchParams->indexUsePreparedLib) {
+    loadPreparedLib();
+  }
+  
   // if asked, also read the peptide index into memory
   if (loadPeptideIndex) {
     m_pepIdxFileName = m_libFileNameStruct.path + m_libFileNameStruct.name + ".pepidx";
-    m_pepIndex = new SpectraSTPeptideLibIndex(m_pepIdxFileName, &m_libFin, binary); 
+    m_pepIndex = new SpectraSTPeptideLibIndex(m_pepIdxFileName, &m_libFin, binary, m_mappedLib); 
   }
   
   // Fingerprint
@@ -184,6 +221,61 @@ void SpectraSTLib::initializeLibSearchMode(bool loadPeptideIndex) {
   
 }
 
+// loadPreparedLib - maps the search-ready library spectra (.spprep) for the m/z index to hand out. If the file
+// is not there, or goes with another version of the library or other search parameters, it is (re-)created
+// first, by preparing every entry in the library for search once.
+void SpectraSTLib::loadPreparedLib() {
+  
+  if (m_searchParams->peakNoBinning || m_searchParams->useTierwiseOpenModSearch) {
+    // these compare the peaks themselves, which prepared library spectra no longer have
+    g_log->log("SEARCH", "Search-ready library spectra (-s_PRP) not used with -s_NOB or -s_OMT.");
+    return;
+  }
+  
+  string prepFileName = m_libFileNameStruct.path + m_libFileNameStruct.name + ".spprep";
+  unsigned long long paramsKey = m_searchParams->calcPreparationKey();
+  
+  m_preparedLib = new SpectraSTPreparedLibFile(prepFileName);
+  
+  if (!(m_preparedLib->isUpToDate(paramsKey, m_libFileName))) {
+    
+    delete (m_preparedLib);
+    m_preparedLib = NULL;
+    
+    g_log->log("SEARCH", "Creating search-ready library spectra \"" + prepFileName + "\".");
+    
+    SpectraSTPreparedLibFile* newPreparedLib = new SpectraSTPreparedLibFile(prepFileName, paramsKey, m_libFileName);
+    if (!(newPreparedLib->isOpen())) {
+      delete (newPreparedLib);
+      return;
+    }
+    
+    fstream::off_type offset;
+    m_mzIndex->reset();
+    while (m_mzIndex->nextFileOffset(offset)) {
+      SpectraSTLibEntry* entry = m_mzIndex->readEntry(offset, true);
+      entry->getPeakList()->prepareForSearch(*m_searchParams, true);
+      newPreparedLib->insertEntry(offset, entry->getPeakList());
+      delete (entry);
+    }
+    m_mzIndex->reset();
+    
+    newPreparedLib->finish();
+    delete (newPreparedLib);
+    
+    m_preparedLib = new SpectraSTPreparedLibFile(prepFileName);
+    if (!(m_preparedLib->isUpToDate(paramsKey, m_libFileName))) {
+      g_log->error("SEARCH", "Cannot use search-ready library spectra \"" + prepFileName + "\". Library spectra will be prepared as they are retrieved.");
+      delete (m_preparedLib);
+      m_preparedLib = NULL;
+      return;
+    }
+  }
+  
+  m_mzIndex->setPreparedLib(m_preparedLib);
+  
+}
+
 // initializeLibSearchMode - initializes the library for create mode. 
 void SpectraSTLib::initializeLibCreateMode() {
 
@@ -205,6 +297,12 @@ void SpectraSTLib::initializeLibCreateMode() {
     g_log->error("CREATE", "Cannot open SPLIB file \"" + m_libFileName + "\" for writing library. No library creation performed.");
     return;
   }
+  
+  // the mappable binary format has a fixed-size header in front of the preamble
+  if (m_createParams->binaryFormat && m_createParams->mappableFormat) {
+    m_mappedLib = new SpectraSTMappedLibFile();
+    m_mappedLib->writeHeader(m_libFout);
+  }
     
   // if binary format is specified (which is default), also writes a text .sptxt file for human reading
   if (m_createParams->binaryFormat) {
@@ -264,6 +362,11 @@ void SpectraSTLib::initializeLibCreateMode() {
   // repeated as it parses through the file.
   importer->import();
   
+  // the string table of the mappable binary format goes after the last entry
+  if (m_mappedLib) {
+    m_mappedLib->writeStringTable(m_libFout, m_count);
+  }
+  
   // by then, the index object should contain indexes to all the inserted entries. Now write
   // the entire index to the .spidx and .pepidx files for future use.
   m_mzIndex->writeToFile();
@@ -326,6 +429,9 @@ void SpectraSTLib::insertEntry(SpectraSTLibEntry* entry) {
     
     
   // remember offset
+  if (m_mappedLib) {
+    m_mappedLib->alignRecord(m_libFout);
+  }
   fstream::off_type offset = m_libFout.tellp();
   
   // update counts
@@ -388,7 +494,11 @@ void SpectraSTLib::insertEntry(SpectraSTLibEntry* entry) {
     bfoss << binaryFileOffset;
   
     // write the library in binary format to .splib
-    entry->writeToBinaryFile(m_libFout);
+    if (m_mappedLib) {
+      entry->writeToMappedFile(m_libFout, *m_mappedLib);
+    } else {
+      entry->writeToBinaryFile(m_libFout);
+    }
     
     if (!m_noSptxt) {
       // note the binary file offset as a comment -- just as a convenience for people examining the .sptxt file to view
@@ -422,6 +532,36 @@ void SpectraSTLib::retrieve(vector<SpectraSTLibEntry*>& entries, double lowMz, d
   m_mzIndex->retrieve(entries, lowMz, highMz, shortAnnotation);
 }
 
+// retrieve - retrieves exactly the library entries with precursor m/z in any of the ranges, and store them in the
+// vector 'entries'. Basically calls SpectraSTMzLibIndex::retrieve
+void SpectraSTLib::retrieve(vector<SpectraSTLibEntry*>& entries, vector<mzRange>& ranges, bool shortAnnotation, mzLibRetrieveCounts* counts) {
+  
+  // check to make sure we are in the Search mode
+  if (!m_searchParams) {
+    return;
+  }	
+  m_mzIndex->retrieve(entries, ranges, shortAnnotation, counts);
+}
+
+// release - tells the library that the search that retrieved the entries in [lowMz, highMz] is done with them. 
+// See SpectraSTMzLibIndex::release
+void SpectraSTLib::release(double lowMz, double highMz) {
+  
+  if (!m_searchParams) {
+    return;
+  }
+  m_mzIndex->release(lowMz, highMz);
+}
+
+// release - same as above, for entries retrieved by ranges
+void SpectraSTLib::release(vector<mzRange>& ranges) {
+  
+  if (!m_searchParams) {
+    return;
+  }
+  m_mzIndex->release(ranges);
+}
+
 // writePreamble - writes some information about the library to the library file (.sptxt if binary library format is used, .splib otherwise)
 void SpectraSTLib::writePreamble(vector<string>& lines) {
   
@@ -465,7 +605,7 @@ void SpectraSTLib::writePreamble(vector<string>& lines) {
     
     // writing to .splib (binary) file
     offset = m_libFout.tellp();
-    if (offset != 0) {
+    if (offset != (m_mappedLib ? (fstream::off_type)SpectraSTMappedLibFile::HEADER_SIZE : 0)) {
       return;
     }
     // print header
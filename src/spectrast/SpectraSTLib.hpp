@@ -68,6 +68,9 @@ public:
   void insertEntry(SpectraSTLibEntry* entry);
   
   void retrieve(vector<SpectraSTLibEntry*>& hits, double lowMz, double highMz, bool shortAnnotation = true);
+  void retrieve(vector<SpectraSTLibEntry*>& hits, vector<mzRange>& ranges, bool shortAnnotation = true, mzLibRetrieveCounts* counts = NULL);
+  void release(double lowMz, double highMz);
+  void release(vector<mzRange>& ranges);
   
   SpectraSTPeptideLibIndex* getPeptideLibIndexPtr() { return (m_pepIndex); }
   
@@ -116,6 +119,14 @@ private:
   string m_pepIdxFileName; // the corresponding .pepidx file
   FileName m_libFileNameStruct;
   
+  // m_mappedLib - the memory-mapped .splib file when searching a library in the mappable binary format,
+  // or the string table being built when creating one. NULL otherwise. IS the property of SpectraSTLib.
+  SpectraSTMappedLibFile* m_mappedLib;
+  
+  // m_preparedLib - the search-ready library spectra (.spprep), when searching with -s_PRP. NULL otherwise.
+  // IS the property of SpectraSTLib.
+  SpectraSTPreparedLibFile* m_preparedLib;
+  
   // fstream objects for i/o
   ifstream m_libFin;
   ofstream m_libFout;
@@ -132,6 +143,7 @@ private:
   
   // Utility functions for initialization
   void initializeLibSearchMode(bool loadPeptideIndex);
+  void loadPreparedLib();
   void initializeLibCreateMode();
   
   void extractDatabaseFileFromPreamble(bool binary);
@@ -6,6 +6,7 @@
 #include <sstream>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
 
@@ -61,13 +62,14 @@ SpectraSTLibEntry::SpectraSTLibEntry(Peptide* pep, string comments, string statu
   m_comments(NULL),
   m_status(status),
   m_fullName(""),
+  m_commentFields(NULL),
   m_peakList(peakList),
   m_libId(0),
   m_libFileOffset(0),
   m_dotTimeProfile(NULL),
   m_ms1(NULL),
-  m_searchMutex(NULL), 
-  m_fragType(fragType) {
+  m_fragType(fragType),
+  m_searchPrepareState(NOT_PREPARED) {
 
   // the name is of the format AC[339]DEFGHIK/2	
   m_name = pep->interactStyleWithCharge();
@@ -85,6 +87,7 @@ SpectraSTLibEntry::SpectraSTLibEntry(Peptide* pep, string comments, string statu
   avemzss.precision(4);
   avemzss << fixed << showpoint << pep->averageMZ();
   m_commentsStr += avemzss.str();
+  clearCommentFields();
   
   // if peakList is not instantiated, will do so here
   if (!m_peakList) {
@@ -107,14 +110,15 @@ SpectraSTLibEntry::SpectraSTLibEntry(string name, double precursorMz, string com
   m_comments(NULL),
   m_status(status),
   m_fullName(name),
+  m_commentFields(NULL),
   m_peakList(peakList),
   m_libId(0),
   m_libFileOffset(0),
 //  m_dotHistogram(50, 0.0),
   m_dotTimeProfile(NULL),
   m_ms1(NULL),
-  m_searchMutex(NULL), 
-  m_fragType(fragType) {
+  m_fragType(fragType),
+  m_searchPrepareState(NOT_PREPARED) {
 
   if (!(m_fragType.empty())) {
     m_fullName += " (" + m_fragType + ")";
@@ -135,7 +139,7 @@ SpectraSTLibEntry::SpectraSTLibEntry(string name, double precursorMz, string com
 
 
 // constructor from library file
-SpectraSTLibEntry::SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSearch, bool multithreaded) :
+SpectraSTLibEntry::SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSearch) :
   m_name(""),
   m_charge(0),
   m_mw(0.0),
@@ -145,33 +149,15 @@ SpectraSTLibEntry::SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSear
   m_comments(NULL),
   m_status(""),
   m_fullName(""),
+  m_commentFields(NULL),
   m_peakList(NULL),
   m_libId(0),
   m_libFileOffset(0),
   m_dotTimeProfile(NULL),
   m_ms1(NULL),
-  m_searchMutex(NULL), 
-  m_fragType("") {
+  m_fragType(""),
+  m_searchPrepareState(NOT_PREPARED) {
     
-  if (multithreaded) {
-#ifdef MSVC
-  m_searchMutex = CreateMutex( 
-			    NULL,              // default security attributes
-			    FALSE,             // initially not owned
-			    NULL);             // unnamed mutex
-  
-  if (m_searchMutex == NULL) 
-    {
-      printf("CreateMutex error: %d\n", (int)GetLastError());
-      exit(1);
-    }
-#else
-    m_searchMutex = new pthread_mutex_t();
-    pthread_mutex_init(m_searchMutex, NULL);
-#endif
-
-  }
-      
   // construct the object by reading from a library file
   if (binary) {
     readFromBinaryFile(libFin, forSearch);
@@ -180,6 +166,29 @@ SpectraSTLibEntry::SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSear
   }
 }
 
+// constructor from a memory-mapped library file
+SpectraSTLibEntry::SpectraSTLibEntry(SpectraSTMappedLibFile& mappedLib, fstream::off_type offset, bool forSearch) :
+  m_pep(NULL),
+  m_libId(0),
+  m_libFileOffset(0),
+  m_name(""),
+  m_mw(0.0),
+  m_precursorMz(0.0),
+  m_status(""),
+  m_fullName(""),
+  m_commentsStr(""),
+  m_charge(0),
+  m_fragType(""),
+  m_comments(NULL),
+  m_commentFields(NULL),
+  m_peakList(NULL),
+  m_dotTimeProfile(NULL),
+  m_ms1(NULL),
+  m_searchPrepareState(NOT_PREPARED) {
+    
+  readFromMappedFile(mappedLib, offset, forSearch);
+}
+
 // readFromFile - reads from a text .splib file.
 void SpectraSTLibEntry::readFromFile(ifstream& libFin, bool forSearch) {
 
@@ -211,6 +220,7 @@ void SpectraSTLibEntry::readFromFile(ifstream& libFin, bool forSearch) {
       m_status = tail;
     } else if (head == "Comment") {
       m_commentsStr = tail;
+      clearCommentFields();
     } 		
   }
   
@@ -359,6 +369,72 @@ void SpectraSTLibEntry::readFromBinaryFile(ifstream& libFin, bool forSearch) {
   }
   m_fullName = line;
   
+  parseBinaryFullName();
+  
+  // precursor m/z
+  libFin.read((char*)(&m_precursorMz), sizeof(double));
+  
+  m_mw = m_precursorMz * m_charge;
+    
+  // status
+  if (!nextLine(libFin, line)) {
+    g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
+    g_log->crash();
+  }
+  m_status = line;
+  
+  // num peaks
+  unsigned int numPeaks = 0;
+  libFin.read((char*)(&numPeaks), sizeof(unsigned int));
+  
+  m_peakList = new SpectraSTPeakList(m_precursorMz, m_charge, numPeaks, true, m_fragType);
+  
+  if (m_pep) {
+    m_peakList->setPeptidePtr(m_pep);
+  }
+
+  // peaks
+  for (unsigned int i = 0; i < numPeaks; i++) {
+    double mz = 0.0;
+    double intensity = 0.0;
+    libFin.read((char*)(&mz), sizeof(double));    
+    libFin.read((char*)(&intensity), sizeof(double));
+   
+    if (!nextLine(libFin, line)) {
+      g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
+      g_log->crash();
+    }
+    string annotation = line;
+   
+    if (!nextLine(libFin, line)) {
+      g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
+      g_log->crash();
+    }
+    string info = line;
+    
+    float floatIntensity = (float)intensity;
+
+    if (!forSearch) {
+      m_peakList->insert(mz, floatIntensity, annotation, info);
+    } else {
+      m_peakList->insertForSearch(mz, floatIntensity, (annotation.empty() ? "" : annotation.substr(0,1)));   
+    }
+  }
+  
+  // comments
+  if (!nextLine(libFin, line)) {
+    g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
+    g_log->crash();
+  }
+  m_commentsStr = line;
+  clearCommentFields();
+
+}
+
+// parseBinaryFullName - sets the name, charge, peptide and fragmentation type from the full name, as
+// stored in the binary library formats
+void SpectraSTLibEntry::parseBinaryFullName() {
+  
   if (m_fullName.size() < 2) {  
     g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
     g_log->crash();
@@ -421,63 +497,61 @@ void SpectraSTLibEntry::readFromBinaryFile(ifstream& libFin, bool forSearch) {
     m_charge = m_pep->charge;
   
   }
-  // precursor m/z
-  libFin.read((char*)(&m_precursorMz), sizeof(double));
   
+}
+
+// readFromMappedFile - reads an entry from a memory-mapped binary library file. See SpectraSTMappedLibFile for the format.
+void SpectraSTLibEntry::readFromMappedFile(SpectraSTMappedLibFile& mappedLib, fstream::off_type offset, bool forSearch) {
+  
+  m_libFileOffset = offset;
+  
+  const char* data = mappedLib.getRecord(offset);
+  
+  struct mappedLibRecord record;
+  memcpy(&record, data, sizeof(struct mappedLibRecord));
+  
+  unsigned int numPeaks = record.numPeaks;
+  const double* mzs = (const double*)(data + sizeof(struct mappedLibRecord));
+  const float* intensities = (const float*)(mzs + numPeaks);
+  const unsigned int* annotations = (const unsigned int*)(intensities + numPeaks);
+  const unsigned int* infos = annotations + numPeaks;
+  const char* strings = (const char*)(infos + numPeaks);
+  
+  m_libId = record.libId;
+  
+  // full name
+  m_fullName.assign(strings, record.fullNameLength);
+  strings += record.fullNameLength;
+  parseBinaryFullName();
+  
+  // precursor m/z
+  m_precursorMz = record.precursorMz;
   m_mw = m_precursorMz * m_charge;
-    
-  // status
-  if (!nextLine(libFin, line)) {
-    g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
-    g_log->crash();
-  }
-  m_status = line;
   
-  // num peaks
-  unsigned int numPeaks = 0;
-  libFin.read((char*)(&numPeaks), sizeof(unsigned int));
+  // status
+  m_status.assign(strings, record.statusLength);
+  strings += record.statusLength;
   
   m_peakList = new SpectraSTPeakList(m_precursorMz, m_charge, numPeaks, true, m_fragType);
   
   if (m_pep) {
     m_peakList->setPeptidePtr(m_pep);
   }
-
+  
   // peaks
   for (unsigned int i = 0; i < numPeaks; i++) {
-    double mz = 0.0;
-    double intensity = 0.0;
-    libFin.read((char*)(&mz), sizeof(double));    
-    libFin.read((char*)(&intensity), sizeof(double));
-   
-    if (!nextLine(libFin, line)) {
-      g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
-      g_log->crash();
-    }
-    string annotation = line;
-   
-    if (!nextLine(libFin, line)) {
-      g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
-      g_log->crash();
-    }
-    string info = line;
-    
-    float floatIntensity = (float)intensity;
-
+    const char* annotation = mappedLib.getString(annotations[i]);
     if (!forSearch) {
-      m_peakList->insert(mz, floatIntensity, annotation, info);
+      m_peakList->insert(mzs[i], intensities[i], annotation, mappedLib.getString(infos[i]));
     } else {
-      m_peakList->insertForSearch(mz, floatIntensity, (annotation.empty() ? "" : annotation.substr(0,1)));   
+      m_peakList->insertForSearch(mzs[i], intensities[i], (annotation[0] == '\0' ? string("") : string(1, annotation[0])));
     }
   }
   
   // comments
-  if (!nextLine(libFin, line)) {
-    g_log->error("GENERAL", "Corrupt .splib file from which to import entry.");
-    g_log->crash();
-  }
-  m_commentsStr = line;
-
+  m_commentsStr.assign(strings, record.commentsLength);
+  clearCommentFields();
+  
 }
 
 // destructor
@@ -497,6 +571,8 @@ SpectraSTLibEntry::~SpectraSTLibEntry() {
     delete m_comments;
     m_comments = NULL;
   }
+  
+  clearCommentFields();
 
   if (m_dotTimeProfile) {
     delete (m_dotTimeProfile);
@@ -514,9 +590,11 @@ SpectraSTLibEntry::~SpectraSTLibEntry() {
 SpectraSTLibEntry::SpectraSTLibEntry(SpectraSTLibEntry& other) :
   m_pep(NULL),
   m_comments(NULL),
+  m_commentFields(NULL),
   m_peakList(NULL),
   m_ms1(NULL),
-  m_dotTimeProfile(NULL) {
+  m_dotTimeProfile(NULL),
+  m_searchPrepareState(NOT_PREPARED) {
   
   (*this) = other;
 }
@@ -529,6 +607,7 @@ SpectraSTLibEntry& SpectraSTLibEntry::operator=(SpectraSTLibEntry& other) {
   this->m_name = other.m_name;
   this->m_mw = other.m_mw;
   this->m_commentsStr = other.m_commentsStr;
+  clearCommentFields();
   this->m_precursorMz = other.m_precursorMz;
   this->m_fullName = other.m_fullName;
   this->m_charge = other.m_charge;
@@ -689,6 +768,31 @@ void SpectraSTLibEntry::writeToBinaryFile(ofstream& libFout) {
 
 }
 
+// writeToMappedFile - write the entry to file in the memory-mappable binary format. The file must be positioned
+// at a record boundary (see SpectraSTMappedLibFile::alignRecord).
+void SpectraSTLibEntry::writeToMappedFile(ofstream& libFout, SpectraSTMappedLibFile& mappedLib) {
+  
+  string commentsStr = getCommentsStr();
+  
+  struct mappedLibRecord record;
+  record.libId = m_libId;
+  record.numPeaks = m_peakList->getNumPeaks();
+  record.precursorMz = m_precursorMz;
+  record.fullNameLength = (unsigned int)(m_fullName.length());
+  record.statusLength = (unsigned int)(m_status.length());
+  record.commentsLength = (unsigned int)(commentsStr.length());
+  record.reserved = 0;
+  
+  libFout.write((char*)(&record), sizeof(struct mappedLibRecord));
+  m_peakList->writeToMappedFile(libFout, mappedLib);
+  libFout.write(m_fullName.data(), m_fullName.length());
+  libFout.write(m_status.data(), m_status.length());
+  libFout.write(commentsStr.data(), commentsStr.length());
+  
+  mappedLib.alignRecord(libFout);
+  
+}
+
 // writeDtaFile - write the entry as a .dta (i.e. no header) 
 void SpectraSTLibEntry::writeDtaFile(string dtaFileName) {
 
@@ -1076,43 +1180,22 @@ string SpectraSTLibEntry::getCommentsStr() {
   }
   
   m_commentsStr = ss.str();
+  clearCommentFields();
   return (ss.str());
 }
 
 // getOneComment - get one comment field. If m_comments is not instantiated, just
-// do simple string parsing to find the field.
-bool SpectraSTLibEntry::getOneComment(string attr, string& value) {
+// look up where the field is in the comments string.
+bool SpectraSTLibEntry::getOneComment(const string& attr, string& value) {
 
   if (!m_comments) {
-    string::size_type found = m_commentsStr.find(attr + '=', 0);
-
-    if (found == string::npos) {
+    string::size_type valueStart = 0;
+    string::size_type valueEnd = 0;
+    if (!findOneComment(attr, valueStart, valueEnd)) {
       return (false);
-    } else {
-
-      string::size_type vs;
-      if (found == 0) {
-	vs = found + attr.length() + 1;
-      } else {
-	// make sure the attribute we're looking for isn't prefixed with something else
-	found = m_commentsStr.find(' ' + attr + '=', 0);
-	if (found == string::npos) {
-	  return (false);
-	}
-	vs = found + attr.length() + 2;
-      }
-
-      if (vs >= m_commentsStr.length()) {
-        return (false);
-      }
-      if (m_commentsStr[vs] == '\"') {
-        // in quote, get rid of quotes
-        value = nextToken(m_commentsStr, vs, vs, "\"\t\r\n", "\"");
-      } else {
-        value = nextToken(m_commentsStr, vs, vs, " \t\r\n");
-      }
-      return (true);
     }
+    value.assign(m_commentsStr, valueStart, valueEnd - valueStart);
+    return (true);
     
   } else {
     // already parsed into m_comments. simply find it from the map object
@@ -1125,6 +1208,117 @@ bool SpectraSTLibEntry::getOneComment(string attr, string& value) {
     }
   }
 }
+
+// getOneComment - get one numeric comment field, e.g. Prob=0.99, or the leading number of a field 
+// like Nreps=3/5 or RetentionTime=1023.4,1025.0,1021.9. Does not create any temporary strings.
+bool SpectraSTLibEntry::getOneComment(const string& attr, double& value) {
+  
+  if (!m_comments) {
+    string::size_type valueStart = 0;
+    string::size_type valueEnd = 0;
+    if (!findOneComment(attr, valueStart, valueEnd)) {
+      return (false);
+    }
+    value = atof(m_commentsStr.c_str() + valueStart);
+    return (true);
+    
+  } else {
+    map<string, string>::iterator found = m_comments->find(attr);
+    if (found == m_comments->end()) {
+      return (false);
+    } else {
+      value = atof(found->second.c_str());
+      return (true);
+    }
+  }
+}
+
+// findOneComment - finds the position of the value of a comment field in m_commentsStr, without the quotes if quoted.
+// Indexes m_commentsStr first if not yet done.
+bool SpectraSTLibEntry::findOneComment(const string& attr, string::size_type& valueStart, string::size_type& valueEnd) {
+  
+  if (!m_commentFields) {
+    indexCommentsStr();
+  }
+  
+  const char* str = m_commentsStr.c_str();
+  string::size_type attrLen = attr.length();
+  
+  for (vector<CommentField>::iterator f = m_commentFields->begin(); f != m_commentFields->end(); f++) {
+    if (f->attrEnd - f->attrStart == attrLen && attr.compare(0, attrLen, str + f->attrStart, attrLen) == 0) {
+      valueStart = f->valueStart;
+      valueEnd = f->valueEnd;
+      return (true);
+    }
+  }
+  return (false);
+}
+
+// indexCommentsStr - locates all the attr=value fields in m_commentsStr, splitting them the same way as parseCommentsStr.
+// A value in quotes can contain whitespace; the quotes are not part of the value. Fields without '=' are skipped, and
+// if an attr appears more than once, the first one is found.
+void SpectraSTLibEntry::indexCommentsStr() {
+  
+  if (m_commentFields) {
+    m_commentFields->clear();
+  } else {
+    m_commentFields = new vector<CommentField>;
+  }
+  
+  const char* str = m_commentsStr.c_str();
+  string::size_type len = m_commentsStr.length();
+  string::size_type pos = 0;
+  
+  while (pos < len) {
+    
+    // skip whitespace to the start of the field
+    while (pos < len && (str[pos] == ' ' || str[pos] == '\t' || str[pos] == '\r' || str[pos] == '\n')) pos++;
+    if (pos >= len) break;
+    
+    string::size_type fieldStart = pos;
+    string::size_type eqPos = string::npos;
+    while (pos < len && str[pos] != ' ' && str[pos] != '\t' && str[pos] != '\r' && str[pos] != '\n' && str[pos] != '\"') {
+      if (str[pos] == '=' && eqPos == string::npos) eqPos = pos;
+      pos++;
+    }
+    
+    CommentField field;
+    field.attrStart = (unsigned int)fieldStart;
+    field.attrEnd = (unsigned int)eqPos;
+    field.valueStart = (unsigned int)(eqPos + 1);
+    field.valueEnd = (unsigned int)pos;
+    
+    if (pos < len && str[pos] == '\"') {
+      // the value (or the rest of it) is quoted, and goes all the way to the next quote, ignoring whitespace in between
+      string::size_type openQuotePos = pos;
+      string::size_type closeQuotePos = m_commentsStr.find('\"', openQuotePos + 1);
+      if (closeQuotePos == string::npos) closeQuotePos = len;
+      
+      if (openQuotePos == eqPos + 1) {
+        field.valueStart = (unsigned int)(openQuotePos + 1);
+        field.valueEnd = (unsigned int)closeQuotePos;
+      } else {
+        // quote in the middle of the value -- just keep it all
+        field.valueEnd = (unsigned int)(closeQuotePos < len ? closeQuotePos + 1 : len);
+      }
+      pos = closeQuotePos + 1;
+    }
+    
+    if (eqPos != string::npos) {
+      m_commentFields->push_back(field);
+    }
+  }
+  
+}
+
+// clearCommentFields - discards m_commentFields. Must be called whenever m_commentsStr is changed.
+void SpectraSTLibEntry::clearCommentFields() {
+  
+  if (m_commentFields) {
+    delete (m_commentFields);
+    m_commentFields = NULL;
+  }
+}
 	
 // setOneComment - set one comment field. This will automatically parse the string into an object
 // for easy insertion or modification. returns true if that comment is found.
@@ -1216,10 +1410,7 @@ void SpectraSTLibEntry::synchWithPep() {
 double SpectraSTLibEntry::getAveragePrecursorMz() {
    
   double mz = m_precursorMz;
-  string mzStr("");
-  if (getOneComment("AvePrecursorMz", mzStr)) {
-    mz = atof(mzStr.c_str());
-  }
+  getOneComment("AvePrecursorMz", mz);
   return (mz);
 }
 
@@ -1228,14 +1419,9 @@ double SpectraSTLibEntry::getProb(double valueIfNotFound) {
   
   double prob = valueIfNotFound;
   
-  string probStr("");
-  if (getOneComment("Prob", probStr)) {
-    prob = atof(probStr.c_str());
-  } else {
-    string tfRatioStr("");
-    string::size_type tfRatioPos = 0;
-    if (getOneComment("Tfratio", tfRatioStr)) {
-      double tfRatio = atof(tfRatioStr.c_str());
+  if (!getOneComment("Prob", prob)) {
+    double tfRatio = 0.0;
+    if (getOneComment("Tfratio", tfRatio)) {
       prob = tfRatio / (1.0 + tfRatio);
     }
   }
@@ -1247,10 +1433,9 @@ double SpectraSTLibEntry::getProb(double valueIfNotFound) {
 unsigned int SpectraSTLibEntry::getNrepsUsed(unsigned int valueIfNotFound) {
   
   unsigned int numRepsUsed = valueIfNotFound;
-  string nrepsStr("");
-  string::size_type slashPos = 0;
-  if (getOneComment("Nreps", nrepsStr)) {
-    numRepsUsed = atoi(nextToken(nrepsStr, 0, slashPos, "/ \t\r\n").c_str());
+  double nreps = 0.0;
+  if (getOneComment("Nreps", nreps)) {
+    numRepsUsed = (unsigned int)nreps;
   }
   
   return (numRepsUsed);
@@ -2055,31 +2240,78 @@ void SpectraSTLibEntry::printDotTimeProfile(ofstream& fout) {
   
 }
 
+// prepareForSearch - prepares the peak list for search, once. In a multi-threaded search, any number of threads can
+// get here for the same (cached) entry at the same time: the first one to flip m_searchPrepareState does the work,
+// and the others wait for it to finish. Once prepared, this is just a check of m_searchPrepareState.
 void SpectraSTLibEntry::prepareForSearch(SpectraSTSearchParams& searchParams) {
   
-  if (!(m_peakList->isPreparedForSearch())) {
-  
-    if (m_searchMutex) {
+  if (m_searchPrepareState == PREPARED) {
+    return;
+  }
+
 #ifdef MSVC
-      WaitForSingleObject( m_searchMutex,    // handle to mutex
-			   INFINITE);      //#include "windows.h"
+  bool isFirst = (InterlockedCompareExchange(&m_searchPrepareState, BEING_PREPARED, NOT_PREPARED) == NOT_PREPARED);
 #else
-      pthread_mutex_lock(m_searchMutex);
-#endif      
-    }
-  
-    m_peakList->prepareForSearch(searchParams, true);
+  bool isFirst = __sync_bool_compare_and_swap(&m_searchPrepareState, NOT_PREPARED, BEING_PREPARED);
+#endif
   
-    if (m_searchMutex) {
+  if (isFirst) {
+    
+    if (!(m_peakList->isPreparedForSearch())) {
+      m_peakList->prepareForSearch(searchParams, true);
+    } else if (searchParams.sketchFilterMinDot > 0.0) {
+      // read prepared from the search-ready library file, which does not keep the sketches
+      m_peakList->buildSketch(searchParams);
+    }
+    
+    // index the comments now, so that threads looking up comments of this entry will not do so concurrently
+    if (!m_comments && !m_commentFields) {
+      indexCommentsStr();
+    }
+    
+    // the exchange is a full barrier -- no other thread sees PREPARED before the prepared peak list
+#ifdef MSVC
+    InterlockedExchange(&m_searchPrepareState, PREPARED);
+#else
+    __sync_val_compare_and_swap(&m_searchPrepareState, BEING_PREPARED, PREPARED);
+#endif
+    
+  } else {
+    
+    while (m_searchPrepareState != PREPARED) {
 #ifdef MSVC
-      ReleaseMutex( m_searchMutex );      //#include "windows.h"
+      SwitchToThread();
 #else
-      pthread_mutex_unlock( m_searchMutex );//#include <pthread.h>
+      sched_yield();
+#endif
+    }
+#ifndef MSVC
+    __sync_synchronize();
 #endif
+  }
+}
 
+// calcMemoryUsage - the approximate number of bytes this entry takes up in memory. For sizing the cache
+// of library entries.
+unsigned long long SpectraSTLibEntry::calcMemoryUsage() {
+  
+  unsigned long long bytes = sizeof(SpectraSTLibEntry);
+  bytes += m_name.capacity() + m_status.capacity() + m_fullName.capacity() + m_commentsStr.capacity() + m_fragType.capacity();
+  
+  if (m_pep) bytes += sizeof(Peptide);
+  if (m_peakList) bytes += m_peakList->calcMemoryUsage();
+  
+  if (m_comments) {
+    for (map<string, string>::iterator i = m_comments->begin(); i != m_comments->end(); i++) {
+      bytes += sizeof(*i) + i->first.capacity() + i->second.capacity();
     }
+  }
   
+  if (m_commentFields) {
+    bytes += sizeof(vector<CommentField>) + m_commentFields->capacity() * sizeof(CommentField);
   }
+  
+  return (bytes);
 }
 
 
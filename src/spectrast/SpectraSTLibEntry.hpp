@@ -2,6 +2,7 @@
 #define SPECTRASTLIBENTRY_HPP_
 
 #include "SpectraSTPeakList.hpp"
+#include "SpectraSTMappedLibFile.hpp"
 #include "Peptide.hpp"
 #include <iostream>
 #include <string>
@@ -14,6 +15,7 @@
 #include "windows.h"
 #else
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 /*
@@ -64,7 +66,8 @@ public:
   // 2. by giving a ifstream object pointing to the beginning of an entry in a library file
   SpectraSTLibEntry(Peptide* pep, string comments, string status, SpectraSTPeakList* peakList, string fragType = "");
   SpectraSTLibEntry(string name, double precursorMz, string comments, string status, SpectraSTPeakList* peakList, string fragType = "");
-  SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSearch = false, bool multithreaded = false);
+  SpectraSTLibEntry(ifstream& libFin, bool binary, bool forSearch = false);
+  SpectraSTLibEntry(SpectraSTMappedLibFile& mappedLib, fstream::off_type offset, bool forSearch = false);
   
   // copy constructor and assignment operator
   SpectraSTLibEntry(SpectraSTLibEntry& other);
@@ -111,7 +114,8 @@ public:
   unsigned int getNMC();
   
   // Accessing the comment
-  bool getOneComment(string attr, string& value);
+  bool getOneComment(const string& attr, string& value);
+  bool getOneComment(const string& attr, double& value); // reads the (leading) number of the field
   bool setOneComment(string attr, string value);
   bool deleteOneComment(string attr);
   
@@ -139,6 +143,7 @@ public:
   // File I/O methods
   void writeToFile(ofstream& libFout);
   void writeToBinaryFile(ofstream& libFout);
+  void writeToMappedFile(ofstream& libFout, SpectraSTMappedLibFile& mappedLib);
   void writeDtaFile(string dtaFileName);
   void writeMRM(ofstream& mrmFout, string format);
   void writeInfo(ofstream& mrmFout);
@@ -170,6 +175,8 @@ public:
   
   void prepareForSearch(SpectraSTSearchParams& searchParams);
   
+  unsigned long long calcMemoryUsage();
+  
 private:
 
   // fields
@@ -191,6 +198,18 @@ private:
   // which will be done by string parsing of m_commentsStr instead.
   map<string, string>* m_comments;
   
+  // m_commentFields is a flat table locating each attr=value field in m_commentsStr, so that getOneComment()
+  // need not scan the string on every call. Built on the first lookup (or on preparing for search, 
+  // so that threads sharing a cached entry never build it concurrently), and discarded whenever m_commentsStr changes.
+  // Not used once m_comments is instantiated.
+  typedef struct _commentField {
+    unsigned int attrStart;
+    unsigned int attrEnd;
+    unsigned int valueStart;
+    unsigned int valueEnd;
+  } CommentField;
+  vector<CommentField>* m_commentFields;
+  
   // m_peakList IS the property of SpectraSTLibEntry!
   SpectraSTPeakList* m_peakList;
   
@@ -203,15 +222,24 @@ private:
   // parse m_commentsStr to create m_comments
   void parseCommentsStr();
   
+  // index m_commentsStr to create (or discard) m_commentFields, and look up a field in it
+  void indexCommentsStr();
+  void clearCommentFields();
+  bool findOneComment(const string& attr, string::size_type& valueStart, string::size_type& valueEnd);
+  
   // reading from files - these are private, so to read from files the constructor has to be called
   void readFromFile(ifstream& libFin, bool forSearch);
   void readFromBinaryFile(ifstream& libFin, bool forSearch);
+  void readFromMappedFile(SpectraSTMappedLibFile& mappedLib, fstream::off_type offset, bool forSearch);
+  void parseBinaryFullName();
   
-
+  // m_searchPrepareState - whether the peak list is prepared for search. Changed atomically, so that in a 
+  // multi-threaded search, exactly one thread prepares it (see prepareForSearch()).
+  enum { NOT_PREPARED = 0, BEING_PREPARED = 1, PREPARED = 2 };
 #ifdef MSVC
-  HANDLE m_searchMutex;
+  volatile LONG m_searchPrepareState;
 #else
-  pthread_mutex_t* m_searchMutex;	
+  volatile long m_searchPrepareState;
 #endif
 
 
@@ -5,6 +5,7 @@
 #include "FileUtils.hpp"
 
 #include <fstream>
+#include <string.h>
 
 
 /*
@@ -52,6 +53,9 @@ hlam@systemsbiology.org
 
 using namespace std;
 
+// the FNV-1a offset basis
+const unsigned long long SpectraSTLibIndex::CHECKSUM_SEED = 14695981039346656037ULL;
+
 // constructor for creating
 SpectraSTLibIndex::SpectraSTLibIndex(string idxFileName, string idxType) :
   m_idxFileName(idxFileName),
@@ -59,17 +63,19 @@ SpectraSTLibIndex::SpectraSTLibIndex(string idxFileName, string idxType) :
   m_idxType(idxType),
   m_retrievalMode(false),
   m_binaryLib(false),
+  m_mappedLib(NULL),
   m_entryCount(0) {
   
 }
 
 // constructor for retrieval
-SpectraSTLibIndex::SpectraSTLibIndex(string idxFileName, ifstream* libFinPtr, string idxType, bool binaryLib) :
+SpectraSTLibIndex::SpectraSTLibIndex(string idxFileName, ifstream* libFinPtr, string idxType, bool binaryLib, SpectraSTMappedLibFile* mappedLib) :
   m_idxFileName(idxFileName), 
   m_libFinPtr(libFinPtr),
   m_idxType(idxType),
   m_retrievalMode(true),
   m_binaryLib(binaryLib),
+  m_mappedLib(mappedLib),
   m_entryCount(0) {	
   
 }
@@ -77,3 +83,49 @@ SpectraSTLibIndex::SpectraSTLibIndex(string idxFileName, ifstream* libFinPtr, st
 // destructor - Since all the entries stored in the cache remain property of the index, they
 // have to be deleted here.
 SpectraSTLibIndex::~SpectraSTLibIndex() {}
+
+// readEntry - reads the entry at the file offset, either straight from the mapped library, or by seeking the .splib stream.
+// libFin is the stream to read from, if not the shared m_libFinPtr (e.g. a stream of the calling thread's own).
+// If bytesRead is not NULL, it is set to the size of the entry in the library file.
+// The returned SpectraSTLibEntry object becomes property of caller!
+SpectraSTLibEntry* SpectraSTLibIndex::readEntry(fstream::off_type offset, bool forSearch, ifstream* libFin, unsigned long long* bytesRead) {
+  
+  SpectraSTLibEntry* entry = NULL;
+  
+  if (m_mappedLib) {
+    if (!m_mappedLib->checkRecord(offset)) return (NULL);
+    entry = new SpectraSTLibEntry(*m_mappedLib, offset, forSearch);
+    if (bytesRead) *bytesRead = m_mappedLib->getRecordSize(offset);
+  } else {
+    if (!libFin) libFin = m_libFinPtr;
+    libFin->seekg(offset);
+    entry = new SpectraSTLibEntry(*libFin, m_binaryLib, forSearch);
+    if (bytesRead) {
+      // where the reading stopped. Unknown if the last entry is read up to the end of the file.
+      fstream::off_type end = libFin->tellg();
+      *bytesRead = (end > offset ? (unsigned long long)(end - offset) : 0);
+    }
+  }
+  
+  entry->setLibFileOffset(offset);
+  return (entry);
+}
+
+// calcChecksum - a 64-bit FNV-1a hash of the data, taken 8 bytes at a time (the tail byte by byte), which is fast enough
+// to check on every load of an index. Start with CHECKSUM_SEED; pass the result back in to continue over the next array.
+unsigned long long SpectraSTLibIndex::calcChecksum(const char* data, unsigned long long length, unsigned long long checksum) {
+  
+  const unsigned long long prime = 1099511628211ULL;
+  
+  unsigned long long pos = 0;
+  for (; pos + 8 <= length; pos += 8) {
+    unsigned long long word = 0;
+    memcpy(&word, data + pos, 8);
+    checksum = (checksum ^ word) * prime;
+  }
+  for (; pos < length; pos++) {
+    checksum = (checksum ^ (unsigned char)(data[pos])) * prime;
+  }
+  
+  return (checksum);
+}
@@ -53,7 +53,7 @@ class SpectraSTLibIndex {
 public:
   
   SpectraSTLibIndex(string idxFileName, string idxType);
-  SpectraSTLibIndex(string idxFileName, ifstream* libFinPtr, string idxType, bool binaryLib);
+  SpectraSTLibIndex(string idxFileName, ifstream* libFinPtr, string idxType, bool binaryLib, SpectraSTMappedLibFile* mappedLib = NULL);
   
   
   virtual ~SpectraSTLibIndex();
@@ -68,6 +68,14 @@ public:
   
   unsigned int getEntryCount() { return (m_entryCount); }
   
+  // readEntry - reads the entry at the file offset. The returned SpectraSTLibEntry object becomes property of caller!
+  SpectraSTLibEntry* readEntry(fstream::off_type offset, bool forSearch = false, ifstream* libFin = NULL, unsigned long long* bytesRead = NULL);
+  
+  // calcChecksum - checksum of the binary index files, see the .cpp file. Pass the checksum so far to continue over more data.
+  static unsigned long long calcChecksum(const char* data, unsigned long long length, unsigned long long checksum = CHECKSUM_SEED);
+  
+  static const unsigned long long CHECKSUM_SEED;
+  
 protected:
   
   // m_libFinPtr - The ifstream of the .splib file. Used to retrieve entries.
@@ -86,6 +94,10 @@ protected:
   // m_binaryLib - whether the library is in binary format
   bool m_binaryLib;
   
+  // m_mappedLib - the memory-mapped library, if the library is in the mappable binary format (else NULL). 
+  // NOT a property of this class.
+  SpectraSTMappedLibFile* m_mappedLib;
+  
   // m_entryCount
   unsigned int m_entryCount;
 };
@@ -0,0 +1,215 @@
+#include "SpectraSTLineReader.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTLineReader
+ *
+ * Buffered line reader for text query files. See the header file.
+ *
+ */
+
+// 1 MB at a time
+const unsigned int SpectraSTLineReader::DEFAULT_BLOCK_SIZE = 1 << 20;
+
+// the powers of 10 that are exact in a double
+static const double exactPowersOf10[] = { 
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+// constructor
+SpectraSTLineReader::SpectraSTLineReader(istream& fin, unsigned int blockSize) :
+  m_fin(fin),
+  m_buffer(blockSize + 1),
+  m_begin(0),
+  m_end(0),
+  m_blockSize(blockSize),
+  m_eof(false) {
+
+}
+
+// destructor
+SpectraSTLineReader::~SpectraSTLineReader() {
+
+}
+
+// readBlock - moves the unread part of the buffer to the front, and reads the next block after it. The buffer grows if
+// a line is longer than the block. Returns false if there is nothing more to read.
+bool SpectraSTLineReader::readBlock() {
+
+  if (m_eof) {
+    return (false);
+  }
+
+  unsigned int unread = m_end - m_begin;
+  if (unread > 0 && m_begin > 0) {
+    memmove(&(m_buffer[0]), &(m_buffer[m_begin]), unread);
+  }
+  m_begin = 0;
+  m_end = unread;
+
+  // always leave room for the '\0' after the last line
+  if (m_buffer.size() < unread + m_blockSize + 1) {
+    m_buffer.resize(unread + m_blockSize + 1);
+  }
+
+  m_fin.read(&(m_buffer[m_end]), m_blockSize);
+  unsigned int numRead = (unsigned int)(m_fin.gcount());
+  m_end += numRead;
+
+  if (numRead < m_blockSize) {
+    m_eof = true;
+  }
+
+  return (numRead > 0);
+}
+
+// nextLine - puts the next line in 'line', without the line break. Returns false, with 'line' "_EOF_", at the end of the file.
+bool SpectraSTLineReader::nextLine(const char*& line) {
+
+  char* newline = NULL;
+
+  while (!(newline = (m_begin < m_end ? (char*)memchr(&(m_buffer[m_begin]), '\n', m_end - m_begin) : NULL))) {
+    if (!readBlock()) {
+      break;
+    }
+  }
+
+  char* start = &(m_buffer[m_begin]);
+  char* end = NULL;
+
+  if (newline) {
+    end = newline;
+    m_begin = (unsigned int)(newline - &(m_buffer[0])) + 1;
+  } else if (m_begin < m_end) {
+    // last line, without a line break
+    end = &(m_buffer[m_end]);
+    m_begin = m_end;
+  } else {
+    line = "_EOF_";
+    return (false);
+  }
+
+  if (end > start && *(end - 1) == '\r') {
+    end--;
+  }
+  *end = '\0';
+
+  line = start;
+  return (true);
+}
+
+// nextLine - puts the next line in 'line', skipping over any line starting with 'skipoverLinePrefix'. Flags (by returning false)
+// if it gets a line starting with 'flagLinePrefix'. Either being empty means blank lines. 'line' will be "_EOF_" if it reaches
+// the end of the file. Same as nextLine(fin, line, flagLinePrefix, skipoverLinePrefix) in FileUtils.
+bool SpectraSTLineReader::nextLine(const char*& line, const char* flagLinePrefix, const char* skipoverLinePrefix) {
+
+  while (nextLine(line)) {
+    if (!isFlagged(line, skipoverLinePrefix)) {
+      return (!isFlagged(line, flagLinePrefix));
+    }
+  }
+
+  return (false);
+}
+
+// nextLine - same, but copies the line into a string
+bool SpectraSTLineReader::nextLine(string& line, const char* flagLinePrefix, const char* skipoverLinePrefix) {
+
+  const char* cline = NULL;
+  bool ret = nextLine(cline, flagLinePrefix, skipoverLinePrefix);
+  line = cline;
+  return (ret);
+}
+
+// isFlagged - whether line starts with prefix, or is blank if prefix is empty
+bool SpectraSTLineReader::isFlagged(const char* line, const char* prefix) {
+
+  if (prefix[0] == '\0') {
+    return (line[0] == '\0');
+  }
+  return (strncmp(line, prefix, strlen(prefix)) == 0);
+}
+
+// parseNumber - skips the whitespace at p, and parses the token there like atof(). p is moved to the end of the token.
+// Plain decimals of up to 15 digits (as almost all m/z and intensity values are) are converted by hand: the digits make
+// an exact integer, and one division by an exact power of 10 gives the correctly rounded double, the same as atof() would.
+// Anything else goes to atof().
+double SpectraSTLineReader::parseNumber(const char*& p) {
+
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+    p++;
+  }
+
+  const char* token = p;
+
+  bool negative = false;
+  if (*p == '-') {
+    negative = true;
+    p++;
+  } else if (*p == '+') {
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int numDigits = 0;
+  int numFractionDigits = 0;
+  bool hasPoint = false;
+
+  for (; ; p++) {
+    if (*p >= '0' && *p <= '9') {
+      mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+      numDigits++;
+      if (hasPoint) numFractionDigits++;
+    } else if (*p == '.' && !hasPoint) {
+      hasPoint = true;
+    } else {
+      break;
+    }
+  }
+
+  bool isPlain = (numDigits > 0 && numDigits <= 15 && (*p == '\0' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'));
+
+  // to the end of the token
+  while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+    p++;
+  }
+
+  if (!isPlain) {
+    return (atof(token));
+  }
+
+  double value = (double)mantissa / exactPowersOf10[numFractionDigits];
+  return (negative ? -value : value);
+}
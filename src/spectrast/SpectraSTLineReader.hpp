@@ -0,0 +1,88 @@
+#ifndef SPECTRASTLINEREADER_HPP_
+#define SPECTRASTLINEREADER_HPP_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTLineReader
+ *
+ * A line reader for the large text query files (.mgf, .msp). The file is read in big blocks into a buffer, and
+ * lines are handed out as pointers into the buffer (the newline replaced by '\0'), so that reading a line copies
+ * and allocates nothing. The nextLine() methods behave as the nextLine() functions in FileUtils.
+ *
+ * parseNumber() is a replacement for atof() on the next token of a line, for reading the peak lists.
+ *
+ */
+
+using namespace std;
+
+class SpectraSTLineReader {
+
+public:
+
+  SpectraSTLineReader(istream& fin, unsigned int blockSize = DEFAULT_BLOCK_SIZE);
+  ~SpectraSTLineReader();
+
+  // nextLine - the next line; returns false (and the line "_EOF_") at the end of the file. The line is only valid until the next call.
+  bool nextLine(const char*& line);
+
+  // nextLine - as nextLine(fin, line, flagLinePrefix, skipoverLinePrefix) in FileUtils
+  bool nextLine(const char*& line, const char* flagLinePrefix, const char* skipoverLinePrefix);
+  bool nextLine(string& line, const char* flagLinePrefix, const char* skipoverLinePrefix);
+
+  // parseNumber - parses the next whitespace-delimited token from p as atof() does, and moves p past it
+  static double parseNumber(const char*& p);
+
+  static const unsigned int DEFAULT_BLOCK_SIZE;
+
+private:
+
+  istream& m_fin;
+
+  // m_buffer - the block(s) read from the file. The unread part is m_buffer[m_begin] to m_buffer[m_end - 1].
+  vector<char> m_buffer;
+  unsigned int m_begin;
+  unsigned int m_end;
+
+  unsigned int m_blockSize;
+
+  bool m_eof;
+
+  bool readBlock();
+  static bool isFlagged(const char* line, const char* prefix);
+
+};
+
+#endif /*SPECTRASTLINEREADER_HPP_*/
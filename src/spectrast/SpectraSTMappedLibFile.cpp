@@ -0,0 +1,284 @@
+#include "SpectraSTMappedLibFile.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <string.h>
+#include <sstream>
+
+#ifndef MSVC
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTMappedLibFile
+ *
+ * The memory-mappable binary library format (.splib version 2). See the header file for the layout.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+// the first 8 bytes of a mappable .splib. The old binary format starts with the SpectraST version (a small int),
+// and the text format with '#' or 'N', so this can never be mistaken for either.
+const char SpectraSTMappedLibFile::MAGIC[8] = { 'S', 'P', 'L', 'I', 'B', 'M', 'A', 'P' };
+
+// <magic (8)> <format version (4)> <header size (4)> <string table offset (8)> <string table size (8)> <number of entries (8)>
+const unsigned int SpectraSTMappedLibFile::HEADER_SIZE = 40;
+const unsigned int SpectraSTMappedLibFile::FORMAT_VERSION = 2;
+
+// constructor for creation
+SpectraSTMappedLibFile::SpectraSTMappedLibFile() :
+  m_data(NULL),
+  m_size(0),
+  m_libFileName(""),
+  m_stringTableOffset(0),
+  m_stringTableSize(0),
+  m_stringTable(),
+  m_stringOffsets() {
+
+#ifdef MSVC
+  m_fileHandle = INVALID_HANDLE_VALUE;
+  m_mappingHandle = NULL;
+#else
+  m_fd = -1;
+#endif
+
+  // offset 0 is always the empty string -- most info fields are empty
+  string empty("");
+  addString(empty);
+
+}
+
+// constructor for retrieval - maps the entire file into memory and checks the header
+SpectraSTMappedLibFile::SpectraSTMappedLibFile(string libFileName) :
+  m_data(NULL),
+  m_size(0),
+  m_libFileName(libFileName),
+  m_stringTableOffset(0),
+  m_stringTableSize(0),
+  m_stringTable(),
+  m_stringOffsets() {
+
+#ifdef MSVC
+  m_mappingHandle = NULL;
+  m_fileHandle = CreateFile(libFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_fileHandle != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(m_fileHandle, &fileSize)) {
+      m_size = (unsigned long long)(fileSize.QuadPart);
+      m_mappingHandle = CreateFileMapping(m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (m_mappingHandle) {
+	m_data = (const char*)MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0);
+      }
+    }
+  }
+#else
+  m_fd = open(libFileName.c_str(), O_RDONLY);
+  if (m_fd >= 0) {
+    struct stat st;
+    if (fstat(m_fd, &st) == 0) {
+      m_size = (unsigned long long)(st.st_size);
+      void* mapped = mmap(NULL, (size_t)m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+      if (mapped != MAP_FAILED) {
+	m_data = (const char*)mapped;
+      }
+    }
+  }
+#endif
+
+  if (!m_data) {
+    g_log->error("GENERAL", "Cannot map SPLIB file \"" + libFileName + "\" into memory.");
+    g_log->crash();
+    return;
+  }
+
+  unsigned int formatVersion = 0;
+  if (m_size >= HEADER_SIZE) {
+    memcpy(&formatVersion, m_data + 8, sizeof(unsigned int));
+    memcpy(&m_stringTableOffset, m_data + 16, sizeof(unsigned long long));
+    memcpy(&m_stringTableSize, m_data + 24, sizeof(unsigned long long));
+  }
+
+  // string table offset still 0 means the creation did not finish. The string table always holds at least the
+  // empty string, and must end with a '\0', so that any offset into it gives a terminated string.
+  if (m_size < HEADER_SIZE || memcmp(m_data, MAGIC, 8) != 0 || formatVersion != FORMAT_VERSION ||
+      m_stringTableOffset < HEADER_SIZE || m_stringTableOffset > m_size ||
+      m_stringTableSize == 0 || m_stringTableSize > m_size - m_stringTableOffset ||
+      m_data[m_stringTableOffset + m_stringTableSize - 1] != '\0') {
+    g_log->error("GENERAL", "Corrupt .splib file \"" + libFileName + "\".");
+    g_log->crash();
+  }
+
+}
+
+// destructor - unmaps the file
+SpectraSTMappedLibFile::~SpectraSTMappedLibFile() {
+
+#ifdef MSVC
+  if (m_data) UnmapViewOfFile((LPCVOID)m_data);
+  if (m_mappingHandle) CloseHandle(m_mappingHandle);
+  if (m_fileHandle != INVALID_HANDLE_VALUE) CloseHandle(m_fileHandle);
+#else
+  if (m_data) munmap((void*)m_data, (size_t)m_size);
+  if (m_fd >= 0) close(m_fd);
+#endif
+
+}
+
+// writeHeader - writes the header at the start of the file. The string table offset stays 0 until
+// writeStringTable() fills it in, so that a library whose creation did not finish is recognized as such.
+void SpectraSTMappedLibFile::writeHeader(ofstream& libFout) {
+
+  unsigned long long zero = 0;
+
+  libFout.write(MAGIC, 8);
+  libFout.write((char*)(&FORMAT_VERSION), sizeof(unsigned int));
+  libFout.write((char*)(&HEADER_SIZE), sizeof(unsigned int));
+  libFout.write((char*)(&zero), sizeof(unsigned long long)); // string table offset
+  libFout.write((char*)(&zero), sizeof(unsigned long long)); // string table size
+  libFout.write((char*)(&zero), sizeof(unsigned long long)); // number of entries
+
+}
+
+// alignRecord - pads the file to the next 8-byte boundary, where the next record can start
+void SpectraSTMappedLibFile::alignRecord(ofstream& libFout) {
+
+  fstream::off_type pos = libFout.tellp();
+  while (pos % 8 != 0) {
+    libFout.put('\0');
+    pos++;
+  }
+
+}
+
+// addString - puts a string into the string table (if it is not already there), and returns its offset in the table
+unsigned int SpectraSTMappedLibFile::addString(const string& s) {
+
+  map<string, unsigned int>::iterator found = m_stringOffsets.find(s);
+  if (found != m_stringOffsets.end()) {
+    return (found->second);
+  }
+
+  unsigned int offset = (unsigned int)(m_stringTable.length());
+  m_stringTable += s;
+  m_stringTable += '\0';
+  m_stringOffsets[s] = offset;
+  return (offset);
+
+}
+
+// writeStringTable - appends the string table after the last record, and fills in the header
+void SpectraSTMappedLibFile::writeStringTable(ofstream& libFout, unsigned long long numEntries) {
+
+  alignRecord(libFout);
+
+  unsigned long long stringTableOffset = (unsigned long long)(libFout.tellp());
+  unsigned long long stringTableSize = (unsigned long long)(m_stringTable.length());
+
+  libFout.write(m_stringTable.data(), m_stringTable.length());
+  fstream::off_type end = libFout.tellp();
+
+  libFout.seekp(16);
+  libFout.write((char*)(&stringTableOffset), sizeof(unsigned long long));
+  libFout.write((char*)(&stringTableSize), sizeof(unsigned long long));
+  libFout.write((char*)(&numEntries), sizeof(unsigned long long));
+  libFout.seekp(end);
+
+}
+
+// getRecordSize - the size in bytes of the record at the offset, not counting the padding after it
+unsigned long long SpectraSTMappedLibFile::getRecordSize(fstream::off_type offset) {
+
+  struct mappedLibRecord record;
+  memcpy(&record, getRecord(offset), sizeof(struct mappedLibRecord));
+
+  unsigned long long peakSize = sizeof(double) + sizeof(float) + 2 * sizeof(unsigned int);
+  return (sizeof(struct mappedLibRecord) + record.numPeaks * peakSize + record.fullNameLength + record.statusLength + record.commentsLength);
+
+}
+
+// checkRecord - checks that the record at the offset, with all its arrays and strings, lies between the header
+// and the string table, and that all its annotation and info offsets point into the string table. A library
+// that fails this is corrupt (the offsets in the .spidx and .pepidx do not go with it, for example), and is
+// rejected rather than read past the end of the mapping.
+bool SpectraSTMappedLibFile::checkRecord(fstream::off_type offset) {
+
+  bool isValid = (offset >= (fstream::off_type)HEADER_SIZE &&
+		  (unsigned long long)offset <= m_stringTableOffset - sizeof(struct mappedLibRecord) &&
+		  getRecordSize(offset) <= m_stringTableOffset - (unsigned long long)offset);
+
+  if (isValid) {
+    struct mappedLibRecord record;
+    memcpy(&record, getRecord(offset), sizeof(struct mappedLibRecord));
+
+    const char* offsets = getRecord(offset) + sizeof(struct mappedLibRecord) + record.numPeaks * (sizeof(double) + sizeof(float));
+    for (unsigned int i = 0; isValid && i < 2 * record.numPeaks; i++) {
+      unsigned int stringOffset = 0;
+      memcpy(&stringOffset, offsets + i * sizeof(unsigned int), sizeof(unsigned int));
+      isValid = (stringOffset < m_stringTableSize);
+    }
+  }
+
+  if (!isValid) {
+    stringstream errorMsg;
+    errorMsg << "Corrupt .splib file \"" << m_libFileName << "\": the entry at offset " << offset << " is out of bounds.";
+    g_log->error("GENERAL", errorMsg.str());
+    g_log->crash();
+  }
+
+  return (isValid);
+
+}
+
+// skipHeader - if the stream is positioned at the header of a mappable library, moves it past the header
+// (to the preamble, which is the same as in the old binary format) and returns true. Otherwise leaves
+// the stream where it was, and returns false.
+bool SpectraSTMappedLibFile::skipHeader(ifstream& libFin) {
+
+  fstream::off_type start = libFin.tellg();
+
+  char magic[8];
+  libFin.read(magic, 8);
+
+  if (libFin.gcount() == 8 && memcmp(magic, MAGIC, 8) == 0) {
+    libFin.seekg(start + (fstream::off_type)HEADER_SIZE);
+    return (true);
+  }
+
+  libFin.clear();
+  libFin.seekg(start);
+  return (false);
+
+}
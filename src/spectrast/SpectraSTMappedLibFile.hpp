@@ -0,0 +1,139 @@
+#ifndef SPECTRASTMAPPEDLIBFILE_HPP_
+#define SPECTRASTMAPPEDLIBFILE_HPP_
+
+#include <string>
+#include <fstream>
+#include <map>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTMappedLibFile
+ *
+ * The memory-mappable binary library format (.splib version 2). The file is laid out as
+ *
+ * <header (HEADER_SIZE bytes): magic, format version, header size, string table offset, string table size, number of entries>
+ * <preamble, same as that of the old binary format>
+ * numEntries times, each starting on an 8-byte boundary (the file offsets in the .spidx and .pepidx point here):
+ *   <mappedLibRecord (fixed width)>
+ *   <m/z (double) x numPeaks> <intensity (float) x numPeaks> <annotation (uint) x numPeaks> <info (uint) x numPeaks>
+ *   <fullName> <status> <comments> (not terminated; the lengths are in the record)
+ * <string table: '\0'-terminated strings>
+ *
+ * The peak annotations and infos, which repeat endlessly across the library, are stored once in the string table
+ * and referred to by their offsets into it.
+ *
+ * For searching, the whole file is mapped into memory, and entries are read straight from the mapped records --
+ * there is no stream to seek or lock, and no line-by-line parsing.
+ * For creation, the object keeps the string table as it is built, and writes it at the end.
+ */
+
+using namespace std;
+
+// mappedLibRecord - the fixed-width head of each entry. 32 bytes, so that the m/z array following it stays 8-byte aligned.
+struct mappedLibRecord {
+  unsigned int libId;
+  unsigned int numPeaks;
+  double precursorMz;
+  unsigned int fullNameLength;
+  unsigned int statusLength;
+  unsigned int commentsLength;
+  unsigned int reserved;
+};
+
+class SpectraSTMappedLibFile {
+
+public:
+
+  // constructor for creation
+  SpectraSTMappedLibFile();
+
+  // constructor for retrieval
+  SpectraSTMappedLibFile(string libFileName);
+
+  ~SpectraSTMappedLibFile();
+
+  // Creation methods
+  void writeHeader(ofstream& libFout);
+  void alignRecord(ofstream& libFout);
+  unsigned int addString(const string& s);
+  void writeStringTable(ofstream& libFout, unsigned long long numEntries);
+
+  // Retrieval methods
+  bool checkRecord(fstream::off_type offset);
+  const char* getRecord(fstream::off_type offset) { return (m_data + offset); }
+  const char* getString(unsigned int offset) { return (m_data + m_stringTableOffset + offset); }
+  unsigned long long getRecordSize(fstream::off_type offset);
+  unsigned long long getRecordsEnd() { return (m_stringTableOffset); }
+
+  // skipHeader - checks if the stream is positioned at the header of a mappable library; if so, skips past it.
+  static bool skipHeader(ifstream& libFin);
+
+  static const unsigned int HEADER_SIZE;
+  static const unsigned int FORMAT_VERSION;
+
+private:
+
+  // m_data, m_size - the mapped file
+  const char* m_data;
+  unsigned long long m_size;
+
+  // m_libFileName - the mapped file, for error messages
+  string m_libFileName;
+
+  // m_stringTableOffset, m_stringTableSize - where the string table starts, and how long it is
+  unsigned long long m_stringTableOffset;
+  unsigned long long m_stringTableSize;
+
+  // m_stringTable, m_stringOffsets - the string table being built during creation, and where each string is in it
+  string m_stringTable;
+  map<string, unsigned int> m_stringOffsets;
+
+#ifdef MSVC
+  HANDLE m_fileHandle;
+  HANDLE m_mappingHandle;
+#else
+  int m_fd;
+#endif
+
+  static const char MAGIC[8];
+
+};
+
+#endif /*SPECTRASTMAPPEDLIBFILE_HPP_*/
@@ -6,6 +6,7 @@
 #include "FileUtils.hpp"
 #include "Peptide.hpp"
 #include "ProgressCount.hpp"
+#include "SpectraSTLineReader.hpp"
 
 #include <sstream>
 
@@ -15,7 +16,8 @@ extern SpectraSTLog* g_log;
 
 // constructor
 SpectraSTMgfSearchTask::SpectraSTMgfSearchTask(vector<string>& searchFileNames, SpectraSTSearchParams& params, SpectraSTLib* lib) :
-  SpectraSTSearchTask(searchFileNames, params, lib) {
+  SpectraSTSearchTask(searchFileNames, params, lib),
+  m_scheduler(NULL) {
 }
 
 // destructor
@@ -31,113 +33,22 @@ void SpectraSTMgfSearchTask::search() {
 
     cout << "Multi-threaded search: Using " << numThreads << " threads." << endl;
 
-    // Multi-threaded search   
-    struct threadData* threadDataArray = new struct threadData[numThreads];
-    
-    for (unsigned int ti = 0; ti < numThreads; ti++) {
-      threadDataArray[ti].searchTaskPtr = this;
-      threadDataArray[ti].threadIndex = ti;
-      for (unsigned int j = ti; j < m_searchFileNames.size(); j += numThreads) {
-	threadDataArray[ti].fileIndices.push_back(j);
-      }
-    }      
-    
-#ifdef MSVC
-      DWORD *pId = new DWORD[numThreads];
-      HANDLE *threads = new HANDLE[numThreads];
-#else    
-      pthread_attr_t attr;
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-      void *status;
-	
-      pthread_t* threads = new pthread_t[numThreads];
-#endif
-  
-    for (unsigned int ti = 0; ti < numThreads; ti++) {
-      
-#ifdef MSVC
-      int returnCode = ti + 1;
-      threads[ti] = CreateThread(NULL, 0, runSearchThread, (void*)&threadDataArray[ti], 0, NULL);
-      if (!threads[ti]) {
-	returnCode = 0;
-      }
-#else
-      int returnCode = pthread_create(&threads[ti], &attr, runSearchThread, (void*)(&(threadDataArray[ti]))); 
-#endif
-      
-      if (returnCode != 0) {
-	stringstream msg;
-	msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
-	g_log->error("MGF SEARCH", msg.str());
-	g_log->crash();
-      }
-
-    }
-    
-#ifndef MSVC      
-    pthread_attr_destroy(&attr);
-#endif
-    
-    for (unsigned int ti = 0; ti < numThreads; ti++) { 
-
-#ifdef MSVC
-      int returnCode = WaitForSingleObject(threads[ti],INFINITE);
-#else
-      int returnCode = pthread_join(threads[ti], &status);
-#endif     
-      
-      if (returnCode != 0) {
-	stringstream msg;
-#ifdef MSVC
-	msg << "Cannot join thread #" << ti << "; return code from WaitForSingleObject() is " << returnCode;
-#else
-	msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
-#endif
-	g_log->error("MGF SEARCH", msg.str());
-	g_log->crash();
-      }
-	//printf("Main: completed join with thread %ld having a status of %ld \n",t,(long)status);
-      
-    }
-
-    delete[] threadDataArray;
-    delete[] threads;
-    
-  } else {
-  
-    // Single-threaded search
-    for (unsigned int n = 0; n < (unsigned int)m_searchFileNames.size(); n++) {
-      searchOneFile(n, -1);
-    }
-    
+    // Multi-threaded search. The files are still read (and the results printed) one at a time here,
+    // but the queries are farmed out to a pool of worker threads, so that even a single file is
+    // searched in parallel.
+    m_scheduler = new SpectraSTQueryScheduler(m_lib, numThreads, numThreads * MAX_NUM_PENDING_QUERIES_PER_THREAD);
   }
   
-  logSearchStats("MGF SEARCH");
-}
-
-#ifdef MSVC
-DWORD WINAPI SpectraSTMgfSearchTask::runSearchThread(LPVOID threadArg) {
-#else
-void* SpectraSTMgfSearchTask::runSearchThread(void* threadArg) {
-#endif 
-  
-  struct threadData* threadData = (struct threadData*)threadArg;
-  
-  for (vector<unsigned int>::iterator i = threadData->fileIndices.begin(); i != threadData->fileIndices.end(); i++) {
-  
-    threadData->searchTaskPtr->searchOneFile(*i, (int)(threadData->threadIndex));
+  for (unsigned int n = 0; n < (unsigned int)m_searchFileNames.size(); n++) {
+    searchOneFile(n, -1);
+  }
   
+  if (m_scheduler) {
+    delete (m_scheduler);
+    m_scheduler = NULL;
   }
   
-  long ti = (long)(threadData->threadIndex);
-
-#ifdef MSVC
-  ExitThread(0);
-#else
-  pthread_exit((void*)ti); 
-#endif
-
+  logSearchStats("MGF SEARCH");
 }
 
 // searchOneFile - search one mgf file
@@ -174,14 +85,23 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 
   }
   
+  // reads the file in big blocks; the peak lines are parsed straight from its buffer
+  SpectraSTLineReader reader(fin);
+  
   string line("");
   string::size_type pos = 0;
   
+  // the number of peaks in the last query, to size the peak list of the next one
+  unsigned int lastNumPeaks = 0;
   
   while (true) {
     
+    // for the search metrics, the time to read and parse this record
+    double readStart = SpectraSTSearchMetrics::now();
+    
     if (line == "_EOF_") {
       // no more record
+      finishPendingSearches(fileIndex, threadIndex, pc);
       if (threadIndex == -1) {
 	pc.done();
       } else {
@@ -198,9 +118,10 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     
     // skips over all lines until the line with Name: (will stop when it reaches either "Name:" or the end-of-file)
     if (line.compare(0, 10, "BEGIN IONS") != 0) {
-      while (nextLine(fin, line, "BEGIN IONS", ""));
+      while (reader.nextLine(line, "BEGIN IONS", ""));
       if (line == "_EOF_") {
 	// no more record
+	finishPendingSearches(fileIndex, threadIndex, pc);
 	if (threadIndex == -1) {
 	  pc.done();
 	} else {
@@ -225,7 +146,7 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     
     
     // read the rest of the header fields until TITLE:
-    while (nextLine(fin, line, "END IONS", "")) {
+    while (reader.nextLine(line, "END IONS", "")) {
       
       // cerr << line << endl;
       
@@ -243,6 +164,7 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 	charge = atoi((nextToken(line, 7, pos, " \t\r\n", "+")).c_str());
       } else if (line == "_EOF_" || line.compare(0, 10, "BEGIN IONS") == 0) {
 	cerr << "\nBadly formatted .mgf file! Search task truncated." << endl;
+	finishPendingSearches(fileIndex, threadIndex, pc);
 	m_outputs[fileIndex]->printFooter();
 	m_outputs[fileIndex]->closeFile();
 	return;
@@ -281,25 +203,26 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 	
     } else {
 
-      int numPeaks = 0;
-      
-      SpectraSTPeakList* peakList = new SpectraSTPeakList(precursorMz, charge);
+      SpectraSTPeakList* peakList = new SpectraSTPeakList(precursorMz, charge, lastNumPeaks);
       peakList->setNoiseFilterThreshold(m_params.filterRemovePeakIntensityThreshold);
       
       SpectraSTQuery* query = new SpectraSTQuery(title, precursorMz, charge, comments, peakList);
       
       // line should contain the first peak
+      const char* peakLine = line.c_str();
       
       do { // will stop when it reaches the next "END IONS" or end-of-file
 	
 	// here are the peaks
-	double mz = atof((nextToken(line, 0, pos)).c_str());
-	// pos1 now stores the position of the first space after the mz
-	float intensity = atof((nextToken(line, pos, pos)).c_str());
-	// pos2 now stores the position of the first space after the intensity
+	double mz = SpectraSTLineReader::parseNumber(peakLine);
+	// peakLine now points to the first space after the mz
+	float intensity = (float)(SpectraSTLineReader::parseNumber(peakLine));
 	peakList->insertForSearch(mz, intensity, "");
 	
-      } while (nextLine(fin, line, "END IONS", ""));
+      } while (reader.nextLine(peakLine, "END IONS", ""));
+      
+      line = peakLine;
+      lastNumPeaks = peakList->getNumPeaks();
     
       if (!selected) {
 	
@@ -324,23 +247,53 @@ void SpectraSTMgfSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 	
 	// create the search based on what is read, then search
 	SpectraSTSearch* s = new SpectraSTSearch(query, m_params, m_outputs[fileIndex]);
-	s->search(m_lib);
-	
-	stats->m_numSearched++; // counting searches in all mgf files
-	m_searchTaskStats[fileIndex]->processSearchResult(s);
+	s->getMetricsSampleRef().endStage(SpectraSTSearchMetrics::READ_QUERY, readStart);
 	
-	if (threadIndex == -1) pc.increment();
-
-	// print search result
-	s->print();
-	delete (s);
+	if (m_scheduler) {
+	  // multi-threaded: hand the search to the worker threads, and print whatever is done (in order)
+	  while (m_scheduler->isFull()) {
+	    finishSearch(m_scheduler->retrieve(true), fileIndex, threadIndex, pc);
+	  }
+	  m_scheduler->submit(s);
+	  while ((s = m_scheduler->retrieve(false))) {
+	    finishSearch(s, fileIndex, threadIndex, pc);
+	  }
+	} else {
+	  s->search(m_lib);
+	  finishSearch(s, fileIndex, threadIndex, pc);
+	}
       }
     }
 
   }
+  finishPendingSearches(fileIndex, threadIndex, pc);
   m_outputs[fileIndex]->printFooter();
   m_outputs[fileIndex]->closeFile();
 
 }
 
+// finishSearch - keeps stats and prints the result of one finished search
+void SpectraSTMgfSearchTask::finishSearch(SpectraSTSearch* s, unsigned int fileIndex, int threadIndex, ProgressCount& pc) {
+  
+  m_searchTaskStats[fileIndex]->m_numSearched++; // counting searches in all mgf files
+  m_searchTaskStats[fileIndex]->processSearchResult(s);
+  
+  if (threadIndex == -1) pc.increment();
+  
+  // print search result
+  double printStart = SpectraSTSearchMetrics::now();
+  s->print();
+  m_searchTaskStats[fileIndex]->m_metrics.addStageTime(SpectraSTSearchMetrics::OUTPUT, SpectraSTSearchMetrics::now() - printStart);
+  delete (s);
+}
 
+// finishPendingSearches - waits for all searches handed to the worker threads to finish, and prints them
+void SpectraSTMgfSearchTask::finishPendingSearches(unsigned int fileIndex, int threadIndex, ProgressCount& pc) {
+  
+  if (!m_scheduler) return;
+  
+  SpectraSTSearch* s = NULL;
+  while ((s = m_scheduler->retrieve(true))) {
+    finishSearch(s, fileIndex, threadIndex, pc);
+  }
+}
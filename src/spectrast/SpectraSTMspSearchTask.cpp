@@ -6,6 +6,7 @@
 #include "FileUtils.hpp"
 #include "Peptide.hpp"
 #include "ProgressCount.hpp"
+#include "SpectraSTLineReader.hpp"
 
 #include <sstream>
 
@@ -53,7 +54,8 @@ extern SpectraSTLog* g_log;
 
 // constructor
 SpectraSTMspSearchTask::SpectraSTMspSearchTask(vector<string>& searchFileNames, SpectraSTSearchParams& params, SpectraSTLib* lib) :
-  SpectraSTSearchTask(searchFileNames, params, lib) {
+  SpectraSTSearchTask(searchFileNames, params, lib),
+  m_scheduler(NULL) {
 }
 
 // destructor
@@ -70,116 +72,24 @@ void SpectraSTMspSearchTask::search() {
 
     cout << "Multi-threaded search: Using " << numThreads << " threads." << endl;
 
-    // Multi-threaded search   
-    struct threadData* threadDataArray = new struct threadData[numThreads];
-    
-    for (unsigned int ti = 0; ti < numThreads; ti++) {
-      threadDataArray[ti].searchTaskPtr = this;
-      threadDataArray[ti].threadIndex = ti;
-      for (unsigned int j = ti; j < m_searchFileNames.size(); j += numThreads) {
-	threadDataArray[ti].fileIndices.push_back(j);
-      }
-    }      
-    
-#ifdef MSVC
-      DWORD *pId = new DWORD[numThreads];
-      HANDLE *threads = new HANDLE[numThreads];
-#else    
-      pthread_attr_t attr;
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-      void *status;
-	
-      pthread_t* threads = new pthread_t[numThreads];
-#endif
-      
-    for (unsigned int ti = 0; ti < numThreads; ti++) {
-      
-#ifdef MSVC
-      int returnCode = ti + 1;
-      threads[ti] = CreateThread(NULL, 0, runSearchThread, (void*)&threadDataArray[ti], 0, NULL);
-      if (!threads[ti]) {
-	returnCode = 0;
-      }
-#else
-      int returnCode = pthread_create(&threads[ti], &attr, runSearchThread, (void*)(&(threadDataArray[ti]))); 
-#endif
-      
-      if (returnCode != 0) {
-	stringstream msg;
-	msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
-	g_log->error("MSP SEARCH", msg.str());
-	g_log->crash();
-      }
-
-    }
-    
-#ifndef MSVC      
-    pthread_attr_destroy(&attr);
-#endif
-    
-    for (unsigned int ti = 0; ti < numThreads; ti++) { 
-      
-#ifdef MSVC
-      int returnCode = WaitForSingleObject(threads[ti],INFINITE);
-#else
-      int returnCode = pthread_join(threads[ti], &status);
-#endif
-      
-      if (returnCode != 0) {
-	stringstream msg;
-#ifdef MSVC
-	msg << "Cannot join thread #" << ti << "; return code from WaitForSingleObject() is " << returnCode;
-#else
-	msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
-#endif
-	g_log->error("MSP SEARCH", msg.str());
-	g_log->crash();
-      }
-	//printf("Main: completed join with thread %ld having a status of %ld \n",t,(long)status);
-      
-    }
-
-    delete[] threadDataArray;
-    delete[] threads;
-    
-  } else {
-    
-    // single-threaded search
-      for (unsigned int n = 0; n < (unsigned int)m_searchFileNames.size(); n++) {
-      searchOneFile(n, -1);
-    }
-  
+    // Multi-threaded search. The files are still read (and the results printed) one at a time here,
+    // but the queries are farmed out to a pool of worker threads, so that even a single file is
+    // searched in parallel.
+    m_scheduler = new SpectraSTQueryScheduler(m_lib, numThreads, numThreads * MAX_NUM_PENDING_QUERIES_PER_THREAD);
   }
   
-  
-  logSearchStats("MSP SEARCH");
-}
-
-#ifdef MSVC
-DWORD WINAPI SpectraSTMspSearchTask::runSearchThread(LPVOID threadArg) {
-#else
-void* SpectraSTMspSearchTask::runSearchThread(void* threadArg) {
-#endif  
-  
-  struct threadData* threadData = (struct threadData*)threadArg;
-  
-  for (vector<unsigned int>::iterator i = threadData->fileIndices.begin(); i != threadData->fileIndices.end(); i++) {
-  
-    threadData->searchTaskPtr->searchOneFile(*i, (int)(threadData->threadIndex));
-  
+  for (unsigned int n = 0; n < (unsigned int)m_searchFileNames.size(); n++) {
+    searchOneFile(n, -1);
   }
   
-  long ti = (long)(threadData->threadIndex);
+  if (m_scheduler) {
+    delete (m_scheduler);
+    m_scheduler = NULL;
+  }
   
-#ifdef MSVC
-  ExitThread(0);
-#else
-  pthread_exit((void*)ti); 
-#endif
+  logSearchStats("MSP SEARCH");
 }
 
-
 // searchOneFile - search one msp file
 void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadIndex) {
   
@@ -213,14 +123,21 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 
   }
   
+  // reads the file in big blocks; the peak lines are parsed straight from its buffer
+  SpectraSTLineReader reader(fin);
+  
   string line("");
   string::size_type pos = 0;
   
   
   while (true) {
     
+    // for the search metrics, the time to read and parse this record
+    double readStart = SpectraSTSearchMetrics::now();
+    
     if (line == "_EOF_") {
       // no more record
+      finishPendingSearches(fileIndex, threadIndex, pc);
       if (threadIndex == -1) {
 	pc.done();
       } else {
@@ -237,9 +154,10 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     
     // skips over all lines until the line with Name: (will stop when it reaches either "Name:" or the end-of-file) 
     if (line.compare(0, 6, "Name: ") != 0) {	
-      while (nextLine(fin, line, "Name: ", ""));
+      while (reader.nextLine(line, "Name: ", ""));
       if (line == "_EOF_") {
 	// no more record
+	finishPendingSearches(fileIndex, threadIndex, pc);
 	if (threadIndex == -1) {
 	  pc.done();
 	} else {
@@ -276,7 +194,7 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     int charge = 0;
     
     // read the rest of the header fields until Num peaks:
-    while (nextLine(fin, line, "Num peaks: ", "")) {
+    while (reader.nextLine(line, "Num peaks: ", "")) {
       if (line.compare(0, 3, "MW:") == 0) {
 	mw = atof((nextToken(line, 3, pos, "\r\n")).c_str());				
       } else if (line.compare(0, 8, "Comment:") == 0) {
@@ -299,6 +217,7 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
 	// reach the end unexpectedly, or see another name field before the Num peaks field. 
 	// ignore this incomplete record, and return
 	cerr << "\nBadly formatted .msp file! Library creation truncated." << endl;	
+	finishPendingSearches(fileIndex, threadIndex, pc);
 	return;
       } else {
 	cerr << "Unrecognized header field. Ignored." << endl;
@@ -308,6 +227,7 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     if (line == "_EOF_") {
       // no "Num peaks:" field. ignore this incomplete record, and return
       cerr << "\nBadly formatted .msp file! Library creation truncated." << endl;	
+      finishPendingSearches(fileIndex, threadIndex, pc);
       m_outputs[fileIndex]->printFooter();
       m_outputs[fileIndex]->closeFile();
 
@@ -347,24 +267,30 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
     
     SpectraSTQuery* query = new SpectraSTQuery(name, precursorMz, charge, comments, peakList);
     
-    while (nextLine(fin, line, "Name: ", "")) { // will stop when it reaches the next "Name:" or end-of-file
+    const char* peakLine = NULL;
+    
+    while (reader.nextLine(peakLine, "Name: ", "")) { // will stop when it reaches the next "Name:" or end-of-file
       
       // here are the peaks		
-      double mz = atof((nextToken(line, 0, pos)).c_str());
-      // pos1 now stores the position of the first space after the mz
-      float intensity = (float)(atof((nextToken(line, pos, pos)).c_str()));
-      // pos2 now stores the position of the first space after the intensity
+      double mz = SpectraSTLineReader::parseNumber(peakLine);
+      // peakLine now points to the first space after the mz
+      float intensity = (float)(SpectraSTLineReader::parseNumber(peakLine));
+      // peakLine now points to the first space after the intensity
+      
+      string annotation("");
       
-      // annotation has quotes around it, remove them by adding the quote char to the skipover and delimiter strings passed into nextToken
-      string annotation = nextToken(line, pos, pos, "\"\r\n", "\"\t");
+      if (*peakLine != '\0') {
+	// annotation has quotes around it, remove them by adding the quote char to the skipover and delimiter strings passed into nextToken
+	annotation = nextToken(peakLine, 0, pos, "\"\r\n", "\"\t");
       
-      string info("");
+	string info("");
       
-      string::size_type spacePos = annotation.find_first_of(" \t", 0);
-      string::size_type dummyPos = 0;
-      if (spacePos != string::npos) {
-	info = nextToken(annotation, spacePos + 1, dummyPos, "\r\n", " \t");
-	annotation = annotation.substr(0, spacePos);
+	string::size_type spacePos = annotation.find_first_of(" \t", 0);
+	string::size_type dummyPos = 0;
+	if (spacePos != string::npos) {
+	  info = nextToken(annotation, spacePos + 1, dummyPos, "\r\n", " \t");
+	  annotation = annotation.substr(0, spacePos);
+	}
       }
       // annotation will get an empty string if there's no annotation
       peakList->insertForSearch(mz, intensity, annotation);
@@ -372,6 +298,8 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
       
     }	
     
+    line = peakLine;
+    
     if (!selected) {
       // not selected to be searched, or bad spectra, ignore
       delete query;
@@ -395,21 +323,52 @@ void SpectraSTMspSearchTask::searchOneFile(unsigned int fileIndex, int threadInd
       
       // create the search based on what is read, then search
       SpectraSTSearch* s = new SpectraSTSearch(query, m_params, m_outputs[fileIndex]);
-      s->search(m_lib);
-      
-      stats->m_numSearched++; // counting searches in all msp files
-      m_searchTaskStats[fileIndex]->processSearchResult(s);
+      s->getMetricsSampleRef().endStage(SpectraSTSearchMetrics::READ_QUERY, readStart);
       
-      if (threadIndex == -1) pc.increment();
-      
-      // print search result
-      s->print();
-      delete s;
+      if (m_scheduler) {
+        // multi-threaded: hand the search to the worker threads, and print whatever is done (in order)
+        while (m_scheduler->isFull()) {
+          finishSearch(m_scheduler->retrieve(true), fileIndex, threadIndex, pc);
+        }
+        m_scheduler->submit(s);
+        while ((s = m_scheduler->retrieve(false))) {
+          finishSearch(s, fileIndex, threadIndex, pc);
+        }
+      } else {
+        s->search(m_lib);
+        finishSearch(s, fileIndex, threadIndex, pc);
+      }
     }
     
   }
+  finishPendingSearches(fileIndex, threadIndex, pc);
   m_outputs[fileIndex]->printFooter();
   m_outputs[fileIndex]->closeFile();
 
 }
 
+// finishSearch - keeps stats and prints the result of one finished search
+void SpectraSTMspSearchTask::finishSearch(SpectraSTSearch* s, unsigned int fileIndex, int threadIndex, ProgressCount& pc) {
+  
+  m_searchTaskStats[fileIndex]->m_numSearched++; // counting searches in all msp files
+  m_searchTaskStats[fileIndex]->processSearchResult(s);
+  
+  if (threadIndex == -1) pc.increment();
+  
+  // print search result
+  double printStart = SpectraSTSearchMetrics::now();
+  s->print();
+  m_searchTaskStats[fileIndex]->m_metrics.addStageTime(SpectraSTSearchMetrics::OUTPUT, SpectraSTSearchMetrics::now() - printStart);
+  delete (s);
+}
+
+// finishPendingSearches - waits for all searches handed to the worker threads to finish, and prints them
+void SpectraSTMspSearchTask::finishPendingSearches(unsigned int fileIndex, int threadIndex, ProgressCount& pc) {
+  
+  if (!m_scheduler) return;
+  
+  SpectraSTSearch* s = NULL;
+  while ((s = m_scheduler->retrieve(true))) {
+    finishSearch(s, fileIndex, threadIndex, pc);
+  }
+}
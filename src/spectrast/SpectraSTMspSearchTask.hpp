@@ -2,16 +2,8 @@
 #define SPECTRASTMSPSEARCHTASK_HPP_
 
 #include "SpectraSTSearchTask.hpp"
-
-#ifdef __MINGW__
-#define MSVC
-#endif
-
-#ifdef MSVC
-#include "windows.h"
-#else
-#include <pthread.h>
-#endif
+#include "SpectraSTQueryScheduler.hpp"
+#include "ProgressCount.hpp"
 
 /*
 
@@ -58,15 +50,14 @@ public:
   
   virtual void search();
         
-#ifdef MSVC
-  static DWORD WINAPI runSearchThread(LPVOID threadArg);
-#else
-  static void* runSearchThread(void* threadArg);
-#endif
-  
-  
+
 private:
   void searchOneFile(unsigned int fileIndex, int threadIndex);
+  void finishSearch(SpectraSTSearch* s, unsigned int fileIndex, int threadIndex, ProgressCount& pc);
+  void finishPendingSearches(unsigned int fileIndex, int threadIndex, ProgressCount& pc);
+  
+  // pool of worker threads searching the queries of a file in parallel - NULL if single-threaded
+  SpectraSTQueryScheduler* m_scheduler;
   
   
 };
@@ -49,6 +49,7 @@ hlam@systemsbiology.org
 
 using namespace std;
 #include <algorithm> // for std::sort
+#include <string.h>
 
 extern SpectraSTLog* g_log;
 
@@ -56,18 +57,55 @@ extern SpectraSTLog* g_log;
 // in memory.
 const double SpectraSTMzLibIndex::CACHE_ALL = 999999.0;
 
+// The number of locks for reading bins into the cache in a multi-threaded search. Bin b is guarded by lock b % NUM_CACHE_SHARDS,
+// so that threads reading different bins rarely wait for one another.
+const unsigned int SpectraSTMzLibIndex::NUM_CACHE_SHARDS = 64;
+
+// The first 8 bytes of a binary .spidx. An old text .spidx starts with the m/z value of the first bin.
+const char SpectraSTMzLibIndex::MAGIC[8] = { 'S', 'P', 'I', 'D', 'X', 'B', 'I', 'N' };
+
+// <magic (8)> <format version (4)> <header size (4)> <number of entries (8)> <number of bins (4)> <max charge (4)> <checksum (8)>
+// <precursor m/z (double) x numEntries> <file offset (long long) x numEntries> <charge (int) x numEntries> <bin start (uint) x numBins>
+// Each array starts on an 8-byte boundary, so the file can as well be mapped into memory and used as is. 
+// The checksum is over the arrays.
+const unsigned int SpectraSTMzLibIndex::FORMAT_VERSION = 2;
+const unsigned int SpectraSTMzLibIndex::HEADER_SIZE = 40;
+
+// loadPublished - reads a pointer that another thread may have just published with a compare-and-swap (see retrieveBin()),
+// with acquire semantics, so that what it points to is seen fully constructed.
+static inline void* loadPublished(void** ptr) {
+#ifdef MSVC
+  return (InterlockedCompareExchangePointer((PVOID volatile*)ptr, NULL, NULL));
+#else
+  return (__atomic_load_n(ptr, __ATOMIC_ACQUIRE));
+#endif
+}
+
 // constructor for creating
 SpectraSTMzLibIndex::SpectraSTMzLibIndex(string idxFileName) :
   SpectraSTLibIndex(idxFileName, "PrecursorMZ"), 
-  m_offsets(MAX_MZ - MIN_MZ + 1),
+  m_entryMzs(),
+  m_entryCharges(),
+  m_entryOffsets(),
+  m_binStarts(MAX_MZ - MIN_MZ + 2, 0),
+  m_fileOrder(),
+  m_maxCharge(0),
   m_cacheSize(0),
   m_cacheCapacity(0),
   m_cache(MAX_MZ - MIN_MZ + 1),
-  m_cacheQueue(),
-  // m_cacheMutex(NULL),
-  m_libReadMutex(NULL),
-  m_curBin(0),
-  m_curOffset(-1),
+  m_cacheLru(),
+  m_cacheLruPos(MAX_MZ - MIN_MZ + 1),
+  m_cacheBinBytes(MAX_MZ - MIN_MZ + 1, 0),
+  m_cacheBytes(0),
+  m_cachePins(MAX_MZ - MIN_MZ + 1, 0),
+  m_pinUntilRelease(false),
+  m_cacheMutex(NULL),
+  m_cacheShardMutexes(),
+  m_threadLibFins(),
+  m_threadLibFinMutex(NULL),
+  m_preparedLib(NULL),
+  m_cacheCapacityBytes(0),
+  m_curEntry(-1),
   m_sortedOffsets(NULL),
   m_curSortedOffset(-1) {
   
@@ -77,22 +115,38 @@ SpectraSTMzLibIndex::SpectraSTMzLibIndex(string idxFileName) :
 
 // constructor for retrieval. Note that the cache capacity is set to the ceiling of cacheRange.
 // e.g. if cacheRange is 6.5 Th, a maximum of 7 bins can be in memory at any given time.
-SpectraSTMzLibIndex::SpectraSTMzLibIndex(string idxFileName, ifstream* libFinPtr, double cacheRange, bool binaryLib, bool useMTSearch) :
-  SpectraSTLibIndex(idxFileName, libFinPtr, "PrecursorMZ", binaryLib),
-  m_offsets(MAX_MZ - MIN_MZ + 1),
+// If cacheMemoryLimit (in bytes) is not 0, it sets the cache capacity instead, and cacheRange is ignored.
+SpectraSTMzLibIndex::SpectraSTMzLibIndex(string idxFileName, ifstream* libFinPtr, double cacheRange, bool binaryLib, bool useMTSearch, SpectraSTMappedLibFile* mappedLib, unsigned long long cacheMemoryLimit) :
+  SpectraSTLibIndex(idxFileName, libFinPtr, "PrecursorMZ", binaryLib, mappedLib),
+  m_entryMzs(),
+  m_entryCharges(),
+  m_entryOffsets(),
+  m_binStarts(MAX_MZ - MIN_MZ + 2, 0),
+  m_fileOrder(),
+  m_maxCharge(0),
   m_cacheSize(0),
   m_cacheCapacity((int)cacheRange + 1),
   m_cache(MAX_MZ - MIN_MZ + 1),
-  m_cacheQueue(),
-//  m_cacheMutex(NULL),
-  m_libReadMutex(NULL), 
-  m_curBin(0),
-  m_curOffset(-1),
+  m_cacheLru(),
+  m_cacheLruPos(MAX_MZ - MIN_MZ + 1),
+  m_cacheBinBytes(MAX_MZ - MIN_MZ + 1, 0),
+  m_cacheBytes(0),
+  m_cachePins(MAX_MZ - MIN_MZ + 1, 0),
+  m_pinUntilRelease(false),
+  m_cacheMutex(NULL),
+  m_cacheShardMutexes(),
+  m_threadLibFins(),
+  m_threadLibFinMutex(NULL),
+  m_preparedLib(NULL),
+  m_cacheCapacityBytes(cacheMemoryLimit),
+  m_curEntry(-1),
   m_sortedOffsets(NULL),
   m_curSortedOffset(-1) {
   
-  if (useMTSearch) {
-    m_cacheCapacity = (int)CACHE_ALL + 1; // for multi-threaded search, forced to keep entire library in memory
+  if (cacheMemoryLimit > 0) {
+    m_cacheCapacity = MAX_MZ - MIN_MZ + 1; // only limited by memory
+  } else if (useMTSearch) {
+    m_cacheCapacity = (int)CACHE_ALL + 1; // for multi-threaded search without a memory limit, forced to keep entire library in memory
   }
     
   initialize(useMTSearch);
@@ -113,22 +167,34 @@ SpectraSTMzLibIndex::~SpectraSTMzLibIndex() {
     }
   }
   
-//  if (m_cacheMutex) {
-//    for (vector<pthread_mutex_t*>::iterator cmtBin = m_cacheMutex->begin(); cmtBin != m_cacheMutex->end(); cmtBin++) {
-//      if (*cmtBin) {
-//	pthread_mutex_destroy(*cmtBin);
-//	delete (*cmtBin);
-//      }
-//    }
-//    delete (m_cacheMutex);
-//  }
+  if (m_threadLibFinMutex) {
+    for (vector<ifstream*>::iterator fin = m_threadLibFins.begin(); fin != m_threadLibFins.end(); fin++) {
+      (*fin)->close();
+      delete (*fin);
+    }
+#ifdef MSVC
+    TlsFree(m_threadLibFinKey);
+    CloseHandle(m_threadLibFinMutex);
+#else
+    pthread_key_delete(m_threadLibFinKey);
+    pthread_mutex_destroy(m_threadLibFinMutex);
+    delete (m_threadLibFinMutex);
+#endif
+  }
   
-  if (m_libReadMutex) {
+  if (m_cacheMutex) {
 #ifdef MSVC
-    CloseHandle(m_libReadMutex);
+    CloseHandle(m_cacheMutex);
+    for (vector<HANDLE>::iterator sh = m_cacheShardMutexes.begin(); sh != m_cacheShardMutexes.end(); sh++) {
+      CloseHandle(*sh);
+    }
 #else
-    pthread_mutex_destroy(m_libReadMutex);
-    delete (m_libReadMutex);
+    pthread_mutex_destroy(m_cacheMutex);
+    delete (m_cacheMutex);
+    for (vector<pthread_mutex_t*>::iterator sh = m_cacheShardMutexes.begin(); sh != m_cacheShardMutexes.end(); sh++) {
+      pthread_mutex_destroy(*sh);
+      delete (*sh);
+    }
 #endif
   }
   
@@ -138,199 +204,694 @@ SpectraSTMzLibIndex::~SpectraSTMzLibIndex() {
   
 }
 
-// insertEntry - given a new entry and its file offset, adds it into the index
+// insertEntry - given a new entry and its file offset, adds it into the index. The entries are only sorted
+// when the index is written to file.
 void SpectraSTMzLibIndex::insertEntry(SpectraSTLibEntry* entry, fstream::off_type offset) {
   
-  // finds out which bin this entry should go into
-  unsigned int binNum = calcBinNumber((unsigned int)(entry->getPrecursorMz()));
+  m_entryMzs.push_back(entry->getPrecursorMz());
+  m_entryCharges.push_back(entry->getCharge());
+  m_entryOffsets.push_back(offset);
   
-  // insert the file offset
-  (m_offsets[binNum]).push_back(offset);
+  if (entry->getCharge() > m_maxCharge) m_maxCharge = entry->getCharge();
   
   m_entryCount++;
   
 }
 
-// writeToFile - write the entire index to a file. The .spidx simply contains lines of the form
-// <m/z value>\t<offset 1> <offset 2> ... <offset n>
+// writeToFile - write the entire index to a file. The .spidx is a short header followed by the arrays
+// m_entryMzs, m_entryOffsets, m_entryCharges and m_binStarts, sorted by precursor m/z.
 void SpectraSTMzLibIndex::writeToFile() {
   
+  sortEntries();
+  
   ofstream idxFout;
-  if (!myFileOpen(idxFout, m_idxFileName)) {
+  if (!myFileOpen(idxFout, m_idxFileName, true)) {
     g_log->error("CREATE", "Cannot open SPIDX file \"" + m_idxFileName + "\" for writing index.");
     return;
   }
   
-  for (unsigned int b = 0; b < (unsigned int)(m_offsets.size()); b++) {
-    idxFout << calcBinMz(b) << '\t';
-    for (vector<fstream::off_type>::iterator i = m_offsets[b].begin(); i != m_offsets[b].end(); i++) {
-      idxFout << (*i) << " ";
-    }
-    idxFout << endl;
+  unsigned long long numEntries = (unsigned long long)(m_entryMzs.size());
+  unsigned int numBins = (unsigned int)(m_binStarts.size());
+  
+  vector<long long> offsets(m_entryOffsets.begin(), m_entryOffsets.end());
+  
+  // pad the charges (4 bytes each) so that the bin starts are 8-byte aligned too
+  vector<int> charges(m_entryCharges);
+  if (charges.size() % 2 != 0) charges.push_back(0);
+  
+  unsigned long long checksum = CHECKSUM_SEED;
+  if (numEntries > 0) {
+    checksum = calcChecksum((char*)(&(m_entryMzs[0])), numEntries * sizeof(double), checksum);
+    checksum = calcChecksum((char*)(&(offsets[0])), numEntries * sizeof(long long), checksum);
+    checksum = calcChecksum((char*)(&(charges[0])), charges.size() * sizeof(int), checksum);
+  }
+  checksum = calcChecksum((char*)(&(m_binStarts[0])), numBins * sizeof(unsigned int), checksum);
+  
+  idxFout.write(MAGIC, 8);
+  idxFout.write((char*)(&FORMAT_VERSION), sizeof(unsigned int));
+  idxFout.write((char*)(&HEADER_SIZE), sizeof(unsigned int));
+  idxFout.write((char*)(&numEntries), sizeof(unsigned long long));
+  idxFout.write((char*)(&numBins), sizeof(unsigned int));
+  idxFout.write((char*)(&m_maxCharge), sizeof(int));
+  idxFout.write((char*)(&checksum), sizeof(unsigned long long));
+  
+  if (numEntries > 0) {
+    idxFout.write((char*)(&(m_entryMzs[0])), numEntries * sizeof(double));
+    idxFout.write((char*)(&(offsets[0])), numEntries * sizeof(long long));
+    idxFout.write((char*)(&(charges[0])), charges.size() * sizeof(int));
   }
+  idxFout.write((char*)(&(m_binStarts[0])), numBins * sizeof(unsigned int));
   
 }
 
 // readFromFile - read the entire index into memory from a file. MUST BE modified together with writeToFile()
-// to ensure sychronization of the .spidx file format.
+// to ensure sychronization of the .spidx file format. The arrays are read straight into place -- there is nothing to parse.
+// An old text .spidx is converted to the binary format, and rewritten; a binary one of an older version is rebuilt.
 void SpectraSTMzLibIndex::readFromFile() {
   
   ifstream idxFin;
-  if (!myFileOpen(idxFin, m_idxFileName)) {
+  if (!myFileOpen(idxFin, m_idxFileName, true)) {
     g_log->error("SEARCH", "Cannot open SPIDX file \"" + m_idxFileName + "\" for reading index. Exiting.");
     g_log->crash();
     return;
   }
   
+  char magic[8];
+  idxFin.read(magic, 8);
+  
+  if (idxFin.gcount() < 8 || memcmp(magic, MAGIC, 8) != 0) {
+    // old text .spidx
+    idxFin.clear();
+    idxFin.seekg(0);
+    readFromTextFile(idxFin);
+    return;
+  }
+  
+  unsigned int formatVersion = 0;
+  idxFin.read((char*)(&formatVersion), sizeof(unsigned int));
+  
+  unsigned int headerSize = 0;
+  unsigned long long numEntries = 0;
+  unsigned int numBins = 0;
+  unsigned long long checksum = 0;
+  idxFin.read((char*)(&headerSize), sizeof(unsigned int));
+  idxFin.read((char*)(&numEntries), sizeof(unsigned long long));
+  idxFin.read((char*)(&numBins), sizeof(unsigned int));
+  idxFin.read((char*)(&m_maxCharge), sizeof(int));
+  idxFin.read((char*)(&checksum), sizeof(unsigned long long));
+  
+  if (idxFin.good() && formatVersion != FORMAT_VERSION) {
+    idxFin.close();
+    rebuildFromLibFile();
+    return;
+  }
+  
+  if (!idxFin.good() || headerSize != HEADER_SIZE) {
+    g_log->error("SEARCH", "Corrupt or unknown version of SPIDX file \"" + m_idxFileName + "\". Exiting.");
+    g_log->crash();
+    return;
+  }
+  
+  m_entryMzs.resize((unsigned int)numEntries);
+  m_entryCharges.resize((unsigned int)numEntries + (unsigned int)numEntries % 2);
+  m_entryOffsets.resize((unsigned int)numEntries);
+  vector<unsigned int> binStarts(numBins);
+  
+  unsigned long long actualChecksum = CHECKSUM_SEED;
+  
+  if (numEntries > 0) {
+    
+    idxFin.read((char*)(&(m_entryMzs[0])), numEntries * sizeof(double));
+    actualChecksum = calcChecksum((char*)(&(m_entryMzs[0])), numEntries * sizeof(double), actualChecksum);
+    
+    if (sizeof(fstream::off_type) == sizeof(long long)) {
+      idxFin.read((char*)(&(m_entryOffsets[0])), numEntries * sizeof(long long));
+      actualChecksum = calcChecksum((char*)(&(m_entryOffsets[0])), numEntries * sizeof(long long), actualChecksum);
+    } else {
+      vector<long long> offsets((unsigned int)numEntries);
+      idxFin.read((char*)(&(offsets[0])), numEntries * sizeof(long long));
+      actualChecksum = calcChecksum((char*)(&(offsets[0])), numEntries * sizeof(long long), actualChecksum);
+      m_entryOffsets.assign(offsets.begin(), offsets.end());
+    }
+    
+    idxFin.read((char*)(&(m_entryCharges[0])), m_entryCharges.size() * sizeof(int));
+    actualChecksum = calcChecksum((char*)(&(m_entryCharges[0])), m_entryCharges.size() * sizeof(int), actualChecksum);
+    m_entryCharges.resize((unsigned int)numEntries);
+  }
+  
+  if (numBins > 0) {
+    idxFin.read((char*)(&(binStarts[0])), numBins * sizeof(unsigned int));
+    actualChecksum = calcChecksum((char*)(&(binStarts[0])), numBins * sizeof(unsigned int), actualChecksum);
+  }
+  
+  if (!idxFin.good() || actualChecksum != checksum) {
+    g_log->error("SEARCH", "Corrupt SPIDX file \"" + m_idxFileName + "\" (checksum mismatch). Please recreate it. Exiting.");
+    g_log->crash();
+    return;
+  }
+  
+  m_entryCount = (unsigned int)numEntries;
+  
+  if (numBins == (unsigned int)(m_binStarts.size())) {
+    m_binStarts.swap(binStarts);
+    m_fileOrder.clear();
+  } else {
+    // written with a different m/z range of bins
+    sortEntries();
+  }
+  
+}
+
+// readFromTextFile - reads an old text .spidx, which contains lines of the form
+// <m/z value>\t<offset 1> <offset 2> ... <offset n>
+// Since these do not have the exact precursor m/z and charge, all entries are read from the library to find out.
+// The .spidx is then rewritten in the binary format, so that this only happens once.
+void SpectraSTMzLibIndex::readFromTextFile(ifstream& idxFin) {
+  
+  g_log->log("SEARCH", "Converting old SPIDX file \"" + m_idxFileName + "\" to the current format.");
+  
+  // the caller may still be reading the .splib from where it is now (e.g. the preamble)
+  fstream::off_type libFinPos = m_libFinPtr->tellg();
+  
   string line;
   
   while (nextLine(idxFin, line, "")) {
     
     string::size_type pos = 0;
     
-    // first token in the line is the m/z value of that bin
-    string massStr = nextToken(line, 0, pos);
-    unsigned int binNum = calcBinNumber(atof(massStr.c_str()));
+    // first token in the line is the m/z value of that bin -- not needed
+    nextToken(line, 0, pos);
     
     // all tokens after the first are file offsets
     while (pos < line.length()) {
       string offsetStr = nextToken(line, pos, pos);
       if (offsetStr != "") {
 	fstream::off_type offset = strtoull(offsetStr.c_str(), NULL, 10);
-	(m_offsets[binNum]).push_back(offset);
-        m_entryCount++;
+	SpectraSTLibEntry* entry = readEntry(offset);
+	insertEntry(entry, offset);
+	delete (entry);
       }
-    }		
+    }
+  }
+  
+  idxFin.close();
+  
+  m_libFinPtr->clear();
+  m_libFinPtr->seekg(libFinPos);
+  
+  writeToFile();
+  
+}
+
+// rebuildFromLibFile - builds the index again by reading every entry in the library, for a binary .spidx of an older
+// version, whose layout is not read any more. The .spidx is then rewritten in the current format.
+void SpectraSTMzLibIndex::rebuildFromLibFile() {
+  
+  g_log->log("SEARCH", "Rebuilding SPIDX file \"" + m_idxFileName + "\" of an older version from the library.");
+  
+  // the caller may still be reading the .splib from where it is now (e.g. the preamble)
+  fstream::off_type libFinPos = m_libFinPtr->tellg();
+  
+  // skip the preamble, to where the first entry starts
+  m_libFinPtr->clear();
+  m_libFinPtr->seekg(0);
+  if (m_mappedLib) {
+    SpectraSTMappedLibFile::skipHeader(*m_libFinPtr);
   }
   
-}	
-	
+  string line;
+  if (m_binaryLib) {
+    int spectrastVersion = 0;
+    int spectrastSubVersion = 0;
+    unsigned int numLines = 0;
+    m_libFinPtr->read((char*)(&spectrastVersion), sizeof(int));
+    m_libFinPtr->read((char*)(&spectrastSubVersion), sizeof(int));
+    nextLine(*m_libFinPtr, line); // library file name
+    m_libFinPtr->read((char*)(&numLines), sizeof(unsigned int));
+    for (unsigned int i = 0; i < numLines && nextLine(*m_libFinPtr, line); i++);
+  } else {
+    while (m_libFinPtr->peek() == '#' && nextLine(*m_libFinPtr, line));
+  }
+  
+  if (!m_libFinPtr->good()) {
+    g_log->error("SEARCH", "Corrupt .splib file. Cannot rebuild SPIDX file \"" + m_idxFileName + "\". Exiting.");
+    g_log->crash();
+    return;
+  }
+  
+  fstream::off_type offset = m_libFinPtr->tellg();
+  
+  if (m_mappedLib) {
+    // the records follow one another, each starting on an 8-byte boundary, up to the string table
+    while ((offset = (offset + 7) / 8 * 8) < (fstream::off_type)(m_mappedLib->getRecordsEnd())) {
+      unsigned long long bytesRead = 0;
+      SpectraSTLibEntry* entry = readEntry(offset, false, NULL, &bytesRead);
+      insertEntry(entry, offset);
+      delete (entry);
+      offset += (fstream::off_type)bytesRead;
+    }
+    
+  } else {
+    // the entries follow one another up to the end of the file (text entries may be separated by blank lines)
+    while (true) {
+      while (!m_binaryLib && isspace(m_libFinPtr->peek())) m_libFinPtr->get();
+      if (m_libFinPtr->peek() == EOF) break;
+      offset = m_libFinPtr->tellg();
+      SpectraSTLibEntry* entry = readEntry(offset);
+      insertEntry(entry, offset);
+      delete (entry);
+    }
+  }
+  
+  m_libFinPtr->clear();
+  m_libFinPtr->seekg(libFinPos);
+  
+  writeToFile();
+  
+}
+
+// sortEntries - sorts the entries by precursor m/z (and then file offset), and works out which of them are in which bin.
+void SpectraSTMzLibIndex::sortEntries() {
+  
+  unsigned int numEntries = (unsigned int)(m_entryMzs.size());
+  
+  bool isSorted = true;
+  for (unsigned int pos = 1; pos < numEntries && isSorted; pos++) {
+    if (m_entryMzs[pos] < m_entryMzs[pos - 1] ||
+	(m_entryMzs[pos] == m_entryMzs[pos - 1] && m_entryOffsets[pos] < m_entryOffsets[pos - 1])) {
+      isSorted = false;
+    }
+  }
+  
+  if (!isSorted) {
+    vector<pair<pair<double, fstream::off_type>, int> > entries;
+    entries.reserve(numEntries);
+    for (unsigned int pos = 0; pos < numEntries; pos++) {
+      entries.push_back(make_pair(make_pair(m_entryMzs[pos], m_entryOffsets[pos]), m_entryCharges[pos]));
+    }
+    sort(entries.begin(), entries.end());
+    for (unsigned int pos = 0; pos < numEntries; pos++) {
+      m_entryMzs[pos] = entries[pos].first.first;
+      m_entryOffsets[pos] = entries[pos].first.second;
+      m_entryCharges[pos] = entries[pos].second;
+    }
+  }
+  
+  // m_binStarts[b] is the position of the first entry in bin b or later
+  unsigned int pos = 0;
+  for (unsigned int b = 0; b < (unsigned int)(m_binStarts.size()); b++) {
+    while (pos < numEntries && calcBinNumber(m_entryMzs[pos]) < b) {
+      pos++;
+    }
+    m_binStarts[b] = pos;
+  }
+  
+  m_fileOrder.clear();
+  
+}
+
+// sortFileOrder - fills in m_fileOrder, the order for sequential access. This is the order of the .splib within each bin,
+// which is the order the entries are inserted when the library is created.
+void SpectraSTMzLibIndex::sortFileOrder() {
+  
+  m_fileOrder.clear();
+  m_fileOrder.reserve(m_entryOffsets.size());
+  
+  for (unsigned int b = 0; b < (unsigned int)(m_binStarts.size()) - 1; b++) {
+    
+    vector<pair<fstream::off_type, unsigned int> > entriesInBin;
+    for (unsigned int pos = m_binStarts[b]; pos < m_binStarts[b + 1]; pos++) {
+      entriesInBin.push_back(make_pair(m_entryOffsets[pos], pos));
+    }
+    sort(entriesInBin.begin(), entriesInBin.end());
+    
+    for (vector<pair<fstream::off_type, unsigned int> >::iterator en = entriesInBin.begin(); en != entriesInBin.end(); en++) {
+      m_fileOrder.push_back(en->second);
+    }
+  }
+  
+}
+
 // retrieve - Given the target m/z and a tolerance around it, retrieves all library entries
 // that fall into the corresponding bins, and return them in the vector 'entries'. It first checks
 // if the required bins are already in memory (being active in the cache); if not, it updates the cache (and deletes old cached item
-// if the cache becomes full) first. The returned entries remain property of SpectraSTMzLibIndex, and 
-// WILL BE RE-USED for different queries!
+// if the cache is full).
 //
-// NOTE: The target m/z tolerance is not exact; it is possible that entries outside of the range 
-// [targetMz - targetMzTolerance, targetMz + targetMzTolerance] are retrieved. This is necessarily the result of
-// having an index that puts entries into 1 m/z unit-wide bins. Within the same bin, some entries may lie within the 
-// range and others may not, and the index has no way of knowing which ones. 
+// NOTE: The target m/z tolerance is not exact; it is possible that entries outside of the range
+// [targetMz - targetMzTolerance, targetMz + targetMzTolerance] are retrieved, since all entries in the 1 m/z unit-wide
+// bins overlapping the range are. Use the other retrieve() to get the entries in the range only.
 // The function, however, is guaranteed to retrieve at least all the entries within the range.
 void SpectraSTMzLibIndex::retrieve(vector<SpectraSTLibEntry*>& entries, double lowMz, double highMz, bool shortAnnotation) {
- 
-  unsigned int low = calcBinNumber(lowMz);
-  unsigned int high = calcBinNumber(highMz);
   
-  if (m_cacheCapacity >= (int)CACHE_ALL) {  // keep everything in memory
+  vector<mzRange> ranges(1);
+  ranges[0].lowMz = lowMz;
+  ranges[0].highMz = highMz;
+  ranges[0].charge = 0;
+  
+  retrieveRanges(entries, ranges, true, shortAnnotation, NULL);
+  
+}
+
+// retrieve - retrieves exactly the library entries with precursor m/z within any of the ranges (and of the charge
+// specified for the range, if any). Entries outside the ranges are never read. Each entry is only returned once, even if
+// the ranges overlap. The entries are returned in the same order as the other retrieve(). If counts is not NULL, the numbers
+// of entries found in the cache and read from the library are added to it.
+void SpectraSTMzLibIndex::retrieve(vector<SpectraSTLibEntry*>& entries, vector<mzRange>& ranges, bool shortAnnotation, mzLibRetrieveCounts* counts) {
+  
+  retrieveRanges(entries, ranges, false, shortAnnotation, counts);
+  
+}
+
+// retrieveRanges - does the work of retrieve(). If wholeBins is true, all entries in the bins overlapping the ranges are retrieved.
+void SpectraSTMzLibIndex::retrieveRanges(vector<SpectraSTLibEntry*>& entries, vector<mzRange>& ranges, bool wholeBins, bool shortAnnotation, mzLibRetrieveCounts* counts) {
+  
+  // in a multi-threaded search, this thread's own stream of the .splib (NULL otherwise, meaning the shared one)
+  ifstream* libFin = getThreadLibFin();
+  
+  unsigned int numReadBefore = (counts ? counts->numRead : 0);
+  
+  vector<binnedEntry> hits;
+  
+  for (vector<mzRange>::iterator r = ranges.begin(); r != ranges.end(); r++) {
+    
+    unsigned int low = calcBinNumber(r->lowMz);
+    unsigned int high = calcBinNumber(r->highMz);
+    
+    // the positions of the entries in range, by binary search
+    unsigned int first = 0;
+    unsigned int last = (unsigned int)(m_entryMzs.size());
+    if (!wholeBins) {
+      first = (unsigned int)(lower_bound(m_entryMzs.begin(), m_entryMzs.end(), r->lowMz) - m_entryMzs.begin());
+      last = (unsigned int)(upper_bound(m_entryMzs.begin(), m_entryMzs.end(), r->highMz) - m_entryMzs.begin());
+    }
     
     for (unsigned int b = low; b <= high; b++) {
+      retrieveBin(hits, b, first, last, (wholeBins ? 0 : r->charge), shortAnnotation, libFin, counts);
+    }
+  }
+  
+  if (m_cacheCapacity < (int)CACHE_ALL) {
     
-      //if (m_cacheMutex && (*m_cacheMutex)[b]) {
-//	pthread_mutex_lock((*m_cacheMutex)[b]);
-  //    }
-      
-      if (m_cache[b] == NULL) {
-	// this bin is not yet in memory, read it	
-	
-	if (m_libReadMutex) {
-#ifdef MSVC
-      WaitForSingleObject( m_libReadMutex,    // handle to mutex
-			   INFINITE);      //#include "windows.h"
-#else
-      pthread_mutex_lock(m_libReadMutex);
-#endif      
-	}
-	
-	if (m_cache[b] == NULL) {
-	  
-	  vector<SpectraSTLibEntry*>* newCacheBin = new vector<SpectraSTLibEntry*>();
-	  for (vector<fstream::off_type>::iterator offset = (m_offsets[b]).begin(); offset != (m_offsets[b]).end(); offset++) {
-	    m_libFinPtr->seekg(*offset);
-	
-	    SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib, shortAnnotation, (m_libReadMutex != NULL));
-	  
-	    newEntry->setLibFileOffset(*offset);
-	    newCacheBin->push_back(newEntry);
+    // if cache is full, free the least recently used bins.
+    if (m_cacheMutex) {
+      lockCache();
+      evictCacheBins();
+      unlockCache();
+    } else {
+      evictCacheBins();
+      // single-threaded: done with the bins, unpin them (see retrieveBin) -- unless they stay pinned until release()
+      if (!m_pinUntilRelease) {
+        for (vector<mzRange>::iterator r = ranges.begin(); r != ranges.end(); r++) {
+	  for (unsigned int b = calcBinNumber(r->lowMz); b <= calcBinNumber(r->highMz); b++) {
+	    m_cachePins[b]--;
 	  }
-	  m_cache[b] = newCacheBin;
-	  
-	} 
-	
-	if (m_libReadMutex) {
+        }
+      }
+    }
+  }
+  
+  // bin by bin, and in file order within each bin. Overlapping ranges give the same entry more than once; keep one.
+  sort(hits.begin(), hits.end());
+  vector<binnedEntry>::iterator hitsEnd = unique(hits.begin(), hits.end());
+  
+  for (vector<binnedEntry>::iterator h = hits.begin(); h != hitsEnd; h++) {
+    entries.push_back(h->second);
+  }
+  
+  // every entry returned that this call did not read was in the cache already
+  if (counts) {
+    counts->numCached += (unsigned int)(hitsEnd - hits.begin()) - (counts->numRead - numReadBefore);
+  }
+  
+}
+
+// retrieveBin - makes sure that a bin is active in the cache, and that the entries of the bin at positions [first, last)
+// (and of the charge, if not 0) are read in. These entries are added to hits. Three cases:
+//
+// Entire library cached: no lock. In a multi-threaded search, two threads may both find a bin (or an entry) missing;
+// both read it, but only the first to swap its copy into the cache wins. The other deletes its own.
+//
+// Limited cache, multi-threaded: every bin retrieved is pinned until the search using it calls release(). Only the
+// bookkeeping is done under m_cacheMutex; the entries themselves are read under the lock of the bin's shard only.
+//
+// Limited cache, single-threaded: the bin is pinned until the end of retrieveRanges(), so that it is not freed while
+// other bins are retrieved.
+void SpectraSTMzLibIndex::retrieveBin(vector<binnedEntry>& hits, unsigned int bin, unsigned int first, unsigned int last, int charge, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts) {
+  
+  unsigned int binFirst = m_binStarts[bin];
+  if (first < binFirst) first = binFirst;
+  if (last > m_binStarts[bin + 1]) last = m_binStarts[bin + 1];
+  
+  if (m_cacheCapacity >= (int)CACHE_ALL) {  // keep everything in memory
+  
+    vector<SpectraSTLibEntry*>* cacheBin = (vector<SpectraSTLibEntry*>*)loadPublished((void**)(&(m_cache[bin])));
+    if (cacheBin == NULL) {
+      vector<SpectraSTLibEntry*>* newCacheBin = new vector<SpectraSTLibEntry*>(m_binStarts[bin + 1] - binFirst, (SpectraSTLibEntry*)NULL);
 #ifdef MSVC
-	  ReleaseMutex( m_libReadMutex );      //#include "windows.h"
+      bool isPublished = (InterlockedCompareExchangePointer((PVOID volatile*)(&(m_cache[bin])), (PVOID)newCacheBin, NULL) == NULL);
 #else
-	  pthread_mutex_unlock(m_libReadMutex);
+      bool isPublished = __sync_bool_compare_and_swap(&(m_cache[bin]), (vector<SpectraSTLibEntry*>*)NULL, newCacheBin);
 #endif
-	}
-	
-      }
+      if (!isPublished) delete (newCacheBin);
+      cacheBin = (vector<SpectraSTLibEntry*>*)loadPublished((void**)(&(m_cache[bin])));
+    }
+    
+    for (unsigned int pos = first; pos < last; pos++) {
       
-  //    if (m_cacheMutex && (*m_cacheMutex)[b]) {
-//	pthread_mutex_unlock((*m_cacheMutex)[b]);
-  //    }
+      if (!isChargeMatched(pos, charge)) continue;
       
-      // now we can retrieve
-      for (vector<SpectraSTLibEntry*>::iterator entry = m_cache[b]->begin(); entry != m_cache[b]->end(); entry++) {
-        entries.push_back(*entry);
+      SpectraSTLibEntry** slot = &((*cacheBin)[pos - binFirst]);
+      SpectraSTLibEntry* entry = (SpectraSTLibEntry*)loadPublished((void**)slot);
+      if (entry == NULL) {
+	SpectraSTLibEntry* newEntry = readCacheEntry(pos, shortAnnotation, libFin, counts);
+#ifdef MSVC
+	bool isPublished = (InterlockedCompareExchangePointer((PVOID volatile*)slot, (PVOID)newEntry, NULL) == NULL);
+#else
+	bool isPublished = __sync_bool_compare_and_swap(slot, (SpectraSTLibEntry*)NULL, newEntry);
+#endif
+	if (!isPublished) delete (newEntry);
+	entry = (SpectraSTLibEntry*)loadPublished((void**)slot);
       }
-       
+      
+      hits.push_back(binnedEntry(make_pair(bin, m_entryOffsets[pos]), entry));
+    }
+    return;
+  }
+  
+  if (m_cacheMutex) { // multi-threaded, cache size limited
+  
+    lockCacheShard(bin);
+    
+    lockCache();
+    if (m_cache[bin] == NULL) {
+      activateCacheBin(bin);
+    } else {
+      m_cacheLru.splice(m_cacheLru.begin(), m_cacheLru, m_cacheLruPos[bin]); // most recently used now
     }
+    m_cachePins[bin]++;
+    unlockCache();
     
-  } else { // cache size limited, keep a queue
+    unsigned long long bytes = readCacheBinEntries(bin, first, last, charge, shortAnnotation, libFin, counts);
     
+    if (bytes > 0) {
+      lockCache();
+      m_cacheBinBytes[bin] += bytes;
+      m_cacheBytes += bytes;
+      unlockCache();
+    }
+    
+    unlockCacheShard(bin);
   
-    for (unsigned int b = low; b <= high; b++) {
+  } else { // single-threaded, cache size limited
+  
+    if (m_cache[bin] == NULL) {
+      activateCacheBin(bin);
+    } else {
+      m_cacheLru.splice(m_cacheLru.begin(), m_cacheLru, m_cacheLruPos[bin]); // most recently used now
+    }
+    m_cachePins[bin]++;
     
+    unsigned long long bytes = readCacheBinEntries(bin, first, last, charge, shortAnnotation, libFin, counts);
+    m_cacheBinBytes[bin] += bytes;
+    m_cacheBytes += bytes;
+  
+  }
+  
+  // now we can retrieve -- the bin is pinned, so it stays
+  for (unsigned int pos = first; pos < last; pos++) {
+    if (isChargeMatched(pos, charge)) {
+      hits.push_back(binnedEntry(make_pair(bin, m_entryOffsets[pos]), (*(m_cache[bin]))[pos - binFirst]));
+    }
+  }
+  
+}
+
+// release - tells the index that the search that retrieved the entries in [lowMz, highMz] is done with them.
+// In a multi-threaded search with a limited cache, bins are only freed after all searches using them are done. 
+// The same if single-threaded with m_pinUntilRelease, without the locking. Otherwise, this does nothing: bins are freed 
+// only when other bins are retrieved, which means the search using them is done.
+void SpectraSTMzLibIndex::release(double lowMz, double highMz) {
+  
+  unsigned int low = calcBinNumber(lowMz);
+  unsigned int high = calcBinNumber(highMz);
+  
+  if (!m_cacheMutex) {
+    if (m_pinUntilRelease && m_cacheCapacity < (int)CACHE_ALL) {
+      for (unsigned int b = low; b <= high; b++) {
+        if (m_cachePins[b] > 0) m_cachePins[b]--;
+      }
+    }
+    return;
+  }
+  
+  lockCache();
+  for (unsigned int b = low; b <= high; b++) {
+    if (m_cachePins[b] > 0) m_cachePins[b]--;
+  }
+  unlockCache();
+  
+}
+
+// release - same as above, for entries retrieved by ranges
+void SpectraSTMzLibIndex::release(vector<mzRange>& ranges) {
+  
+  for (vector<mzRange>::iterator r = ranges.begin(); r != ranges.end(); r++) {
+    release(r->lowMz, r->highMz);
+  }
+  
+}
+
+// readCacheBinEntries - reads the entries of an active bin at positions [first, last) (and of the charge, if not 0) that are
+// not already there. Returns the memory they take up in bytes, if the cache is limited by memory.
+unsigned long long SpectraSTMzLibIndex::readCacheBinEntries(unsigned int bin, unsigned int first, unsigned int last, int charge, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts) {
+  
+  unsigned long long bytes = 0;
+  
+  for (unsigned int pos = first; pos < last; pos++) {
     
-      if (m_cache[b] == NULL) {
-	// this bin is not yet in memory, read it	
-      
-	vector<SpectraSTLibEntry*>* newCacheBin = new vector<SpectraSTLibEntry*>();
-	for (vector<fstream::off_type>::iterator offset = (m_offsets[b]).begin(); offset != (m_offsets[b]).end(); offset++) {
-	  m_libFinPtr->seekg(*offset);
-        
-	  SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib, shortAnnotation, false);
-	
-	  newEntry->setLibFileOffset(*offset);
-	  newCacheBin->push_back(newEntry);
-	}
-	m_cache[b] = newCacheBin;
-	m_cacheSize++;
-      
-	// get into the cache queue
-	m_cacheQueue.push(b);
+    SpectraSTLibEntry*& slot = (*(m_cache[bin]))[pos - m_binStarts[bin]];
+    
+    if (slot == NULL && isChargeMatched(pos, charge)) {
+      slot = readCacheEntry(pos, shortAnnotation, libFin, counts);
       
-	// if cache is full, pop the cache queue and free the oldest active bin
-	if (m_cacheSize > m_cacheCapacity) {
-
-	  unsigned int old = m_cacheQueue.front();
-	  while (old >= low && old <= high) {
-	    // still need this bin, pop it but re-push to end of queue
-	    m_cacheQueue.pop();
-	    m_cacheQueue.push(old);
-	    old = m_cacheQueue.front();
-	  }
+      // NOTE: entries not prepared already (see SpectraSTPreparedLibFile) are counted at the size they are read in,
+      // which is bigger than what they shrink to after preparation for search.
+      if (m_cacheCapacityBytes > 0) bytes += slot->calcMemoryUsage();
+    }
+  }
+  
+  return (bytes);
+}
 
-	  // finally find an old bin that's not needed, pop and free this one
-	  m_cacheQueue.pop();
-	  freeCacheBin(old);	
-	}
-      } 
-    
-      // now we can retrieve
-      for (vector<SpectraSTLibEntry*>::iterator entry = m_cache[b]->begin(); entry != m_cache[b]->end(); entry++) {
-	entries.push_back(*entry);
-      }
+// readCacheEntry - reads the entry at a position from the library, for the cache. Counted in counts, if not NULL.
+SpectraSTLibEntry* SpectraSTMzLibIndex::readCacheEntry(unsigned int pos, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts) {
+  
+  SpectraSTLibEntry* newEntry = NULL;
+  if (counts) {
+    unsigned long long bytesRead = 0;
+    newEntry = readEntry(m_entryOffsets[pos], shortAnnotation, libFin, &bytesRead);
+    counts->numRead++;
+    counts->bytesRead += bytesRead;
+  } else {
+    newEntry = readEntry(m_entryOffsets[pos], shortAnnotation, libFin);
+  }
+  if (m_preparedLib) m_preparedLib->retrieve(m_entryOffsets[pos], newEntry->getPeakList());
+  return (newEntry);
+}
+
+// isChargeMatched - whether the entry at a position is of the charge (any charge if 0). An entry of unknown charge
+// counts as singly charged.
+bool SpectraSTMzLibIndex::isChargeMatched(unsigned int pos, int charge) {
+  
+  if (charge == 0) return (true);
+  
+  int entryCharge = m_entryCharges[pos];
+  if (entryCharge == 0) entryCharge = 1;
+  return (entryCharge == charge);
+}
+
+// getThreadLibFin - returns the calling thread's own stream of the .splib, opening it the first time the thread 
+// gets here. Returns NULL if there are no such streams (single-threaded search, or mapped library).
+ifstream* SpectraSTMzLibIndex::getThreadLibFin() {
+  
+  if (!m_threadLibFinMutex) return (NULL);
+  
+#ifdef MSVC
+  ifstream* libFin = (ifstream*)(TlsGetValue(m_threadLibFinKey));
+#else
+  ifstream* libFin = (ifstream*)(pthread_getspecific(m_threadLibFinKey));
+#endif
+  
+  if (!libFin) {
     
+    FileName fn;
+    parseFileName(m_idxFileName, fn);
+    string libFileName = fn.path + fn.name + ".splib";
+    libFin = new ifstream();
+    if (!myFileOpen(*libFin, libFileName, true)) {
+      g_log->error("SEARCH", "Cannot open SPLIB file \"" + libFileName + "\" for reading.");
+      g_log->crash();
     }
     
+#ifdef MSVC
+    WaitForSingleObject(m_threadLibFinMutex, INFINITE);
+    m_threadLibFins.push_back(libFin);
+    ReleaseMutex(m_threadLibFinMutex);
+    TlsSetValue(m_threadLibFinKey, (LPVOID)libFin);
+#else
+    pthread_mutex_lock(m_threadLibFinMutex);
+    m_threadLibFins.push_back(libFin);
+    pthread_mutex_unlock(m_threadLibFinMutex);
+    pthread_setspecific(m_threadLibFinKey, (void*)libFin);
+#endif
+    
   }
   
+  return (libFin);
+}
+
+// activateCacheBin - puts an empty bin (with a NULL slot for each entry) into the cache, as the most recently used
+void SpectraSTMzLibIndex::activateCacheBin(unsigned int bin) {
+  
+  unsigned int numEntries = m_binStarts[bin + 1] - m_binStarts[bin];
+  m_cache[bin] = new vector<SpectraSTLibEntry*>(numEntries, (SpectraSTLibEntry*)NULL);
+  m_cacheSize++;
+  
+  m_cacheBinBytes[bin] = 0;
+  if (m_cacheCapacityBytes > 0) {
+    m_cacheBinBytes[bin] = sizeof(vector<SpectraSTLibEntry*>) + numEntries * sizeof(SpectraSTLibEntry*);
+  }
+  m_cacheBytes += m_cacheBinBytes[bin];
+  
+  m_cacheLru.push_front(bin);
+  m_cacheLruPos[bin] = m_cacheLru.begin();
   
 }
 
-// freeCacheBin - frees a bin of entries in the cache
+// evictCacheBins - while the cache is over capacity, frees the least recently used bins. Pinned bins (see release()
+// and retrieveBin()) are still in use, and are never freed.
+void SpectraSTMzLibIndex::evictCacheBins() {
+  
+  list<unsigned int>::iterator i = m_cacheLru.end();
+  
+  while (i != m_cacheLru.begin() && 
+	 (m_cacheSize > m_cacheCapacity || (m_cacheCapacityBytes > 0 && m_cacheBytes > m_cacheCapacityBytes))) {
+    
+    i--;
+    unsigned int old = *i;
+    
+    if (m_cachePins[old] > 0) {
+      // still need this bin, skip it
+      continue;
+    }
+    
+    i = m_cacheLru.erase(i);
+    freeCacheBin(old);
+  }
+  
+}
+
+// freeCacheBin - frees a bin of entries in the cache. The caller takes it off m_cacheLru.
 void SpectraSTMzLibIndex::freeCacheBin(unsigned int bin) {
 
   // check to make sure it's active
@@ -345,25 +906,54 @@ void SpectraSTMzLibIndex::freeCacheBin(unsigned int bin) {
     m_cache[bin] = NULL;
     
     m_cacheSize--;
+    m_cacheBytes -= m_cacheBinBytes[bin];
+    m_cacheBinBytes[bin] = 0;
   }
 }
 
+// lockCache, unlockCache - for the bookkeeping of a limited cache in a multi-threaded search
+void SpectraSTMzLibIndex::lockCache() {
+#ifdef MSVC
+  WaitForSingleObject(m_cacheMutex, INFINITE);
+#else
+  pthread_mutex_lock(m_cacheMutex);
+#endif
+}
+
+void SpectraSTMzLibIndex::unlockCache() {
+#ifdef MSVC
+  ReleaseMutex(m_cacheMutex);
+#else
+  pthread_mutex_unlock(m_cacheMutex);
+#endif
+}
+
+// lockCacheShard, unlockCacheShard - so that only one thread reads any given bin into a limited cache
+void SpectraSTMzLibIndex::lockCacheShard(unsigned int bin) {
+#ifdef MSVC
+  WaitForSingleObject(m_cacheShardMutexes[bin % NUM_CACHE_SHARDS], INFINITE);
+#else
+  pthread_mutex_lock(m_cacheShardMutexes[bin % NUM_CACHE_SHARDS]);
+#endif
+}
+
+void SpectraSTMzLibIndex::unlockCacheShard(unsigned int bin) {
+#ifdef MSVC
+  ReleaseMutex(m_cacheShardMutexes[bin % NUM_CACHE_SHARDS]);
+#else
+  pthread_mutex_unlock(m_cacheShardMutexes[bin % NUM_CACHE_SHARDS]);
+#endif
+}
+
 // nextEntry - sequential access of the m/z index. returns NULL if there's no more entry left.
 SpectraSTLibEntry* SpectraSTMzLibIndex::nextEntry() {
 
-  m_curOffset++;
-
-  while (m_curOffset >= (int)(m_offsets[m_curBin].size())) {
-    m_curBin++;
-    m_curOffset = 0;
-    if (m_curBin >= (unsigned int)m_offsets.size()) {
-      return NULL;
-    }
+  fstream::off_type offset = 0;
+  if (!nextFileOffset(offset)) {
+    return NULL;
   }
 
-  m_libFinPtr->seekg((m_offsets[m_curBin])[m_curOffset]);
-  SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
-  newEntry->setLibFileOffset((m_offsets[m_curBin])[m_curOffset]);
+  SpectraSTLibEntry* newEntry = readEntry(offset);
 
   return (newEntry);
 
@@ -371,33 +961,48 @@ SpectraSTLibEntry* SpectraSTMzLibIndex::nextEntry() {
 
 bool SpectraSTMzLibIndex::nextFileOffset(fstream::off_type& offset) {
   
-  m_curOffset++;
+  if (m_fileOrder.size() != m_entryOffsets.size()) {
+    sortFileOrder();
+  }
+  
+  m_curEntry++;
 
-  while (m_curOffset >= (int)(m_offsets[m_curBin].size())) {
-    m_curBin++;
-    m_curOffset = 0;
-    if (m_curBin >= (unsigned int)m_offsets.size()) {
-      return (false);
-    }
+  if (m_curEntry >= (int)(m_fileOrder.size())) {
+    m_curEntry = (int)(m_fileOrder.size());
+    return (false);
   }
-  offset = (m_offsets[m_curBin])[m_curOffset];
+  offset = m_entryOffsets[m_fileOrder[m_curEntry]];
   return (true);
   
 }
 
 SpectraSTLibEntry* SpectraSTMzLibIndex::thisEntry() {
   
-  if (m_curBin >= (unsigned int)m_offsets.size() || m_curOffset >= (int)(m_offsets[m_curBin].size())) {
+  if (m_curEntry < 0 || m_curEntry >= (int)(m_fileOrder.size())) {
     return NULL;
   }
   
-  m_libFinPtr->seekg((m_offsets[m_curBin])[m_curOffset]);
-  SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
-  newEntry->setLibFileOffset((m_offsets[m_curBin])[m_curOffset]);
+  SpectraSTLibEntry* newEntry = readEntry(m_entryOffsets[m_fileOrder[m_curEntry]]);
   
   return (newEntry);
 }
 
+// getFileOrderOffsets - the file offsets of all entries, bin by bin, and in the order they are in the .splib within each bin.
+// This is the order of nextEntry().
+void SpectraSTMzLibIndex::getFileOrderOffsets(vector<fstream::off_type>& offsets) {
+  
+  if (m_fileOrder.size() != m_entryOffsets.size()) {
+    sortFileOrder();
+  }
+  
+  offsets.clear();
+  offsets.reserve(m_fileOrder.size());
+  for (vector<unsigned int>::iterator i = m_fileOrder.begin(); i != m_fileOrder.end(); i++) {
+    offsets.push_back(m_entryOffsets[*i]);
+  }
+  
+}
+
 // sortEntriesByNreps - sorts the entries by number of replicates, so that nextSortedEntry will return the entries in descending
 // order of number of replicates.
 void SpectraSTMzLibIndex::sortEntriesByNreps() {
@@ -431,20 +1036,25 @@ void SpectraSTMzLibIndex::sortEntriesBySN() {
   
   reset();
   
+  if (m_fileOrder.size() != m_entryOffsets.size()) {
+    sortFileOrder();
+  }
+  
   m_sortedOffsets = new vector<pair<fstream::off_type, double> >;
   
-  for (vector< vector<fstream::off_type> >::iterator bin = m_offsets.begin(); bin != m_offsets.end(); bin++) {
+  // m_fileOrder goes bin by bin, and bin b is at the same positions in m_fileOrder as in the sorted arrays
+  for (unsigned int b = 0; b < (unsigned int)(m_binStarts.size()) - 1; b++) {
     
     vector<pair<fstream::off_type, double> > entriesInBin;
     
-    for (vector<fstream::off_type>::iterator en = bin->begin(); en != bin->end(); en++) {
+    for (unsigned int i = m_binStarts[b]; i < m_binStarts[b + 1]; i++) {
       
-      m_libFinPtr->seekg(*en);
-      SpectraSTLibEntry* entry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
+      fstream::off_type offset = m_entryOffsets[m_fileOrder[i]];
+      SpectraSTLibEntry* entry = readEntry(offset);
       double sn = entry->getPeakList()->calcSignalToNoise();
     
       pair<fstream::off_type, double> p;
-      p.first = (*en);
+      p.first = offset;
       p.second = sn;
       
       entriesInBin.push_back(p);
@@ -472,9 +1082,7 @@ SpectraSTLibEntry* SpectraSTMzLibIndex::nextSortedEntry() {
   } else {
     
     fstream::off_type offset = ((*m_sortedOffsets)[m_curSortedOffset]).first;
-    m_libFinPtr->seekg(offset);
-    SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
-    newEntry->setLibFileOffset(offset);
+    SpectraSTLibEntry* newEntry = readEntry(offset);
 
     return (newEntry);
   }
@@ -509,17 +1117,14 @@ SpectraSTLibEntry* SpectraSTMzLibIndex::thisSortedEntry() {
     return NULL;
   } else {
     fstream::off_type offset = ((*m_sortedOffsets)[m_curSortedOffset]).first;
-    m_libFinPtr->seekg(offset);
-    SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
-    newEntry->setLibFileOffset(offset);
+    SpectraSTLibEntry* newEntry = readEntry(offset);
     return (newEntry);
   }
 }
 
 // reset - goes back to the start, used for the nextEntry and nextSortedEntry sequential readers.
 void SpectraSTMzLibIndex::reset() {
-  m_curBin = 0;
-  m_curOffset = -1;
+  m_curEntry = -1;
   m_curSortedOffset = -1;
 }
 
@@ -545,35 +1150,38 @@ unsigned int SpectraSTMzLibIndex::calcBinMz(unsigned int binNum) {
 // initialize - simply clear the bins and the cache
 void SpectraSTMzLibIndex::initialize(bool useMTSearch) {
   
-  for (vector< vector<fstream::off_type> >::iterator oBin = m_offsets.begin(); oBin != m_offsets.end(); oBin++) {
-    (*oBin).clear();
-  }
-  
   for (vector< vector<SpectraSTLibEntry*>* >::iterator cBin = m_cache.begin(); cBin != m_cache.end(); cBin++) {
     (*cBin) = NULL;
   }
   
-  if (useMTSearch) {
+  if (useMTSearch && !m_mappedLib) {
+    // each thread reads the .splib through its own stream
 #ifdef MSVC
-    m_libReadMutex = CreateMutex( 
-				 NULL,              // default security attributes
-				 FALSE,             // initially not owned
-				 NULL);             // unnamed mutex
-  
-    if (m_libReadMutex == NULL) 
-      {
-	printf("CreateMutex error: %d\n", (int)GetLastError());
-	exit(1);
-      }
+    m_threadLibFinKey = TlsAlloc();
+    m_threadLibFinMutex = CreateMutex(NULL, FALSE, NULL);
 #else
-    m_libReadMutex = new pthread_mutex_t();
-    pthread_mutex_init(m_libReadMutex, NULL);
+    pthread_key_create(&m_threadLibFinKey, NULL);
+    m_threadLibFinMutex = new pthread_mutex_t();
+    pthread_mutex_init(m_threadLibFinMutex, NULL);
+#endif
+  }
+  
+  if (useMTSearch && m_cacheCapacity < (int)CACHE_ALL) {
+    // multi-threaded search with a limited cache
+#ifdef MSVC
+    m_cacheMutex = CreateMutex(NULL, FALSE, NULL);
+    for (unsigned int sh = 0; sh < NUM_CACHE_SHARDS; sh++) {
+      m_cacheShardMutexes.push_back(CreateMutex(NULL, FALSE, NULL));
+    }
+#else
+    m_cacheMutex = new pthread_mutex_t();
+    pthread_mutex_init(m_cacheMutex, NULL);
+    for (unsigned int sh = 0; sh < NUM_CACHE_SHARDS; sh++) {
+      pthread_mutex_t* shardMutex = new pthread_mutex_t();
+      pthread_mutex_init(shardMutex, NULL);
+      m_cacheShardMutexes.push_back(shardMutex);
+    }
 #endif
-   // m_cacheMutex = new vector<pthread_mutex_t*>(MIN_MZ - MIN_MZ + 1);
-   // for (vector<pthread_mutex_t*>::iterator cmtBin = m_cacheMutex->begin(); cmtBin != m_cacheMutex->end(); cmtBin++) {
-   //   (*cmtBin) = new pthread_mutex_t();
-   //   pthread_mutex_init((*cmtBin), NULL);
-   // }    
   }
   
 }
@@ -590,7 +1198,7 @@ void SpectraSTMzLibIndex::printDotTimeProfiles(ofstream& fout) {
   for (vector<vector<SpectraSTLibEntry*>* >::iterator bin = m_cache.begin(); bin != m_cache.end(); bin++) {
     if (*bin) {
       for (vector<SpectraSTLibEntry*>::iterator en = (*bin)->begin(); en != (*bin)->end(); en++) { 
-	(*en)->printDotTimeProfile(fout);
+	if (*en) (*en)->printDotTimeProfile(fout);
       }
     }
   }
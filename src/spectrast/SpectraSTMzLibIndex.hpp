@@ -3,9 +3,10 @@
 
 #include "SpectraSTLibEntry.hpp"
 #include "SpectraSTLibIndex.hpp"
+#include "SpectraSTPreparedLibFile.hpp"
 #include <iostream>
 #include <vector>
-#include <queue>
+#include <list>
 #include <string>
 
 #ifdef __MINGW__
@@ -53,16 +54,37 @@ hlam@systemsbiology.org
 
 /* Class: SpectraSTMzLibIndex
  * 
- * Implements a library index on the precursor m/z value. 
+ * Implements a library index on the precursor m/z value. The index keeps the exact precursor m/z, charge and file offset
+ * of every entry, sorted by precursor m/z, so that the entries in any m/z range are found by binary search. The .spidx
+ * file is these arrays in binary, with a header and a checksum, and is loaded without any parsing. (An old text .spidx, which 
+ * only says which 1-Th bin each entry is in, is converted the first time it is read. A binary one of an older version is
+ * rebuilt from the .splib.)
  * 
  * NOTE ON CACHING: The recently retrieved entries are cached in memory for efficiency. The cache capacity
- * is specified by the cacheRange argument in the constructor for retrieval. See the retrieve() method for
+ * is specified by the cacheRange argument (in 1-Th bins), or by the cacheMemoryLimit argument (in bytes) 
+ * in the constructor for retrieval. The least recently used bin is freed first. See the retrieve() method for
  * more information.
  * 
  */
 
 using namespace std;
 
+// mzRange - a range of precursor m/z to retrieve library entries in, for retrieve(). If charge is not 0, only entries of that
+// charge are retrieved; entries of unknown charge count as singly charged.
+struct mzRange {
+  double lowMz;
+  double highMz;
+  int charge;
+};
+
+// mzLibRetrieveCounts - for the search metrics (see SpectraSTSearchMetrics), the counts of a retrieve(): the entries that were 
+// already in the cache, and the entries that had to be read from the library (with their size in the library file)
+struct mzLibRetrieveCounts {
+  unsigned int numCached;
+  unsigned int numRead;
+  unsigned long long bytesRead;
+};
+
 class SpectraSTMzLibIndex : public SpectraSTLibIndex {
 	
 	
@@ -72,7 +94,7 @@ public:
   SpectraSTMzLibIndex(string idxFileName);
   
   // constructor for retrieval
-  SpectraSTMzLibIndex(string idxFileName, ifstream* libFinPtr, double cacheRange, bool binaryLib, bool useMTSearch);
+  SpectraSTMzLibIndex(string idxFileName, ifstream* libFinPtr, double cacheRange, bool binaryLib, bool useMTSearch, SpectraSTMappedLibFile* mappedLib = NULL, unsigned long long cacheMemoryLimit = 0);
   
   virtual ~SpectraSTMzLibIndex();
   
@@ -83,8 +105,14 @@ public:
   virtual void writeToFile();
   virtual void readFromFile();	
   
-  // Retrieval method
+  // Retrieval methods
   void retrieve(vector<SpectraSTLibEntry*>& hits, double lowMz, double highMz, bool shortAnnotation = false);
+  void retrieve(vector<SpectraSTLibEntry*>& hits, vector<mzRange>& ranges, bool shortAnnotation = false, mzLibRetrieveCounts* counts = NULL);
+  void release(double lowMz, double highMz);
+  void release(vector<mzRange>& ranges);
+  int getMaxCharge() { return (m_maxCharge); }
+  void setPreparedLib(SpectraSTPreparedLibFile* preparedLib) { m_preparedLib = preparedLib; }
+  void setPinUntilRelease(bool pinUntilRelease) { m_pinUntilRelease = pinUntilRelease; }
 
   // Sequential access method - the returned SpectraSTLibEntry object becomes property of caller!
   SpectraSTLibEntry* nextEntry();
@@ -100,40 +128,101 @@ public:
   bool nextSortedFileOffset(fstream::off_type& offset);
   SpectraSTLibEntry* thisSortedEntry();
   
+  // Access bin by bin, for a sweep over the library in m/z order. Bin b holds the entries getBinStart(b) to getBinStart(b + 1) - 1,
+  // counting in the order of getFileOrderOffsets().
+  unsigned int getNumBins() { return (m_binStarts.empty() ? 0 : (unsigned int)(m_binStarts.size()) - 1); }
+  unsigned int getBinStart(unsigned int bin) { return (m_binStarts[bin]); }
+  void getFileOrderOffsets(vector<fstream::off_type>& offsets);
+  unsigned int calcBinNumber(double mass);
+  
   void print();
   
   void printDotTimeProfiles(ofstream& fout);
   // void printDotHistograms(ofstream& fout);
   
+  static bool sortEntriesDesc(pair<fstream::off_type, double> a, pair<fstream::off_type, double> b);
+  
   static const double CACHE_ALL;
+  static const unsigned int NUM_CACHE_SHARDS;
+  static const unsigned int FORMAT_VERSION;
   
   
 private:
   
   
-  // m_offsets - The file offsets into the .splib file. Each bin is 1 m/z unit wide, and contains a list of file offsets that
-  // points to all entries of that m/z value in the .splib files.
-  vector< vector<fstream::off_type> > m_offsets;
+  // m_entryMzs, m_entryCharges, m_entryOffsets - the precursor m/z, charge and file offset into the .splib file of all entries,
+  // sorted by precursor m/z (then by file offset). An entry is referred to by its position in these arrays.
+  // (In creation mode, they are in the order the entries are inserted until written to the .spidx.)
+  vector<double> m_entryMzs;
+  vector<int> m_entryCharges;
+  vector<fstream::off_type> m_entryOffsets;
+  
+  // m_binStarts - the entries are also divided into bins 1 m/z unit wide; bin b holds the entries at positions
+  // m_binStarts[b] to m_binStarts[b + 1] - 1.
+  vector<unsigned int> m_binStarts;
+  
+  // m_fileOrder - the positions of all entries, bin by bin, and in the order they are in the .splib within each bin.
+  // This is the order of sequential access by nextEntry(). Only filled when needed. 
+  vector<unsigned int> m_fileOrder;
+  
+  // m_maxCharge - the highest charge of any entry
+  int m_maxCharge;
   
   // m_cache - The cache, pointers to 1 m/z-unit-wide bins of SpectraSTLibEntry's.
   // The cache is allocated for the entire m/z range, but at any given time, only a fraction
-  // of the bins are active. When a bin is active (in use), the pointer points to a vector of
-  // SpectraSTLibEntry's. When it is inactive, the pointer is NULL. 
+  // of the bins are active. When a bin is active (in use), the pointer points to a vector with a slot for each of
+  // the entries in the bin; entries are only read into their slots when retrieved, the other slots are NULL. 
+  // When it is inactive, the pointer is NULL. 
   vector<vector<SpectraSTLibEntry*>* > m_cache;
   
-  // m_cacheQueue - queue to remember which bin is created for the longest, which will be
-  // the first to be inactivated when the cache goes over capacity.
-  queue<unsigned int> m_cacheQueue;
+  // m_cacheLru, m_cacheLruPos - the active bins, the most recently used one first. The last one that is not in use
+  // is the first to be inactivated when the cache goes over capacity. m_cacheLruPos is where each active bin is in m_cacheLru.
+  list<unsigned int> m_cacheLru;
+  vector<list<unsigned int>::iterator> m_cacheLruPos;
   
+  // m_cacheBinBytes, m_cacheBytes - the (approximate) memory taken up by each active bin, and by all of them
+  vector<unsigned long long> m_cacheBinBytes;
+  unsigned long long m_cacheBytes;
+  
+  // m_cachePins - for a limited cache: the number of searches still using each bin. (In a single-threaded search, bins
+  // are only pinned while being retrieved; see release() for multi-threaded search.) A bin is only ever freed when no 
+  // search is using it.
+  vector<int> m_cachePins;
+  
+  // m_pinUntilRelease - single-threaded, limited cache: keep the bins pinned until release(), as in a multi-threaded
+  // search, instead of only while being retrieved. For searches in blocks (-s_BLK), which retrieve the candidates of
+  // all queries in the block before scoring any of them.
+  bool m_pinUntilRelease;
+  
+  // m_cacheMutex, m_cacheShardMutexes - to synchronize the cache in case of multi-threaded search with a limited cache:
+  // m_cacheMutex guards the bookkeeping (which bins are active, m_cacheLru, m_cacheBytes, m_cachePins), and 
+  // m_cacheShardMutexes[b % NUM_CACHE_SHARDS] the reading of bin b. All NULL (or empty) in a single-threaded search.
+  // (With the entire library cached, there is no lock: a bin read by a thread is published by an atomic 
+  // compare-and-swap of m_cache[b], see retrieve().)
 #ifdef MSVC
-  HANDLE m_libReadMutex;
+  HANDLE m_cacheMutex;
+  vector<HANDLE> m_cacheShardMutexes;
 #else
-  pthread_mutex_t* m_libReadMutex;
+  pthread_mutex_t* m_cacheMutex;
+  vector<pthread_mutex_t*> m_cacheShardMutexes;
 #endif
   
-  // m_cacheMutex - mutex to synchronize retrieval in case of multi-threaded search.
-  // Dynamically allocated so as not to waste memory in a single-thread search
-  // vector<pthread_mutex_t*>* m_cacheMutex; 
+  // m_threadLibFins, m_threadLibFinKey, m_threadLibFinMutex - in a multi-threaded search of a .splib not mapped into memory, 
+  // each thread reads through its own stream of the .splib (opened on first use, found by m_threadLibFinKey), so that 
+  // threads never wait for one another to seek and read. m_threadLibFinMutex only guards m_threadLibFins, which
+  // keeps the streams around for deletion. m_threadLibFinMutex is NULL if the streams are not used.
+  vector<ifstream*> m_threadLibFins;
+#ifdef MSVC
+  DWORD m_threadLibFinKey;
+  HANDLE m_threadLibFinMutex;
+#else
+  pthread_key_t m_threadLibFinKey;
+  pthread_mutex_t* m_threadLibFinMutex;
+#endif
+  
+  // m_preparedLib - the search-ready library spectra, if used. Retrieved entries found there come out already
+  // prepared for search. NOT a property of this class.
+  SpectraSTPreparedLibFile* m_preparedLib;
   
   // m_cacheSize - the current number of active bins	
   int m_cacheSize;
@@ -142,9 +231,12 @@ private:
   // than m_cacheCapacity, a bin of entries will be freed to maintain the cache size below capacity.
   int m_cacheCapacity;
   
-  // m_curBin, m_curOffset - indices into the m_offsets 2-D array. For sequential access using nextEntry()
-  unsigned int m_curBin;
-  int m_curOffset;
+  // m_cacheCapacityBytes - the maximum allowable memory taken up by the active bins (0 if not limited). If m_cacheBytes
+  // gets bigger than m_cacheCapacityBytes, bins of entries will be freed to bring it below capacity.
+  unsigned long long m_cacheCapacityBytes;
+  
+  // m_curEntry - index into m_fileOrder. For sequential access using nextEntry()
+  int m_curEntry;
 
   // m_sortedOffsets - vectors of sorted (by whatever criterion, Nreps is the only implemented so far) offsets
   vector<pair<fstream::off_type, double> >* m_sortedOffsets;
@@ -153,12 +245,30 @@ private:
   int m_curSortedOffset;
   
   // Private methods
+  typedef pair<pair<unsigned int, fstream::off_type>, SpectraSTLibEntry*> binnedEntry;
+  
   void initialize(bool useMTSearch);
+  void readFromTextFile(ifstream& idxFin);
+  void rebuildFromLibFile();
+  void sortEntries();
+  void sortFileOrder();
+  void retrieveRanges(vector<SpectraSTLibEntry*>& entries, vector<mzRange>& ranges, bool wholeBins, bool shortAnnotation, mzLibRetrieveCounts* counts);
+  void retrieveBin(vector<binnedEntry>& hits, unsigned int bin, unsigned int first, unsigned int last, int charge, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts);
+  unsigned long long readCacheBinEntries(unsigned int bin, unsigned int first, unsigned int last, int charge, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts);
+  SpectraSTLibEntry* readCacheEntry(unsigned int pos, bool shortAnnotation, ifstream* libFin, mzLibRetrieveCounts* counts);
+  bool isChargeMatched(unsigned int pos, int charge);
   void freeCacheBin(unsigned int bin);
-  unsigned int calcBinNumber(double mass);
+  ifstream* getThreadLibFin();
+  void activateCacheBin(unsigned int bin);
+  void evictCacheBins();
+  void lockCache();
+  void unlockCache();
+  void lockCacheShard(unsigned int bin);
+  void unlockCacheShard(unsigned int bin);
   unsigned int calcBinMz(unsigned int binNum);
   
-  static bool sortEntriesDesc(pair<fstream::off_type, double> a, pair<fstream::off_type, double> b);
+  static const char MAGIC[8];
+  static const unsigned int HEADER_SIZE;
   
 };
 
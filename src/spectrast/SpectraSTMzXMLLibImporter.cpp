@@ -1,5 +1,7 @@
 #include "SpectraSTMzXMLLibImporter.hpp"
 #include "SpectraSTReplicates.hpp"
+#include "SpectraSTScanPrefetcher.hpp"
+#include "SpectraSTConstants.hpp"
 #include "SpectraSTLog.hpp"
 #include "FileUtils.hpp"
 #include "Peptide.hpp"
@@ -161,6 +163,33 @@ void SpectraSTMzXMLLibImporter::readFromFile(string& impFileName) {
   m_numImportedInFile = 0;
   m_numConsensusInFile = 0;
   m_numBadConsensusInFile = 0;
+  
+  // with -c_SCN, the scan headers are taken from the .spscan file next to the mzXML file (created the first time)
+  SpectraSTScanHeaderIndex* headerIndex = NULL;
+  if (m_params.useScanHeaderIndex) {
+    headerIndex = new SpectraSTScanHeaderIndex(impFileName);
+    headerIndex->load(cramp, numScans);
+  }
+  
+  // with -c_PRF, the scans are read ahead, in order, by background threads. They only read the peak lists of the
+  // scans that will be imported (by the checks below). If the headers are known already, only those scans are added.
+  SpectraSTScanPrefetcher* prefetcher = NULL;
+  if (m_params.numPrefetchThreads > 0) {
+    vector<string> prefetchFileNames(1, impFileName);
+    prefetcher = new SpectraSTScanPrefetcher(prefetchFileNames, m_params.numPrefetchThreads, 
+					     m_params.numPrefetchThreads * MAX_NUM_PREFETCHED_SCANS_PER_THREAD, true);
+    for (int k = 1; k <= numScans; k++) {
+      if (!headerIndex) {
+	prefetcher->add(0, k, true);
+      } else {
+	scanHeaderRecord header;
+	if (headerIndex->getScanHeader(k, header) && header.scanNum == k && header.msLevel != 1) {
+	  prefetcher->add(0, k, false);
+	}
+      }
+    }
+    prefetcher->start();
+  }
       
   for (int k = 1; k <= numScans; k++) {	
 	
@@ -168,29 +197,52 @@ void SpectraSTMzXMLLibImporter::readFromFile(string& impFileName) {
 
     // get the scan header (no peak list) first to check whether it's MS2. 
     // it'd be a waste of time if we read all scans, including MS1
-    rampScanInfo* scanInfo = cramp->getScanHeaderInfo(k);			
+    scanHeaderRecord header;
+    bool isFound = false;
+    rampPeakList* peaks = NULL;
+    if (headerIndex) {
+      isFound = headerIndex->getScanHeader(k, header);
+    } else if (prefetcher) {
+      prefetchedScan scan;
+      prefetcher->next(scan);
+      isFound = SpectraSTScanHeaderIndex::makeScanHeader(scan.scanInfo, header);
+      if (scan.scanInfo) delete (scan.scanInfo);
+      peaks = scan.peaks;
+    } else {
+      isFound = SpectraSTScanHeaderIndex::readScanHeader(cramp, k, header);
+    }
 
     // check to make sure the scan is good, and is not MS1	
-    if (!scanInfo || (scanInfo->m_data.acquisitionNum != k)) {
+    if (!isFound || (header.scanNum != k)) {
       m_numMissingInFile++;          
-          
-      if (scanInfo) delete (scanInfo);
       continue;
     }
 	
-    if (scanInfo->m_data.msLevel == 1) {
+    if (header.msLevel == 1) {
       m_numMS1InFile++;
-      delete (scanInfo);
       continue;
     }
+    
+    // the prefetcher only has the scans that get this far, if the headers are known already
+    if (headerIndex && prefetcher) {
+      prefetchedScan scan;
+      prefetcher->next(scan);
+      peaks = scan.peaks;
+    }
           
     // now we can import
-    importOne(cramp, scanInfo, fn.name);
-    // done, can delete scanInfo
-    delete scanInfo;
+    importOne(cramp, header, fn.name, peaks);
 	
   }		
   
+  if (prefetcher) {
+    delete (prefetcher);
+  }
+  
+  if (headerIndex) {
+    delete (headerIndex);
+  }
+  
   // flush out last remaining clusters
   for (map<double, vector<SpectraSTLibEntry*>* >::iterator i = m_clusters.begin(); i != m_clusters.end(); i++) {
     formConsensusEntry(i->second);
@@ -213,10 +265,10 @@ void SpectraSTMzXMLLibImporter::readFromFile(string& impFileName) {
   delete (cramp);
 }
   
-// import - reads one MS2 spectrum  
-void SpectraSTMzXMLLibImporter::importOne(cRamp* cramp, rampScanInfo* scanInfo, string& prefix) {
+// import - reads one MS2 spectrum. The peaks may have been read already (by the prefetcher); they are deleted here.
+void SpectraSTMzXMLLibImporter::importOne(cRamp* cramp, scanHeaderRecord& header, string& prefix, rampPeakList* peaks) {
   
-  unsigned int scanNum = scanInfo->m_data.acquisitionNum;
+  unsigned int scanNum = header.scanNum;
   
   stringstream namess;
   namess << '_' << prefix << '_';
@@ -225,22 +277,21 @@ void SpectraSTMzXMLLibImporter::importOne(cRamp* cramp, rampScanInfo* scanInfo,
   namess << right << scanNum;
   
   // Go back to the mzXML file and get the peaks using Ramp
-  rampPeakList* peaks = cramp->getPeakList(scanNum);
+  if (!peaks) peaks = cramp->getPeakList(scanNum);
   if (!peaks) {
     m_numFailedFilterInFile++;
     return;
   }
   
   int peakCount = peaks->getPeakCount();
-  double precursorMz = scanInfo->m_data.precursorMZ;
-  int precursorCharge = scanInfo->m_data.precursorCharge;
+  double precursorMz = header.precursorMz;
+  int precursorCharge = header.precursorCharge;
   if (precursorCharge < 1) precursorCharge = 0;
-  double retentionTime = scanInfo->getRetentionTimeSeconds();
-  double precursorIntensity = scanInfo->m_data.precursorIntensity;
-  double totIonCurrent = scanInfo->m_data.totIonCurrent;
+  double retentionTime = header.retentionTime;
+  double precursorIntensity = header.precursorIntensity;
+  double totIonCurrent = header.totIonCurrent;
   
-  string fragType("");
-  if (scanInfo->m_data.activationMethod) fragType = scanInfo->m_data.activationMethod;
+  string fragType(header.activationMethod);
   
   if (!(m_params.setFragmentation.empty())) {
     // allow override of frag type if the user explicitly specifies it
@@ -2,6 +2,7 @@
 #define SPECTRASTMZXMLLIBIMPORTER_HPP_
 
 #include "SpectraSTLibImporter.hpp"
+#include "SpectraSTScanHeaderIndex.hpp"
 
 #ifdef STANDALONE_LINUX
 #include "SpectraST_cramp.hpp"
@@ -70,7 +71,7 @@ private:
   map<double, vector<SpectraSTLibEntry*>* > m_clusters;
   
   void readFromFile(string& impFileName);
-  void importOne(cRamp* cramp, rampScanInfo* scanInfo, string& prefix);
+  void importOne(cRamp* cramp, scanHeaderRecord& header, string& prefix, rampPeakList* peaks = NULL);
   void formConsensusEntry(vector<SpectraSTLibEntry*>* cluster);
 
 };
@@ -64,8 +64,12 @@ SpectraSTMzXMLSearchTask::SpectraSTMzXMLSearchTask(vector<string>& searchFileNam
   SpectraSTSearchTask(searchFileNames, params,lib),
   m_files(searchFileNames.size()),
   m_scans(),
+  m_scheduler(NULL),
+  m_pendingFileIndices(),
+  m_searchBlockSize(0),
+  m_block(),
   m_isMzData(false),
-  m_fingerprintMutex(NULL) {
+  m_fingerprintCounts(NULL) {
   
   char* rampExt = rampValidFileType(m_searchFileNames[0].c_str());
   if (strstri(rampExt, ".mzdata")) { // accommodates .mzdata.gz
@@ -73,22 +77,10 @@ SpectraSTMzXMLSearchTask::SpectraSTMzXMLSearchTask(vector<string>& searchFileNam
   }
   
   if (!(m_params.printFingerprintingSummary.empty())) {
-    
-#ifdef MSVC
-    m_fingerprintMutex = CreateMutex( 
-			    NULL,              // default security attributes
-			    FALSE,             // initially not owned
-			    NULL);             // unnamed mutex
-  
-    if (m_fingerprintMutex == NULL) {
-      printf("CreateMutex error: %d\n", (int)GetLastError());
-      exit(1);
-    }
-#else
-    m_fingerprintMutex = new pthread_mutex_t();
-    pthread_mutex_init(m_fingerprintMutex, NULL);
-#endif
- 
+    // one slot per search thread, so that the threads can record their top hits without locking.
+    // a search without a likely good hit is recorded as (number of lib entry + 1)
+    unsigned int numSlots = (m_params.numThreadsUsed > 1 ? (unsigned int)(m_params.numThreadsUsed) : 1);
+    m_fingerprintCounts = new SpectraSTFingerprintCounts(numSlots, m_lib->getMzLibIndexPtr()->getEntryCount() + 1);
   }
 }
 
@@ -96,15 +88,8 @@ SpectraSTMzXMLSearchTask::SpectraSTMzXMLSearchTask(vector<string>& searchFileNam
 // destructor - deletes the cRamp objects -- essentially closing the mzXML files too
 SpectraSTMzXMLSearchTask::~SpectraSTMzXMLSearchTask() {
   
-  if (m_fingerprintMutex) {
-    
-#ifdef MSVC
-    CloseHandle(m_fingerprintMutex);
-#else
-    pthread_mutex_destroy(m_fingerprintMutex);
-    delete (m_fingerprintMutex);
-#endif
-
+  if (m_fingerprintCounts) {
+    delete (m_fingerprintCounts);
   }
   
 }
@@ -113,19 +98,38 @@ SpectraSTMzXMLSearchTask::~SpectraSTMzXMLSearchTask() {
 // search - runs the searches
 void SpectraSTMzXMLSearchTask::search() {
 	
-  if (!m_params.indexCacheAll) {
+  if (!m_params.indexCacheAll || m_params.indexCacheMemoryMB > 0) {
     
     // Not caching all entries. In this case, the queries have to be sorted by precursor m/z first, such that
     // the cached window slides from low to high precursor m/z only once. (Otherwise, the cached entries will need to be swapped 
     // in and out repeatedly, defeating the purpose of caching.)
     
+    // In a multi-threaded search (only possible with the cache limited in memory), the sorted queries are farmed out to a pool 
+    // of worker threads. Since the queries in flight are few and adjacent in precursor m/z, the threads share one narrow
+    // window of cached entries that slides just the same. The results are printed in the sorted order, as in a single-threaded search.
+    // Neighboring queries then also share most of their candidates. With -s_BLK, they are searched in blocks that 
+    // compare each library entry to several queries in a row (see SpectraSTSearch::searchBlock).
+    m_searchBlockSize = m_params.searchBlockSize;
+    
+    unsigned int numThreads = (unsigned int)(m_params.numThreadsUsed);
+    if (numThreads > 1) {
+      cout << "Multi-threaded search: Using " << numThreads << " threads." << endl;
+      // room for two blocks per thread, so that the workers do not wait for the reader to fill the next one
+      unsigned int maxNumPendingPerThread = MAX_NUM_PENDING_QUERIES_PER_THREAD;
+      if (m_searchBlockSize * 2 > maxNumPendingPerThread) maxNumPendingPerThread = m_searchBlockSize * 2;
+      m_scheduler = new SpectraSTQueryScheduler(m_lib, numThreads, numThreads * maxNumPendingPerThread);
+    }
+    
     // There is a catch however. To be able to search out of order, one has to keep many mzXML files open, and most systems
     // have a max file opened limit. In such case, we will need to divide the mzXML files into smaller batches. The library will
     // will need to be read numBatches times, but the tradeoff is we won't need to keep all entries cached in memory by selecting
     // the indexCacheAll option.
     
-    // Divide the mzXML files into equal batches of at most MAX_NUM_OPEN_FILES files. 
-    unsigned int numBatches = ((unsigned int)m_searchFileNames.size() - 1) / MAX_NUM_OPEN_FILES + 1;
+    // Divide the mzXML files into equal batches of at most MAX_NUM_OPEN_FILES files. With -s_PRF, each prefetch thread
+    // opens the files of the batch too, so the batches are made smaller.
+    unsigned int maxNumFilesPerBatch = MAX_NUM_OPEN_FILES / (1 + m_params.numPrefetchThreads);
+    if (maxNumFilesPerBatch < 1) maxNumFilesPerBatch = 1;
+    unsigned int numBatches = ((unsigned int)m_searchFileNames.size() - 1) / maxNumFilesPerBatch + 1;
     unsigned int batchStart = 0;
     for (unsigned int b = 0; b < numBatches; b++) {
       m_batchBoundaries.push_back(batchStart);
@@ -150,15 +154,36 @@ void SpectraSTMzXMLSearchTask::search() {
       string msg("Searching");
       pc.start(msg);
     
+      // with -s_PRF, the peak lists are read ahead, in the sorted order, by background threads
+      SpectraSTScanPrefetcher* prefetcher = NULL;
+      if (m_params.numPrefetchThreads > 0) {
+        prefetcher = new SpectraSTScanPrefetcher(m_searchFileNames, m_params.numPrefetchThreads, 
+                                                 m_params.numPrefetchThreads * MAX_NUM_PREFETCHED_SCANS_PER_THREAD, !m_isMzData);
+        for (vector<pair<unsigned int, scanHeaderRecord> >::iterator i = m_scans.begin(); i != m_scans.end(); i++) {
+          prefetcher->add((*i).first, (*i).second.scanNum, false);
+        }
+        prefetcher->start();
+      }
+      
       // create searches from the m_scans one-by-one, and search them
-      for (vector<pair<unsigned int, rampScanInfo*> >::iterator i = m_scans.begin(); i != m_scans.end(); i++) {
+      for (vector<pair<unsigned int, scanHeaderRecord> >::iterator i = m_scans.begin(); i != m_scans.end(); i++) {
       
-        searchOneScan((*i).first, (*i).second);
+        rampPeakList* peaks = NULL;
+        if (prefetcher) {
+          prefetchedScan scan;
+          prefetcher->next(scan);
+          peaks = scan.peaks;
+        }
+        
+        searchOneScan((*i).first, (*i).second, -1, peaks);
         pc.increment();	
-      
-        // done. we can delete the rampScanInfo object now.
-        delete (*i).second;
       }	
+      m_scans.clear();
+      finishPendingSearches();
+      
+      if (prefetcher) {
+        delete (prefetcher);
+      }
       pc.done();
     
       
@@ -174,6 +199,11 @@ void SpectraSTMzXMLSearchTask::search() {
       
     } // for each batch
 
+    if (m_scheduler) {
+      delete (m_scheduler);
+      m_scheduler = NULL;
+    }
+    
     logSearchStats("MZXML SEARCH");
 
     
@@ -183,11 +213,6 @@ void SpectraSTMzXMLSearchTask::search() {
     // by precursor m/z before searching. We simply open the files one by one and search the queries
     // in the order they are read.
     
-    // Fingerprinting    
-    m_searchFingerprintIndexedByLibID.assign(m_lib->getMzLibIndexPtr()->getEntryCount() + 1, 0);
-    m_searchFingerprintIndexedBySearchID.assign(99999999, 0);
-    // END Fingerprinting
-    
     unsigned int numThreads = (unsigned int)(m_params.numThreadsUsed);
     
     if (numThreads > 1) {
@@ -390,6 +415,34 @@ void SpectraSTMzXMLSearchTask::searchOneFile(unsigned int fileIndex, int threadI
   //  cerr << "After start " << threadIndex << " = " << pthread_self() << endl;
     
   stats->m_numScans = numScans;
+  
+  // with -s_SCN, the scan headers are taken from the .spscan file next to the mzXML file (created the first time)
+  SpectraSTScanHeaderIndex* headerIndex = NULL;
+  if (m_params.useScanHeaderIndex) {
+    headerIndex = new SpectraSTScanHeaderIndex(m_searchFileNames[fileIndex]);
+    headerIndex->load(cramp, numScans);
+  }
+  
+  // with -s_PRF, the selected scans are read ahead, in order, by background threads. They only read the peak lists of the
+  // scans that will be searched (by the checks below). If the headers are known already, only those scans are added.
+  SpectraSTScanPrefetcher* prefetcher = NULL;
+  if (m_params.numPrefetchThreads > 0) {
+    prefetcher = new SpectraSTScanPrefetcher(m_searchFileNames, m_params.numPrefetchThreads, 
+					     m_params.numPrefetchThreads * MAX_NUM_PREFETCHED_SCANS_PER_THREAD, !m_isMzData);
+    for (int k = 1; k <= numScans; k++) {
+      if (m_searchAll || isInSelectedList(SpectraSTQuery::constructQueryTPPStyle(fn.name, k, k, 0))) {
+	if (!headerIndex) {
+	  prefetcher->add(fileIndex, k, true);
+	} else {
+	  scanHeaderRecord header;
+	  if (headerIndex->getScanHeader(k, header) && (m_isMzData || header.scanNum == k) && header.msLevel != 1) {
+	    prefetcher->add(fileIndex, header.scanNum, false);
+	  }
+	}
+      }
+    }
+    prefetcher->start();
+  }
  
   for (int k = 1; k <= numScans; k++) {	
     
@@ -405,29 +458,52 @@ void SpectraSTMzXMLSearchTask::searchOneFile(unsigned int fileIndex, int threadI
     }
     // get the scan header (no peak list) first to check whether it's MS2. 
     // it'd be a waste of time if we read all scans, including MS1
-    rampScanInfo* scanInfo = cramp->getScanHeaderInfo(k);			
+    scanHeaderRecord header;
+    bool isFound = false;
+    rampPeakList* peaks = NULL;
+    if (headerIndex) {
+      isFound = headerIndex->getScanHeader(k, header);
+    } else if (prefetcher) {
+      prefetchedScan scan;
+      prefetcher->next(scan);
+      isFound = SpectraSTScanHeaderIndex::makeScanHeader(scan.scanInfo, header);
+      if (scan.scanInfo) delete (scan.scanInfo);
+      peaks = scan.peaks;
+    } else {
+      isFound = SpectraSTScanHeaderIndex::readScanHeader(cramp, k, header);
+    }
     
     // check to make sure the scan is good, and is not MS1	
-    if (!scanInfo || (!m_isMzData && scanInfo->m_data.acquisitionNum != k)) {
+    if (!isFound || (!m_isMzData && header.scanNum != k)) {
       stats->m_numMissing++;          
-      
-      if (scanInfo) delete (scanInfo);
       continue;
     }
     
-    if (scanInfo->m_data.msLevel == 1) {
+    if (header.msLevel == 1) {
       stats->m_numMS1++;
-      delete (scanInfo);
       continue;
     }
     
+    // the prefetcher only has the scans that get this far, if the headers are known already
+    if (headerIndex && prefetcher) {
+      prefetchedScan scan;
+      prefetcher->next(scan);
+      peaks = scan.peaks;
+    }
+    
     // now we can search
-    searchOneScan(fileIndex, scanInfo);
-    // done, can delete scanInfo
-    delete scanInfo;
+    searchOneScan(fileIndex, header, threadIndex, peaks);
     
   }	
   
+  if (prefetcher) {
+    delete (prefetcher);
+  }
+  
+  if (headerIndex) {
+    delete (headerIndex);
+  }
+  
   if (threadIndex == -1) {
     pc.done();
   } else {
@@ -529,6 +605,13 @@ void SpectraSTMzXMLSearchTask::prepareSortedSearch(unsigned int batch) {
       
     stats->m_numScans += numScans;
       
+    // with -s_SCN, the scan headers are taken from the .spscan file next to the mzXML file (created the first time)
+    SpectraSTScanHeaderIndex* headerIndex = NULL;
+    if (m_params.useScanHeaderIndex) {
+      headerIndex = new SpectraSTScanHeaderIndex(m_searchFileNames[n]);
+      headerIndex->load(cramp, numScans);
+    }
+    
     // Read all scan headers into memory (excluding the peak lists to save memory)
     for (int k = 1; k <= numScans; k++) {	
 	
@@ -538,33 +621,39 @@ void SpectraSTMzXMLSearchTask::prepareSortedSearch(unsigned int batch) {
         stats->m_numNotSelected++;
         continue;	
       }
-      rampScanInfo* scanInfo = cramp->getScanHeaderInfo(k);	
+      
+      pair<unsigned int, scanHeaderRecord> ms;
+      ms.first = n;
+      bool isFound = false;
+      if (headerIndex) {
+        isFound = headerIndex->getScanHeader(k, ms.second);
+      } else {
+        isFound = SpectraSTScanHeaderIndex::readScanHeader(cramp, k, ms.second);
+      }
 	
-      if (!scanInfo || scanInfo->m_data.acquisitionNum != k) {
+      if (!isFound || ms.second.scanNum != k) {
         stats->m_numMissing++; 
 	  // the middle predicate is to deal with the case where RAMP returns a bogus scan when
 	  // given a nonexistent scan number -- this should become unnecessary eventually if cramp becomes smart enough
-        if (scanInfo) delete scanInfo;
         continue;
       } 
 	  
-      if (scanInfo->m_data.msLevel == 1) {
+      if (ms.second.msLevel == 1) {
         stats->m_numMS1++;
-        delete (scanInfo);
         continue;
       }
         
-        
-      pair<unsigned int, rampScanInfo*> ms;
-      ms.first = n;
-      ms.second = scanInfo;
       m_scans.push_back(ms);
 	
     }
+    
+    if (headerIndex) {
+      delete (headerIndex);
+    }
   }
     
     // sort all the MS2 scans by precursor m/z
-  sort(m_scans.begin(), m_scans.end(), SpectraSTMzXMLSearchTask::sortRampScanInfoPtrsByPrecursorMzAsc);
+  sort(m_scans.begin(), m_scans.end(), SpectraSTMzXMLSearchTask::sortScanHeadersByPrecursorMzAsc);
     
   // display DONE sorting message
   if (!g_quiet) {
@@ -579,28 +668,30 @@ void SpectraSTMzXMLSearchTask::prepareSortedSearch(unsigned int batch) {
 
 
 // searchOneScan - search one spectrum, specified by the cRamp object that points to that mzXML file,
-// and a rampScanInfo object that points to that scan.
-void SpectraSTMzXMLSearchTask::searchOneScan(unsigned int fileIndex, rampScanInfo* scanInfo) {
+// and the header of that scan. The peaks may have been read already (by the prefetcher).
+void SpectraSTMzXMLSearchTask::searchOneScan(unsigned int fileIndex, scanHeaderRecord& header, int threadIndex, rampPeakList* peaks) {
   
   cRamp* cramp = m_files[fileIndex].second;
   SpectraSTSearchTaskStats* stats = m_searchTaskStats[fileIndex];
   
- // cerr << "Searching scan #" << scanInfo->m_data.acquisitionNum << " of file #" << fileIndex << " by thread #" << pthread_self() << endl;
+  // for the search metrics, the time to read the peaks and construct the query
+  double readStart = SpectraSTSearchMetrics::now();
+  
+ // cerr << "Searching scan #" << header.scanNum << " of file #" << fileIndex << " by thread #" << pthread_self() << endl;
   
   // Go back to the mzxml file and get the peaks using Ramp
-  rampPeakList* peaks = cramp->getPeakList(scanInfo->m_data.acquisitionNum);
+  if (!peaks) peaks = cramp->getPeakList(header.scanNum);
   if (!peaks) {
     stats->m_numFailedFilter++;
     return;
   }
   
   int peakCount = peaks->getPeakCount();
-  double precursorMz = scanInfo->m_data.precursorMZ;
-  int precursorCharge = scanInfo->m_data.precursorCharge;
+  double precursorMz = header.precursorMz;
+  int precursorCharge = header.precursorCharge;
   if (precursorCharge < 1) precursorCharge = 0;
   
-  string fragType("");
-  if (scanInfo->m_data.activationMethod) fragType = scanInfo->m_data.activationMethod;
+  string fragType(header.activationMethod);
   
   // create the peak list and read the peaks one-by-one
   SpectraSTPeakList* peakList = new SpectraSTPeakList(precursorMz, precursorCharge, peakCount, false, fragType);
@@ -608,10 +699,10 @@ void SpectraSTMzXMLSearchTask::searchOneScan(unsigned int fileIndex, rampScanInf
 
   // construct the query
   string prefix = m_files[fileIndex].first.name;
-  int scanNum = scanInfo->m_data.acquisitionNum;
+  int scanNum = header.scanNum;
   SpectraSTQuery* query = new SpectraSTQuery(prefix, scanNum, scanNum, precursorMz, precursorCharge, "", peakList);
  
-  query->setRetentionTime(scanInfo->getRetentionTimeSeconds());
+  query->setRetentionTime(header.retentionTime);
   
   for (int j = 0; j < peakCount; j++) {
     double mz = peaks->getPeak(j)->mz;
@@ -641,8 +732,8 @@ void SpectraSTMzXMLSearchTask::searchOneScan(unsigned int fileIndex, rampScanInf
   
   int possibleChargeCount = 0;
   int ch = 1;
-  while (possibleChargeCount < scanInfo->m_data.numPossibleCharges) {
-    while (ch < 8 && !(scanInfo->m_data.possibleChargesArray[ch])) ch++;
+  while (possibleChargeCount < header.numPossibleCharges) {
+    while (ch < 8 && !(header.possibleCharges & (1 << ch))) ch++;
     if (ch >= 8) break;
     query->addPossibleCharge(ch);
     possibleChargeCount++;
@@ -651,22 +742,112 @@ void SpectraSTMzXMLSearchTask::searchOneScan(unsigned int fileIndex, rampScanInf
     
   // create the Search object and search!  
   SpectraSTSearch* s = new SpectraSTSearch(query, m_params, m_outputs[fileIndex]);
-  s->search(m_lib);
+  s->getMetricsSampleRef().endStage(SpectraSTSearchMetrics::READ_QUERY, readStart);
+  
+  if (m_searchBlockSize > 1) {
+    // hold the search for the block. The block is searched first if it is full, or if this query's precursor m/z window 
+    // does not overlap that of the first query in the block (the queries come sorted by precursor m/z).
+    if (!m_block.empty() && 
+        (m_block.size() >= m_searchBlockSize || precursorMz - m_block[0].second->m_query->getPrecursorMz() > 2.0 * m_params.precursorMzTolerance)) {
+      searchQueryBlock();
+    }
+    m_block.push_back(pair<unsigned int, SpectraSTSearch*>(fileIndex, s));
+    
+  } else if (m_scheduler) {
+    // multi-threaded: hand the search to the worker threads, and finish whatever is done (in order)
+    while (m_scheduler->isFull()) {
+      finishScheduledSearch(m_scheduler->retrieve(true));
+    }
+    m_scheduler->submit(s);
+    m_pendingFileIndices.push_back(fileIndex);
+    while ((s = m_scheduler->retrieve(false))) {
+      finishScheduledSearch(s);
+    }
+  } else {
+    s->search(m_lib);
+    finishSearch(s, fileIndex, threadIndex);
+  }
+  
+}
+
+// finishSearch - keeps stats and prints the result of one finished search
+void SpectraSTMzXMLSearchTask::finishSearch(SpectraSTSearch* s, unsigned int fileIndex, int threadIndex) {
+  
+  SpectraSTSearchTaskStats* stats = m_searchTaskStats[fileIndex];
+  
   stats->m_numSearched++;
   
-  if (!m_params.printFingerprintingSummary.empty()) {
-    updateFingerprint(s);
+  if (m_fingerprintCounts) {
+    updateFingerprint(s, threadIndex);
   }     
     
   // m_searchCount++;    // NOTE: Due to multithreading, this needs mutex. Comment out for efficiency. m_searchCount will be computed by summing m_numSearchedInFile[].
   
   stats->processSearchResult(s); 
   
+  double printStart = SpectraSTSearchMetrics::now();
   s->print();
+  stats->m_metrics.addStageTime(SpectraSTSearchMetrics::OUTPUT, SpectraSTSearchMetrics::now() - printStart);
   delete s;
   
 }
 
+// finishScheduledSearch - finishes a search retrieved from the worker threads. They come back in the order submitted,
+// so it belongs to the file at the front of m_pendingFileIndices.
+void SpectraSTMzXMLSearchTask::finishScheduledSearch(SpectraSTSearch* s) {
+  
+  unsigned int fileIndex = m_pendingFileIndices.front();
+  m_pendingFileIndices.pop_front();
+  
+  finishSearch(s, fileIndex, -1);
+}
+
+// finishPendingSearches - searches what is left in the block, waits for all searches handed to the worker threads 
+// to finish, and prints them
+void SpectraSTMzXMLSearchTask::finishPendingSearches() {
+  
+  searchQueryBlock();
+  
+  if (!m_scheduler) return;
+  
+  SpectraSTSearch* s = NULL;
+  while ((s = m_scheduler->retrieve(true))) {
+    finishScheduledSearch(s);
+  }
+}
+
+// searchQueryBlock - searches the block of held searches together (on the worker threads, if any), and finishes them in order
+void SpectraSTMzXMLSearchTask::searchQueryBlock() {
+  
+  if (m_block.empty()) return;
+  
+  vector<SpectraSTSearch*> searches;
+  for (vector<pair<unsigned int, SpectraSTSearch*> >::iterator i = m_block.begin(); i != m_block.end(); i++) {
+    searches.push_back(i->second);
+  }
+  
+  if (m_scheduler) {
+    while (!(m_scheduler->hasRoomFor((unsigned int)(searches.size())))) {
+      finishScheduledSearch(m_scheduler->retrieve(true));
+    }
+    m_scheduler->submitBlock(searches);
+    for (vector<pair<unsigned int, SpectraSTSearch*> >::iterator i = m_block.begin(); i != m_block.end(); i++) {
+      m_pendingFileIndices.push_back(i->first);
+    }
+    SpectraSTSearch* s = NULL;
+    while ((s = m_scheduler->retrieve(false))) {
+      finishScheduledSearch(s);
+    }
+  } else {
+    SpectraSTSearch::searchBlock(searches, m_lib);
+    for (vector<pair<unsigned int, SpectraSTSearch*> >::iterator i = m_block.begin(); i != m_block.end(); i++) {
+      finishSearch(i->second, i->first, -1);
+    }
+  }
+  
+  m_block.clear();
+}
+
 // Fingerprinting
 void SpectraSTMzXMLSearchTask::printFingerprintingSummary() {
 
@@ -681,6 +862,13 @@ void SpectraSTMzXMLSearchTask::printFingerprintingSummary() {
   SpectraSTLibEntry* tempEntry = NULL;
   map<string, pair<unsigned int, unsigned int> > samples;
   
+  // merge the top hits recorded by all search threads. the last element counts the searches without a likely good hit
+  unsigned int noHitLibId = m_lib->getMzLibIndexPtr()->getEntryCount() + 1;
+  m_searchFingerprintIndexedByLibID.assign(noHitLibId + 1, 0);
+  m_fingerprintCounts->mergeCounts(m_searchFingerprintIndexedByLibID);
+  m_searchFingerprintIndexedBySearchID.clear();
+  m_fingerprintCounts->mergeTopHits(m_searchFingerprintIndexedBySearchID);
+  
   m_lib->getMzLibIndexPtr()->reset();
   
   while (tempEntry = m_lib->getMzLibIndexPtr()->nextEntry()) {
@@ -744,7 +932,12 @@ void SpectraSTMzXMLSearchTask::printFingerprintingSummary() {
 
 void SpectraSTMzXMLSearchTask::calcFingerprint(bool printFingerprint, ofstream& fingerprintFout) {
  
-  vector<vector<float> > libFP = m_lib->getFingerprint();
+  vector<vector<float> >& libFP = m_lib->getFingerprint();
+  
+  if (libFP.empty()) {
+    // no sample information in library, nothing to compare against
+    return;
+  }
   
   vector<float> dot, dot_sqrt, dot_binary, dot_unique, dot_unique_sqrt, spectralCount, spectralCount_unique, sq, sq_sqrt, sq_unique, sq_unique_sqrt, libSize, libSum, sqItself_unique, sqItself_unique_sqrt;
   dot.assign(libFP.size(), 0);
@@ -914,65 +1107,35 @@ void SpectraSTMzXMLSearchTask::calcFingerprint(bool printFingerprint, ofstream&
 
 void SpectraSTMzXMLSearchTask::doBootstrapping() {
 
-  m_searchFingerprintIndexedByLibID.assign(m_lib->getMzLibIndexPtr()->getEntryCount(), 0);
+  m_searchFingerprintIndexedByLibID.assign(m_lib->getMzLibIndexPtr()->getEntryCount() + 2, 0);
+  
+  unsigned int numSearches = (unsigned int)(m_searchFingerprintIndexedBySearchID.size());
+  if (numSearches == 0) return;
   
-  for (int count = 0; count < m_searchCount; count++) {
+  for (unsigned int count = 0; count < numSearches; count++) {
     
-    unsigned int randomSearchID = (unsigned int)((double)rand() / (double)RAND_MAX * (double)(m_searchCount));
+    unsigned int randomSearchID = (unsigned int)((double)rand() / (double)RAND_MAX * (double)(numSearches));
+    if (randomSearchID >= numSearches) randomSearchID = numSearches - 1;
     
-    m_searchFingerprintIndexedByLibID[(unsigned int)(m_searchFingerprintIndexedBySearchID[randomSearchID])]++;
+    m_searchFingerprintIndexedByLibID[m_searchFingerprintIndexedBySearchID[randomSearchID]]++;
     
   }
   
 }
 
-void SpectraSTMzXMLSearchTask::updateFingerprint(SpectraSTSearch* s) {
+// updateFingerprint - records the top hit of a finished search into the slot of the search thread (threadIndex = -1 means single-threaded)
+void SpectraSTMzXMLSearchTask::updateFingerprint(SpectraSTSearch* s, int threadIndex) {
 
-  if (m_fingerprintMutex) {
-#ifdef MSVC
-      WaitForSingleObject(m_fingerprintMutex,    // handle to mutex
-			  INFINITE);      //#include "windows.h"
-#else
-      pthread_mutex_lock(m_fingerprintMutex);
-#endif     
-
-    }
-       
-    m_searchCount++;   
-    if (s->isLikelyGood()) {
-      //1. spectral counts
-      m_searchFingerprintIndexedByLibID[s->getTopHit()->getLibId()]++;  
-      m_searchFingerprintIndexedBySearchID[m_searchCount - 1] = s->getTopHit()->getLibId();
+  m_fingerprintCounts->add(threadIndex >= 0 ? (unsigned int)threadIndex : 0, s);
   
-     
-      //    cerr << "libid: " << candidates[0]->getEntry()->getLibId() << " query: " << queryName << " dot: " << candidates[0]->getSimScoresRef().dot 
-      //    << " delta: " << candidates[0]->getSimScoresRef().delta << " dotBias: " << candidates[0]->getSimScoresRef().dotBias 
-      //    << " mzDiff: " << candidates[0]->getSimScoresRef().precursorMzDiff << endl;
-   
-      //2. precursorIntensity
-      //    m_searchFingerprintIndexedByLibID[candidates[0]->getEntry()->getLibId()] += query->getPrecursorIntensity();
-      // log_transform
-      //if (query->getPrecursorIntensity()!=0){m_searchFingerprintIndexedByLibID[candidates[0]->getEntry()->getLibId()] += log2(query->getPrecursorIntensity());}
-    } else {
-      m_searchFingerprintIndexedBySearchID[m_searchCount - 1] = m_lib->getMzLibIndexPtr()->getEntryCount()+1;
-    }    
-
-    if (m_fingerprintMutex) {
-#ifdef MSVC
-      ReleaseMutex(m_fingerprintMutex);      //#include "windows.h"
-#else
-      pthread_mutex_unlock(m_fingerprintMutex);//#include <pthread.h>
-#endif
-    }
-    
 }
 
 
 
-// sortRampScanInfoPtrsByPrecursorMzAsc - comparison function used by sort() to sort rampScanInfo pointers
+// sortScanHeadersByPrecursorMzAsc - comparison function used by sort() to sort scan headers
 // by precursor m/z
-bool SpectraSTMzXMLSearchTask::sortRampScanInfoPtrsByPrecursorMzAsc(pair<unsigned int, rampScanInfo*> a, pair<unsigned int, rampScanInfo*> b) {
+bool SpectraSTMzXMLSearchTask::sortScanHeadersByPrecursorMzAsc(const pair<unsigned int, scanHeaderRecord>& a, const pair<unsigned int, scanHeaderRecord>& b) {
   
-  return (a.second->m_data.precursorMZ < b.second->m_data.precursorMZ);
+  return (a.second.precursorMz < b.second.precursorMz);
 }
 
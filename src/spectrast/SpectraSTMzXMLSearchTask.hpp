@@ -5,6 +5,10 @@
 #include "SpectraSTSearchParams.hpp"
 #include "SpectraSTLib.hpp"
 #include "FileUtils.hpp"
+#include "SpectraSTQueryScheduler.hpp"
+#include "SpectraSTFingerprintCounts.hpp"
+#include "SpectraSTScanPrefetcher.hpp"
+#include "SpectraSTScanHeaderIndex.hpp"
 
 #ifdef STANDALONE_LINUX
 #include "SpectraST_cramp.hpp"
@@ -15,6 +19,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
 
 #ifdef __MINGW__
 #define MSVC
@@ -86,8 +91,8 @@ private:
   // m_files - keeps the open files as tuples (fileName, cRamp*)
   vector<pair<FileName, cRamp*> > m_files;
   
-  // m_scans - all the scans to be searched, as (fileIndex, scanInfo*). 
-  vector<pair<unsigned int, rampScanInfo*> > m_scans;
+  // m_scans - all the scans to be searched, as (fileIndex, scan header). 
+  vector<pair<unsigned int, scanHeaderRecord> > m_scans;
   
   // m_batchBoundaries - the index boundaries of the batches. Say m_batchBoundaries contains 0, 9, 19, then
   // there are two batches, files 0 to 8, and files 9 to 18. The last number in m_batchBoundaries is the
@@ -101,27 +106,40 @@ private:
   void searchOneFile(unsigned int fileIndex, int threadIndex);
   
   // private method for searching one query
-  void searchOneScan(unsigned int fileIndex, rampScanInfo* scanInfo);
+  void searchOneScan(unsigned int fileIndex, scanHeaderRecord& header, int threadIndex, rampPeakList* peaks = NULL);
+  
+  // private methods for keeping stats and printing the result of finished searches
+  void finishSearch(SpectraSTSearch* s, unsigned int fileIndex, int threadIndex);
+  void finishScheduledSearch(SpectraSTSearch* s);
+  void finishPendingSearches();
+  void searchQueryBlock();
+  
+  // m_scheduler - pool of worker threads searching the sorted queries in parallel - NULL if single-threaded, or if 
+  // searching one file per thread (with the entire library cached)
+  SpectraSTQueryScheduler* m_scheduler;
+  
+  // m_pendingFileIndices - the files of the queries handed to m_scheduler but not yet finished, in the order submitted
+  deque<unsigned int> m_pendingFileIndices;
+  
+  // m_searchBlockSize, m_block - in a sorted search with -s_BLK, the searches held back, as (fileIndex, search), to be
+  // searched together as a block once there are m_searchBlockSize of them or the precursor m/z moves on (see searchOneScan)
+  unsigned int m_searchBlockSize;
+  vector<pair<unsigned int, SpectraSTSearch*> > m_block;
   
   // comparator method for sorting
-  static bool sortRampScanInfoPtrsByPrecursorMzAsc(pair<unsigned int, rampScanInfo*> a, pair<unsigned int, rampScanInfo*> b);
+  static bool sortScanHeadersByPrecursorMzAsc(const pair<unsigned int, scanHeaderRecord>& a, const pair<unsigned int, scanHeaderRecord>& b);
   
   bool m_isMzData;
   
    // Fingerprinting
-  vector<float> m_searchFingerprintIndexedByLibID; 
-  vector<float> m_searchFingerprintIndexedBySearchID; // Index starts with zero. If dot IsLikelyGood, the value is the matched libID; else, the value is (number of lib entry + 1)
+  SpectraSTFingerprintCounts* m_fingerprintCounts; // NULL unless fingerprinting summary is requested
+  vector<float> m_searchFingerprintIndexedByLibID; // only filled when printing the summary
+  vector<unsigned int> m_searchFingerprintIndexedBySearchID; // Index starts with zero. If dot IsLikelyGood, the value is the matched libID; else, the value is (number of lib entry + 1)
   vector<float> m_bootstrapSupport;  
   
-#ifdef MSVC
-  HANDLE m_fingerprintMutex;
-#else
-  pthread_mutex_t* m_fingerprintMutex;
-#endif
-  
   void printFingerprintingSummary();
   void calcFingerprint(bool doBootstrapping, ofstream& fout);
-  void updateFingerprint(SpectraSTSearch* s);
+  void updateFingerprint(SpectraSTSearch* s, int threadIndex);
   void doBootstrapping(); 
   // END Fingerprinting
 };
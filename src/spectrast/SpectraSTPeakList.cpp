@@ -3,13 +3,24 @@
 #include "SpectraSTLog.hpp"
 #include "SpectraSTDenoiser.hpp"
 #include "SpectraSTConstants.hpp"
+#include "SpectraSTDotKernel.hpp"
+#include "SpectraSTPreparedLibFile.hpp"
 #include "FileUtils.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <math.h>
+#include <string.h>
+#include <unordered_map>
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
 
 
 /*
@@ -58,6 +69,75 @@ extern SpectraSTLog* g_log;
 
 vector<double>* SpectraSTPeakList::poissonCutoffTable = NULL;
 
+// the table of all peak labels (see PeakLabel), the id of each label in it (keyed by the label in the table, so that
+// each label is only stored once), and the lock for adding to it
+struct peakLabelHash {
+  size_t operator()(const string* s) const { return (hash<string>()(*s)); }
+};
+struct peakLabelEqual {
+  bool operator()(const string* a, const string* b) const { return (*a == *b); }
+};
+string* PeakLabel::s_table[1 << (32 - PeakLabel::TABLE_CHUNK_BITS)];
+static unordered_map<const string*, unsigned int, peakLabelHash, peakLabelEqual> s_peakLabelIds;
+static unsigned int s_numPeakLabels = 0;
+#ifdef MSVC
+static HANDLE s_peakLabelMutex = CreateMutex(NULL, FALSE, NULL);
+#else
+static pthread_mutex_t s_peakLabelMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+bool PeakLabel::s_isTableInitialized = PeakLabel::initializeTable();
+
+// initializeTable - puts the empty label (id 0) and the single-character labels (ids 1 to 255) in the table
+bool PeakLabel::initializeTable() {
+  
+  if (!s_table[0]) {
+    s_table[0] = new string[TABLE_CHUNK_SIZE];
+    for (unsigned int c = 1; c < 256; c++) {
+      s_table[0][c].assign(1, (char)c);
+    }
+    s_numPeakLabels = 256;
+  }
+  return (true);
+}
+
+// intern - finds the id of a label, adding it to the table if it is not there yet
+unsigned int PeakLabel::intern(const string& s) {
+  
+  if (s.empty()) return (0);
+  if (s.length() == 1 && s[0] != '\0' && s_isTableInitialized) return ((unsigned char)(s[0]));
+  
+#ifdef MSVC
+  WaitForSingleObject(s_peakLabelMutex, INFINITE);
+#else
+  pthread_mutex_lock(&s_peakLabelMutex);
+#endif
+  
+  initializeTable();
+  
+  unsigned int id = 0;
+  unordered_map<const string*, unsigned int, peakLabelHash, peakLabelEqual>::iterator found = s_peakLabelIds.find(&s);
+  if (found != s_peakLabelIds.end()) {
+    id = found->second;
+  } else {
+    id = s_numPeakLabels++;
+    if (!s_table[id >> TABLE_CHUNK_BITS]) {
+      s_table[id >> TABLE_CHUNK_BITS] = new string[TABLE_CHUNK_SIZE];
+    }
+    string* label = &(s_table[id >> TABLE_CHUNK_BITS][id & (TABLE_CHUNK_SIZE - 1)]);
+    *label = s;
+    s_peakLabelIds[label] = id;
+  }
+  
+#ifdef MSVC
+  ReleaseMutex(s_peakLabelMutex);
+#else
+  pthread_mutex_unlock(&s_peakLabelMutex);
+#endif
+  
+  return (id);
+}
+
 // Constructor
 SpectraSTPeakList::SpectraSTPeakList(double parentMz, int parentCharge, unsigned int numPeaks, bool useBinIndex, string fragType) : 
   m_peaks() ,
@@ -81,6 +161,10 @@ SpectraSTPeakList::SpectraSTPeakList(double parentMz, int parentCharge, unsigned
   m_numAssignedPeaks(0),
   m_bins(NULL),
   m_binIndex(NULL),
+  m_packedBins(NULL),
+  m_packedBinIndex(NULL),
+  m_numPackedBins(0),
+  m_sketch(NULL),
   m_scaleMzPower(0.0), 
   m_scaleIntensityPower(1.0),
   m_scaleUnassignedFactor(1.0),
@@ -120,6 +204,10 @@ SpectraSTPeakList::SpectraSTPeakList(vector<SpectraSTPeakList*>& pls, Peptide* p
   m_numAssignedPeaks(0),
   m_bins(NULL),
   m_binIndex(NULL),
+  m_packedBins(NULL),
+  m_packedBinIndex(NULL),
+  m_numPackedBins(0),
+  m_sketch(NULL),
   m_scaleMzPower(0.0), 
   m_scaleIntensityPower(1.0),
   m_scaleUnassignedFactor(1.0),
@@ -166,6 +254,10 @@ SpectraSTPeakList::SpectraSTPeakList(Peptide* pep, string fragType) :
   m_numAssignedPeaks(0),
   m_bins(NULL),
   m_binIndex(NULL),
+  m_packedBins(NULL),
+  m_packedBinIndex(NULL),
+  m_numPackedBins(0),
+  m_sketch(NULL),
   m_scaleMzPower(0.0), 
   m_scaleIntensityPower(1.0),
   m_scaleUnassignedFactor(1.0),
@@ -182,6 +274,10 @@ SpectraSTPeakList::SpectraSTPeakList(SpectraSTPeakList& other) :
   m_peakMap(NULL),
   m_bins(NULL),
   m_binIndex(NULL),
+  m_packedBins(NULL),
+  m_packedBinIndex(NULL),
+  m_numPackedBins(0),
+  m_sketch(NULL),
   m_scaleMzPower(0.0), 
   m_scaleIntensityPower(1.0),
   m_scaleUnassignedFactor(1.0) {	
@@ -250,6 +346,26 @@ SpectraSTPeakList& SpectraSTPeakList::operator=(SpectraSTPeakList& other) {
     if (this->m_binIndex) delete (this->m_binIndex);
     this->m_binIndex = NULL;
   }
+  
+  if (this->m_packedBins) delete[] (this->m_packedBins);
+  if (this->m_packedBinIndex) delete[] (this->m_packedBinIndex);
+  this->m_packedBins = NULL;
+  this->m_packedBinIndex = NULL;
+  this->m_numPackedBins = other.m_numPackedBins;
+  if (other.m_packedBins) {
+    this->m_packedBins = new float[m_numPackedBins];
+    this->m_packedBinIndex = new unsigned short[m_numPackedBins];
+    for (unsigned int b = 0; b < m_numPackedBins; b++) {
+      this->m_packedBins[b] = other.m_packedBins[b];
+      this->m_packedBinIndex[b] = other.m_packedBinIndex[b];
+    }
+  }
+  
+  if (this->m_sketch) delete (this->m_sketch);
+  this->m_sketch = NULL;
+  if (other.m_sketch) {
+    this->m_sketch = new peakListSketch(*(other.m_sketch));
+  }
     
   return (*this);
 }
@@ -269,6 +385,15 @@ SpectraSTPeakList::~SpectraSTPeakList() {
   if (m_binIndex) {
     delete (m_binIndex);
   }
+  if (m_packedBins) {
+    delete[] (m_packedBins);
+  }
+  if (m_packedBinIndex) {
+    delete[] (m_packedBinIndex);
+  }
+  if (m_sketch) {
+    delete (m_sketch);
+  }
   
 }
 
@@ -427,10 +552,99 @@ void SpectraSTPeakList::writeToBinaryFile(ofstream& libFout) {
     
     libFout << i->annotation << endl;
     libFout << i->info << endl;
-    
+
   }
 }
+
+// writeToMappedFile - writes the peaks in the memory-mappable binary format, as four arrays: m/z's, intensities,
+// and the string table offsets of the annotations and the infos. The number of peaks is written by the caller.
+void SpectraSTPeakList::writeToMappedFile(ofstream& libFout, SpectraSTMappedLibFile& mappedLib) {
+
+  if (!m_isSortedByMz) {
+    sort(m_peaks.begin(), m_peaks.end(), SpectraSTPeakList::sortPeaksByMzAsc);
+    m_isSortedByMz = true;
+  }
+
+  vector<Peak>::iterator i;
+
+  for (i = m_peaks.begin(); i != m_peaks.end(); i++) {
+    libFout.write((char*)&(i->mz), sizeof(double));
+  }
+  for (i = m_peaks.begin(); i != m_peaks.end(); i++) {
+    libFout.write((char*)&(i->intensity), sizeof(float));
+  }
+  for (i = m_peaks.begin(); i != m_peaks.end(); i++) {
+    unsigned int annotation = mappedLib.addString(i->annotation);
+    libFout.write((char*)&(annotation), sizeof(unsigned int));
+  }
+  for (i = m_peaks.begin(); i != m_peaks.end(); i++) {
+    unsigned int info = mappedLib.addString(i->info);
+    libFout.write((char*)&(info), sizeof(unsigned int));
+  }
+
+}
 	
+// writePreparedToFile - writes the packed bins of a library spectrum prepared for search, as a record of the
+// search-ready library file (.spprep). Returns false (and writes nothing) if the bins are not packed.
+bool SpectraSTPeakList::writePreparedToFile(ofstream& prepFout) {
+
+  if (!m_isPreparedForSearch || !m_packedBins) {
+    return (false);
+  }
+
+  struct preparedLibRecord record;
+  record.binMagnitude = m_binMagnitude;
+  record.numBins = m_numBins;
+  record.numBinsPerMzUnit = m_numBinsPerMzUnit;
+  record.numPackedBins = m_numPackedBins;
+
+  prepFout.write((char*)(&record), sizeof(struct preparedLibRecord));
+  prepFout.write((char*)m_packedBins, m_numPackedBins * sizeof(float));
+  prepFout.write((char*)m_packedBinIndex, m_numPackedBins * sizeof(unsigned short));
+
+  return (true);
+
+}
+
+// readPreparedFromMappedFile - puts the packed bins of a record of the search-ready library file (.spprep) into
+// this peak list, which is then in the same state as after prepareForSearch() for a library spectrum.
+void SpectraSTPeakList::readPreparedFromMappedFile(const char* data) {
+
+  struct preparedLibRecord record;
+  memcpy(&record, data, sizeof(struct preparedLibRecord));
+
+  const float* bins = (const float*)(data + sizeof(struct preparedLibRecord));
+  const unsigned short* binIndex = (const unsigned short*)(bins + record.numPackedBins);
+
+  vector<Peak>().swap(m_peaks);
+
+  if (m_bins) delete (m_bins);
+  m_bins = NULL;
+  if (m_binIndex) delete (m_binIndex);
+  m_binIndex = NULL;
+  if (m_packedBins) delete[] (m_packedBins);
+  if (m_packedBinIndex) delete[] (m_packedBinIndex);
+
+  m_numPackedBins = record.numPackedBins;
+  m_packedBins = new float[m_numPackedBins];
+  m_packedBinIndex = new unsigned short[m_numPackedBins];
+  memcpy(m_packedBins, bins, m_numPackedBins * sizeof(float));
+  memcpy(m_packedBinIndex, binIndex, m_numPackedBins * sizeof(unsigned short));
+
+  m_binMagnitude = record.binMagnitude;
+  m_numBins = record.numBins;
+  m_numBinsPerMzUnit = record.numBinsPerMzUnit;
+
+  if (m_intensityRanked) delete (m_intensityRanked);
+  m_intensityRanked = NULL;
+
+  if (m_peakMap) delete (m_peakMap);
+  m_peakMap = NULL;
+
+  m_isPreparedForSearch = true;
+
+}
+
 // writeToDtaFile - similar to writeToFile, except that it won't write
 // the Num peak: header, nor the annotations. (The caller needs to write the MW and 
 // charge before calling this function.)
@@ -833,78 +1047,14 @@ double SpectraSTPeakList::calcDotTierwiseOpenModSearch(SpectraSTPeakList* other,
 // calcDotAndDotBias for more documentation.
 double SpectraSTPeakList::calcDot(SpectraSTPeakList* other) {
 
-  if ((!(this->m_bins)) || (!(other->m_bins))) {
+  if ((!(this->isBinned())) || (!(other->isBinned()))) {
     return (0.0);
   }	
   if (other->m_binMagnitude < 0.00001 || m_binMagnitude < 0.00001) {
     return (0.0);
   }
   
-  float d = 0.0;
-  float dot = 0.0;
-
-  if (!(this->m_binIndex) && (!(other->m_binIndex))) {
-  
-    vector<float>::iterator i;
-    vector<float>::iterator j;
-    for (i = this->m_bins->begin(), j = other->m_bins->begin(); 
-         i != this->m_bins->end() && j != other->m_bins->end();
-         i++, j++) {
-      d = (*i) * (*j);
-      dot += d;	 
-    }
-    
-  } else if ((!(this->m_binIndex)) && other->m_binIndex) {
-    
-    vector<float>::iterator j;
-    vector<unsigned int>::iterator jj;
-    
-    for (j = other->m_bins->begin(), jj = other->m_binIndex->begin(); 
-         j != other->m_bins->end() && jj != other->m_binIndex->end(); 
-         j++, jj++) {
-
-      d = (*j) * ((*(this->m_bins))[*jj]);
-      dot += d;        
-    }
-    
-  } else if (this->m_binIndex && (!(other->m_binIndex))) {
-     
-    vector<float>::iterator i;
-    vector<unsigned int>::iterator ii;
-    
-    for (i = this->m_bins->begin(), ii = this->m_binIndex->begin(); 
-         i != this->m_bins->end() && ii != this->m_binIndex->end(); 
-         i++, ii++) {
-
-           d = (*i) * ((*(other->m_bins))[*ii]);
-           dot += d;        
-         }
-    
-  } else {
-    
-    vector<float>::iterator i = this->m_bins->begin();
-    vector<unsigned int>::iterator ii = this->m_binIndex->begin();
-    vector<float>::iterator j = other->m_bins->begin();
-    vector<unsigned int>::iterator jj = other->m_binIndex->begin();
-    
-    while (ii != this->m_binIndex->end() && jj != other->m_binIndex->end()) {    
-      if (*ii == *jj) {
-        d = (*i) * (*j);
-        dot += d;
-        i++;
-        ii++;
-        j++;
-        jj++;
-      } else if (*ii < *jj) {
-        i++;
-        ii++;
-      } else {
-        j++;
-        jj++;
-      }
-    }
-  }
-         
+  float dot = calcBinsDot(other, NULL);
   
   // normalize to 1 by dividing by the magnitudes
   return ((double)(dot / (m_binMagnitude * other->m_binMagnitude)));	
@@ -915,7 +1065,7 @@ double SpectraSTPeakList::calcDot(SpectraSTPeakList* other) {
 // between the spectral vectors, and the dot bias. Note that the bins are dotted, not the individual peaks.
 double SpectraSTPeakList::calcDotAndDotBias(SpectraSTPeakList* other, double& dotBias) {
 		
-  if ((!(this->m_bins)) || (!(other->m_bins))) {
+  if ((!(this->isBinned())) || (!(other->isBinned()))) {
     dotBias = 0.0;
     return (0.0);
   }	
@@ -924,86 +1074,8 @@ double SpectraSTPeakList::calcDotAndDotBias(SpectraSTPeakList* other, double& do
     return (0.0);
   }
   
-  float d = 0.0;
-  float dot = 0.0;
   float sumDotSquares = 0.0;
-  
-  // 4 cases: either of the two peak lists can use binIndex or not
-  
-  if (!(this->m_binIndex) && (!(other->m_binIndex))) {
-    // both don't use a binIndex - easiest, just dot the corresponding bins 
-    
-    vector<float>::iterator i;
-    vector<float>::iterator j;
-    for (i = this->m_bins->begin(), j = other->m_bins->begin(); 
-         i != this->m_bins->end() && j != other->m_bins->end();
-         i++, j++) {
-    
-      d = (*i) * (*j);
-      dot += d;	 
-      sumDotSquares += d * d;
-    }
-    
-  } else if ((!(this->m_binIndex)) && other->m_binIndex) {
-    // other uses a binIndex. In this case, go down other->m_binIndex, and use
-    // the m/z indices to index into this's bins
-    
-    vector<float>::iterator j;
-    vector<unsigned int>::iterator jj;
-    
-    for (j = other->m_bins->begin(), jj = other->m_binIndex->begin(); 
-         j != other->m_bins->end() && jj != other->m_binIndex->end(); 
-         j++, jj++) {
-
-       d = (*j) * ((*(this->m_bins))[*jj]);
-       dot += d;        
-       sumDotSquares += d * d;
-    }
-    
-  } else if (this->m_binIndex && (!(other->m_binIndex))) {
-    // this uses a binIndex. In this case, go down this->m_binIndex, and use
-    // the m/z indices to index into other's bins
-     
-    
-    vector<float>::iterator i;
-    vector<unsigned int>::iterator ii;
-    
-    for (i = this->m_bins->begin(), ii = this->m_binIndex->begin(); 
-         i != this->m_bins->end() && ii != this->m_binIndex->end(); 
-         i++, ii++) {
-
-      d = (*i) * ((*(other->m_bins))[*ii]);
-      dot += d;        
-      sumDotSquares += d * d;
-    }
-    
-  } else {
-    // both uses a binIndex. Then have to do it the see-saw way...   
-    
-    vector<float>::iterator i = this->m_bins->begin();
-    vector<unsigned int>::iterator ii = this->m_binIndex->begin();
-    vector<float>::iterator j = other->m_bins->begin();
-    vector<unsigned int>::iterator jj = other->m_binIndex->begin();
-    
-    while (ii != this->m_binIndex->end() && jj != other->m_binIndex->end()) {    
-      if (*ii == *jj) {
-        d = (*i) * (*j);
-        dot += d;
-        sumDotSquares += d * d;
-
-        i++;
-        ii++;
-        j++;
-        jj++;
-      } else if (*ii < *jj) {
-        i++;
-        ii++;
-      } else {
-        j++;
-        jj++;
-      }
-    }
-  }
+  float dot = calcBinsDot(other, &sumDotSquares);
  
   // normalize to 1 by dividing by the magnitudes
   sumDotSquares /= (double)((m_binMagnitude * m_binMagnitude * other->m_binMagnitude * other->m_binMagnitude));
@@ -1016,6 +1088,134 @@ double SpectraSTPeakList::calcDotAndDotBias(SpectraSTPeakList* other, double& do
   return (dot);
 }
 
+// calcBinsDot - the unnormalized dot product of the bins of the two peak lists. If sumOfSquares is not NULL,
+// the sum of squares of the products is also returned through it. 4 cases: either of the two peak lists
+// can use binIndex or not (a packed peak list counts as one using binIndex). The loops themselves are
+// in SpectraSTDotKernel, which picks the fastest instruction set available.
+float SpectraSTPeakList::calcBinsDot(SpectraSTPeakList* other, float* sumOfSquares) {
+
+  if (sumOfSquares) *sumOfSquares = 0.0;
+
+  bool thisIsDense = (this->m_bins && !(this->m_binIndex));
+  bool otherIsDense = (other->m_bins && !(other->m_binIndex));
+
+  if (thisIsDense && otherIsDense) {
+    // both don't use a binIndex - easiest, just dot the corresponding bins
+
+    unsigned int numBins = (unsigned int)(this->m_bins->size() < other->m_bins->size() ? this->m_bins->size() : other->m_bins->size());
+    if (numBins == 0) return (0.0);
+    return (SpectraSTDotKernel::denseDense(&((*(this->m_bins))[0]), &((*(other->m_bins))[0]), numBins, sumOfSquares));
+
+  } else if (thisIsDense || otherIsDense) {
+    // one uses a binIndex. In this case, go down its binIndex, and use
+    // the m/z indices to index into the other's bins
+
+    SpectraSTPeakList* dense = (thisIsDense ? this : other);
+    SpectraSTPeakList* sparse = (thisIsDense ? other : this);
+
+    if (sparse->m_packedBins) {
+      if (sparse->m_numPackedBins == 0) return (0.0);
+      return (SpectraSTDotKernel::denseSparse(&((*(dense->m_bins))[0]), sparse->m_packedBins, sparse->m_packedBinIndex, sparse->m_numPackedBins, sumOfSquares));
+    }
+
+    if (sparse->m_bins->empty()) return (0.0);
+    return (SpectraSTDotKernel::denseSparse(&((*(dense->m_bins))[0]), &((*(sparse->m_bins))[0]), &((*(sparse->m_binIndex))[0]), (unsigned int)(sparse->m_bins->size()), sumOfSquares));
+
+  }
+
+  // both uses a binIndex. Then have to do it the see-saw way... Packed bin numbers are widened
+  // first; this doesn't happen in searching, where the query is never packed.
+
+  vector<unsigned int> thisWidened;
+  const float* thisBins = NULL;
+  const unsigned int* thisIndex = NULL;
+  unsigned int thisNumBins = 0;
+
+  if (this->m_packedBins) {
+    thisWidened.assign(this->m_packedBinIndex, this->m_packedBinIndex + this->m_numPackedBins);
+    thisBins = this->m_packedBins;
+    thisNumBins = this->m_numPackedBins;
+    if (thisNumBins > 0) thisIndex = &(thisWidened[0]);
+  } else if (!(this->m_bins->empty())) {
+    thisBins = &((*(this->m_bins))[0]);
+    thisIndex = &((*(this->m_binIndex))[0]);
+    thisNumBins = (unsigned int)(this->m_bins->size());
+  }
+
+  vector<unsigned int> otherWidened;
+  const float* otherBins = NULL;
+  const unsigned int* otherIndex = NULL;
+  unsigned int otherNumBins = 0;
+
+  if (other->m_packedBins) {
+    otherWidened.assign(other->m_packedBinIndex, other->m_packedBinIndex + other->m_numPackedBins);
+    otherBins = other->m_packedBins;
+    otherNumBins = other->m_numPackedBins;
+    if (otherNumBins > 0) otherIndex = &(otherWidened[0]);
+  } else if (!(other->m_bins->empty())) {
+    otherBins = &((*(other->m_bins))[0]);
+    otherIndex = &((*(other->m_binIndex))[0]);
+    otherNumBins = (unsigned int)(other->m_bins->size());
+  }
+
+  if (thisNumBins == 0 || otherNumBins == 0) return (0.0);
+  return (SpectraSTDotKernel::sparseSparse(thisBins, thisIndex, thisNumBins, otherBins, otherIndex, otherNumBins, sumOfSquares));
+
+}
+
+// packBins - for a library spectrum prepared for search. Library spectra stay in the cache and are compared
+// over and over, so their occupied bins are moved into two tight arrays (intensities and 16-bit bin numbers),
+// and the peaks are freed. The query, binned only once, stays dense, so that the dot product is simply
+// a gather of the query bins at the library's bin numbers.
+void SpectraSTPeakList::packBins() {
+
+  if (!m_bins) return;
+
+  vector<Peak>().swap(m_peaks); // clear() would keep the capacity
+
+  if (m_numBins > 65536) {
+    // bin numbers won't fit in 16 bits. Leave as is, just trim the vectors
+    vector<float>(*m_bins).swap(*m_bins);
+    if (m_binIndex) vector<unsigned int>(*m_binIndex).swap(*m_binIndex);
+    return;
+  }
+
+  if (m_binIndex) {
+
+    m_numPackedBins = (unsigned int)(m_bins->size());
+    m_packedBins = new float[m_numPackedBins];
+    m_packedBinIndex = new unsigned short[m_numPackedBins];
+    for (unsigned int b = 0; b < m_numPackedBins; b++) {
+      m_packedBins[b] = (*m_bins)[b];
+      m_packedBinIndex[b] = (unsigned short)((*m_binIndex)[b]);
+    }
+
+    delete (m_binIndex);
+    m_binIndex = NULL;
+
+  } else {
+
+    m_numPackedBins = 0;
+    for (vector<float>::iterator i = m_bins->begin(); i != m_bins->end(); i++) {
+      if (*i != 0.0) m_numPackedBins++;
+    }
+    m_packedBins = new float[m_numPackedBins];
+    m_packedBinIndex = new unsigned short[m_numPackedBins];
+    unsigned int p = 0;
+    for (unsigned int b = 0; b < (unsigned int)(m_bins->size()); b++) {
+      if ((*m_bins)[b] != 0.0) {
+	m_packedBins[p] = (*m_bins)[b];
+	m_packedBinIndex[p] = (unsigned short)b;
+	p++;
+      }
+    }
+  }
+
+  delete (m_bins);
+  m_bins = NULL;
+
+}
+
 // printPeaks - just cout all the peaks, for debugging only.
 void SpectraSTPeakList::printPeaks() {
 
@@ -1030,12 +1230,18 @@ void SpectraSTPeakList::printPeaks() {
 // printPeaks - just cout all the bins, for debugging only.
 void SpectraSTPeakList::printBins() {
 	
-  if (!m_bins) {
+  if (!isBinned()) {
     cout << "NOT BINNED!" << endl;
     return;
   }
   
-  if (m_binIndex) {
+  if (m_packedBins) {
+    
+    for (unsigned int b = 0; b < m_numPackedBins; b++) {
+      cout << m_packedBinIndex[b] << "\t" << calcBinMz((unsigned int)(m_packedBinIndex[b])) << "\t" << m_packedBins[b] << endl;
+    }
+    
+  } else if (m_binIndex) {
     vector<float>::iterator i;
     vector<unsigned int>::iterator ii;
   
@@ -1259,12 +1465,19 @@ bool SpectraSTPeakList::isNearPrecursor(double mz) {
 void SpectraSTPeakList::binPeaksWithScaling(double mzPower, double intensityPower, double unassignedFactor,
 		int numBinsPerMzUnit, double fractionToNeighbor, bool rebin, bool removePrecursor, double removeLightIonsMzCutoff) {
   
-  if (m_bins && !rebin) {
+  if (isBinned() && !rebin) {
     return;
   }
   if (m_bins) {
     delete (m_bins);
   }
+  if (m_packedBins) {
+    delete[] (m_packedBins);
+    delete[] (m_packedBinIndex);
+    m_packedBins = NULL;
+    m_packedBinIndex = NULL;
+    m_numPackedBins = 0;
+  }
   
   m_numBinsPerMzUnit = numBinsPerMzUnit;
   
@@ -1373,12 +1586,19 @@ void SpectraSTPeakList::binPeaksWithScaling(double mzPower, double intensityPowe
 // binPeaks - put peaks in bins. (ASSUMING ALREADY SCALED)
 void SpectraSTPeakList::binPeaks(int numBinsPerMzUnit, double fractionToNeighbor, bool rebin) {  
   
-  if (m_bins && !rebin) {
+  if (isBinned() && !rebin) {
     return;
   }
   if (m_bins) {
     delete (m_bins);
   }
+  if (m_packedBins) {
+    delete[] (m_packedBins);
+    delete[] (m_packedBinIndex);
+    m_packedBins = NULL;
+    m_packedBinIndex = NULL;
+    m_numPackedBins = 0;
+  }
   
   m_numBinsPerMzUnit = numBinsPerMzUnit;
   
@@ -2291,9 +2511,50 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
     alignMzAccuracy = 0.1;
   } 
 
-  // first, rank all peak lists by intensity
-  for (vector<SpectraSTPeakList*>::iterator pl = pls.begin(); pl != pls.end(); pl++) {
-    (*pl)->rankByIntensity();
+  // first, rank all peak lists by intensity. Only the top maxNumPeaks peaks of each are aligned. These peaks are kept in
+  // flat arrays, peak list by peak list (starting at listStarts[i]), in the order of rank: whether each is aligned already,
+  // and the number of replicates it stands for. For finding the peaks to align quickly, the peaks of each peak list are 
+  // also kept sorted by m/z, with their ranks.
+  vector<unsigned int> listStarts(pls.size() + 1, 0);
+  for (unsigned int i = 0; i < (unsigned int)(pls.size()); i++) {
+    pls[i]->rankByIntensity();
+    unsigned int plmax = (unsigned int)(pls[i]->m_intensityRanked->size()) > maxNumPeaks ? maxNumPeaks : (unsigned int)(pls[i]->m_intensityRanked->size());
+    listStarts[i + 1] = listStarts[i] + plmax;
+  }
+
+  // alignStatus - ' ' if not aligned, 'A' if aligned, 'S' if aligned and voted in (a signal)
+  vector<char> alignStatus(listStarts.back(), ' ');
+  vector<unsigned int> numReps(listStarts.back(), 1);
+  vector<pair<double, unsigned int> > mzSorted(listStarts.back());
+
+  for (unsigned int i = 0; i < (unsigned int)(pls.size()); i++) {
+
+    vector<Peak*>* ranked = pls[i]->m_intensityRanked;
+
+    for (unsigned int r = 0; r < listStarts[i + 1] - listStarts[i]; r++) {
+
+      Peak* peak = (*ranked)[r];
+      unsigned int pos = listStarts[i] + r;
+      mzSorted[pos] = pair<double, unsigned int>(peak->mz, r);
+
+      if (peak->info == "A" || peak->info == "S") {
+	// already aligned
+	alignStatus[pos] = peak->info[0];
+	continue;
+      }
+
+      // parse out the number of replicates used for this peak list
+      // this is in case the peak list is a previous consensus. in this case,
+      // it has to count more in the voting
+      if (!(peak->info.empty())) {
+	string::size_type slashPos = peak->info.find('/', 0);
+	if (slashPos != string::npos) {
+	  numReps[pos] = atoi((peak->info.substr(0, slashPos)).c_str());
+	}
+      }
+    }
+
+    sort(mzSorted.begin() + listStarts[i], mzSorted.begin() + listStarts[i + 1]);
   }
 	
   unsigned int plCount = 0;
@@ -2307,19 +2568,20 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
 		
     vector<Peak*>* pl1 = (*cur)->m_intensityRanked;	
     
-    unsigned int pl1max = (unsigned int)(pl1->size()) > maxNumPeaks ? maxNumPeaks : (unsigned int)(pl1->size());
+    unsigned int pl1start = listStarts[plCount];
+    unsigned int pl1max = listStarts[plCount + 1] - pl1start;
     
     for (unsigned int r1 = 0; r1 < pl1max; r1++) { 
       // r1 is the rank of the peak
       // for each peak in the current peak list...
       
-      if ((*pl1)[r1]->info == "A" || (*pl1)[r1]->info == "S") {
-      // if (!((*pl1)[r1])) {
+      if (alignStatus[pl1start + r1] != ' ') {
 	// already aligned
 	continue;
       }
        
-      vector<Peak*> aligned;
+      // the positions (in the flat arrays) of the peaks aligned
+      vector<unsigned int> aligned;
       
       // the percentile is 0 if the peak is the largest, and 1 if the peak is the smallest
       double percentile1 = (double)(r1) / 200.0;
@@ -2328,17 +2590,7 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
       double mz1 = (*pl1)[r1]->mz;
       float intensity1 = (*pl1)[r1]->intensity;
       
-      // parse out the number of replicates used for this peak list
-      // this is in case the peak list is a previous consensus. in this case,
-      // it has to count more in the voting
-      string info1 = (*pl1)[r1]->info;
-      unsigned int numRep1 = 1;		
-      if (!info1.empty()) {				
-        string::size_type slashPos1 = info1.find('/', 0);
-        if (slashPos1 != string::npos) {
-          numRep1 = atoi((info1.substr(0, slashPos1)).c_str());
-	}
-      }
+      unsigned int numRep1 = numReps[pl1start + r1];		
       
       double weight1 = (*cur)->m_weight;
             
@@ -2355,18 +2607,30 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
       // counting the number of replicates containing this peak
       unsigned int numRepWithPeak = numRep1;
       
-      for (vector<SpectraSTPeakList*>::iterator other = cur + 1; other != pls.end(); other++) {
+      unsigned int plCount2 = plCount + 1;
+      for (vector<SpectraSTPeakList*>::iterator other = cur + 1; other != pls.end(); other++, plCount2++) {
 	// for all subsequent peak lists...
         
 	vector<Peak*>* pl2 = (*other)->m_intensityRanked;
 	
-        unsigned int pl2max = (unsigned int)(pl2->size()) > maxNumPeaks ? maxNumPeaks : (unsigned int)(pl2->size());
-        
-        for (unsigned int r2 = 0; r2 < pl2max; r2++) {
+	unsigned int pl2start = listStarts[plCount2];
+	unsigned int pl2max = listStarts[plCount2 + 1] - pl2start;
+	
+	// the peak aligned is the top-ranked one not aligned already with an align score of at least 0. Since the align
+	// score is at most 1 - mzDiff, only the peaks within alignMzAccuracy (plus a little for rounding) of mzAve can have one.
+	vector<pair<double, unsigned int> >::iterator first = mzSorted.begin() + pl2start;
+	vector<pair<double, unsigned int> >::iterator last = mzSorted.begin() + pl2start + pl2max;
+	double highMz = mzAve + alignMzAccuracy + 0.000001;
+	
+	unsigned int bestR2 = pl2max;
+	
+        for (vector<pair<double, unsigned int> >::iterator p2 = lower_bound(first, last, pair<double, unsigned int>(mzAve - alignMzAccuracy - 0.000001, 0)); 
+	     p2 != last && p2->first <= highMz; p2++) {
 	  
-	  if ((*pl2)[r2]->info == "A" || (*pl2)[r2]->info == "S") {
-          // if (!((*pl2)[r2])) {
-            // already aligned
+	  unsigned int r2 = p2->second;
+	  
+	  if (r2 >= bestR2 || alignStatus[pl2start + r2] != ' ') {
+            // already aligned, or a higher-ranked peak can be aligned
             continue;
           }
 	  
@@ -2379,7 +2643,7 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
           // percentileMax gets 5/100. 
           double percentileMax = (percentile1 > percentile2 ? percentile1 : percentile2);
 
-          double mz2 = (*pl2)[r2]->mz;
+          double mz2 = p2->first;
 
           // the difference in m/z, normalized
           // gets a value of 1 if the mzDiff is equal to ALIGN_MZ_TOLERANCE
@@ -2392,45 +2656,40 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
           double alignScore = (1.0 - percentileMax)  - mzDiff;
     
           if (alignScore >= 0) {
-            // found a peak in peak list 2 that can be aligned
-            
-            float intensity2 = (*pl2)[r2]->intensity;
-            unsigned int numRep2 = 1;						
-            string info2 = (*pl2)[r2]->info;						
-            if (!info2.empty()) {
-              string::size_type slashPos2 = info2.find('/', 0);
-              if (slashPos2 != string::npos) {
-                numRep2 = atoi((info2.substr(0, slashPos2)).c_str());
-              }
-            }
-	    
-            // weighted average the m/z and intensity together
-            double weight2 = (*other)->m_weight;
-            double wMz2 = weight2 * mz2;
-            float wIntensity2 = (float)weight2 * intensity2;
-            sumMz += wMz2;
-            sumIntensity += wIntensity2;		
-            sumMzSq += mz2 * wMz2;
-            sumIntensitySq += intensity2 * wIntensity2;		
-            sumW += weight2;
-            mzAve = sumMz / sumW;
-            // mark this peak as aligned already
-	    (*pl2)[r2]->info = "A";            
-            aligned.push_back((*pl2)[r2]);
-            // (*pl2)[r2] = NULL;		
-            
-            // count the votes
-            numRepWithPeak += numRep2;
-            break;		
+            bestR2 = r2;
           }
-        }				
+        }
+	
+	if (bestR2 < pl2max) {
+	  // found a peak in peak list 2 that can be aligned
+	  
+	  double mz2 = (*pl2)[bestR2]->mz;
+	  float intensity2 = (*pl2)[bestR2]->intensity;
+	  unsigned int numRep2 = numReps[pl2start + bestR2];						
+	  
+	  // weighted average the m/z and intensity together
+	  double weight2 = (*other)->m_weight;
+	  double wMz2 = weight2 * mz2;
+	  float wIntensity2 = (float)weight2 * intensity2;
+	  sumMz += wMz2;
+	  sumIntensity += wIntensity2;		
+	  sumMzSq += mz2 * wMz2;
+	  sumIntensitySq += intensity2 * wIntensity2;		
+	  sumW += weight2;
+	  mzAve = sumMz / sumW;
+	  // mark this peak as aligned already
+	  alignStatus[pl2start + bestR2] = 'A';            
+	  aligned.push_back(pl2start + bestR2);
+	  
+	  // count the votes
+	  numRepWithPeak += numRep2;
+	}
       }
       
       // done going through all peak lists searching for this peak
       
-      (*pl1)[r1]->info = "A";
-      aligned.push_back((*pl1)[r1]);
-      //       (*pl1)[r1] = NULL;
+      alignStatus[pl1start + r1] = 'A';
+      aligned.push_back(pl1start + r1);
       
       if (numRepWithPeak >= minNumRepWithPeak) {
         // make the peak quorum, voted in. will include this peak in the final consensus
@@ -2465,14 +2724,27 @@ void SpectraSTPeakList::createConsensusSpectrum(vector<SpectraSTPeakList*>& pls,
         newPeak.info = ss.str();
         m_peaks.push_back(newPeak);
 	
-	for (vector<Peak*>::iterator ap = aligned.begin(); ap != aligned.end(); ap++) {
-          (*ap)->info = "S"; // enough votes, these are signals in the original replicates
+	for (vector<unsigned int>::iterator ap = aligned.begin(); ap != aligned.end(); ap++) {
+          alignStatus[*ap] = 'S'; // enough votes, these are signals in the original replicates
         }
       }
     }
     
   }
   
+  // mark the peaks aligned in the original replicates -- the denoiser takes those marked "S" as signals
+  for (unsigned int i = 0; i < (unsigned int)(pls.size()); i++) {
+    vector<Peak*>* ranked = pls[i]->m_intensityRanked;
+    for (unsigned int r = 0; r < listStarts[i + 1] - listStarts[i]; r++) {
+      char status = alignStatus[listStarts[i] + r];
+      if (status == 'A') {
+	(*ranked)[r]->info = "A";
+      } else if (status == 'S') {
+	(*ranked)[r]->info = "S";
+      }
+    }
+  }
+  
   // sort the peaks by m/z again
   sort(m_peaks.begin(), m_peaks.end(), SpectraSTPeakList::sortPeaksByMzAsc);
   m_isSortedByMz = true;
@@ -3402,7 +3674,7 @@ void SpectraSTPeakList::repositionPeaks(bool keepEffectivePeakCountConstant) {
 }
 
 // sortPeakByIntensity - comparison function used by sort() to sort peaks
-bool SpectraSTPeakList::sortPeaksByIntensityDesc(Peak a, Peak b) {
+bool SpectraSTPeakList::sortPeaksByIntensityDesc(const Peak& a, const Peak& b) {
 	
   return (a.intensity > b.intensity);	
 
@@ -3416,7 +3688,7 @@ bool SpectraSTPeakList::sortPeakPtrsByIntensityDesc(Peak* a, Peak* b) {
 }
 
 // sortPeakByMzAsc - comparison function used by sort() to sort peaks
-bool SpectraSTPeakList::sortPeaksByMzAsc(Peak a, Peak b) {
+bool SpectraSTPeakList::sortPeaksByMzAsc(const Peak& a, const Peak& b) {
 	
   return (a.mz < b.mz);
 }
@@ -4122,6 +4394,26 @@ bool SpectraSTPeakList::passFilterUnidentified(SpectraSTCreateParams& params) {
   
 }
 
+// calcMemoryUsage - the approximate number of bytes this peak list takes up in memory
+unsigned long long SpectraSTPeakList::calcMemoryUsage() {
+  
+  unsigned long long bytes = sizeof(SpectraSTPeakList);
+  
+  bytes += m_peaks.capacity() * sizeof(Peak); // the labels are in the shared table of PeakLabel
+  
+  if (m_bins) bytes += m_bins->capacity() * sizeof(float);
+  if (m_binIndex) bytes += m_binIndex->capacity() * sizeof(unsigned int);
+  if (m_packedBins) bytes += m_numPackedBins * (sizeof(float) + sizeof(unsigned short));
+  if (m_sketch) bytes += sizeof(peakListSketch);
+  if (m_intensityRanked) bytes += m_intensityRanked->capacity() * sizeof(Peak*);
+  if (m_peakMap) bytes += m_peakMap->size() * (sizeof(pair<const double, pair<Peak*, double> >) + 4 * sizeof(void*)); // + tree node
+  
+  return (bytes);
+}
+
+// prepareForSearch - scales, rank-transforms (or simplifies) and bins the peaks for the dot product. NOTE: Library
+// spectra prepared this way may be saved and reused (see SpectraSTPreparedLibFile) -- any parameter used here
+// must also go into SpectraSTSearchParams::calcPreparationKey.
 void SpectraSTPeakList::prepareForSearch(SpectraSTSearchParams& params, bool isLibrarySpectrum) {
  
   if (m_isPreparedForSearch) return;
@@ -4164,7 +4456,11 @@ void SpectraSTPeakList::prepareForSearch(SpectraSTSearchParams& params, bool isL
     
   } else {
     binPeaks(params.peakBinningNumBinsPerMzUnit, params.peakBinningFractionToNeighbor, false);
-    m_peaks.clear(); // this saves memory -- all dot product calculations only need the bins
+    if (isLibrarySpectrum) {
+      packBins(); // library spectra stay in the cache and are compared over and over -- make them small
+    } else {
+      m_peaks.clear(); // this saves memory -- all dot product calculations only need the bins
+    }
   }
     
     
@@ -4174,10 +4470,102 @@ void SpectraSTPeakList::prepareForSearch(SpectraSTSearchParams& params, bool isL
   if (m_peakMap) delete (m_peakMap);
   m_peakMap = NULL;
   
+  if (params.sketchFilterMinDot > 0.0) {
+    buildSketch(params);
+  }
+  
   m_isPreparedForSearch = true;
 	     
 }
 
+// buildSketch - keeps the peakListSketch::SIZE most intense bins of a peak list prepared for search (or its most intense
+// peaks, if it is not binned), normalized, as its sketch. The dot product of two sketches (see calcSketchDot) is that of
+// the two peak lists restricted to the bins that are among the most intense in both: for binned peak lists never more
+// than the full dot product, and for similar spectra most of it. Does nothing if the sketch is already there.
+void SpectraSTPeakList::buildSketch(SpectraSTSearchParams& params) {
+  
+  if (m_sketch) return;
+  
+  // (intensity, bin number or m/z) of all occupied bins (or peaks)
+  vector<pair<float, float> > all;
+  float magnitude = m_binMagnitude;
+  float mzTolerance = 0.25; // bin numbers are integers, so this matches only the same bin
+  
+  if (m_packedBins) {
+    all.reserve(m_numPackedBins);
+    for (unsigned int b = 0; b < m_numPackedBins; b++) {
+      all.push_back(pair<float, float>(m_packedBins[b], (float)(m_packedBinIndex[b])));
+    }
+  } else if (m_bins && m_binIndex) {
+    all.reserve(m_bins->size());
+    for (unsigned int b = 0; b < (unsigned int)(m_bins->size()); b++) {
+      all.push_back(pair<float, float>((*m_bins)[b], (float)((*m_binIndex)[b])));
+    }
+  } else if (m_bins) {
+    for (unsigned int b = 0; b < (unsigned int)(m_bins->size()); b++) {
+      if ((*m_bins)[b] > 0.0) all.push_back(pair<float, float>((*m_bins)[b], (float)b));
+    }
+  } else {
+    all.reserve(m_peaks.size());
+    for (vector<Peak>::iterator p = m_peaks.begin(); p != m_peaks.end(); p++) {
+      all.push_back(pair<float, float>(p->intensity, (float)(p->mz)));
+    }
+    magnitude = m_peakMagnitude;
+    mzTolerance = (float)(0.5 / (double)(params.peakBinningNumBinsPerMzUnit));
+  }
+  
+  m_sketch = new peakListSketch;
+  m_sketch->numPeaks = 0;
+  m_sketch->mzTolerance = mzTolerance;
+  
+  if (magnitude < 0.00001) return; // the dot product will be 0 anyway
+  
+  unsigned int numPeaks = (all.size() < peakListSketch::SIZE ? (unsigned int)(all.size()) : peakListSketch::SIZE);
+  partial_sort(all.begin(), all.begin() + numPeaks, all.end(), greater<pair<float, float> >());
+  
+  // by ascending bin number (or m/z)
+  vector<pair<float, float> > top;
+  for (unsigned int p = 0; p < numPeaks; p++) {
+    top.push_back(pair<float, float>(all[p].second, all[p].first / magnitude));
+  }
+  sort(top.begin(), top.end());
+  
+  m_sketch->numPeaks = numPeaks;
+  for (unsigned int p = 0; p < numPeaks; p++) {
+    m_sketch->mz[p] = top[p].first;
+    m_sketch->intensity[p] = top[p].second;
+  }
+}
+
+// calcSketchDot - the dot product of the sketches of two peak lists (see buildSketch), with the peaks of the other
+// shifted up by mzShift (in the open modification search, peaks can match shifted by the mass difference).
+// If either has no sketch, returns 1.0, i.e. cannot tell.
+double SpectraSTPeakList::calcSketchDot(SpectraSTPeakList* other, double mzShift) {
+  
+  if (!m_sketch || !(other->m_sketch)) return (1.0);
+  
+  float mzTolerance = (m_sketch->mzTolerance > other->m_sketch->mzTolerance ? m_sketch->mzTolerance : other->m_sketch->mzTolerance);
+  float shift = (float)mzShift;
+  
+  float dot = 0.0;
+  unsigned int i = 0;
+  unsigned int j = 0;
+  while (i < m_sketch->numPeaks && j < other->m_sketch->numPeaks) {
+    float diff = m_sketch->mz[i] - other->m_sketch->mz[j] - shift;
+    if (diff <= mzTolerance && diff >= -mzTolerance) {
+      dot += m_sketch->intensity[i] * other->m_sketch->intensity[j];
+      i++;
+      j++;
+    } else if (diff < 0.0) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  
+  return ((double)dot);
+}
+
 void SpectraSTPeakList::prepareForNoBinningDot() {
   
   vector<Peak> newPeaks;
@@ -6,6 +6,7 @@
 #include "SpectraSTSimScores.hpp"
 #include "Analyte.hpp"
 #include "Peptide.hpp"
+#include "SpectraSTMappedLibFile.hpp"
 
 #include <string>
 #include <vector>
@@ -50,15 +51,80 @@ hlam@systemsbiology.org
 
 using namespace std;
 
-// a peak - note that we use float's for intensities to save memory
+// a peak label (annotation or info) - a 4-byte id of the string in a table of all labels, which holds each distinct label
+// once. The id is 0 when empty. Most peaks (e.g. those of all query spectra) have no labels, and labels of library peaks
+// repeat a lot, so this keeps a Peak small and trivial to copy and sort. Reads like a const string.
+class PeakLabel {
+  
+public:
+  PeakLabel() : m_id(0) { }
+  PeakLabel(const string& s) : m_id(intern(s)) { }
+  PeakLabel(const char* s) : m_id(s && *s ? intern(string(s)) : 0) { }
+  
+  PeakLabel& operator=(const string& s) { m_id = intern(s); return (*this); }
+  PeakLabel& operator=(const char* s) { m_id = (s && *s ? intern(string(s)) : 0); return (*this); }
+  PeakLabel& operator+=(const string& s) { if (!s.empty()) m_id = intern(str() + s); return (*this); }
+  
+  operator const string&() const { return (str()); }
+  const string& str() const { return (m_id ? lookup(m_id) : emptyString()); }
+  
+  bool empty() const { return (m_id == 0); }
+  string::size_type length() const { return (str().length()); }
+  char operator[](string::size_type pos) const { return (str()[pos]); }
+  string::size_type find(char c, string::size_type pos = 0) const { return (str().find(c, pos)); }
+  string::size_type find(const string& s, string::size_type pos = 0) const { return (str().find(s, pos)); }
+  string::size_type find_first_of(const char* s, string::size_type pos = 0) const { return (str().find_first_of(s, pos)); }
+  string substr(string::size_type pos = 0, string::size_type n = string::npos) const { return (str().substr(pos, n)); }
+  
+private:
+  
+  // m_id - where the label is in the table; 0 if empty
+  unsigned int m_id;
+  
+  // s_table - the table of all labels, in chunks of TABLE_CHUNK_SIZE, allocated as needed. A label, once in
+  // the table, is never changed or moved, so any thread can look it up without a lock. The single-character
+  // labels (e.g. the ion types kept for search) have ids 1 to 255, the character itself.
+  static const unsigned int TABLE_CHUNK_BITS = 12;
+  static const unsigned int TABLE_CHUNK_SIZE = 1 << TABLE_CHUNK_BITS;
+  static string* s_table[1 << (32 - TABLE_CHUNK_BITS)];
+  static bool s_isTableInitialized;
+  
+  static unsigned int intern(const string& s);
+  static const string& lookup(unsigned int id) { return (s_table[id >> TABLE_CHUNK_BITS][id & (TABLE_CHUNK_SIZE - 1)]); }
+  static bool initializeTable();
+  
+  static const string& emptyString() { static const string empty; return (empty); }
+  
+};
+
+inline bool operator==(const PeakLabel& l, const char* s) { return (l.str() == s); }
+inline bool operator!=(const PeakLabel& l, const char* s) { return (l.str() != s); }
+inline bool operator==(const PeakLabel& l, const string& s) { return (l.str() == s); }
+inline bool operator!=(const PeakLabel& l, const string& s) { return (l.str() != s); }
+inline string operator+(const string& s, const PeakLabel& l) { return (s + l.str()); }
+inline string operator+(const PeakLabel& l, const string& s) { return (l.str() + s); }
+inline ostream& operator<<(ostream& out, const PeakLabel& l) { return (out << l.str()); }
+
+// a peak - note that we use float's for intensities to save memory. 24 bytes.
 typedef struct _peak {
   double mz;
   float intensity;
-  string annotation;	
-  string info;
+  PeakLabel annotation;	
+  PeakLabel info;
 	
 } Peak;
 
+// peakListSketch - a small, fixed-size summary of a peak list prepared for search (see SpectraSTPeakList::buildSketch):
+// its most intense bins (or peaks, if not binned), normalized to the magnitude of the whole, by ascending bin number (or m/z)
+struct peakListSketch {
+  static const unsigned int SIZE = 16;
+  
+  unsigned int numPeaks;
+  float mzTolerance; // for matching the m/z of peaks; bin numbers are matched exactly
+  float mz[SIZE];
+  float intensity[SIZE];
+};
+
 class SpectraSTDenoiser;
 
 class SpectraSTPeakList {
@@ -101,6 +167,7 @@ public:
   bool isAnnotated() { return (m_isAnnotated); }
   bool isPreparedForSearch() { return (m_isPreparedForSearch); }
   string getFracUnassignedStr();
+  unsigned long long calcMemoryUsage();
 
   // setters
   void insert(double mz, float intensity, string annotation, string info);
@@ -122,9 +189,13 @@ public:
   double calcDotNoBinning(SpectraSTPeakList* other, float mzTolerance);
   double calcDotTierwiseOpenModSearch(SpectraSTPeakList* other, float mzTolerance, pair<double, string>& openMod, int& numTiersUsed);
   double calcDotTierwiseOpenModSearch(SpectraSTPeakList* other, float mzTolerance, float precMzTol, pair<double, string>& openMod, int& numTiersUsed);
+  double calcSketchDot(SpectraSTPeakList* other, double mzShift = 0.0);
   // File output methods
   void writeToFile(ofstream& libFout);
   void writeToBinaryFile(ofstream& libFout);	
+  void writeToMappedFile(ofstream& libFout, SpectraSTMappedLibFile& mappedLib);
+  bool writePreparedToFile(ofstream& prepFout);
+  void readPreparedFromMappedFile(const char* data);
   void writeToDtaFile(ofstream& dtaFout);
   
   // preprocessing methods 
@@ -142,6 +213,7 @@ public:
   void normalizeTo(float basePeakValue, float maxDynamicRange = 0.0);
   void prepareForSearch(SpectraSTSearchParams& params, bool isLibrarySpectrum);
   void prepareForNoBinningDot();
+  void buildSketch(SpectraSTSearchParams& params);
 
   // peak list annotation method
   void annotate(bool redo = false, bool fixMz = false);
@@ -216,6 +288,16 @@ private:
   // m_binIndex - when bin index is used, for storing the indices of the bins in m_bins
   vector<unsigned int>* m_binIndex;
   
+  // m_packedBins, m_packedBinIndex - a library spectrum prepared for search keeps its bins here instead
+  // (see packBins): the occupied bins and their 16-bit bin numbers, in two tight arrays. m_bins and m_binIndex are then NULL.
+  float* m_packedBins;
+  unsigned short* m_packedBinIndex;
+  unsigned int m_numPackedBins;
+  
+  // m_sketch - the sketch of a peak list prepared for search, for a quick estimate of the dot product before the real
+  // one (-s_SKD). NULL if not built.
+  peakListSketch* m_sketch;
+  
   // m_intensityRanked - an index to m_peaks where the Peak pointers are sorted by decreasing intensity
   // for efficiency, this won't be instantiated at construction (since many operations on peak lists do not
   // require such a sorted list), but rather will only be created when rankByIntensity() is called.
@@ -270,6 +352,9 @@ private:
   
   // helper methods
   unsigned int calcBinNumber(double mz);
+  bool isBinned() { return (m_bins || m_packedBins); }
+  void packBins();
+  float calcBinsDot(SpectraSTPeakList* other, float* sumOfSquares);
   double calcBinMz(unsigned int binNum);
 
   float scale(Peak& p, double mzPower, double intensityPower, double unassignedFactor, bool removePrecursor, double removeLightIonsMzCutoff = 0.0);
@@ -290,9 +375,9 @@ private:
   void generateTheoreticalSpectrum();
  
   // comparators for sorting
-  static bool sortPeaksByIntensityDesc(Peak a, Peak b);
+  static bool sortPeaksByIntensityDesc(const Peak& a, const Peak& b);
   static bool sortPeakPtrsByIntensityDesc(Peak* a, Peak* b);
-  static bool sortPeaksByMzAsc(Peak a, Peak b); 
+  static bool sortPeaksByMzAsc(const Peak& a, const Peak& b); 
   static bool sortFragmentIonsByProminence(FragmentIon a, FragmentIon b);
   static bool sortByMScoreDesc(pair<int, unsigned int> a, pair<int, unsigned int> b);
 };
@@ -91,14 +91,14 @@ void SpectraSTPepXMLSearchOutput::printHeader() {
   
   
   // almost the same as Sequest2XML here. uses the same #define's. 
-  (*m_fout) << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl;
-  (*m_fout) << "<?xml-stylesheet type=\"text/xsl\" href=\"" << PEPXML_STD_XSL << "pepXML_std.xsl" << "\"?>" << endl;
+  (*m_fout) << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << '\n';
+  (*m_fout) << "<?xml-stylesheet type=\"text/xsl\" href=\"" << PEPXML_STD_XSL << "pepXML_std.xsl" << "\"?>" << '\n';
   
   (*m_fout) << "<msms_pipeline_analysis date=\"" << SpectraSTPepXMLSearchOutput::getDateTime(USE_LOCAL_TIME) << "\" ";
   (*m_fout) << "xmlns=\"" << PEPXML_NAMESPACE << "\" ";
   (*m_fout) << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" ";
   (*m_fout) << "xsi:schemaLocation=\"" << PEPXML_NAMESPACE << " " << PEPXML_STD_XSL << PEPXML_SCHEMA << "\" ";
-  (*m_fout) << "summary_xml=\"" << fn.name + fn.ext << "\">" << endl;
+  (*m_fout) << "summary_xml=\"" << fn.name + fn.ext << "\">" << '\n';
     
   // need to get full path -- not relative -- here? why?
   // const int dirSize = 1024;
@@ -134,14 +134,14 @@ void SpectraSTPepXMLSearchOutput::printHeader() {
 	// MH: Someone please answer this question. The data types seem redundant, although I see files that list both
 	//     .raw and .mzXML. Why both? And how do you know which label to put with which attribute?
   (*m_fout) << "raw_data_type=\"" << m_searchFileExt << "\" ";
-  (*m_fout) << "raw_data=\"" << m_searchFileExt << "\">" << endl;
+  (*m_fout) << "raw_data=\"" << m_searchFileExt << "\">" << '\n';
   
   if (m_searchParams.enzymeForPepXMLOutput.empty()) {
     // default to trypsin if -s_ENZ option is not set.
     // hard-coded sample_enzyme element for trypsin
-    (*m_fout) << "<sample_enzyme name=\"trypsin\">" << endl;
-    (*m_fout) << "<specificity cut=\"KR\" no_cut=\"P\" sense=\"C\"/>" << endl;
-    (*m_fout) << "</sample_enzyme>" << endl;
+    (*m_fout) << "<sample_enzyme name=\"trypsin\">" << '\n';
+    (*m_fout) << "<specificity cut=\"KR\" no_cut=\"P\" sense=\"C\"/>" << '\n';
+    (*m_fout) << "</sample_enzyme>" << '\n';
 
   } else {
 
@@ -155,9 +155,9 @@ void SpectraSTPepXMLSearchOutput::printHeader() {
     }
     delete (enzFactory);
 #else
-    (*m_fout) << "<sample_enzyme name=\"trypsin\">" << endl;
-    (*m_fout) << "<specificity cut=\"KR\" no_cut=\"P\" sense=\"C\"/>" << endl;
-    (*m_fout) << "</sample_enzyme>" << endl;
+    (*m_fout) << "<sample_enzyme name=\"trypsin\">" << '\n';
+    (*m_fout) << "<specificity cut=\"KR\" no_cut=\"P\" sense=\"C\"/>" << '\n';
+    (*m_fout) << "</sample_enzyme>" << '\n';
 #endif
     
   }
@@ -166,11 +166,11 @@ void SpectraSTPepXMLSearchOutput::printHeader() {
   (*m_fout) << "<search_summary base_name=\"" << baseName << "\" ";
   (*m_fout) << "search_engine=\"" << "SpectraST" << "\" ";
   (*m_fout) << "precursor_mass_type=\"monoisotopic\" fragment_mass_type=\"monoisotopic\" ";
-  (*m_fout) << "out_data_type=\"out\" out_data=\".tgz\" search_id=\"1\">" << endl;
+  (*m_fout) << "out_data_type=\"out\" out_data=\".tgz\" search_id=\"1\">" << '\n';
   
 
   if (!m_searchParams.databaseFile.empty()) {
-    (*m_fout) << "<search_database local_path=\"" << m_searchParams.databaseFile << "\" type=\"" << m_searchParams.databaseType << "\"/>" << endl;
+    (*m_fout) << "<search_database local_path=\"" << m_searchParams.databaseFile << "\" type=\"" << m_searchParams.databaseType << "\"/>" << '\n';
   } 
   
   // SpectraSTSearchParams can be entered here...
@@ -184,12 +184,12 @@ void SpectraSTPepXMLSearchOutput::printHeader() {
     icatType = "uc";
   }
   
-  (*m_fout) << "<parameter name=\"icat_type\" value=\"" << icatType << "\"/>" << endl;
+  (*m_fout) << "<parameter name=\"icat_type\" value=\"" << icatType << "\"/>" << '\n';
   */
   
   // etc
   
-  (*m_fout) << "</search_summary>" << endl;
+  (*m_fout) << "</search_summary>" << '\n';
   
   
 }
@@ -240,11 +240,11 @@ void SpectraSTPepXMLSearchOutput::printStartQuery(string query, double precursor
     (*m_fout) << " retention_time_sec=\"" << fixed << retentionTime << "\"";
   }
   
-  (*m_fout) << ">" << endl;
+  (*m_fout) << ">" << '\n';
   
   // HOPEFULLY WE'LL HAVE A NEW PEPXML SCHEMA FOR SPECTRAST SOON
   
-  (*m_fout) << "<search_result>" << endl;
+  (*m_fout) << "<search_result>" << '\n';
   
   
 }
@@ -252,8 +252,8 @@ void SpectraSTPepXMLSearchOutput::printStartQuery(string query, double precursor
 // printEndQuery - prints whatever is needed to finish up a spectrum_query
 void SpectraSTPepXMLSearchOutput::printEndQuery(string query) {
   
-  (*m_fout) << "</search_result>" << endl;
-  (*m_fout) << "</spectrum_query>" << endl;
+  (*m_fout) << "</search_result>" << '\n';
+  (*m_fout) << "</spectrum_query>" << '\n';
   
 
 }
@@ -284,7 +284,7 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
     (*m_fout).precision(4);
     (*m_fout) << fixed << showpoint << showpos << massDiff;
     (*m_fout) << noshowpos << "\" num_tol_term=\"2\" ";
-    (*m_fout) << "num_missed_cleavages=\"0\">" << endl;
+    (*m_fout) << "num_missed_cleavages=\"0\">" << '\n';
     
     
     
@@ -314,7 +314,7 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
             
       if (numProteins != (unsigned int)(proteins.size())) {
         // something wrong... but don't complain
-        // cerr << "Protein count doesn't match number of listed proteins!" << endl; 
+        // cerr << "Protein count doesn't match number of listed proteins!" << '\n'; 
       }
     }
         
@@ -357,11 +357,11 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
 #endif
     
     (*m_fout) << noshowpos << "\" num_tol_term=\"" << ntt;
-    (*m_fout) << "\" num_missed_cleavages=\"" << nmc << "\">" << endl;
+    (*m_fout) << "\" num_missed_cleavages=\"" << nmc << "\">" << '\n';
     
     if (proteins.size() > 1) {
       for (vector<string>::size_type i = 1; i < proteins.size(); i++) {
-        (*m_fout) << "<alternative_protein protein=\"" << proteins[i] << "\"/>" << endl; 
+        (*m_fout) << "<alternative_protein protein=\"" << proteins[i] << "\"/>" << '\n'; 
         // no protein desc, num_tol_term or prev/next AA, schema doesn't require them. but will this break something?
       }
     }
@@ -385,7 +385,7 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
 	}
       }
       
-      (*m_fout) << "modified_peptide=\"" << p->interactStyle() << "\">" << endl;
+      (*m_fout) << "modified_peptide=\"" << p->interactStyle() << "\">" << '\n';
       
       map<int, string>::iterator i;
       for (i = p->mods.begin(); i != p->mods.end(); i++) {
@@ -393,12 +393,12 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
         (*m_fout) << "<mod_aminoacid_mass position=\"" << (*i).first + 1;
 
 	if (m_searchParams.precursorMzUseAverage) {
-	  (*m_fout) << "\" mass=\"" << Peptide::getAAPlusModAverageMass(p->stripped[(*i).first], (*i).second) << "\"/>" << endl; 
+	  (*m_fout) << "\" mass=\"" << Peptide::getAAPlusModAverageMass(p->stripped[(*i).first], (*i).second) << "\"/>" << '\n'; 
 	} else {
-	  (*m_fout) << "\" mass=\"" << Peptide::getAAPlusModMonoisotopicMass(p->stripped[(*i).first], (*i).second) << "\"/>" << endl;
+	  (*m_fout) << "\" mass=\"" << Peptide::getAAPlusModMonoisotopicMass(p->stripped[(*i).first], (*i).second) << "\"/>" << '\n';
         }
       }
-      (*m_fout) << "</modification_info>" << endl;
+      (*m_fout) << "</modification_info>" << '\n';
     }
     
   }
@@ -407,28 +407,28 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
   simScores.printPepXML((*m_fout));
   
   
-  (*m_fout) << "<search_score name=\"charge\" value=\"" << entry->getCharge() << "\"/>" << endl;	
-  (*m_fout) << "<search_score name=\"lib_file_offset\" value=\"" << entry->getLibFileOffset() << "\"/>" << endl;
+  (*m_fout) << "<search_score name=\"charge\" value=\"" << entry->getCharge() << "\"/>" << '\n';	
+  (*m_fout) << "<search_score name=\"lib_file_offset\" value=\"" << entry->getLibFileOffset() << "\"/>" << '\n';
   
   double libProb = entry->getProb(1.0);
 
   (*m_fout).precision(4);  
-  (*m_fout) << "<search_score name=\"lib_probability\" value=\"" << fixed << libProb << "\"/>" << endl;
+  (*m_fout) << "<search_score name=\"lib_probability\" value=\"" << fixed << libProb << "\"/>" << '\n';
   
-  (*m_fout) << "<search_score name=\"lib_status\" value=\"" << entry->getStatus() << "\"/>" << endl;
+  (*m_fout) << "<search_score name=\"lib_status\" value=\"" << entry->getStatus() << "\"/>" << '\n';
 
   unsigned int numUsed = entry->getNrepsUsed();
     
-  (*m_fout) << "<search_score name=\"lib_num_replicates\" value=\"" << numUsed << "\"/>" << endl;
+  (*m_fout) << "<search_score name=\"lib_num_replicates\" value=\"" << numUsed << "\"/>" << '\n';
 
   string remarkStr("");
   if (entry->getOneComment("Remark", remarkStr)) {
-    (*m_fout) << "<search_score name=\"lib_remark\" value=\"" << remarkStr << "\"/>" << endl;  
+    (*m_fout) << "<search_score name=\"lib_remark\" value=\"" << remarkStr << "\"/>" << '\n';  
   } else {
-    (*m_fout) << "<search_score name=\"lib_remark\" value=\"" << "_NONE_" << "\"/>" << endl;  
+    (*m_fout) << "<search_score name=\"lib_remark\" value=\"" << "_NONE_" << "\"/>" << '\n';  
   }
   
-  (*m_fout) << "</search_hit>" << endl;
+  (*m_fout) << "</search_hit>" << '\n';
   
   
 }	
@@ -436,8 +436,8 @@ void SpectraSTPepXMLSearchOutput::printHit(string query, unsigned int hitRank, S
 // printFooter - prints whatever is needed at the end of the pepXML file
 void SpectraSTPepXMLSearchOutput::printFooter() {
   
-  (*m_fout) << "</msms_run_summary>" << endl;
-  (*m_fout) << "</msms_pipeline_analysis>" << endl;
+  (*m_fout) << "</msms_run_summary>" << '\n';
+  (*m_fout) << "</msms_pipeline_analysis>" << '\n';
   
 }
 
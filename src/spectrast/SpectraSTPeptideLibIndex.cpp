@@ -5,6 +5,7 @@
 
 #include <sstream>
 #include <stdlib.h>
+#include <string.h>
 
 #define NORMALCELLCOLOR   "#FFDDDD"
 #define HEADERCELLCOLOR   "#42D4FD"
@@ -44,6 +45,9 @@ hlam@systemsbiology.org
  * 
  * Implements a library index on the peptide to facilitate retrieval by peptide. 
  * Note that this is not used by SpectraST for search, but it is useful for library manipulation
+ *
+ * The .pepidx is binary, with the statistics stored alongside the index, so that loading it needs no parsing
+ * (of the peptides in particular). See writeToFile() for the format.
  */
  
 using namespace std;
@@ -82,8 +86,8 @@ SpectraSTPeptideLibIndex::SpectraSTPeptideLibIndex(string idxFileName) :
 }
 
 // constructor for retrieval
-SpectraSTPeptideLibIndex::SpectraSTPeptideLibIndex(string idxFileName, ifstream* libFinPtr, bool binaryLib) :
-  SpectraSTLibIndex(idxFileName, libFinPtr, "Peptide", binaryLib),
+SpectraSTPeptideLibIndex::SpectraSTPeptideLibIndex(string idxFileName, ifstream* libFinPtr, bool binaryLib, SpectraSTMappedLibFile* mappedLib) :
+  SpectraSTLibIndex(idxFileName, libFinPtr, "Peptide", binaryLib, mappedLib),
   m_map(),
   m_peptideSequenceCount(0),
   m_peptideIonCount(0),
@@ -242,51 +246,231 @@ void SpectraSTPeptideLibIndex::insertEntry(SpectraSTLibEntry* entry, fstream::of
 	
 }
 
-// writeToFile - writes the peptide index to file. NOTE that this function must be modified together with
+// The first 8 bytes of a binary .pepidx. An old text .pepidx starts with '#' or a peptide.
+const char SpectraSTPeptideLibIndex::MAGIC[8] = { 'S', 'P', 'P', 'E', 'P', 'B', 'I', 'N' };
+
+// <magic (8)> <format version (4)> <header size (4)> <number of peptides (4)> <number of peptide ions (4)> <number of offsets (8)>
+// <number of mod types (4)> <number of statistics (4)> <string table size (8)> <checksum (8)>
+// <file offset (long long) x numOffsets> <statistic (uint) x numStats> 
+// <peptide key (uint) x numPeptides> <first ion (uint) x (numPeptides + 1)> <ion subkey (uint) x numIons> <first offset (uint) x (numIons + 1)>
+// <mod type (uint) x numMods> <mod count (uint) x numMods> <string table: '\0'-terminated strings>
+// The keys, subkeys and mod types are offsets into the string table. Peptide p has the ions firstIon[p] to firstIon[p + 1] - 1,
+// and ion i the file offsets firstOffset[i] to firstOffset[i + 1] - 1. The checksum is over everything after the header.
+const unsigned int SpectraSTPeptideLibIndex::FORMAT_VERSION = 1;
+const unsigned int SpectraSTPeptideLibIndex::HEADER_SIZE = 56;
+
+// writeArray, readArray - write/read an array of the binary .pepidx, and add it to the checksum
+static void writeArray(ofstream& idxFout, const void* data, unsigned long long length, unsigned long long& checksum) {
+  if (length == 0) return;
+  idxFout.write((const char*)data, length);
+  checksum = SpectraSTLibIndex::calcChecksum((const char*)data, length, checksum);
+}
+
+static void readArray(ifstream& idxFin, void* data, unsigned long long length, unsigned long long& checksum) {
+  if (length == 0) return;
+  idxFin.read((char*)data, length);
+  checksum = SpectraSTLibIndex::calcChecksum((const char*)data, length, checksum);
+}
+
+// writeToFile - writes the peptide index to file, in binary. NOTE that this function must be modified together with
 // readFromFile if the file format is changed!
 void SpectraSTPeptideLibIndex::writeToFile() {
 
   ofstream idxFout;
   
-  if (!myFileOpen(idxFout, m_idxFileName)) {
+  if (!myFileOpen(idxFout, m_idxFileName, true)) {
     g_log->error("CREATE", "Cannot open PEPIDX file \"" + m_idxFileName + " for writing peptide index.");
     return;
   }
   
-  idxFout << "### " << m_idxFileName << endl;
-  idxFout << "### " << endl;
-
-  printStats(idxFout, "### ");
-
-  idxFout << "### ===" << endl;
+  // flatten the map into arrays
+  string stringTable("");
+  vector<unsigned int> peptideKeys;
+  vector<unsigned int> firstIons;
+  vector<unsigned int> ionSubkeys;
+  vector<unsigned int> firstOffsets;
+  vector<long long> offsets;
   
   for (map<string, map<string, vector<fstream::off_type> > >::iterator i = m_map.begin(); i != m_map.end(); i++) {
     
+    peptideKeys.push_back((unsigned int)(stringTable.length()));
+    stringTable += (*i).first;
+    stringTable += '\0';
+    firstIons.push_back((unsigned int)(ionSubkeys.size()));
+    
     for (map<string, vector<fstream::off_type> >::iterator j = ((*i).second).begin(); j != ((*i).second).end(); j++) {
       
-      idxFout << (*i).first << '\t' << (*j).first << '\t';
-      
-      for (vector<fstream::off_type>::iterator k = ((*j).second).begin(); k != ((*j).second).end(); k++) {
-	idxFout << (*k) << ' ';
-      }
+      ionSubkeys.push_back((unsigned int)(stringTable.length()));
+      stringTable += (*j).first;
+      stringTable += '\0';
+      firstOffsets.push_back((unsigned int)(offsets.size()));
       
-      idxFout << endl;	
+      offsets.insert(offsets.end(), ((*j).second).begin(), ((*j).second).end());
     }		
   }
+  firstIons.push_back((unsigned int)(ionSubkeys.size()));
+  firstOffsets.push_back((unsigned int)(offsets.size()));
+  
+  vector<unsigned int> modTypes;
+  vector<unsigned int> modCounts;
+  for (map<string, unsigned int>::iterator m = m_modsCount.begin(); m != m_modsCount.end(); m++) {
+    modTypes.push_back((unsigned int)(stringTable.length()));
+    stringTable += m->first;
+    stringTable += '\0';
+    modCounts.push_back(m->second);
+  }
+  
+  vector<unsigned int*> statFields;
+  getStatFields(statFields);
+  vector<unsigned int> stats;
+  for (vector<unsigned int*>::iterator st = statFields.begin(); st != statFields.end(); st++) {
+    stats.push_back(**st);
+  }
+  stats.push_back(m_isUnique ? 1 : 0);
+  
+  unsigned int numPeptides = (unsigned int)(peptideKeys.size());
+  unsigned int numIons = (unsigned int)(ionSubkeys.size());
+  unsigned long long numOffsets = (unsigned long long)(offsets.size());
+  unsigned int numMods = (unsigned int)(modTypes.size());
+  unsigned int numStats = (unsigned int)(stats.size());
+  unsigned long long stringTableSize = (unsigned long long)(stringTable.length());
+  unsigned long long checksum = CHECKSUM_SEED;
+  
+  idxFout.write(MAGIC, 8);
+  idxFout.write((char*)(&FORMAT_VERSION), sizeof(unsigned int));
+  idxFout.write((char*)(&HEADER_SIZE), sizeof(unsigned int));
+  idxFout.write((char*)(&numPeptides), sizeof(unsigned int));
+  idxFout.write((char*)(&numIons), sizeof(unsigned int));
+  idxFout.write((char*)(&numOffsets), sizeof(unsigned long long));
+  idxFout.write((char*)(&numMods), sizeof(unsigned int));
+  idxFout.write((char*)(&numStats), sizeof(unsigned int));
+  idxFout.write((char*)(&stringTableSize), sizeof(unsigned long long));
+  fstream::off_type checksumPos = idxFout.tellp();
+  idxFout.write((char*)(&checksum), sizeof(unsigned long long)); // filled in below
+  
+  writeArray(idxFout, (offsets.empty() ? NULL : &(offsets[0])), numOffsets * sizeof(long long), checksum);
+  writeArray(idxFout, &(stats[0]), numStats * sizeof(unsigned int), checksum);
+  writeArray(idxFout, (peptideKeys.empty() ? NULL : &(peptideKeys[0])), numPeptides * sizeof(unsigned int), checksum);
+  writeArray(idxFout, &(firstIons[0]), (numPeptides + 1) * sizeof(unsigned int), checksum);
+  writeArray(idxFout, (ionSubkeys.empty() ? NULL : &(ionSubkeys[0])), numIons * sizeof(unsigned int), checksum);
+  writeArray(idxFout, &(firstOffsets[0]), (numIons + 1) * sizeof(unsigned int), checksum);
+  writeArray(idxFout, (modTypes.empty() ? NULL : &(modTypes[0])), numMods * sizeof(unsigned int), checksum);
+  writeArray(idxFout, (modCounts.empty() ? NULL : &(modCounts[0])), numMods * sizeof(unsigned int), checksum);
+  writeArray(idxFout, stringTable.data(), stringTableSize, checksum);
+  
+  idxFout.seekp(checksumPos);
+  idxFout.write((char*)(&checksum), sizeof(unsigned long long));
   
- 
 }
 
-// readFromFile - reads the peptide index from file and creates the map object in memory. 
+// readFromFile - reads the peptide index from file and creates the map object in memory. The statistics are stored in the file,
+// so nothing has to be parsed. An old text .pepidx is converted to binary.
 // NOTE that this function must be modified together with writeToFile if the file format is changed!
 void SpectraSTPeptideLibIndex::readFromFile() {
   
   ifstream idxFin;
-  if (!myFileOpen(idxFin, m_idxFileName)) {
+  if (!myFileOpen(idxFin, m_idxFileName, true)) {
     g_log->error("CREATE", "Cannot open PEPIDX file \"" + m_idxFileName + " for reading peptide index. Exiting.");
     g_log->crash();
   }
+  
+  char magic[8];
+  idxFin.read(magic, 8);
+  
+  if (idxFin.gcount() < 8 || memcmp(magic, MAGIC, 8) != 0) {
+    // old text .pepidx
+    idxFin.clear();
+    idxFin.seekg(0);
+    readFromTextFile(idxFin);
+    return;
+  }
+  
+  unsigned int formatVersion = 0;
+  unsigned int headerSize = 0;
+  unsigned int numPeptides = 0;
+  unsigned int numIons = 0;
+  unsigned long long numOffsets = 0;
+  unsigned int numMods = 0;
+  unsigned int numStats = 0;
+  unsigned long long stringTableSize = 0;
+  unsigned long long checksum = 0;
+  
+  idxFin.read((char*)(&formatVersion), sizeof(unsigned int));
+  idxFin.read((char*)(&headerSize), sizeof(unsigned int));
+  idxFin.read((char*)(&numPeptides), sizeof(unsigned int));
+  idxFin.read((char*)(&numIons), sizeof(unsigned int));
+  idxFin.read((char*)(&numOffsets), sizeof(unsigned long long));
+  idxFin.read((char*)(&numMods), sizeof(unsigned int));
+  idxFin.read((char*)(&numStats), sizeof(unsigned int));
+  idxFin.read((char*)(&stringTableSize), sizeof(unsigned long long));
+  idxFin.read((char*)(&checksum), sizeof(unsigned long long));
+  
+  vector<unsigned int*> statFields;
+  getStatFields(statFields);
+  
+  if (!idxFin.good() || formatVersion != FORMAT_VERSION || headerSize != HEADER_SIZE || numStats != statFields.size() + 1) {
+    g_log->error("CREATE", "Corrupt or unknown version of PEPIDX file \"" + m_idxFileName + "\". Exiting.");
+    g_log->crash();
+    return;
+  }
+  
+  vector<long long> offsets((unsigned int)numOffsets);
+  vector<unsigned int> stats(numStats);
+  vector<unsigned int> peptideKeys(numPeptides);
+  vector<unsigned int> firstIons(numPeptides + 1);
+  vector<unsigned int> ionSubkeys(numIons);
+  vector<unsigned int> firstOffsets(numIons + 1);
+  vector<unsigned int> modTypes(numMods);
+  vector<unsigned int> modCounts(numMods);
+  vector<char> stringTable((unsigned int)stringTableSize + 1, '\0');
+  
+  unsigned long long actualChecksum = CHECKSUM_SEED;
+  readArray(idxFin, (offsets.empty() ? NULL : &(offsets[0])), numOffsets * sizeof(long long), actualChecksum);
+  readArray(idxFin, &(stats[0]), numStats * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, (peptideKeys.empty() ? NULL : &(peptideKeys[0])), numPeptides * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, &(firstIons[0]), (numPeptides + 1) * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, (ionSubkeys.empty() ? NULL : &(ionSubkeys[0])), numIons * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, &(firstOffsets[0]), (numIons + 1) * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, (modTypes.empty() ? NULL : &(modTypes[0])), numMods * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, (modCounts.empty() ? NULL : &(modCounts[0])), numMods * sizeof(unsigned int), actualChecksum);
+  readArray(idxFin, &(stringTable[0]), stringTableSize, actualChecksum);
+  
+  if (!idxFin.good() || actualChecksum != checksum) {
+    g_log->error("CREATE", "Corrupt PEPIDX file \"" + m_idxFileName + "\" (checksum mismatch). Please recreate it. Exiting.");
+    g_log->crash();
+    return;
+  }
+  
+  for (unsigned int st = 0; st < (unsigned int)(statFields.size()); st++) {
+    *(statFields[st]) = stats[st];
+  }
+  m_isUnique = (stats[statFields.size()] != 0);
+  
+  for (unsigned int m = 0; m < numMods; m++) {
+    m_modsCount[string(&(stringTable[modTypes[m]]))] = modCounts[m];
+  }
+  
+  // the keys are already in order, so each insertion goes to the end
+  for (unsigned int p = 0; p < numPeptides; p++) {
+    
+    map<string, vector<fstream::off_type> >& ions = 
+      m_map.insert(m_map.end(), make_pair(string(&(stringTable[peptideKeys[p]])), map<string, vector<fstream::off_type> >()))->second;
     
+    for (unsigned int i = firstIons[p]; i < firstIons[p + 1]; i++) {
+      ions.insert(ions.end(), make_pair(string(&(stringTable[ionSubkeys[i]])), 
+					vector<fstream::off_type>(offsets.begin() + firstOffsets[i], offsets.begin() + firstOffsets[i + 1])));
+    }
+  }
+  
+}
+
+// readFromTextFile - reads an old text .pepidx, which contains a line of the form
+// <stripped peptide>\t<subkey>\t<offset 1> <offset 2> ... <offset n>
+// for each peptide ion, and works out the statistics. The .pepidx is then rewritten in binary, so that this only happens once.
+void SpectraSTPeptideLibIndex::readFromTextFile(ifstream& idxFin) {
+  
+  g_log->log("CREATE", "Converting old PEPIDX file \"" + m_idxFileName + "\" to the current format.");
+  
   string line("");
   
   char firstChar = (char)(idxFin.peek());
@@ -390,6 +574,10 @@ void SpectraSTPeptideLibIndex::readFromFile() {
     lastKey = key;
     
   } // next line in .pepidx file
+  
+  idxFin.close();
+  
+  writeToFile();
 
 }	
 	
@@ -421,8 +609,7 @@ void SpectraSTPeptideLibIndex::retrieve(vector<SpectraSTLibEntry*>& hits, string
 	if (mods.empty() || (mods == subkeyMods)) {
 	  // don't care about mods, or mods matched
 	  for (vector<fstream::off_type>::iterator j = (*i).second.begin(); j != (*i).second.end(); j++) {
-	    m_libFinPtr->seekg(*j);
-	    SpectraSTLibEntry* entry = new SpectraSTLibEntry(*m_libFinPtr, m_binaryLib);
+	    SpectraSTLibEntry* entry = readEntry(*j);
 	    //					entry->readFromFile(*m_libFinPtr);
 	    
 	    hits.push_back(entry);
@@ -549,6 +736,36 @@ bool SpectraSTPeptideLibIndex::hasSharedSequence(Peptide& pep, string& foundPept
   return (false);
 }
 
+// getStatFields - lists all the statistics counters (except m_isUnique), in the order they are stored in the .pepidx
+void SpectraSTPeptideLibIndex::getStatFields(vector<unsigned int*>& fields) {
+  
+  fields.clear();
+  fields.push_back(&m_entryCount);
+  fields.push_back(&m_peptideSequenceCount);
+  fields.push_back(&m_peptideIonCount);
+  fields.push_back(&m_peptideSpectrumCount);
+  for (vector<unsigned int>::iterator ch = m_chargeCount.begin(); ch != m_chargeCount.end(); ch++) {
+    fields.push_back(&(*ch));
+  }
+  fields.push_back(&m_trypticCount);
+  fields.push_back(&m_semitrypticCount);
+  fields.push_back(&m_nontrypticCount);
+  fields.push_back(&m_nonPeptideCount);
+  fields.push_back(&m_nonPeptideIonCount);
+  fields.push_back(&m_nonPeptideSpectrumCount);
+  fields.push_back(&m_prob9999);
+  fields.push_back(&m_prob999);
+  fields.push_back(&m_prob99);
+  fields.push_back(&m_prob9);
+  fields.push_back(&m_prob0);
+  fields.push_back(&m_nreps20);
+  fields.push_back(&m_nreps10);
+  fields.push_back(&m_nreps4);
+  fields.push_back(&m_nreps2);
+  fields.push_back(&m_nreps1);
+  
+}
+
 // isUniqueLibrary - returns TRUE if the library is "unique" and FALSE otherwise
 bool SpectraSTPeptideLibIndex::isUniqueLibrary() {
   return (m_isUnique);
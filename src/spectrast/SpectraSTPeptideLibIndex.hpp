@@ -50,7 +50,7 @@ class SpectraSTPeptideLibIndex : public SpectraSTLibIndex {
   
 public:
   SpectraSTPeptideLibIndex(string idxFileName);
-  SpectraSTPeptideLibIndex(string idxFileName, ifstream* libFinPtr, bool binaryLib);
+  SpectraSTPeptideLibIndex(string idxFileName, ifstream* libFinPtr, bool binaryLib, SpectraSTMappedLibFile* mappedLib = NULL);
   virtual ~SpectraSTPeptideLibIndex();
   
   virtual void insertEntry(SpectraSTLibEntry* entry, fstream::off_type offset);
@@ -86,6 +86,8 @@ public:
   
   static string constructSubkey(SpectraSTLibEntry* entry); 
   
+  static const unsigned int FORMAT_VERSION;
+  
 private:
   
   // statistics
@@ -125,6 +127,12 @@ private:
   // an iterator to m_map
   map<string, map<string, vector<fstream::off_type> > >::iterator m_curPeptide;
   
+  void readFromTextFile(ifstream& idxFin);
+  void getStatFields(vector<unsigned int*>& fields);
+  
+  static const char MAGIC[8];
+  static const unsigned int HEADER_SIZE;
+  
  
  
   
@@ -0,0 +1,269 @@
+#include "SpectraSTPreparedLibFile.hpp"
+#include "SpectraSTPeakList.hpp"
+#include "SpectraSTLog.hpp"
+#include "FileUtils.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+#ifndef MSVC
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTPreparedLibFile
+ *
+ * The search-ready library spectra (.spprep). See the header file for the layout.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+const char SpectraSTPreparedLibFile::MAGIC[8] = { 'S', 'P', 'P', 'R', 'E', 'P', '\0', '\0' };
+
+// <magic (8)> <format version (4)> <header size (4)> <params key (8)> <.splib size (8)> <.splib modification time (8)>
+// <number of records (8)> <index offset (8)>
+const unsigned int SpectraSTPreparedLibFile::HEADER_SIZE = 56;
+const unsigned int SpectraSTPreparedLibFile::FORMAT_VERSION = 1;
+
+// constructor for creation - opens a temporary file next to the file and writes the header. finish() renames it
+// to the file, so that a process that has the old file mapped never sees it change under it. The index offset also
+// stays 0 until finish() fills it in, so that a file whose creation did not finish is never used.
+SpectraSTPreparedLibFile::SpectraSTPreparedLibFile(string fileName, unsigned long long paramsKey, string libFileName) :
+  m_fileName(fileName),
+  m_fout(),
+  m_index(),
+  m_data(NULL),
+  m_size(0),
+  m_indexEntries(NULL),
+  m_numRecords(0) {
+
+#ifdef MSVC
+  m_fileHandle = INVALID_HANDLE_VALUE;
+  m_mappingHandle = NULL;
+#else
+  m_fd = -1;
+#endif
+
+  if (!myFileOpen(m_fout, fileName + ".tmp", true)) {
+    g_log->error("SEARCH", "Cannot open file \"" + fileName + ".tmp\" for writing the search-ready library spectra. Library spectra will be prepared as they are retrieved.");
+    return;
+  }
+
+  unsigned long long libFileSize = 0;
+  unsigned long long libFileModTime = 0;
+  getFileStamp(libFileName, libFileSize, libFileModTime);
+
+  unsigned long long zero = 0;
+
+  m_fout.write(MAGIC, 8);
+  m_fout.write((char*)(&FORMAT_VERSION), sizeof(unsigned int));
+  m_fout.write((char*)(&HEADER_SIZE), sizeof(unsigned int));
+  m_fout.write((char*)(&paramsKey), sizeof(unsigned long long));
+  m_fout.write((char*)(&libFileSize), sizeof(unsigned long long));
+  m_fout.write((char*)(&libFileModTime), sizeof(unsigned long long));
+  m_fout.write((char*)(&zero), sizeof(unsigned long long)); // number of records
+  m_fout.write((char*)(&zero), sizeof(unsigned long long)); // index offset
+
+}
+
+// constructor for retrieval - maps the file into memory. A missing, unfinished or otherwise unusable file
+// is not an error; isUpToDate() will just return false.
+SpectraSTPreparedLibFile::SpectraSTPreparedLibFile(string fileName) :
+  m_fileName(fileName),
+  m_fout(),
+  m_index(),
+  m_data(NULL),
+  m_size(0),
+  m_indexEntries(NULL),
+  m_numRecords(0) {
+
+#ifdef MSVC
+  m_mappingHandle = NULL;
+  m_fileHandle = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_fileHandle != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(m_fileHandle, &fileSize) && fileSize.QuadPart > 0) {
+      m_size = (unsigned long long)(fileSize.QuadPart);
+      m_mappingHandle = CreateFileMapping(m_fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (m_mappingHandle) {
+	m_data = (const char*)MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0);
+      }
+    }
+  }
+#else
+  m_fd = open(fileName.c_str(), O_RDONLY);
+  if (m_fd >= 0) {
+    struct stat st;
+    if (fstat(m_fd, &st) == 0 && st.st_size > 0) {
+      m_size = (unsigned long long)(st.st_size);
+      void* mapped = mmap(NULL, (size_t)m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+      if (mapped != MAP_FAILED) {
+	m_data = (const char*)mapped;
+      }
+    }
+  }
+#endif
+
+  if (!m_data || m_size < HEADER_SIZE) return;
+
+  unsigned int formatVersion = 0;
+  unsigned long long indexOffset = 0;
+  memcpy(&formatVersion, m_data + 8, sizeof(unsigned int));
+  memcpy(&m_numRecords, m_data + 40, sizeof(unsigned long long));
+  memcpy(&indexOffset, m_data + 48, sizeof(unsigned long long));
+
+  if (memcmp(m_data, MAGIC, 8) != 0 || formatVersion != FORMAT_VERSION || indexOffset == 0 ||
+      indexOffset % 8 != 0 || indexOffset + m_numRecords * sizeof(preparedLibIndexEntry) > m_size) {
+    m_numRecords = 0;
+    return;
+  }
+
+  m_indexEntries = (const preparedLibIndexEntry*)(m_data + indexOffset);
+
+}
+
+// destructor
+SpectraSTPreparedLibFile::~SpectraSTPreparedLibFile() {
+
+  if (m_fout.is_open()) m_fout.close();
+
+#ifdef MSVC
+  if (m_data) UnmapViewOfFile((LPCVOID)m_data);
+  if (m_mappingHandle) CloseHandle(m_mappingHandle);
+  if (m_fileHandle != INVALID_HANDLE_VALUE) CloseHandle(m_fileHandle);
+#else
+  if (m_data) munmap((void*)m_data, (size_t)m_size);
+  if (m_fd >= 0) close(m_fd);
+#endif
+
+}
+
+// insertEntry - writes the record of a library spectrum that has been prepared for search
+void SpectraSTPreparedLibFile::insertEntry(fstream::off_type libFileOffset, SpectraSTPeakList* peakList) {
+
+  fstream::off_type pos = m_fout.tellp();
+  while (pos % 8 != 0) {
+    m_fout.put('\0');
+    pos++;
+  }
+
+  if (peakList->writePreparedToFile(m_fout)) {
+    preparedLibIndexEntry e;
+    e.libFileOffset = (unsigned long long)libFileOffset;
+    e.recordOffset = (unsigned long long)pos;
+    m_index.push_back(e);
+  }
+
+}
+
+// finish - appends the index after the last record, fills in the header, and moves the file into place
+void SpectraSTPreparedLibFile::finish() {
+
+  fstream::off_type pos = m_fout.tellp();
+  while (pos % 8 != 0) {
+    m_fout.put('\0');
+    pos++;
+  }
+
+  sort(m_index.begin(), m_index.end(), SpectraSTPreparedLibFile::sortIndexEntriesAsc);
+
+  unsigned long long indexOffset = (unsigned long long)pos;
+  unsigned long long numRecords = (unsigned long long)(m_index.size());
+
+  if (!m_index.empty()) {
+    m_fout.write((char*)(&(m_index[0])), m_index.size() * sizeof(preparedLibIndexEntry));
+  }
+
+  m_fout.seekp(40);
+  m_fout.write((char*)(&numRecords), sizeof(unsigned long long));
+  m_fout.write((char*)(&indexOffset), sizeof(unsigned long long));
+  m_fout.close();
+
+  if (!renameFile(m_fileName + ".tmp", m_fileName)) {
+    g_log->error("SEARCH", "Cannot rename file \"" + m_fileName + ".tmp\" to \"" + m_fileName + "\".");
+    removeFile(m_fileName + ".tmp");
+  }
+
+}
+
+// isUpToDate - checks that the file was created with the same search parameters, for the library as it is now
+bool SpectraSTPreparedLibFile::isUpToDate(unsigned long long paramsKey, string libFileName) {
+
+  if (!m_indexEntries) return (false);
+
+  unsigned long long fileParamsKey = 0;
+  unsigned long long fileLibFileSize = 0;
+  unsigned long long fileLibFileModTime = 0;
+  memcpy(&fileParamsKey, m_data + 16, sizeof(unsigned long long));
+  memcpy(&fileLibFileSize, m_data + 24, sizeof(unsigned long long));
+  memcpy(&fileLibFileModTime, m_data + 32, sizeof(unsigned long long));
+
+  unsigned long long libFileSize = 0;
+  unsigned long long libFileModTime = 0;
+  getFileStamp(libFileName, libFileSize, libFileModTime);
+
+  return (fileParamsKey == paramsKey && fileLibFileSize == libFileSize && fileLibFileModTime == libFileModTime);
+
+}
+
+// retrieve - looks up the record of the entry at the .splib file offset, and if there is one, puts the
+// prepared bins into the peak list. Returns false if there is no record, in which case the peak list is untouched.
+bool SpectraSTPreparedLibFile::retrieve(fstream::off_type libFileOffset, SpectraSTPeakList* peakList) {
+
+  if (!m_indexEntries) return (false);
+
+  preparedLibIndexEntry key;
+  key.libFileOffset = (unsigned long long)libFileOffset;
+  key.recordOffset = 0;
+
+  const preparedLibIndexEntry* found = lower_bound(m_indexEntries, m_indexEntries + m_numRecords, key, SpectraSTPreparedLibFile::sortIndexEntriesAsc);
+
+  if (found == m_indexEntries + m_numRecords || found->libFileOffset != key.libFileOffset) {
+    return (false);
+  }
+
+  peakList->readPreparedFromMappedFile(m_data + found->recordOffset);
+  return (true);
+
+}
+
+// sortIndexEntriesAsc - for sorting the index by .splib file offset
+bool SpectraSTPreparedLibFile::sortIndexEntriesAsc(preparedLibIndexEntry a, preparedLibIndexEntry b) {
+
+  return (a.libFileOffset < b.libFileOffset);
+
+}
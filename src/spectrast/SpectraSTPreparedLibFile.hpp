@@ -0,0 +1,137 @@
+#ifndef SPECTRASTPREPAREDLIBFILE_HPP_
+#define SPECTRASTPREPAREDLIBFILE_HPP_
+
+#include <string>
+#include <fstream>
+#include <vector>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTPreparedLibFile
+ *
+ * The search-ready library spectra (.spprep), kept next to the .splib of the same name. Preparing a library
+ * spectrum for search (SpectraSTPeakList::prepareForSearch -- scaling, rank transform, binning) gives the same
+ * result every time for the same search parameters, so it is done once for the entire library, and the
+ * packed bins are saved here. A search then copies them into the retrieved entries instead. The file is laid out as
+ *
+ * <header (HEADER_SIZE bytes): magic, format version, header size, params key, .splib size, .splib modification time,
+ *                              number of records, index offset>
+ * numRecords times, each starting on an 8-byte boundary:
+ *   <preparedLibRecord (fixed width)> <bins (float) x numPackedBins> <bin numbers (unsigned short) x numPackedBins>
+ * <index: numRecords preparedLibIndexEntry's, sorted by .splib file offset>
+ *
+ * The params key (see SpectraSTSearchParams::calcPreparationKey) and the size and modification time of the .splib
+ * tell whether the file still goes with the library and the search parameters; if not, it is simply re-created.
+ * Entries whose bins cannot be packed (see SpectraSTPeakList::packBins) have no record, and are prepared as usual.
+ */
+
+using namespace std;
+
+class SpectraSTPeakList;
+
+// preparedLibRecord - the fixed-width head of each record. 16 bytes, so that the bins following it stay aligned.
+struct preparedLibRecord {
+  float binMagnitude;
+  unsigned int numBins;
+  unsigned int numBinsPerMzUnit;
+  unsigned int numPackedBins;
+};
+
+// preparedLibIndexEntry - where the record of the entry at a .splib file offset is
+struct preparedLibIndexEntry {
+  unsigned long long libFileOffset;
+  unsigned long long recordOffset;
+};
+
+class SpectraSTPreparedLibFile {
+
+public:
+
+  // constructor for creation
+  SpectraSTPreparedLibFile(string fileName, unsigned long long paramsKey, string libFileName);
+
+  // constructor for retrieval
+  SpectraSTPreparedLibFile(string fileName);
+
+  ~SpectraSTPreparedLibFile();
+
+  // Creation methods
+  bool isOpen() { return (m_fout.good()); }
+  void insertEntry(fstream::off_type libFileOffset, SpectraSTPeakList* peakList);
+  void finish();
+
+  // Retrieval methods
+  bool isUpToDate(unsigned long long paramsKey, string libFileName);
+  bool retrieve(fstream::off_type libFileOffset, SpectraSTPeakList* peakList);
+
+  static const unsigned int HEADER_SIZE;
+  static const unsigned int FORMAT_VERSION;
+
+private:
+
+  // m_fileName - the file. While it is being created, it is written as <m_fileName>.tmp
+  string m_fileName;
+
+  // m_fout, m_index - the file being created, and the index to be written at its end
+  ofstream m_fout;
+  vector<preparedLibIndexEntry> m_index;
+
+  // m_data, m_size - the mapped file
+  const char* m_data;
+  unsigned long long m_size;
+
+  // m_indexEntries, m_numRecords - the index in the mapped file
+  const preparedLibIndexEntry* m_indexEntries;
+  unsigned long long m_numRecords;
+
+#ifdef MSVC
+  HANDLE m_fileHandle;
+  HANDLE m_mappingHandle;
+#else
+  int m_fd;
+#endif
+
+  static bool sortIndexEntriesAsc(preparedLibIndexEntry a, preparedLibIndexEntry b);
+
+  static const char MAGIC[8];
+
+};
+
+#endif /*SPECTRASTPREPAREDLIBFILE_HPP_*/
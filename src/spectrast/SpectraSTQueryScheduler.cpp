@@ -0,0 +1,360 @@
+#include "SpectraSTQueryScheduler.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTQueryScheduler
+ *
+ * Runs SpectraSTSearch::search() for individual queries on a pool of worker threads,
+ * handing the finished searches back in submission order.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+// constructor - spawns the worker threads
+SpectraSTQueryScheduler::SpectraSTQueryScheduler(SpectraSTLib* lib, unsigned int numWorkers, unsigned int maxNumPending) :
+  m_lib(lib),
+  m_numWorkers(numWorkers),
+  m_maxNumPending(maxNumPending),
+  m_queues(numWorkers),
+  m_finished(maxNumPending, NULL),
+  m_numSubmitted(0),
+  m_numRetrieved(0),
+  m_numQueued(0),
+  m_stop(false),
+  m_workerData(NULL),
+  m_queueLocks(NULL),
+  m_threads(NULL) {
+
+  if (m_numWorkers < 1) {
+    m_numWorkers = 1;
+    m_queues.resize(1);
+  }
+  if (m_maxNumPending < m_numWorkers) {
+    m_maxNumPending = m_numWorkers;
+    m_finished.assign(m_maxNumPending, NULL);
+  }
+
+#ifdef MSVC
+  InitializeCriticalSection(&m_stateLock);
+  InitializeConditionVariable(&m_workAvailable);
+  InitializeConditionVariable(&m_searchFinished);
+  m_queueLocks = new CRITICAL_SECTION[m_numWorkers];
+  for (unsigned int q = 0; q < m_numWorkers; q++) {
+    InitializeCriticalSection(&(m_queueLocks[q]));
+  }
+  m_threads = new HANDLE[m_numWorkers];
+#else
+  pthread_mutex_init(&m_stateLock, NULL);
+  pthread_cond_init(&m_workAvailable, NULL);
+  pthread_cond_init(&m_searchFinished, NULL);
+  m_queueLocks = new pthread_mutex_t[m_numWorkers];
+  for (unsigned int q = 0; q < m_numWorkers; q++) {
+    pthread_mutex_init(&(m_queueLocks[q]), NULL);
+  }
+  m_threads = new pthread_t[m_numWorkers];
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+#endif
+
+  m_workerData = new struct queryWorkerData[m_numWorkers];
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+    m_workerData[ti].schedulerPtr = this;
+    m_workerData[ti].workerIndex = ti;
+
+#ifdef MSVC
+    int returnCode = 0;
+    m_threads[ti] = CreateThread(NULL, 0, runWorkerThread, (void*)&m_workerData[ti], 0, NULL);
+    if (!m_threads[ti]) {
+      returnCode = ti + 1;
+    }
+#else
+    int returnCode = pthread_create(&m_threads[ti], &attr, runWorkerThread, (void*)(&(m_workerData[ti])));
+#endif
+
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
+      g_log->error("SEARCH", msg.str());
+      g_log->crash();
+    }
+  }
+
+#ifndef MSVC
+  pthread_attr_destroy(&attr);
+#endif
+
+}
+
+// destructor - tells the workers to quit once their queues are empty, and waits for them
+SpectraSTQueryScheduler::~SpectraSTQueryScheduler() {
+
+  lockState();
+  m_stop = true;
+#ifdef MSVC
+  WakeAllConditionVariable(&m_workAvailable);
+#else
+  pthread_cond_broadcast(&m_workAvailable);
+#endif
+  unlockState();
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+#ifdef MSVC
+    WaitForSingleObject(m_threads[ti], INFINITE);
+    CloseHandle(m_threads[ti]);
+#else
+    void* status;
+    int returnCode = pthread_join(m_threads[ti], &status);
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
+      g_log->error("SEARCH", msg.str());
+      g_log->crash();
+    }
+#endif
+
+  }
+
+  // normally the caller retrieves everything before destroying the scheduler; just in case
+  for (vector<SpectraSTSearch*>::iterator i = m_finished.begin(); i != m_finished.end(); i++) {
+    if (*i) delete (*i);
+  }
+
+#ifdef MSVC
+  for (unsigned int q = 0; q < m_numWorkers; q++) {
+    DeleteCriticalSection(&(m_queueLocks[q]));
+  }
+  DeleteCriticalSection(&m_stateLock);
+#else
+  for (unsigned int q = 0; q < m_numWorkers; q++) {
+    pthread_mutex_destroy(&(m_queueLocks[q]));
+  }
+  pthread_cond_destroy(&m_searchFinished);
+  pthread_cond_destroy(&m_workAvailable);
+  pthread_mutex_destroy(&m_stateLock);
+#endif
+
+  delete[] m_queueLocks;
+  delete[] m_threads;
+  delete[] m_workerData;
+
+}
+
+// submit - queues up a search. The scheduler takes ownership of the search until it is retrieved.
+// The caller must not submit when isFull() -- retrieve() something first.
+void SpectraSTQueryScheduler::submit(SpectraSTSearch* s) {
+
+  vector<SpectraSTSearch*> block(1, s);
+  submitBlock(block);
+}
+
+// submitBlock - queues up a block of searches, to be searched together by one worker with SpectraSTSearch::searchBlock().
+// They are retrieved one by one, in order, like searches submitted separately. The caller must not submit unless hasRoomFor(block.size()).
+void SpectraSTQueryScheduler::submitBlock(vector<SpectraSTSearch*>& block) {
+
+  unsigned long seq = m_numSubmitted;
+  m_numSubmitted += (unsigned long)(block.size());
+  unsigned int q = (unsigned int)(seq % m_numWorkers);
+
+  lockQueue(q);
+  m_queues[q].push_back(pair<unsigned long, vector<SpectraSTSearch*> >(seq, block));
+  unlockQueue(q);
+
+  lockState();
+  m_numQueued++;
+#ifdef MSVC
+  WakeConditionVariable(&m_workAvailable);
+#else
+  pthread_cond_signal(&m_workAvailable);
+#endif
+  unlockState();
+
+}
+
+// retrieve - returns the earliest-submitted search that has not yet been retrieved, if it is finished.
+// If wait is true, blocks until it is finished. Returns NULL if there is nothing (finished) to retrieve.
+SpectraSTSearch* SpectraSTQueryScheduler::retrieve(bool wait) {
+
+  if (isEmpty()) return (NULL);
+
+  unsigned int slot = (unsigned int)(m_numRetrieved % m_maxNumPending);
+
+  lockState();
+  while (wait && !m_finished[slot]) {
+#ifdef MSVC
+    SleepConditionVariableCS(&m_searchFinished, &m_stateLock, INFINITE);
+#else
+    pthread_cond_wait(&m_searchFinished, &m_stateLock);
+#endif
+  }
+  SpectraSTSearch* s = m_finished[slot];
+  m_finished[slot] = NULL;
+  unlockState();
+
+  if (s) m_numRetrieved++;
+  return (s);
+}
+
+#ifdef MSVC
+DWORD WINAPI SpectraSTQueryScheduler::runWorkerThread(LPVOID threadArg) {
+#else
+void* SpectraSTQueryScheduler::runWorkerThread(void* threadArg) {
+#endif
+
+  struct queryWorkerData* workerData = (struct queryWorkerData*)threadArg;
+
+  workerData->schedulerPtr->workerLoop(workerData->workerIndex);
+
+  long ti = (long)(workerData->workerIndex);
+
+#ifdef MSVC
+  ExitThread(0);
+#else
+  pthread_exit((void*)ti);
+#endif
+
+}
+
+// workerLoop - claims one queued job at a time, runs it, and files the results
+void SpectraSTQueryScheduler::workerLoop(unsigned int workerIndex) {
+
+  while (true) {
+
+    lockState();
+    while (m_numQueued == 0 && !m_stop) {
+#ifdef MSVC
+      SleepConditionVariableCS(&m_workAvailable, &m_stateLock, INFINITE);
+#else
+      pthread_cond_wait(&m_workAvailable, &m_stateLock);
+#endif
+    }
+    if (m_numQueued == 0) {
+      // told to stop, and nothing left to do
+      unlockState();
+      return;
+    }
+    m_numQueued--; // claimed one -- there is now guaranteed to be a job for us in one of the queues
+    unlockState();
+
+    pair<unsigned long, vector<SpectraSTSearch*> > job = takeJob(workerIndex);
+
+    SpectraSTSearch::searchBlock(job.second, m_lib);
+
+    lockState();
+    for (unsigned int k = 0; k < (unsigned int)(job.second.size()); k++) {
+      m_finished[(job.first + k) % m_maxNumPending] = job.second[k];
+    }
+#ifdef MSVC
+    WakeConditionVariable(&m_searchFinished);
+#else
+    pthread_cond_signal(&m_searchFinished);
+#endif
+    unlockState();
+
+  }
+
+}
+
+// takeJob - takes the oldest job from the worker's own queue, or failing that,
+// steals the newest job from another worker's queue
+pair<unsigned long, vector<SpectraSTSearch*> > SpectraSTQueryScheduler::takeJob(unsigned int workerIndex) {
+
+  while (true) {
+
+    for (unsigned int k = 0; k < m_numWorkers; k++) {
+
+      unsigned int q = (workerIndex + k) % m_numWorkers;
+
+      lockQueue(q);
+      if (!(m_queues[q].empty())) {
+	pair<unsigned long, vector<SpectraSTSearch*> > job;
+	if (k == 0) {
+	  job = m_queues[q].front();
+	  m_queues[q].pop_front();
+	} else {
+	  job = m_queues[q].back();
+	  m_queues[q].pop_back();
+	}
+	unlockQueue(q);
+	return (job);
+      }
+      unlockQueue(q);
+    }
+
+    // every claimed job is in some queue, but another worker may have beaten us to the one we saw. go around again.
+  }
+
+}
+
+// lockState - locks the counters and the finished list
+void SpectraSTQueryScheduler::lockState() {
+#ifdef MSVC
+  EnterCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_lock(&m_stateLock);
+#endif
+}
+
+// unlockState - unlocks the counters and the finished list
+void SpectraSTQueryScheduler::unlockState() {
+#ifdef MSVC
+  LeaveCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_unlock(&m_stateLock);
+#endif
+}
+
+// lockQueue - locks one worker's queue
+void SpectraSTQueryScheduler::lockQueue(unsigned int q) {
+#ifdef MSVC
+  EnterCriticalSection(&(m_queueLocks[q]));
+#else
+  pthread_mutex_lock(&(m_queueLocks[q]));
+#endif
+}
+
+// unlockQueue - unlocks one worker's queue
+void SpectraSTQueryScheduler::unlockQueue(unsigned int q) {
+#ifdef MSVC
+  LeaveCriticalSection(&(m_queueLocks[q]));
+#else
+  pthread_mutex_unlock(&(m_queueLocks[q]));
+#endif
+}
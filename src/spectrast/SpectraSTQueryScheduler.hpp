@@ -0,0 +1,142 @@
+#ifndef SPECTRASTQUERYSCHEDULER_HPP_
+#define SPECTRASTQUERYSCHEDULER_HPP_
+
+#include "SpectraSTSearch.hpp"
+#include "SpectraSTLib.hpp"
+
+#include <vector>
+#include <deque>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTQueryScheduler
+ *
+ * Runs SpectraSTSearch::search() for individual queries on a pool of worker threads.
+ * The reader (the thread parsing the search file) submits searches, which are dealt
+ * round-robin to per-worker queues; a worker that runs dry steals from the back of the
+ * other workers' queues. Finished searches are handed back to the reader strictly in
+ * submission order, so that printing (and stats-keeping) remains single-threaded and
+ * the output is identical to that of a single-threaded search.
+ *
+ * The number of searches in flight is bounded, so that the reader does not run away
+ * from the workers and pile up the whole file in memory.
+ *
+ */
+
+using namespace std;
+
+struct queryWorkerData;
+
+class SpectraSTQueryScheduler {
+
+public:
+  SpectraSTQueryScheduler(SpectraSTLib* lib, unsigned int numWorkers, unsigned int maxNumPending);
+  ~SpectraSTQueryScheduler();
+
+  void submit(SpectraSTSearch* s);
+  void submitBlock(vector<SpectraSTSearch*>& block);
+  SpectraSTSearch* retrieve(bool wait);
+
+  bool isFull() { return (m_numSubmitted - m_numRetrieved >= m_maxNumPending); }
+  bool hasRoomFor(unsigned int numSearches) { return (m_numSubmitted + numSearches - m_numRetrieved <= m_maxNumPending); }
+  bool isEmpty() { return (m_numSubmitted == m_numRetrieved); }
+
+#ifdef MSVC
+  static DWORD WINAPI runWorkerThread(LPVOID threadArg);
+#else
+  static void* runWorkerThread(void* threadArg);
+#endif
+
+private:
+
+  // pointer to the library object - NOT a property of this class
+  SpectraSTLib* m_lib;
+
+  unsigned int m_numWorkers;
+  unsigned int m_maxNumPending;
+
+  // one queue of (sequence number of the first search, searches) per worker, each guarded by its own lock. A job is 
+  // usually one search; a block of searches (see SpectraSTSearch::searchBlock) is one job, numbered consecutively.
+  vector<deque<pair<unsigned long, vector<SpectraSTSearch*> > > > m_queues;
+
+  // finished searches waiting to be retrieved, indexed by sequence number modulo m_maxNumPending
+  vector<SpectraSTSearch*> m_finished;
+
+  // counters - m_numSubmitted and m_numRetrieved are only touched by the reader,
+  // m_numQueued and m_stop are guarded by the state lock
+  unsigned long m_numSubmitted;
+  unsigned long m_numRetrieved;
+  unsigned int m_numQueued;
+  bool m_stop;
+
+  struct queryWorkerData* m_workerData;
+
+  void workerLoop(unsigned int workerIndex);
+  pair<unsigned long, vector<SpectraSTSearch*> > takeJob(unsigned int workerIndex);
+
+  void lockState();
+  void unlockState();
+  void lockQueue(unsigned int q);
+  void unlockQueue(unsigned int q);
+
+#ifdef MSVC
+  CRITICAL_SECTION m_stateLock;
+  CONDITION_VARIABLE m_workAvailable;
+  CONDITION_VARIABLE m_searchFinished;
+  CRITICAL_SECTION* m_queueLocks;
+  HANDLE* m_threads;
+#else
+  pthread_mutex_t m_stateLock;
+  pthread_cond_t m_workAvailable;
+  pthread_cond_t m_searchFinished;
+  pthread_mutex_t* m_queueLocks;
+  pthread_t* m_threads;
+#endif
+
+};
+
+struct queryWorkerData {
+  SpectraSTQueryScheduler* schedulerPtr;
+  unsigned int workerIndex;
+};
+
+#endif /*SPECTRASTQUERYSCHEDULER_HPP_*/
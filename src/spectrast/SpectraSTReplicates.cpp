@@ -20,7 +20,7 @@ extern SpectraSTLog* g_log;
 //extern double g_retainedSq;
 //extern int g_retainedCount;
 
-SpectraSTReplicates::SpectraSTReplicates(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers) :
+SpectraSTReplicates::SpectraSTReplicates(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers, unsigned int numThreads) :
   m_params(params),
   m_reps(),
   m_numUsed(0),
@@ -30,7 +30,14 @@ SpectraSTReplicates::SpectraSTReplicates(vector<SpectraSTLibEntry*>& entries, Sp
   m_instruments(),
   m_missingXCorr(false),
   m_recordRawSpectra(false),
-  m_denoisers(denoisers) {
+  m_denoisers(denoisers),
+  m_numThreads(numThreads),
+  m_task(BIN_FOR_COMPARE),
+  m_taskPls(),
+  m_taskTarget(NULL),
+  m_taskClusters(),
+  m_taskDots(),
+  m_taskFoundClusters() {
   
   m_recordRawSpectra = m_params.recordRawSpectra;  
     
@@ -117,10 +124,7 @@ void SpectraSTReplicates::addEntry(SpectraSTLibEntry* entry) {
   r.prob = entry->getProb();
   
   // parse out xcorr - only available from SEQUEST of course
-  string xcorrStr("");
-  if (entry->getOneComment("XCorr", xcorrStr)) {
-    r.xcorr = atof(xcorrStr.c_str());
-  } else {
+  if (!(entry->getOneComment("XCorr", r.xcorr))) {
     r.xcorr = 1.0;
     m_missingXCorr = true;
   }
@@ -128,22 +132,15 @@ void SpectraSTReplicates::addEntry(SpectraSTLibEntry* entry) {
   // parse out S/N, if not available, calculates it
   // note that previous consensus spectra will already have an SN field, so that
   // we don't have to calcSignalToNoise for them, as it won't work (They already had noise peaks removed).
-  string snStr("");
-  if (entry->getOneComment("SN", snStr)) {
-    r.sn = atof(snStr.c_str());
-  } else {
+  if (!(entry->getOneComment("SN", r.sn))) {
     r.sn = entry->getPeakList()->calcSignalToNoise();
   }
   
   // parse out precursor intensity.
-  string preIntStr("");
   double preInt = 10000.0; // meaningless default value. avoid this option if precursor intensity is not consistently present
-  if (entry->getOneComment("PrecursorIntensity", preIntStr)) {
-    preInt = atof(preIntStr.c_str());
+  if (entry->getOneComment("PrecursorIntensity", preInt)) {
     if (preInt < 0.1) { 
-      if (entry->getOneComment("TotalIonCurrent", preIntStr)) {
-	preInt = atof(preIntStr.c_str());
-      }  
+      entry->getOneComment("TotalIonCurrent", preInt);
     }
   } 
   entry->getPeakList()->setPrecursorIntensity(preInt);
@@ -379,6 +376,13 @@ SpectraSTLibEntry* SpectraSTReplicates::makeConsensusSpectrum() {
     logss << "Creating consensus of " << m_numUsed << " (of " << m_numTotal << ") replicates: " << m_name;
     g_log->log("CREATE", logss.str());
 
+    // rank the peak lists by intensity first, on several threads if there are many
+    unsigned int numThreads = calcNumThreads((unsigned int)(pls.size()));
+    if (numThreads > 1) {
+      m_taskPls = pls;
+      runTask(RANK_BY_INTENSITY, numThreads);
+    }
+
     // calling the consensus-forming constructor
     SpectraSTPeakList* cpl = new SpectraSTPeakList(pls, usedReps[0]->entry->getPeptidePtr(), m_numUsed, m_params.peakQuorum, m_params.maximumNumPeaksUsed, m_denoisers, m_params.keepRawIntensities);
   
@@ -524,46 +528,89 @@ bool SpectraSTReplicates::removeDissimilarReplicates() {
 
   vector<SpectraSTLibEntry*> clusters;
   vector<unsigned int> clusterSize;
+  
+  // On several threads, the replicates are taken a block at a time. The replicates in the block are first compared to the clusters 
+  // started before the block, all at once; then they are gone through in order, comparing to the clusters started within the block.
+  // Since a replicate goes to the first cluster it is similar to, this gives the same clusters as going through the replicates one by one.
+  unsigned int numReps = (unsigned int)(m_reps.size());
+  unsigned int numThreads = calcNumThreads(numReps);
+  unsigned int blockSize = (numThreads > 1 ? numThreads * MIN_NUM_REPLICATES_PER_THREAD : numReps);
+
+  if (numThreads > 1) {
+    // bin all replicates beforehand, so that comparing them does not change them
+    m_taskPls.clear();
+    for (vector<Replicate>::iterator rep = m_reps.begin(); rep != m_reps.end(); rep++) {
+      m_taskPls.push_back(rep->entry->getPeakList());
+    }
+    runTask(BIN_FOR_COMPARE, numThreads);
+  }
     
-  for (vector<Replicate>::iterator rep = m_reps.begin(); rep != m_reps.end(); rep++) {
+  for (unsigned int blockStart = 0; blockStart < numReps; blockStart += blockSize) {
     
-    SpectraSTPeakList* pl = rep->entry->getPeakList();
-    int mdInt = rep->entry->getMassDiffInt();
+    unsigned int blockEnd = (blockStart + blockSize < numReps ? blockStart + blockSize : numReps);
     
-    for (vector<SpectraSTLibEntry*>::size_type cl = 0; cl < clusters.size(); cl++) {
-     
-      // hijack -- do not cluster replicates or different massdiff integer values
-      // if (mdInt != clusters[cl]->getMassDiffInt()) {
-	 // do not attempt to cluster
-      //	continue;
-      //      }
-      // end hijack
-      
-      double dot = clusters[cl]->getPeakList()->compare(pl);
-      if (dot >= 0.9999) {
-        // fishy. probably identical spectra being included twice!
-        string query1("");
-        string query2("");
-        if (rep->entry->getOneComment("RawSpectrum", query1) && clusters[cl]->getOneComment("RawSpectrum", query2)) {
-          g_log->log("CREATE", "Identical replicates: " + query1 + " and " + query2);
-        }
-        // will not use this spectrum
-        rep->status = 0; 
-        break; 
+    // for each replicate in the block, the first of the clusters started before the block that it is similar to (or -1 if none), 
+    // and the dot product
+    unsigned int numClustersCompared = 0;
+    m_taskFoundClusters.assign(blockEnd - blockStart, -1);
+    
+    if (numThreads > 1 && !(clusters.empty())) {
+      numClustersCompared = (unsigned int)(clusters.size());
+      m_taskClusters.clear();
+      for (vector<SpectraSTLibEntry*>::iterator cl = clusters.begin(); cl != clusters.end(); cl++) {
+	m_taskClusters.push_back((*cl)->getPeakList());
       }
-      if (dot >= 0.6) {
-      	// similar enough to cluster cl. add to it and we're done with this replicate.
-        rep->status = -((int)cl + 1);
-      	clusterSize[cl] += rep->numUsed; 
-        break; 
+      m_taskPls.clear();
+      for (unsigned int k = blockStart; k < blockEnd; k++) {
+	m_taskPls.push_back(m_reps[k].entry->getPeakList());
       }
+      runTask(FIND_SIMILAR_CLUSTER, numThreads);
     }
     
-    if (rep->status > 0) { 
-      // still doesn't belong to any cluster. start a new one
-      rep->status = -((int)(clusters.size()) + 1);
-      clusters.push_back(rep->entry);
-      clusterSize.push_back(rep->numUsed);
+    for (unsigned int k = blockStart; k < blockEnd; k++) {
+    
+      vector<Replicate>::iterator rep = m_reps.begin() + k;
+      SpectraSTPeakList* pl = rep->entry->getPeakList();
+      int mdInt = rep->entry->getMassDiffInt();
+      
+      int foundCluster = m_taskFoundClusters[k - blockStart];
+      vector<SpectraSTLibEntry*>::size_type firstCluster = (foundCluster >= 0 ? (vector<SpectraSTLibEntry*>::size_type)foundCluster : numClustersCompared);
+      
+      for (vector<SpectraSTLibEntry*>::size_type cl = firstCluster; cl < clusters.size(); cl++) {
+       
+	// hijack -- do not cluster replicates or different massdiff integer values
+	// if (mdInt != clusters[cl]->getMassDiffInt()) {
+	   // do not attempt to cluster
+	//	continue;
+	//      }
+	// end hijack
+	
+	double dot = ((int)cl == foundCluster ? m_taskDots[k - blockStart] : clusters[cl]->getPeakList()->compare(pl));
+	if (dot >= 0.9999) {
+	  // fishy. probably identical spectra being included twice!
+	  string query1("");
+	  string query2("");
+	  if (rep->entry->getOneComment("RawSpectrum", query1) && clusters[cl]->getOneComment("RawSpectrum", query2)) {
+	    g_log->log("CREATE", "Identical replicates: " + query1 + " and " + query2);
+	  }
+	  // will not use this spectrum
+	  rep->status = 0; 
+	  break; 
+	}
+	if (dot >= 0.6) {
+	  // similar enough to cluster cl. add to it and we're done with this replicate.
+	  rep->status = -((int)cl + 1);
+	  clusterSize[cl] += rep->numUsed; 
+	  break; 
+	}
+      }
+      
+      if (rep->status > 0) { 
+	// still doesn't belong to any cluster. start a new one
+	rep->status = -((int)(clusters.size()) + 1);
+	clusters.push_back(rep->entry);
+	clusterSize.push_back(rep->numUsed);
+      }
     }
   }    
 
@@ -635,11 +682,26 @@ void SpectraSTReplicates::aggregateStats(SpectraSTLibEntry* final, SpectraSTPeak
   unsigned int precIntCount = 0;
   unsigned int origMaxIntCount = 0;
   
+  // the dot products between the consensus and the replicates, on several threads if there are many
+  unsigned int numThreads = calcNumThreads((unsigned int)(usedReps.size()));
+  if (numThreads > 1) {
+    // the same binning as compare()
+    pl->binPeaksWithScaling(0.0, 0.5, 1.0, 1, 0.5, false, true, 0.0);
+    m_taskPls.clear();
+    for (vector<Replicate*>::iterator r = usedReps.begin(); r != usedReps.end(); r++) {
+      m_taskPls.push_back((*r)->entry->getPeakList());
+    }
+    runTask(BIN_FOR_COMPARE, numThreads);
+    m_taskTarget = pl;
+    runTask(COMPARE_TO_TARGET, numThreads);
+  }
+  
   // loop over all replicates for various evaluation data
-  for (vector<Replicate*>::iterator r = usedReps.begin(); r != usedReps.end(); r++) {
+  unsigned int repCount = 0;
+  for (vector<Replicate*>::iterator r = usedReps.begin(); r != usedReps.end(); r++, repCount++) {
     
      // check dot product between consensus and each replicate
-    double dot = pl->compare((*r)->entry->getPeakList());
+    double dot = (numThreads > 1 ? m_taskDots[repCount] : pl->compare((*r)->entry->getPeakList()));
 //    cerr << dot << endl;
     sumDot += dot;
     sumSqDot += dot * dot;
@@ -694,22 +756,21 @@ void SpectraSTReplicates::aggregateStats(SpectraSTLibEntry* final, SpectraSTPeak
     }
     
     
-    string ticStr("");
-    if ((*r)->entry->getOneComment("TotalIonCurrent", ticStr)) {
-      sumTic += (atof(ticStr.c_str()) * (*r)->numUsed);
+    double tic = 0.0;
+    if ((*r)->entry->getOneComment("TotalIonCurrent", tic)) {
+      sumTic += (tic * (*r)->numUsed);
       ticCount += (*r)->numUsed;
     }
   
-    string precIntStr("");
-    if ((*r)->entry->getOneComment("PrecursorIntensity", precIntStr)) {
-      sumPrecInt += (atof(precIntStr.c_str()) * (*r)->numUsed);
+    double precInt = 0.0;
+    if ((*r)->entry->getOneComment("PrecursorIntensity", precInt)) {
+      sumPrecInt += (precInt * (*r)->numUsed);
       precIntCount += (*r)->numUsed;
     }
 
     double origMaxInt = 0.0;
-    string origMaxIntStr("");
-    if ((*r)->entry->getOneComment("OrigMaxIntensity", origMaxIntStr)) {
-      sumOrigMaxInt += (atof(origMaxIntStr.c_str()) * (*r)->numUsed);
+    if ((*r)->entry->getOneComment("OrigMaxIntensity", origMaxInt)) {
+      sumOrigMaxInt += (origMaxInt * (*r)->numUsed);
       origMaxIntCount += (*r)->numUsed;
     }
     
@@ -914,6 +975,147 @@ void SpectraSTReplicates::plotConsensus(SpectraSTLibEntry* consensus, SpectraSTP
   }
     
 	
+}
+
+// calcNumThreads - the number of threads to share out a task on numReplicates replicates among: at most m_numThreads,
+// with at least MIN_NUM_REPLICATES_PER_THREAD replicates each
+unsigned int SpectraSTReplicates::calcNumThreads(unsigned int numReplicates) {
+
+  unsigned int numThreads = numReplicates / MIN_NUM_REPLICATES_PER_THREAD;
+  if (numThreads > m_numThreads) numThreads = m_numThreads;
+  if (numThreads < 1) numThreads = 1;
+  return (numThreads);
+}
+
+// runTask - does a task for all of m_taskPls, shared out among numThreads threads (including this one) in contiguous slices.
+// Returns when all is done.
+void SpectraSTReplicates::runTask(replicateTask task, unsigned int numThreads) {
+
+  m_task = task;
+
+  unsigned int numItems = (unsigned int)(m_taskPls.size());
+  m_taskDots.assign(numItems, 0.0);
+  if (task == FIND_SIMILAR_CLUSTER) m_taskFoundClusters.assign(numItems, -1);
+
+  if (numThreads > numItems) numThreads = numItems;
+  if (numThreads <= 1) {
+    doTaskItems(0, numItems);
+    return;
+  }
+
+  vector<struct replicateWorkerData> workerData(numThreads);
+  for (unsigned int ti = 0; ti < numThreads; ti++) {
+    workerData[ti].replicatesPtr = this;
+    workerData[ti].first = (unsigned int)((unsigned long long)numItems * ti / numThreads);
+    workerData[ti].last = (unsigned int)((unsigned long long)numItems * (ti + 1) / numThreads);
+  }
+
+  // the first slice is done on this thread
+#ifdef MSVC
+  vector<HANDLE> threads(numThreads, (HANDLE)NULL);
+#else
+  vector<pthread_t> threads(numThreads);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+#endif
+
+  for (unsigned int ti = 1; ti < numThreads; ti++) {
+
+#ifdef MSVC
+    int returnCode = 0;
+    threads[ti] = CreateThread(NULL, 0, runWorkerThread, (void*)&workerData[ti], 0, NULL);
+    if (!threads[ti]) {
+      returnCode = ti + 1;
+    }
+#else
+    int returnCode = pthread_create(&threads[ti], &attr, runWorkerThread, (void*)(&(workerData[ti])));
+#endif
+
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
+      g_log->error("CREATE", msg.str());
+      g_log->crash();
+    }
+  }
+
+#ifndef MSVC
+  pthread_attr_destroy(&attr);
+#endif
+
+  doTaskItems(workerData[0].first, workerData[0].last);
+
+  for (unsigned int ti = 1; ti < numThreads; ti++) {
+
+#ifdef MSVC
+    WaitForSingleObject(threads[ti], INFINITE);
+    CloseHandle(threads[ti]);
+#else
+    void* status;
+    int returnCode = pthread_join(threads[ti], &status);
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
+      g_log->error("CREATE", msg.str());
+      g_log->crash();
+    }
+#endif
+
+  }
+
+}
+
+// doTaskItems - does the current task for m_taskPls[first] to m_taskPls[last - 1]
+void SpectraSTReplicates::doTaskItems(unsigned int first, unsigned int last) {
+
+  for (unsigned int k = first; k < last; k++) {
+
+    SpectraSTPeakList* pl = m_taskPls[k];
+
+    if (m_task == BIN_FOR_COMPARE) {
+      // the same binning as compare()
+      pl->binPeaksWithScaling(0.0, 0.5, 1.0, 1, 0.5, false, true, 0.0);
+
+    } else if (m_task == RANK_BY_INTENSITY) {
+      pl->rankByIntensity();
+
+    } else if (m_task == COMPARE_TO_TARGET) {
+      m_taskDots[k] = m_taskTarget->compare(pl);
+
+    } else {
+      // FIND_SIMILAR_CLUSTER - the first cluster the replicate is similar (or identical) to, as in removeDissimilarReplicates()
+      for (unsigned int cl = 0; cl < (unsigned int)(m_taskClusters.size()); cl++) {
+	double dot = m_taskClusters[cl]->compare(pl);
+	if (dot >= 0.6) {
+	  m_taskFoundClusters[k] = (int)cl;
+	  m_taskDots[k] = dot;
+	  break;
+	}
+      }
+    }
+  }
+
+}
+
+// runWorkerThread - the thread function of the threads started by runTask(): does the slice of the task given in threadArg
+#ifdef MSVC
+DWORD WINAPI SpectraSTReplicates::runWorkerThread(LPVOID threadArg) {
+#else
+void* SpectraSTReplicates::runWorkerThread(void* threadArg) {
+#endif
+
+  struct replicateWorkerData* workerData = (struct replicateWorkerData*)threadArg;
+
+  workerData->replicatesPtr->doTaskItems(workerData->first, workerData->last);
+
+#ifdef MSVC
+  ExitThread(0);
+#else
+  pthread_exit(NULL);
+#endif
+
 }
 
 // sortReplicatesByWeight - comparator for sorting replicates by weight.
@@ -11,6 +11,16 @@
 #include <string>
 #include <vector>
 
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
 /*
 
 Program       : Spectrast
@@ -46,6 +56,9 @@ hlam@systemsbiology.org
  * 
  * Manages a set of "replicate spectra" -- spectra that are spectrally similar and are identified to the same peptide ion.
  * Performs function like weighting, consensus creation, etc. 
+ *
+ * With -c_THR, the per-replicate work of a large set of replicates (binning, ranking and comparing the spectra)
+ * is shared out among threads. The results are the same as on one thread.
  */
 
 using namespace std;
@@ -61,10 +74,12 @@ typedef struct _replicate {
 	double xcorr;
 } Replicate;
 
+struct replicateWorkerData;
+
 class SpectraSTReplicates {
 
 public:
-  SpectraSTReplicates(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers = NULL);
+  SpectraSTReplicates(vector<SpectraSTLibEntry*>& entries, SpectraSTCreateParams& params, vector<SpectraSTDenoiser*>* denoisers = NULL, unsigned int numThreads = 1);
 
   virtual ~SpectraSTReplicates();
 
@@ -76,8 +91,17 @@ public:
   
   static double getMedian(vector<double>& v);
 
+#ifdef MSVC
+  static DWORD WINAPI runWorkerThread(LPVOID threadArg);
+#else
+  static void* runWorkerThread(void* threadArg);
+#endif
+
 private:
 
+  // the per-replicate tasks that can be shared out among threads
+  enum replicateTask { BIN_FOR_COMPARE = 0, RANK_BY_INTENSITY, COMPARE_TO_TARGET, FIND_SIMILAR_CLUSTER };
+
   SpectraSTCreateParams& m_params; 
   Peptide* m_pep; // The Peptide object representing the identification of these replicates. NOT a property of this class
   string m_name;
@@ -93,11 +117,24 @@ private:
   
   vector<SpectraSTDenoiser*>* m_denoisers;
   
+  // m_numThreads - the most threads to share out the per-replicate tasks among. 1 when already on a worker thread
+  // (e.g. of SpectraSTBuildScheduler), which is then busy enough with its own peptide ion.
+  unsigned int m_numThreads;
+  
   // hashes containing sequence search, sample source, and instrument information (parsed from Comment fields)
   map<char, map<string, pair<double, double> >* > m_seqs;
   map<string, pair<unsigned int, unsigned int> > m_samples;
   map<string, pair<unsigned int, unsigned int> > m_instruments;
   
+  // the task being shared out among threads: the peak lists to work on, and the results for each. For COMPARE_TO_TARGET,
+  // the peak list they are compared to; for FIND_SIMILAR_CLUSTER, the peak lists of the clusters they are compared to.
+  replicateTask m_task;
+  vector<SpectraSTPeakList*> m_taskPls;
+  SpectraSTPeakList* m_taskTarget;
+  vector<SpectraSTPeakList*> m_taskClusters;
+  vector<double> m_taskDots;
+  vector<int> m_taskFoundClusters;
+
 
   void addEntry(SpectraSTLibEntry* entry);
   bool removeDissimilarReplicates();
@@ -109,8 +146,18 @@ private:
   void processBestReplicate(SpectraSTLibEntry* best, vector<Replicate*>& usedReps, bool isRaw);
   void processSingle(SpectraSTLibEntry* single, bool isRaw);
 
+  unsigned int calcNumThreads(unsigned int numReplicates);
+  void runTask(replicateTask task, unsigned int numThreads);
+  void doTaskItems(unsigned int first, unsigned int last);
+
   static bool sortReplicatesByWeight(Replicate a, Replicate b);
 
 };
 
+struct replicateWorkerData {
+  SpectraSTReplicates* replicatesPtr;
+  unsigned int first;
+  unsigned int last;
+};
+
 #endif /*SPECTRASTREPLICATES_HPP_*/
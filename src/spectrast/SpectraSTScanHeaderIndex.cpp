@@ -0,0 +1,233 @@
+#include "SpectraSTScanHeaderIndex.hpp"
+#include "SpectraSTLog.hpp"
+#include "FileUtils.hpp"
+
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTScanHeaderIndex
+ *
+ * The scan headers of an .mzXML file, saved in a .spscan file next to it. See the header file for the layout.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+const char SpectraSTScanHeaderIndex::MAGIC[8] = { 'S', 'P', 'S', 'C', 'A', 'N', '\0', '\0' };
+
+// <magic (8)> <format version (4)> <header size (4)> <input file size (8)> <input file modification time (8)>
+// <number of records (8)> <records offset (8)>
+const unsigned int SpectraSTScanHeaderIndex::HEADER_SIZE = 48;
+const unsigned int SpectraSTScanHeaderIndex::FORMAT_VERSION = 1;
+
+// constructor
+SpectraSTScanHeaderIndex::SpectraSTScanHeaderIndex(string fileName) :
+  m_fileName(fileName),
+  m_records() {
+
+}
+
+// destructor
+SpectraSTScanHeaderIndex::~SpectraSTScanHeaderIndex() {
+
+}
+
+// load - gets the headers of scans 1 to numScans of the file opened by cramp. They are read from the .spscan file
+// if it is up to date; otherwise they are read from the file itself, and the .spscan file is (re-)created.
+// Returns true if the .spscan file was used.
+bool SpectraSTScanHeaderIndex::load(cRamp* cramp, int numScans) {
+
+  string indexFileName(m_fileName + ".spscan");
+
+  if (readFromFile(indexFileName, numScans)) {
+    return (true);
+  }
+
+  m_records.assign(numScans > 0 ? numScans : 0, scanHeaderRecord());
+  for (int k = 1; k <= numScans; k++) {
+    readScanHeader(cramp, k, m_records[k - 1]);
+  }
+
+  writeToFile(indexFileName);
+
+  return (false);
+
+}
+
+// getScanHeader - gets the header of a scan. Returns false if the scan has no readable header.
+bool SpectraSTScanHeaderIndex::getScanHeader(int scanNum, scanHeaderRecord& header) {
+
+  if (scanNum < 1 || scanNum > (int)(m_records.size()) || !(m_records[scanNum - 1].isFound)) {
+    return (false);
+  }
+
+  header = m_records[scanNum - 1];
+  return (true);
+
+}
+
+// readScanHeader - reads the header of a scan from the file opened by cramp. Returns false if the scan has no readable header.
+bool SpectraSTScanHeaderIndex::readScanHeader(cRamp* cramp, int scanNum, scanHeaderRecord& header) {
+
+  rampScanInfo* scanInfo = cramp->getScanHeaderInfo(scanNum);
+  bool isFound = makeScanHeader(scanInfo, header);
+  if (scanInfo) delete (scanInfo);
+  return (isFound);
+
+}
+
+// makeScanHeader - fills in the header record from a scan header read by RAMP (which may be NULL,
+// if it could not be read). Returns false if there is no header.
+bool SpectraSTScanHeaderIndex::makeScanHeader(rampScanInfo* scanInfo, scanHeaderRecord& header) {
+
+  memset(&header, 0, sizeof(scanHeaderRecord));
+
+  if (!scanInfo) {
+    return (false);
+  }
+
+  header.filePosition = (long long)(scanInfo->m_data.filePosition);
+  header.precursorMz = scanInfo->m_data.precursorMZ;
+  header.precursorIntensity = scanInfo->m_data.precursorIntensity;
+  header.totIonCurrent = scanInfo->m_data.totIonCurrent;
+  header.retentionTime = scanInfo->getRetentionTimeSeconds();
+  header.scanNum = scanInfo->m_data.acquisitionNum;
+  header.msLevel = scanInfo->m_data.msLevel;
+  header.precursorCharge = scanInfo->m_data.precursorCharge;
+  header.peakCount = scanInfo->m_data.peaksCount;
+  header.numPossibleCharges = scanInfo->m_data.numPossibleCharges;
+  for (int ch = 1; ch < 8; ch++) {
+    if (scanInfo->m_data.possibleChargesArray[ch]) header.possibleCharges |= (unsigned short)(1 << ch);
+  }
+  header.isFound = 1;
+  // the record was zeroed above, so copying at most SCANTYPE_LENGTH - 1 characters leaves it terminated
+  const char* activationMethod = scanInfo->m_data.activationMethod;
+  const char* activationMethodEnd = (const char*)memchr(activationMethod, '\0', SCANTYPE_LENGTH - 1);
+  memcpy(header.activationMethod, activationMethod, activationMethodEnd ? activationMethodEnd - activationMethod : SCANTYPE_LENGTH - 1);
+
+  return (true);
+
+}
+
+// readFromFile - reads the records from the .spscan file. Returns false if there is no such file, or if
+// it does not go with the input file as it is now.
+bool SpectraSTScanHeaderIndex::readFromFile(string indexFileName, int numScans) {
+
+  ifstream fin;
+  if (!myFileOpen(fin, indexFileName, true)) {
+    return (false);
+  }
+
+  char header[48];
+  fin.read(header, HEADER_SIZE);
+  if (!fin.good()) {
+    return (false);
+  }
+
+  unsigned int formatVersion = 0;
+  unsigned int headerSize = 0;
+  unsigned long long fileSize = 0;
+  unsigned long long fileModTime = 0;
+  unsigned long long numRecords = 0;
+  unsigned long long recordsOffset = 0;
+  memcpy(&formatVersion, header + 8, sizeof(unsigned int));
+  memcpy(&headerSize, header + 12, sizeof(unsigned int));
+  memcpy(&fileSize, header + 16, sizeof(unsigned long long));
+  memcpy(&fileModTime, header + 24, sizeof(unsigned long long));
+  memcpy(&numRecords, header + 32, sizeof(unsigned long long));
+  memcpy(&recordsOffset, header + 40, sizeof(unsigned long long));
+
+  unsigned long long inputFileSize = 0;
+  unsigned long long inputFileModTime = 0;
+  getFileStamp(m_fileName, inputFileSize, inputFileModTime);
+
+  if (memcmp(header, MAGIC, 8) != 0 || formatVersion != FORMAT_VERSION || headerSize != HEADER_SIZE ||
+      recordsOffset != HEADER_SIZE || fileSize != inputFileSize || fileModTime != inputFileModTime ||
+      numRecords != (unsigned long long)(numScans > 0 ? numScans : 0)) {
+    return (false);
+  }
+
+  m_records.assign((size_t)numRecords, scanHeaderRecord());
+  if (numRecords > 0) {
+    fin.read((char*)(&(m_records[0])), numRecords * sizeof(scanHeaderRecord));
+    if ((unsigned long long)(fin.gcount()) != numRecords * sizeof(scanHeaderRecord)) {
+      m_records.clear();
+      return (false);
+    }
+  }
+
+  return (true);
+
+}
+
+// writeToFile - writes the records to the .spscan file. If it cannot be written, the headers are simply read
+// again next time.
+void SpectraSTScanHeaderIndex::writeToFile(string indexFileName) {
+
+  ofstream fout;
+  if (!myFileOpen(fout, indexFileName, true)) {
+    g_log->error("SCAN INDEX", "Cannot open file \"" + indexFileName + "\" for writing the scan headers. Scan headers will be read from \"" + m_fileName + "\" every time.");
+    return;
+  }
+
+  unsigned long long fileSize = 0;
+  unsigned long long fileModTime = 0;
+  getFileStamp(m_fileName, fileSize, fileModTime);
+
+  unsigned long long numRecords = (unsigned long long)(m_records.size());
+  unsigned long long recordsOffset = HEADER_SIZE;
+  unsigned long long zero = 0;
+
+  fout.write(MAGIC, 8);
+  fout.write((char*)(&FORMAT_VERSION), sizeof(unsigned int));
+  fout.write((char*)(&HEADER_SIZE), sizeof(unsigned int));
+  fout.write((char*)(&fileSize), sizeof(unsigned long long));
+  fout.write((char*)(&fileModTime), sizeof(unsigned long long));
+  fout.write((char*)(&numRecords), sizeof(unsigned long long));
+  fout.write((char*)(&zero), sizeof(unsigned long long)); // records offset, filled in below
+
+  if (!m_records.empty()) {
+    fout.write((char*)(&(m_records[0])), m_records.size() * sizeof(scanHeaderRecord));
+  }
+
+  fout.seekp(40);
+  fout.write((char*)(&recordsOffset), sizeof(unsigned long long));
+  fout.close();
+
+  stringstream msg;
+  msg << "Saved the headers of " << numRecords << " scans of \"" << m_fileName << "\" in \"" << indexFileName << "\".";
+  g_log->log("SCAN INDEX", msg.str());
+
+}
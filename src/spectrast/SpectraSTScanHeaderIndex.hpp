@@ -0,0 +1,111 @@
+#ifndef SPECTRASTSCANHEADERINDEX_HPP_
+#define SPECTRASTSCANHEADERINDEX_HPP_
+
+#ifdef STANDALONE_LINUX
+#include "SpectraST_cramp.hpp"
+#else
+#include "Parsers/mzParser/cramp.hpp"
+#endif
+
+#include <string>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTScanHeaderIndex
+ *
+ * The scan headers of an .mzXML (or other RAMP-readable) file, saved in a .spscan file next to it (-s_SCN, -c_SCN).
+ * To pick out the MS2 scans and sort them by precursor m/z, every scan header of the file has to be parsed, and
+ * the same runs are often searched against many libraries. So the headers are parsed once, and what SpectraST
+ * needs of them is saved in fixed-width records. The file is laid out as
+ *
+ * <header (HEADER_SIZE bytes): magic, format version, header size, input file size, input file modification time,
+ *                              number of records, records offset>
+ * <scanHeaderRecord (fixed width)> x number of records, one for each of scan numbers 1, 2, ... , last scan
+ *
+ * The size and modification time of the input file tell whether the .spscan file still goes with it; if not,
+ * it is simply re-created. The records offset stays 0 until all records are written, so that a file whose
+ * creation did not finish is never used. The peak lists are still read from the input file.
+ */
+
+using namespace std;
+
+// scanHeaderRecord - what is kept of the header of one scan. 96 bytes. A scan number without a readable
+// header has isFound == 0; scanNum is the scan number given in the header, which is not always the one asked for.
+struct scanHeaderRecord {
+  long long filePosition;
+  double precursorMz;
+  double precursorIntensity;
+  double totIonCurrent;
+  double retentionTime; // in seconds
+  int scanNum;
+  int msLevel;
+  int precursorCharge;
+  int peakCount;
+  int numPossibleCharges;
+  unsigned short possibleCharges; // bit ch is set if charge ch (1 to 7) is possible
+  unsigned short isFound;
+  char activationMethod[SCANTYPE_LENGTH];
+};
+
+class SpectraSTScanHeaderIndex {
+
+public:
+
+  SpectraSTScanHeaderIndex(string fileName);
+  ~SpectraSTScanHeaderIndex();
+
+  bool load(cRamp* cramp, int numScans);
+  bool getScanHeader(int scanNum, scanHeaderRecord& header);
+
+  static bool readScanHeader(cRamp* cramp, int scanNum, scanHeaderRecord& header);
+  static bool makeScanHeader(rampScanInfo* scanInfo, scanHeaderRecord& header);
+
+  static const unsigned int HEADER_SIZE;
+  static const unsigned int FORMAT_VERSION;
+
+private:
+
+  // m_fileName - the input file; the .spscan file is named after it
+  string m_fileName;
+
+  // m_records - the header records of scan numbers 1, 2, ...
+  vector<scanHeaderRecord> m_records;
+
+  bool readFromFile(string indexFileName, int numScans);
+  void writeToFile(string indexFileName);
+
+  static const char MAGIC[8];
+
+};
+
+#endif /*SPECTRASTSCANHEADERINDEX_HPP_*/
@@ -0,0 +1,344 @@
+#include "SpectraSTScanPrefetcher.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTScanPrefetcher
+ *
+ * Reads scans ahead of the caller on a pool of background threads, handing them back in the order added.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+// constructor
+SpectraSTScanPrefetcher::SpectraSTScanPrefetcher(vector<string>& fileNames, unsigned int numWorkers, unsigned int maxNumReady, bool checkScanNum) :
+  m_fileNames(fileNames),
+  m_numWorkers(numWorkers),
+  m_maxNumReady(maxNumReady),
+  m_checkScanNum(checkScanNum),
+  m_requests(),
+  m_readHeaders(),
+  m_ready(),
+  m_isReady(),
+  m_numClaimed(0),
+  m_numTaken(0),
+  m_stop(false),
+  m_isStarted(false),
+  m_workerData(NULL),
+  m_threads(NULL) {
+
+  if (m_numWorkers < 1) {
+    m_numWorkers = 1;
+  }
+  if (m_maxNumReady < m_numWorkers) {
+    m_maxNumReady = m_numWorkers;
+  }
+
+  prefetchedScan empty;
+  empty.fileIndex = 0;
+  empty.scanNum = 0;
+  empty.scanInfo = NULL;
+  empty.peaks = NULL;
+  m_ready.assign(m_maxNumReady, empty);
+  m_isReady.assign(m_maxNumReady, false);
+
+#ifdef MSVC
+  InitializeCriticalSection(&m_stateLock);
+  InitializeConditionVariable(&m_roomAvailable);
+  InitializeConditionVariable(&m_scanReady);
+#else
+  pthread_mutex_init(&m_stateLock, NULL);
+  pthread_cond_init(&m_roomAvailable, NULL);
+  pthread_cond_init(&m_scanReady, NULL);
+#endif
+
+}
+
+// destructor - tells the workers to quit, waits for them, and deletes whatever was read but not taken
+SpectraSTScanPrefetcher::~SpectraSTScanPrefetcher() {
+
+  if (m_isStarted) {
+
+    lockState();
+    m_stop = true;
+#ifdef MSVC
+    WakeAllConditionVariable(&m_roomAvailable);
+#else
+    pthread_cond_broadcast(&m_roomAvailable);
+#endif
+    unlockState();
+
+    for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+#ifdef MSVC
+      WaitForSingleObject(m_threads[ti], INFINITE);
+      CloseHandle(m_threads[ti]);
+#else
+      void* status;
+      int returnCode = pthread_join(m_threads[ti], &status);
+      if (returnCode != 0) {
+	stringstream msg;
+	msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
+	g_log->error("PREFETCH", msg.str());
+	g_log->crash();
+      }
+#endif
+
+    }
+  }
+
+  for (unsigned int slot = 0; slot < m_maxNumReady; slot++) {
+    if (m_isReady[slot]) {
+      if (m_ready[slot].scanInfo) delete (m_ready[slot].scanInfo);
+      if (m_ready[slot].peaks) delete (m_ready[slot].peaks);
+    }
+  }
+
+#ifdef MSVC
+  DeleteCriticalSection(&m_stateLock);
+#else
+  pthread_cond_destroy(&m_scanReady);
+  pthread_cond_destroy(&m_roomAvailable);
+  pthread_mutex_destroy(&m_stateLock);
+#endif
+
+  if (m_threads) delete[] m_threads;
+  if (m_workerData) delete[] m_workerData;
+
+}
+
+// add - adds a scan to be read. If readHeader is false, only the peak list is read (the caller already has the header).
+// All scans must be added before start().
+void SpectraSTScanPrefetcher::add(unsigned int fileIndex, int scanNum, bool readHeader) {
+
+  prefetchedScan scan;
+  scan.fileIndex = fileIndex;
+  scan.scanNum = scanNum;
+  scan.scanInfo = NULL;
+  scan.peaks = NULL;
+
+  m_requests.push_back(scan);
+  m_readHeaders.push_back(readHeader);
+}
+
+// start - spawns the worker threads, which start reading right away
+void SpectraSTScanPrefetcher::start() {
+
+  if (m_isStarted) return;
+  m_isStarted = true;
+
+#ifdef MSVC
+  m_threads = new HANDLE[m_numWorkers];
+#else
+  m_threads = new pthread_t[m_numWorkers];
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+#endif
+
+  m_workerData = new struct prefetchWorkerData[m_numWorkers];
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+    m_workerData[ti].prefetcherPtr = this;
+    m_workerData[ti].workerIndex = ti;
+
+#ifdef MSVC
+    int returnCode = 0;
+    m_threads[ti] = CreateThread(NULL, 0, runWorkerThread, (void*)&m_workerData[ti], 0, NULL);
+    if (!m_threads[ti]) {
+      returnCode = ti + 1;
+    }
+#else
+    int returnCode = pthread_create(&m_threads[ti], &attr, runWorkerThread, (void*)(&(m_workerData[ti])));
+#endif
+
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
+      g_log->error("PREFETCH", msg.str());
+      g_log->crash();
+    }
+  }
+
+#ifndef MSVC
+  pthread_attr_destroy(&attr);
+#endif
+
+}
+
+// next - takes the next scan, in the order added, waiting for it to be read if need be. The caller then owns
+// scan.scanInfo and scan.peaks. Returns false when all scans have been taken.
+bool SpectraSTScanPrefetcher::next(prefetchedScan& scan) {
+
+  if (m_numTaken >= (unsigned long)m_requests.size()) return (false);
+
+  start();
+
+  unsigned int slot = (unsigned int)(m_numTaken % m_maxNumReady);
+
+  lockState();
+  while (!m_isReady[slot]) {
+#ifdef MSVC
+    SleepConditionVariableCS(&m_scanReady, &m_stateLock, INFINITE);
+#else
+    pthread_cond_wait(&m_scanReady, &m_stateLock);
+#endif
+  }
+  scan = m_ready[slot];
+  m_isReady[slot] = false;
+  m_numTaken++;
+  // the slot is free again; a worker waiting for room may claim the scan that goes there
+#ifdef MSVC
+  WakeAllConditionVariable(&m_roomAvailable);
+#else
+  pthread_cond_broadcast(&m_roomAvailable);
+#endif
+  unlockState();
+
+  return (true);
+}
+
+#ifdef MSVC
+DWORD WINAPI SpectraSTScanPrefetcher::runWorkerThread(LPVOID threadArg) {
+#else
+void* SpectraSTScanPrefetcher::runWorkerThread(void* threadArg) {
+#endif
+
+  struct prefetchWorkerData* workerData = (struct prefetchWorkerData*)threadArg;
+
+  workerData->prefetcherPtr->workerLoop();
+
+  long ti = (long)(workerData->workerIndex);
+
+#ifdef MSVC
+  ExitThread(0);
+#else
+  pthread_exit((void*)ti);
+#endif
+
+}
+
+// workerLoop - claims the next scan to read, as long as there is room for it in the ready list, reads it and files it.
+// Each worker has its own cRamp objects, opened as the files are needed, and closed when there is nothing left to read.
+void SpectraSTScanPrefetcher::workerLoop() {
+
+  vector<cRamp*> files(m_fileNames.size(), (cRamp*)NULL);
+
+  while (true) {
+
+    lockState();
+    while (!m_stop && m_numClaimed < (unsigned long)m_requests.size() && m_numClaimed >= m_numTaken + m_maxNumReady) {
+#ifdef MSVC
+      SleepConditionVariableCS(&m_roomAvailable, &m_stateLock, INFINITE);
+#else
+      pthread_cond_wait(&m_roomAvailable, &m_stateLock);
+#endif
+    }
+    if (m_stop || m_numClaimed >= (unsigned long)m_requests.size()) {
+      unlockState();
+      break;
+    }
+    unsigned long claimed = m_numClaimed++;
+    unlockState();
+
+    prefetchedScan scan = m_requests[claimed];
+    readOne(scan, m_readHeaders[claimed], files);
+
+    lockState();
+    unsigned int slot = (unsigned int)(claimed % m_maxNumReady);
+    m_ready[slot] = scan;
+    m_isReady[slot] = true;
+#ifdef MSVC
+    WakeConditionVariable(&m_scanReady);
+#else
+    pthread_cond_signal(&m_scanReady);
+#endif
+    unlockState();
+
+  }
+
+  for (vector<cRamp*>::iterator i = files.begin(); i != files.end(); i++) {
+    if (*i) delete (*i);
+  }
+
+}
+
+// readOne - reads the header (if asked for) and the peak list of one scan. The peak list is not read if the header
+// shows it is missing, or MS1.
+void SpectraSTScanPrefetcher::readOne(prefetchedScan& scan, bool readHeader, vector<cRamp*>& files) {
+
+  if (!files[scan.fileIndex]) {
+    cRamp* cramp = new cRamp(m_fileNames[scan.fileIndex].c_str());
+    if (!cramp->OK()) {
+      // the caller will find out on its own (it has opened the file too) -- nothing is read from this file
+      delete (cramp);
+      return;
+    }
+    files[scan.fileIndex] = cramp;
+  }
+  cRamp* cramp = files[scan.fileIndex];
+
+  int scanNum = scan.scanNum;
+
+  if (readHeader) {
+    scan.scanInfo = cramp->getScanHeaderInfo(scanNum);
+    if (!scan.scanInfo || (m_checkScanNum && scan.scanInfo->m_data.acquisitionNum != scanNum) || scan.scanInfo->m_data.msLevel == 1) {
+      return;
+    }
+    scanNum = scan.scanInfo->m_data.acquisitionNum;
+  }
+
+  scan.peaks = cramp->getPeakList(scanNum);
+}
+
+// lockState - locks the ready list and the counters
+void SpectraSTScanPrefetcher::lockState() {
+#ifdef MSVC
+  EnterCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_lock(&m_stateLock);
+#endif
+}
+
+// unlockState - unlocks the ready list and the counters
+void SpectraSTScanPrefetcher::unlockState() {
+#ifdef MSVC
+  LeaveCriticalSection(&m_stateLock);
+#else
+  pthread_mutex_unlock(&m_stateLock);
+#endif
+}
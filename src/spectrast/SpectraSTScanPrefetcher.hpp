@@ -0,0 +1,151 @@
+#ifndef SPECTRASTSCANPREFETCHER_HPP_
+#define SPECTRASTSCANPREFETCHER_HPP_
+
+#ifdef STANDALONE_LINUX
+#include "SpectraST_cramp.hpp"
+#else
+#include "Parsers/mzParser/cramp.hpp"
+#endif
+
+#include <string>
+#include <vector>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+
+/* Class: SpectraSTScanPrefetcher
+ *
+ * Reads scans from mzXML (or other RAMP-readable) files ahead of the caller, on a pool of background threads
+ * (-s_PRF, -c_PRF). The caller adds the scans it wants, in the order it wants them, then takes them back one by one
+ * with next() -- always in the order added, so whatever is done with them is exactly what would have been done by
+ * reading them on the calling thread.
+ *
+ * Each background thread opens the files with its own cRamp objects, so that the parsing and decoding of the peak lists
+ * happen in parallel. A scan added with its header is only read in full if the header shows it is worth it: it is there,
+ * it is not MS1 and (optionally) it has the scan number asked for. Others come back without peaks, which the caller counts
+ * as missing or MS1 from the header as usual. The number of scans read but not yet taken is bounded.
+ *
+ */
+
+using namespace std;
+
+// prefetchedScan - one scan read by the prefetcher. scanInfo is NULL if the header was not asked for or could not be read;
+// peaks is NULL if the peak list was not read (see above), or could not be read. Both become property of the caller.
+struct prefetchedScan {
+  unsigned int fileIndex;
+  int scanNum;
+  rampScanInfo* scanInfo;
+  rampPeakList* peaks;
+};
+
+struct prefetchWorkerData;
+
+class SpectraSTScanPrefetcher {
+
+public:
+  SpectraSTScanPrefetcher(vector<string>& fileNames, unsigned int numWorkers, unsigned int maxNumReady, bool checkScanNum);
+  ~SpectraSTScanPrefetcher();
+
+  void add(unsigned int fileIndex, int scanNum, bool readHeader);
+  void start();
+  bool next(prefetchedScan& scan);
+
+#ifdef MSVC
+  static DWORD WINAPI runWorkerThread(LPVOID threadArg);
+#else
+  static void* runWorkerThread(void* threadArg);
+#endif
+
+private:
+
+  // the names of the files, indexed by the fileIndex of the scans added
+  vector<string> m_fileNames;
+
+  unsigned int m_numWorkers;
+  unsigned int m_maxNumReady;
+
+  // m_checkScanNum - if true, a scan whose header does not have the scan number asked for is taken as missing, and not read
+  bool m_checkScanNum;
+
+  // the scans to read, in the order added. Not touched after start().
+  vector<prefetchedScan> m_requests;
+  vector<bool> m_readHeaders;
+
+  // scans read but not yet taken, indexed by their position in m_requests modulo m_maxNumReady
+  vector<prefetchedScan> m_ready;
+  vector<bool> m_isReady;
+
+  // counters - m_numClaimed is the number of scans taken up by the workers, m_numTaken the number taken back by the caller.
+  // Both, the ready list and m_stop are guarded by the state lock
+  unsigned long m_numClaimed;
+  unsigned long m_numTaken;
+  bool m_stop;
+  bool m_isStarted;
+
+  struct prefetchWorkerData* m_workerData;
+
+  void workerLoop();
+  void readOne(prefetchedScan& scan, bool readHeader, vector<cRamp*>& files);
+
+  void lockState();
+  void unlockState();
+
+#ifdef MSVC
+  CRITICAL_SECTION m_stateLock;
+  CONDITION_VARIABLE m_roomAvailable;
+  CONDITION_VARIABLE m_scanReady;
+  HANDLE* m_threads;
+#else
+  pthread_mutex_t m_stateLock;
+  pthread_cond_t m_roomAvailable;
+  pthread_cond_t m_scanReady;
+  pthread_t* m_threads;
+#endif
+
+};
+
+struct prefetchWorkerData {
+  SpectraSTScanPrefetcher* prefetcherPtr;
+  unsigned int workerIndex;
+};
+
+#endif /*SPECTRASTSCANPREFETCHER_HPP_*/
@@ -50,12 +50,19 @@ using namespace std;
 
 extern bool g_verbose;
 
+// SEARCH_BLOCK_TILE_WIDTH - the precursor m/z width of the library entries scored against all queries of a block at a time
+// (see searchBlock). The same as the bins of the m/z index; a bin of prepared library spectra stays in the L2 cache.
+static const double SEARCH_BLOCK_TILE_WIDTH = 1.0;
+
 // constructor
 SpectraSTSearch::SpectraSTSearch(SpectraSTQuery* query,	SpectraSTSearchParams& params, SpectraSTSearchOutput* output) :
   m_query(query),
   m_params(params), 
   m_output(output),
-  m_candidates() {
+  m_candidates(),
+  m_lib(NULL),
+  m_retrievedRanges(),
+  m_metricsSample() {
   
   m_candidates.clear();	
   
@@ -69,14 +76,92 @@ SpectraSTSearch::~SpectraSTSearch() {
   for (vector<SpectraSTCandidate*>::iterator i = m_candidates.begin(); i != m_candidates.end(); i++) {
     delete (*i);	
   }
+  
+  if (m_lib) {
+    m_lib->release(m_retrievedRanges);
+  }
 }
 
 // search - main function to perform one search
 void SpectraSTSearch::search(SpectraSTLib* lib) {
 
+  retrieveCandidates(lib);
+  
+  // compare query to each candidate by calculating the dot product
+  double stageStart = SpectraSTSearchMetrics::now();
+  for (vector<SpectraSTCandidate*>::iterator i = m_candidates.begin(); i != m_candidates.end(); i++) {
+    scoreCandidate(*i);
+  }
+  stageStart = m_metricsSample.endStage(SpectraSTSearchMetrics::SCORE, stageStart);
+  
+  finalizeCandidates(stageStart);
+}
+
+// searchBlock - searches a block of queries with overlapping precursor m/z windows together (-s_BLK). All candidates
+// are retrieved first; the distinct library entries of the block are then scored tile by tile, each tile against every
+// query in the block that has them as candidates, before moving on to the next tile. A library spectrum is thus brought
+// into the CPU cache about once per block instead of once per query. The scores are exactly those of search().
+void SpectraSTSearch::searchBlock(vector<SpectraSTSearch*>& block, SpectraSTLib* lib) {
+
+  if (block.size() == 1) {
+    block[0]->search(lib);
+    return;
+  }
+  
+  for (vector<SpectraSTSearch*>::iterator s = block.begin(); s != block.end(); s++) {
+    (*s)->retrieveCandidates(lib);
+  }
+  
+  double scoreStart = SpectraSTSearchMetrics::now();
+  
+  // the tiled loop. The candidates of each query come in the order of the library index, bin by bin, i.e. by ascending
+  // integer precursor m/z. A tile is the candidates within one such m/z unit, starting from the lowest not yet scored in
+  // the block: it is scored against every query in the block (that has them as candidates) before the next tile. 
+  vector<unsigned int> next(block.size(), 0);
+  while (true) {
+    
+    double tileStartMz = -1.0;
+    for (unsigned int b = 0; b < (unsigned int)(block.size()); b++) {
+      vector<SpectraSTCandidate*>& candidates = block[b]->m_candidates;
+      if (next[b] < (unsigned int)(candidates.size())) {
+        double mz = candidates[next[b]]->getEntry()->getPrecursorMz();
+        if (tileStartMz < 0.0 || mz < tileStartMz) tileStartMz = mz;
+      }
+    }
+    if (tileStartMz < 0.0) break; // all scored
+    
+    double tileEndMz = floor(tileStartMz / SEARCH_BLOCK_TILE_WIDTH + 1.0) * SEARCH_BLOCK_TILE_WIDTH;
+    for (unsigned int b = 0; b < (unsigned int)(block.size()); b++) {
+      vector<SpectraSTCandidate*>& candidates = block[b]->m_candidates;
+      while (next[b] < (unsigned int)(candidates.size()) && candidates[next[b]]->getEntry()->getPrecursorMz() < tileEndMz) {
+        block[b]->scoreCandidate(candidates[next[b]]);
+        next[b]++;
+      }
+    }
+  }
+  
+  // the scoring of the block is shared by its queries, so each is charged an equal part of it
+  double scoreEnd = SpectraSTSearchMetrics::now();
+  double scoreTime = (scoreEnd - scoreStart) / (double)(block.size());
+  for (vector<SpectraSTSearch*>::iterator s = block.begin(); s != block.end(); s++) {
+    (*s)->m_metricsSample.stageTimes[SpectraSTSearchMetrics::SCORE] = scoreTime;
+  }
+  
+  for (vector<SpectraSTSearch*>::iterator s = block.begin(); s != block.end(); s++) {
+    (*s)->finalizeCandidates(SpectraSTSearchMetrics::now());
+  }
+}
+
+// retrieveCandidates - prepares the query, and retrieves the library entries within the precursor m/z tolerance as candidates
+void SpectraSTSearch::retrieveCandidates(SpectraSTLib* lib) {
+
+  // the stages are timed for the search metrics; cheap enough to do always
+  double stageStart = SpectraSTSearchMetrics::now();
+  
   double precursorMz = m_query->getPrecursorMz();
 
   m_query->getPeakList()->prepareForSearch(m_params, false);
+  stageStart = m_metricsSample.endStage(SpectraSTSearchMetrics::PREPARE_QUERY, stageStart);
        
   if (g_verbose) {
     cout << endl;
@@ -92,12 +177,11 @@ void SpectraSTSearch::search(SpectraSTLib* lib) {
     cout << ")" << endl;
   }
  
-  // retrieves all entries from the library within the tolerable m/z range
+  // retrieves all entries from the library within the tolerable m/z ranges
   vector<SpectraSTLibEntry*> entries;
   
-  // get more than needed to catch isotope error or (for low resolution data) observed average mass
-  double lowMz = precursorMz - m_params.precursorMzTolerance - 2.0; 
-  double highMz = precursorMz + m_params.precursorMzTolerance;
+  m_lib = lib;
+  calcPrecursorMzRanges(m_retrievedRanges);
   bool shortAnnotation = true;
   
   if (m_params.useTierwiseOpenModSearch) {
@@ -105,7 +189,9 @@ void SpectraSTSearch::search(SpectraSTLib* lib) {
     shortAnnotation = false;
   }
   
-  lib->retrieve(entries, lowMz, highMz, shortAnnotation);
+  // counting what is read from the library (by its size in the file) costs a little more, so only if asked
+  lib->retrieve(entries, m_retrievedRanges, shortAnnotation, (m_params.printSearchMetrics ? &(m_metricsSample.retrieveCounts) : NULL));
+  stageStart = m_metricsSample.endStage(SpectraSTSearchMetrics::RETRIEVE, stageStart);
   
   // for all retrieved entries, do the necessary filtering, add the good ones to m_candidates
   for (vector<SpectraSTLibEntry*>::iterator i = entries.begin(); i != entries.end(); i++) {
@@ -121,6 +207,10 @@ void SpectraSTSearch::search(SpectraSTLib* lib) {
 
       (*i)->prepareForSearch(m_params);
       
+      if (m_params.sketchFilterMinDot > 0.0 && !passSketchFilter(*i)) {
+        continue;
+      }
+      
       SpectraSTCandidate* newCandidate = new SpectraSTCandidate(*i, m_params);	
       m_candidates.push_back(newCandidate);
     
@@ -128,58 +218,76 @@ void SpectraSTSearch::search(SpectraSTLib* lib) {
     } 
   }
   
+  m_metricsSample.numCandidates = (unsigned int)(m_candidates.size());
+  m_metricsSample.endStage(SpectraSTSearchMetrics::PREPARE_CANDIDATES, stageStart);
+  
    if (g_verbose) {
     cout << "\tFound " << m_candidates.size() << " candidate(s)... " << " Comparing... ";
     cout.flush();
   }
    
-  unsigned int numHits = 0; 
-   
-  // compare query to each candidate by calculating the dot product
-  for (vector<SpectraSTCandidate*>::iterator i = m_candidates.begin(); i != m_candidates.end(); i++) {
+}
 
-    SpectraSTLibEntry* entry = (*i)->getEntry();
-    int charge = entry->getCharge();
+// scoreCandidate - compares the query to one candidate by calculating the dot product
+void SpectraSTSearch::scoreCandidate(SpectraSTCandidate* candidate) {
 
-    double dot = 0.0;
-    double dotBias = 0.0;
-    int numTiersUsed = 0;
-     
-    if (m_params.useSp4Scoring) {
-      dot = m_query->getPeakList(charge)->calcDotAndDotBias(entry->getPeakList(), dotBias);
-    } else {
-      if (m_params.useTierwiseOpenModSearch) {
-        dot = m_query->getPeakList(charge)->calcDotTierwiseOpenModSearch(entry->getPeakList(), 0.5 / (double)(m_params.peakBinningNumBinsPerMzUnit), (double)(m_params.precursorMzTolerance), (*i)->getSimScoresRef().openMod, numTiersUsed);   
-        dotBias = (double)numTiersUsed;
-      } else if (m_params.peakNoBinning) {
-	dot = m_query->getPeakList(charge)->calcDotNoBinning(entry->getPeakList(), 0.5 / (double)(m_params.peakBinningNumBinsPerMzUnit));
-        dotBias = (double)(m_query->getPeakList()->getNumPeaks()) / 100.0;
-      } else {      
-        dot = m_query->getPeakList(charge)->calcDot(entry->getPeakList());
-      }
+  double precursorMz = m_query->getPrecursorMz();
+  SpectraSTLibEntry* entry = candidate->getEntry();
+  int charge = entry->getCharge();
 
+  double dot = 0.0;
+  double dotBias = 0.0;
+  int numTiersUsed = 0;
+   
+  if (m_params.useSp4Scoring) {
+    dot = m_query->getPeakList(charge)->calcDotAndDotBias(entry->getPeakList(), dotBias);
+  } else {
+    if (m_params.useTierwiseOpenModSearch) {
+      dot = m_query->getPeakList(charge)->calcDotTierwiseOpenModSearch(entry->getPeakList(), 0.5 / (double)(m_params.peakBinningNumBinsPerMzUnit), (double)(m_params.precursorMzTolerance), candidate->getSimScoresRef().openMod, numTiersUsed);   
+      dotBias = (double)numTiersUsed;
+    } else if (m_params.peakNoBinning) {
+	dot = m_query->getPeakList(charge)->calcDotNoBinning(entry->getPeakList(), 0.5 / (double)(m_params.peakBinningNumBinsPerMzUnit));
+      dotBias = (double)(m_query->getPeakList()->getNumPeaks()) / 100.0;
+    } else {      
+      dot = m_query->getPeakList(charge)->calcDot(entry->getPeakList());
     }
-      
-    (*i)->getSimScoresRef().dot = dot;
-    (*i)->getSimScoresRef().dotBias = dotBias;
-    (*i)->setSortKey(dot);	
-    
-    double openModMz = 0.0;
-  //  double openModMz = (*i)->getSimScoresRef().openMod.first / (double)charge;
-    
-    if (m_params.precursorMzUseAverage) {
-      ((*i)->getSimScoresRef()).precursorMzDiff = precursorMz - entry->getAveragePrecursorMz() - openModMz;          	 
-    } else {
-      ((*i)->getSimScoresRef()).precursorMzDiff = precursorMz - entry->getPrecursorMz() - openModMz;    
-    }
+
+  }
     
-    if (dot > 0.01) numHits++;
+  candidate->getSimScoresRef().dot = dot;
+  candidate->getSimScoresRef().dotBias = dotBias;
+  candidate->setSortKey(dot);	
+  
+  double openModMz = 0.0;
+  //  double openModMz = candidate->getSimScoresRef().openMod.first / (double)charge;
+  
+  if (m_params.precursorMzUseAverage) {
+    (candidate->getSimScoresRef()).precursorMzDiff = precursorMz - entry->getAveragePrecursorMz() - openModMz;          	 
+  } else {
+    (candidate->getSimScoresRef()).precursorMzDiff = precursorMz - entry->getPrecursorMz() - openModMz;    
+  }
+  
+}
+
+// finalizeCandidates - ranks the scored candidates and calculates the final scores. stageStart is when scoring finished.
+void SpectraSTSearch::finalizeCandidates(double stageStart) {
+
+  unsigned int numHits = 0;
+  for (vector<SpectraSTCandidate*>::iterator i = m_candidates.begin(); i != m_candidates.end(); i++) {
+    if ((*i)->getSimScoresRef().dot > 0.01) numHits++;
   }
 
   // sort the hits by the sort key 
   // (in this case, the value of "dot" returned by the SpectraSTPeakList::compare function)
   sort(m_candidates.begin(), m_candidates.end(), SpectraSTCandidate::sortPtrsDesc);
   
+  if (m_params.sketchFilterMinDot > 0.0 && m_params.sketchFilterVerify) {
+    // would a candidate skipped by the sketch filter have been the top hit?
+    m_metricsSample.sketchCounts.isVerified = true;
+    double topDot = (m_candidates.empty() ? 0.0 : m_candidates[0]->getSimScoresRef().dot);
+    m_metricsSample.sketchCounts.isTopHitLost = (m_metricsSample.sketchCounts.bestSkippedDot > topDot);
+  }
+  
   if (m_params.detectHomologs > 1) {
     detectHomologs();
   } else {
@@ -199,9 +307,87 @@ void SpectraSTSearch::search(SpectraSTLib* lib) {
     // sort again by F value (due to dot bias, sorting by dot and by F value could be different
     sort(m_candidates.begin(), m_candidates.end(), SpectraSTCandidate::sortPtrsDesc);
   } 
+  m_metricsSample.endStage(SpectraSTSearchMetrics::FINALIZE, stageStart);
 	
 }
 
+// calcPrecursorMzRanges - works out the ranges of precursor m/z where the library entries within tolerance 
+// (see isWithinPrecursorTolerance) can be. For high mass accuracy data, these are the tolerance window around the
+// precursor m/z, and, for each charge, the window one isotope (1/charge Th) below it. Library entries outside them 
+// are never read.
+void SpectraSTSearch::calcPrecursorMzRanges(vector<mzRange>& ranges) {
+  
+  double precursorMz = m_query->getPrecursorMz();
+  double mzTol = m_params.precursorMzTolerance;
+  
+  // a little extra, since the library m/z in the index can differ from that in the library file in the last digits 
+  // (the text .splib only has 4 decimal places); isWithinPrecursorTolerance() has the final say
+  mzTol += 0.0001;
+  
+  ranges.clear();
+  
+  mzRange r;
+  r.lowMz = precursorMz - mzTol;
+  r.highMz = precursorMz + mzTol;
+  r.charge = 0;
+  ranges.push_back(r);
+  
+  if (m_params.precursorMzTolerance < 0.5) { // high mass accuracy data, catch isotope error
+    
+    int maxCharge = m_lib->getMzLibIndexPtr()->getMaxCharge();
+    for (int charge = 1; charge <= maxCharge || charge == 1; charge++) {
+      // entries of unknown charge count as singly charged, and are always possible
+      if (charge == 1 || m_params.searchAllCharges || m_query->isPossibleCharge(charge)) { 
+        r.lowMz = precursorMz - 1.0 / (double)charge - mzTol;
+        r.highMz = precursorMz - 1.0 / (double)charge + mzTol;
+        r.charge = charge;
+        ranges.push_back(r);
+      }
+    }
+  }
+  
+}
+
+// passSketchFilter - whether a library entry within the precursor m/z tolerance is worth scoring, i.e. whether its dot product
+// with the query, estimated from the sketches of the two (see SpectraSTPeakList::buildSketch), reaches the minimum (-s_SKD).
+// With -s_SKV, an entry that does not is scored anyway, to count whether it would have (see sketchFilterCounts).
+bool SpectraSTSearch::passSketchFilter(SpectraSTLibEntry* entry) {
+  
+  m_metricsSample.sketchCounts.numChecked++;
+  
+  SpectraSTPeakList* queryPeakList = m_query->getPeakList(entry->getCharge());
+  SpectraSTPeakList* libPeakList = entry->getPeakList();
+  
+  double sketchDot = queryPeakList->calcSketchDot(libPeakList);
+  
+  if (m_params.useTierwiseOpenModSearch) {
+    // the higher tiers match the library peaks shifted by the mass difference over the tier (see 
+    // SpectraSTPeakList::calcDotTierwiseOpenModSearch), so add those as well
+    int queryCharge = queryPeakList->getParentCharge();
+    if (queryCharge == 0) queryCharge = libPeakList->getParentCharge();
+    double deltaMass = queryPeakList->getParentMz() * (double)queryCharge - libPeakList->getParentMz() * (double)(libPeakList->getParentCharge());
+    for (int tier = 1; tier < libPeakList->getParentCharge(); tier++) {
+      sketchDot += queryPeakList->calcSketchDot(libPeakList, deltaMass / (double)tier);
+    }
+  }
+  
+  if (sketchDot >= m_params.sketchFilterMinDot) {
+    return (true);
+  }
+  
+  m_metricsSample.sketchCounts.numSkipped++;
+  
+  if (m_params.sketchFilterVerify) {
+    SpectraSTCandidate skipped(entry, m_params);
+    scoreCandidate(&skipped);
+    double dot = skipped.getSimScoresRef().dot;
+    if (dot >= m_params.sketchFilterMinDot) m_metricsSample.sketchCounts.numMissed++;
+    if (dot > m_metricsSample.sketchCounts.bestSkippedDot) m_metricsSample.sketchCounts.bestSkippedDot = dot;
+  }
+  
+  return (false);
+}
+
 bool SpectraSTSearch::isWithinPrecursorTolerance(SpectraSTLibEntry* entry) {
  
   double mzDiff = m_query->getPrecursorMz() - entry->getPrecursorMz();
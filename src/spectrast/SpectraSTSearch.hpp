@@ -5,6 +5,7 @@
 #include "SpectraSTCandidate.hpp"
 #include "SpectraSTSearchOutput.hpp"
 #include "SpectraSTQuery.hpp"
+#include "SpectraSTSearchMetrics.hpp"
 // #include "SpectraSTSearchTaskStats.hpp"
 
 /*
@@ -60,6 +61,8 @@ public:
   
   void search(SpectraSTLib* lib);
   void print();
+  
+  static void searchBlock(vector<SpectraSTSearch*>& block, SpectraSTLib* lib);
   SpectraSTLibEntry* getTopHit() { return (m_candidates.size() > 0 ? m_candidates[0]->getEntry() : NULL); }
   
   bool isLikelyGood();
@@ -69,6 +72,8 @@ public:
   bool isDecoy(unsigned int rank = 1);
   bool isSingleton(unsigned int rank = 1);
   
+  searchMetricsSample& getMetricsSampleRef() { return (m_metricsSample); }
+  
 
 private:
   
@@ -83,10 +88,25 @@ private:
   // the output object responsible for printing the search results
   SpectraSTSearchOutput* m_output;
   
+  // the library searched, and the m/z ranges of the entries retrieved from it. The library is told
+  // when this search is done with the entries (in the destructor), so that it can free them
+  SpectraSTLib* m_lib;
+  vector<mzRange> m_retrievedRanges;
+  
+  // the timings and counters of this search, for the search metrics (-s_MET)
+  searchMetricsSample m_metricsSample;
+  
 //  void calcDeltaSimpleDots();
 //  void calcHitsStats();
 
+  // the three phases of search(). searchBlock() runs them for a block of searches, interleaving the scoring.
+  void retrieveCandidates(SpectraSTLib* lib);
+  void scoreCandidate(SpectraSTCandidate* candidate);
+  void finalizeCandidates(double stageStart);
+  
   bool isWithinPrecursorTolerance(SpectraSTLibEntry* entry);
+  bool passSketchFilter(SpectraSTLibEntry* entry);
+  void calcPrecursorMzRanges(vector<mzRange>& ranges);
   
   void detectHomologs();
 
@@ -0,0 +1,271 @@
+#include "SpectraSTSearchMetrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTSearchMetrics
+ *
+ * Class to accumulate the timings and counters of the searches of a file
+ */
+
+const unsigned int SpectraSTSearchMetrics::NUM_STAGES = 7;
+
+// NUM_LATENCY_BINS - up to 2^22 microseconds (about 4 seconds), then open-ended
+const unsigned int SpectraSTSearchMetrics::NUM_LATENCY_BINS = 24;
+
+// NUM_CANDIDATE_BINS - up to 2^18 candidates, then open-ended
+const unsigned int SpectraSTSearchMetrics::NUM_CANDIDATE_BINS = 20;
+
+const char* SpectraSTSearchMetrics::STAGE_NAMES[] = { "read_query", "prepare_query", "retrieve", "prepare_candidates", "score", "finalize", "output" };
+
+// constructor
+searchMetricsSample::searchMetricsSample() :
+  stageTimes(SpectraSTSearchMetrics::NUM_STAGES, -1.0),
+  numCandidates(0) {
+
+  retrieveCounts.numCached = 0;
+  retrieveCounts.numRead = 0;
+  retrieveCounts.bytesRead = 0;
+
+  sketchCounts.numChecked = 0;
+  sketchCounts.numSkipped = 0;
+  sketchCounts.numMissed = 0;
+  sketchCounts.bestSkippedDot = 0.0;
+  sketchCounts.isVerified = false;
+  sketchCounts.isTopHitLost = false;
+}
+
+// endStage - records the time since start as the time taken by the stage, and returns the current time
+double searchMetricsSample::endStage(unsigned int stage, double start) {
+
+  double end = SpectraSTSearchMetrics::now();
+  stageTimes[stage] = end - start;
+  return (end);
+}
+
+// constructor
+SpectraSTSearchMetrics::SpectraSTSearchMetrics() :
+  m_numQueries(0),
+  m_stageTotals(NUM_STAGES, 0.0),
+  m_stageMaxs(NUM_STAGES, 0.0),
+  m_stageHistograms(NUM_STAGES, vector<unsigned long long>(NUM_LATENCY_BINS, 0)),
+  m_numCandidates(0),
+  m_maxNumCandidates(0),
+  m_candidateHistogram(NUM_CANDIDATE_BINS, 0),
+  m_numEntriesCached(0),
+  m_numEntriesRead(0),
+  m_bytesRead(0),
+  m_numSketchChecked(0),
+  m_numSketchSkipped(0),
+  m_numSketchMissed(0),
+  m_numSketchVerified(0),
+  m_numSketchTopHitsLost(0) {
+
+}
+
+// destructor
+SpectraSTSearchMetrics::~SpectraSTSearchMetrics() {
+
+}
+
+// addSample - adds the timings and counters of a finished search
+void SpectraSTSearchMetrics::addSample(searchMetricsSample& sample) {
+
+  m_numQueries++;
+
+  for (unsigned int stage = 0; stage < NUM_STAGES; stage++) {
+    if (sample.stageTimes[stage] >= 0.0) {
+      addStageTime(stage, sample.stageTimes[stage]);
+    }
+  }
+
+  m_numCandidates += sample.numCandidates;
+  if (sample.numCandidates > m_maxNumCandidates) m_maxNumCandidates = sample.numCandidates;
+  m_candidateHistogram[calcLog2Bin(sample.numCandidates, NUM_CANDIDATE_BINS)]++;
+
+  m_numEntriesCached += sample.retrieveCounts.numCached;
+  m_numEntriesRead += sample.retrieveCounts.numRead;
+  m_bytesRead += sample.retrieveCounts.bytesRead;
+
+  m_numSketchChecked += sample.sketchCounts.numChecked;
+  m_numSketchSkipped += sample.sketchCounts.numSkipped;
+  m_numSketchMissed += sample.sketchCounts.numMissed;
+  if (sample.sketchCounts.isVerified) m_numSketchVerified++;
+  if (sample.sketchCounts.isTopHitLost) m_numSketchTopHitsLost++;
+}
+
+// addStageTime - adds one timing (in seconds) of a stage
+void SpectraSTSearchMetrics::addStageTime(unsigned int stage, double seconds) {
+
+  m_stageTotals[stage] += seconds;
+  if (seconds > m_stageMaxs[stage]) m_stageMaxs[stage] = seconds;
+  m_stageHistograms[stage][calcLog2Bin((unsigned long long)(seconds * 1000000.0), NUM_LATENCY_BINS)]++;
+}
+
+// merge - adds everything recorded in another SpectraSTSearchMetrics object to this one
+void SpectraSTSearchMetrics::merge(SpectraSTSearchMetrics& other) {
+
+  m_numQueries += other.m_numQueries;
+
+  for (unsigned int stage = 0; stage < NUM_STAGES; stage++) {
+    m_stageTotals[stage] += other.m_stageTotals[stage];
+    if (other.m_stageMaxs[stage] > m_stageMaxs[stage]) m_stageMaxs[stage] = other.m_stageMaxs[stage];
+    for (unsigned int bin = 0; bin < NUM_LATENCY_BINS; bin++) {
+      m_stageHistograms[stage][bin] += other.m_stageHistograms[stage][bin];
+    }
+  }
+
+  m_numCandidates += other.m_numCandidates;
+  if (other.m_maxNumCandidates > m_maxNumCandidates) m_maxNumCandidates = other.m_maxNumCandidates;
+  for (unsigned int bin = 0; bin < NUM_CANDIDATE_BINS; bin++) {
+    m_candidateHistogram[bin] += other.m_candidateHistogram[bin];
+  }
+
+  m_numEntriesCached += other.m_numEntriesCached;
+  m_numEntriesRead += other.m_numEntriesRead;
+  m_bytesRead += other.m_bytesRead;
+
+  m_numSketchChecked += other.m_numSketchChecked;
+  m_numSketchSkipped += other.m_numSketchSkipped;
+  m_numSketchMissed += other.m_numSketchMissed;
+  m_numSketchVerified += other.m_numSketchVerified;
+  m_numSketchTopHitsLost += other.m_numSketchTopHitsLost;
+}
+
+// writeJSON - writes the metrics as a JSON object. Each line after the first is started with indent.
+void SpectraSTSearchMetrics::writeJSON(ostream& out, string indent) {
+
+  stringstream ss;
+  ss.setf(ios::fixed);
+
+  ss << "{" << '\n';
+  ss << indent << "  \"queries\": " << m_numQueries << "," << '\n';
+
+  // the histogram bins, by their lower bounds
+  ss << indent << "  \"latency_bins_us\": [0";
+  for (unsigned int bin = 1; bin < NUM_LATENCY_BINS; bin++) {
+    ss << ", " << (1ULL << (bin - 1));
+  }
+  ss << "]," << '\n';
+
+  ss << indent << "  \"stages\": {" << '\n';
+  for (unsigned int stage = 0; stage < NUM_STAGES; stage++) {
+
+    unsigned long long count = 0;
+    for (unsigned int bin = 0; bin < NUM_LATENCY_BINS; bin++) {
+      count += m_stageHistograms[stage][bin];
+    }
+
+    ss << indent << "    \"" << STAGE_NAMES[stage] << "\": { \"count\": " << count;
+    ss.precision(6);
+    ss << ", \"total_s\": " << m_stageTotals[stage];
+    ss.precision(1);
+    ss << ", \"mean_us\": " << (count > 0 ? m_stageTotals[stage] * 1000000.0 / (double)count : 0.0);
+    ss << ", \"max_us\": " << m_stageMaxs[stage] * 1000000.0;
+    ss << ", \"histogram\": [";
+    for (unsigned int bin = 0; bin < NUM_LATENCY_BINS; bin++) {
+      ss << (bin > 0 ? ", " : "") << m_stageHistograms[stage][bin];
+    }
+    ss << "] }" << (stage + 1 < NUM_STAGES ? "," : "") << '\n';
+  }
+  ss << indent << "  }," << '\n';
+
+  ss << indent << "  \"candidates\": { \"total\": " << m_numCandidates;
+  ss.precision(2);
+  ss << ", \"mean\": " << (m_numQueries > 0 ? (double)m_numCandidates / (double)m_numQueries : 0.0);
+  ss << ", \"max\": " << m_maxNumCandidates;
+  ss << ", \"bins\": [0";
+  for (unsigned int bin = 1; bin < NUM_CANDIDATE_BINS; bin++) {
+    ss << ", " << (1ULL << (bin - 1));
+  }
+  ss << "], \"histogram\": [";
+  for (unsigned int bin = 0; bin < NUM_CANDIDATE_BINS; bin++) {
+    ss << (bin > 0 ? ", " : "") << m_candidateHistogram[bin];
+  }
+  ss << "] }," << '\n';
+
+  unsigned long long numEntriesRetrieved = m_numEntriesCached + m_numEntriesRead;
+  ss << indent << "  \"library\": { \"entries_cached\": " << m_numEntriesCached << ", \"entries_read\": " << m_numEntriesRead;
+  ss.precision(4);
+  ss << ", \"cache_hit_ratio\": " << (numEntriesRetrieved > 0 ? (double)m_numEntriesCached / (double)numEntriesRetrieved : 0.0);
+  ss << ", \"bytes_read\": " << m_bytesRead << " }," << '\n';
+
+  // the top hit recall is only known for the searches verified (-s_SKV)
+  ss << indent << "  \"sketch_filter\": { \"checked\": " << m_numSketchChecked << ", \"skipped\": " << m_numSketchSkipped;
+  ss << ", \"skipped_ratio\": " << (m_numSketchChecked > 0 ? (double)m_numSketchSkipped / (double)m_numSketchChecked : 0.0);
+  ss << ", \"verified_queries\": " << m_numSketchVerified << ", \"missed\": " << m_numSketchMissed << ", \"top_hits_lost\": " << m_numSketchTopHitsLost;
+  ss << ", \"top_hit_recall\": " << (m_numSketchVerified > 0 ? 1.0 - (double)m_numSketchTopHitsLost / (double)m_numSketchVerified : 1.0) << " }" << '\n';
+
+  ss << indent << "}";
+
+  out << ss.str();
+}
+
+// now - the time in seconds, from a steady clock. Only good for taking differences.
+double SpectraSTSearchMetrics::now() {
+
+  return (chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// escapeJSON - escapes a string to be put between double quotes in JSON
+string SpectraSTSearchMetrics::escapeJSON(string s) {
+
+  string escaped("");
+  for (string::size_type i = 0; i < s.length(); i++) {
+    char c = s[i];
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      sprintf(buf, "\\u%04x", (unsigned int)c);
+      escaped += buf;
+    } else {
+      escaped += c;
+    }
+  }
+  return (escaped);
+}
+
+// calcLog2Bin - the bin of a value in a histogram with bins 0, 1, [2, 4), [4, 8), ..., the last one open-ended
+unsigned int SpectraSTSearchMetrics::calcLog2Bin(unsigned long long value, unsigned int numBins) {
+
+  unsigned int bin = 0;
+  while (value > 0 && bin < numBins - 1) {
+    value >>= 1;
+    bin++;
+  }
+  return (bin);
+}
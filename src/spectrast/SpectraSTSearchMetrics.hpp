@@ -0,0 +1,139 @@
+#ifndef SPECTRASTSEARCHMETRICS_HPP
+#define SPECTRASTSEARCHMETRICS_HPP
+
+#include "SpectraSTMzLibIndex.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+/* Class: SpectraSTSearchMetrics
+ *
+ * Class to accumulate the timings and counters of the searches of a file (-s_MET): the time spent in each stage
+ * of a search, with a histogram of the per-query latencies, the number of candidates per query, how many
+ * library entries were found in the cache and how many had to be read, and how many candidates the sketch filter skipped.
+ *
+ * Each search times itself into its own searchMetricsSample, on whichever thread runs it. The samples are only added
+ * to the SpectraSTSearchMetrics of the file when the search is finished, by the thread printing it, so no locking is needed.
+ */
+
+using namespace std;
+
+// sketchFilterCounts - the candidates of a search checked by the sketch filter (-s_SKD), and those skipped. With -s_SKV, the
+// skipped ones are scored anyway: those that would have reached the minimum dot product are missed, and if the best of them
+// beats the top hit, the top hit is lost.
+struct sketchFilterCounts {
+  unsigned int numChecked;
+  unsigned int numSkipped;
+  unsigned int numMissed;
+  double bestSkippedDot;
+  bool isVerified;
+  bool isTopHitLost;
+};
+
+// searchMetricsSample - the timings and counters of one search. Stages not timed stay at -1.
+struct searchMetricsSample {
+
+  searchMetricsSample();
+
+  // endStage - records the time since start as the time taken by the stage, and returns the current time,
+  // which is the start of the next stage
+  double endStage(unsigned int stage, double start);
+
+  vector<double> stageTimes;
+  unsigned int numCandidates;
+  mzLibRetrieveCounts retrieveCounts;
+  sketchFilterCounts sketchCounts;
+};
+
+class SpectraSTSearchMetrics {
+
+public:
+
+  // the stages of a search, in order
+  enum searchStage { READ_QUERY = 0, PREPARE_QUERY, RETRIEVE, PREPARE_CANDIDATES, SCORE, FINALIZE, OUTPUT };
+  static const unsigned int NUM_STAGES;
+
+  SpectraSTSearchMetrics();
+  ~SpectraSTSearchMetrics();
+
+  void addSample(searchMetricsSample& sample);
+  void addStageTime(unsigned int stage, double seconds);
+  void merge(SpectraSTSearchMetrics& other);
+
+  void writeJSON(ostream& out, string indent);
+
+  static double now();
+  static string escapeJSON(string s);
+
+private:
+
+  // m_numQueries - the number of searches added
+  unsigned long long m_numQueries;
+
+  // m_stageTotals, m_stageMaxs, m_stageHistograms - for each stage, the total and the longest time taken (in seconds),
+  // and the number of times it took [0, 1), [1, 2), [2, 4), ... microseconds. The last bin is open-ended.
+  vector<double> m_stageTotals;
+  vector<double> m_stageMaxs;
+  vector<vector<unsigned long long> > m_stageHistograms;
+
+  // m_numCandidates, m_maxNumCandidates, m_candidateHistogram - the total and the largest number of candidates
+  // of a query, and the number of queries with 0, 1, [2, 4), [4, 8), ... candidates. The last bin is open-ended.
+  unsigned long long m_numCandidates;
+  unsigned int m_maxNumCandidates;
+  vector<unsigned long long> m_candidateHistogram;
+
+  // m_numEntriesCached, m_numEntriesRead, m_bytesRead - the library entries retrieved that were already in the cache,
+  // and the ones read from the library (and their size there)
+  unsigned long long m_numEntriesCached;
+  unsigned long long m_numEntriesRead;
+  unsigned long long m_bytesRead;
+
+  // m_numSketchChecked, m_numSketchSkipped, m_numSketchMissed, m_numSketchVerified, m_numSketchTopHitsLost - the totals of
+  // the sketch filter counts (see sketchFilterCounts), and the number of searches verified and of top hits lost
+  unsigned long long m_numSketchChecked;
+  unsigned long long m_numSketchSkipped;
+  unsigned long long m_numSketchMissed;
+  unsigned long long m_numSketchVerified;
+  unsigned long long m_numSketchTopHitsLost;
+
+  static const unsigned int NUM_LATENCY_BINS;
+  static const unsigned int NUM_CANDIDATE_BINS;
+  static const char* STAGE_NAMES[];
+
+  static unsigned int calcLog2Bin(unsigned long long value, unsigned int numBins);
+
+};
+
+#endif
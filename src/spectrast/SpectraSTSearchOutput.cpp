@@ -48,6 +48,10 @@ hlam@systemsbiology.org
 
 extern SpectraSTLog* g_log;
 
+// size of the buffer behind each output stream. the writers end lines with '\n' rather than endl, so
+// the file is only written when this fills up or when the file is closed.
+static const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
 // constructor
 SpectraSTSearchOutput::SpectraSTSearchOutput(string outputFileName, string searchFileExt, SpectraSTSearchParams& searchParams) :
   m_outputFileName(outputFileName),
@@ -81,6 +85,13 @@ void SpectraSTSearchOutput::openFile() {
 
   if (m_fout) return; // already open
   m_fout = new ofstream();
+  
+  // the buffer has to be installed before the file is opened to take effect
+  if (m_foutBuffer.empty()) {
+    m_foutBuffer.resize(OUTPUT_BUFFER_SIZE);
+  }
+  m_fout->rdbuf()->pubsetbuf(&(m_foutBuffer[0]), m_foutBuffer.size());
+  
   if (!myFileOpen(*m_fout, m_outputFileName)) {
     g_log->error("SEARCH", "Cannot open file \"" + m_outputFileName + "\" for writing search results. Exiting.");
     g_log->crash();
@@ -88,13 +99,15 @@ void SpectraSTSearchOutput::openFile() {
 
 }
 
-// closeFile - closes the file for output
+// closeFile - closes the file for output, and releases its buffer (the output objects live until the end of the task)
 void SpectraSTSearchOutput::closeFile() {
   
   if (m_fout) {
+    m_fout->flush();
     delete (m_fout);
     m_fout = NULL;
   }
+  vector<char>().swap(m_foutBuffer);
 }
 
 string SpectraSTSearchOutput::getOutputFileName() {
@@ -13,6 +13,7 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
 
 
 
@@ -84,6 +85,7 @@ public:
 protected:
   
 	ofstream* m_fout;
+	vector<char> m_foutBuffer; // stream buffer for m_fout, allocated by openFile() and released by closeFile()
 	string m_outputFileName;
         string m_outputPath;
 	string m_searchFileExt; 
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <iostream>
 #include <stdlib.h>
+#include <sstream>
 
 #ifdef STANDALONE_LINUX
 #include "SpectraST_cramp.hpp"
@@ -79,6 +80,8 @@ SpectraSTSearchParams& SpectraSTSearchParams::operator=(SpectraSTSearchParams& s
   this->databaseFile = s.databaseFile;
   this->databaseType = s.databaseType;
   this->indexCacheAll = s.indexCacheAll;
+  this->indexUsePreparedLib = s.indexUsePreparedLib;
+  this->indexCacheMemoryMB = s.indexCacheMemoryMB;
   this->filterSelectedListFileName = s.filterSelectedListFileName; 
   this->numThreadsUsed = s.numThreadsUsed;
 
@@ -95,6 +98,12 @@ SpectraSTSearchParams& SpectraSTSearchParams::operator=(SpectraSTSearchParams& s
   this->useSp4Scoring = s.useSp4Scoring;
   this->usePValue = s.usePValue;
   this->useTierwiseOpenModSearch = s.useTierwiseOpenModSearch;
+  this->useReferenceDotKernel = s.useReferenceDotKernel;
+  this->searchBlockSize = s.searchBlockSize;
+  this->numPrefetchThreads = s.numPrefetchThreads;
+  this->useScanHeaderIndex = s.useScanHeaderIndex;
+  this->sketchFilterMinDot = s.sketchFilterMinDot;
+  this->sketchFilterVerify = s.sketchFilterVerify;
   this->useRankTransformWithQuota = s.useRankTransformWithQuota;
   this->useRankTransformWithQuotaNumberOfPeaks = s.useRankTransformWithQuotaNumberOfPeaks;
   this->useRankTransformWithQuotaWindowSize = s.useRankTransformWithQuotaWindowSize;
@@ -109,6 +118,7 @@ SpectraSTSearchParams& SpectraSTSearchParams::operator=(SpectraSTSearchParams& s
   this->enzymeForPepXMLOutput = s.enzymeForPepXMLOutput;
   this->printFingerprintingSummary = s.printFingerprintingSummary;
   this->doDecoyAnalysis = s.doDecoyAnalysis;
+  this->printSearchMetrics = s.printSearchMetrics;
   
   this->peakScalingMzPower = s.peakScalingMzPower;
   this->peakScalingIntensityPower = s.peakScalingIntensityPower;
@@ -395,6 +405,7 @@ void SpectraSTSearchParams::finalizeOptions() {
   // Fingerprinting
   if (!(printFingerprintingSummary.empty())) {
     indexCacheAll = true;
+    indexCacheMemoryMB = 0;
   }
   // END Fingerprinting
   
@@ -535,6 +546,15 @@ void SpectraSTSearchParams::finalizeAdvancedOption(string option) {
       valid = true;
     }   
     
+  } else if (optionType == "MET") {
+    if (optionValue.empty()) {
+      printSearchMetrics = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      printSearchMetrics = false;
+      valid = true;
+    }
+    
   } else if (optionType == "ENZ") {
       if (!optionValue.empty()) {
 	enzymeForPepXMLOutput = optionValue;
@@ -570,6 +590,82 @@ void SpectraSTSearchParams::finalizeAdvancedOption(string option) {
       valid = true;
     }
 
+  } else if (optionType == "MEM") {
+
+    if (!optionValue.empty()) {
+      k = atoi(optionValue.c_str());
+      if (k >= 0) {
+	indexCacheMemoryMB = (unsigned int)k;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "PRP") {
+    if (optionValue.empty()) {
+      indexUsePreparedLib = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      indexUsePreparedLib = false;
+      valid = true;
+    }
+
+  } else if (optionType == "RDK") {
+    if (optionValue.empty()) {
+      useReferenceDotKernel = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      useReferenceDotKernel = false;
+      valid = true;
+    }
+
+  } else if (optionType == "BLK") {
+
+    if (!optionValue.empty()) {
+      k = atoi(optionValue.c_str());
+      if (k >= 0) {
+	searchBlockSize = (unsigned int)k;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "PRF") {
+
+    if (!optionValue.empty()) {
+      k = atoi(optionValue.c_str());
+      if (k >= 0) {
+	numPrefetchThreads = (unsigned int)k;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "SCN") {
+    if (optionValue.empty()) {
+      useScanHeaderIndex = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      useScanHeaderIndex = false;
+      valid = true;
+    }
+
+  } else if (optionType == "SKD") {
+
+    if (!optionValue.empty()) {
+      f = atof(optionValue.c_str());
+      if (f >= 0.0 && f <= 1.0) {
+	sketchFilterMinDot = f;
+	valid = true;
+      }
+    }
+
+  } else if (optionType == "SKV") {
+    if (optionValue.empty()) {
+      sketchFilterVerify = true;
+      valid = true;
+    } else if (optionValue == "!") {
+      sketchFilterVerify = false;
+      valid = true;
+    }
+
   } else if (optionType == "MZS") {
 
     if (!optionValue.empty()) {
@@ -856,6 +952,14 @@ void SpectraSTSearchParams::setDefault() {
   // whether or not to load the entire library in memory (faster but needs lots of RAM)
   indexCacheAll = false;
   
+  // whether or not to save the library spectra prepared for search in a .spprep file next to the library,
+  // and use them in later searches with the same parameters instead of preparing them again
+  indexUsePreparedLib = false;
+  
+  // the maximum memory (in MB) used to cache library entries, 0 if not limited. If limited, a multi-threaded search
+  // no longer needs to keep the entire library in memory.
+  indexCacheMemoryMB = 0;
+  
   // the number of threads to use
   numThreadsUsed = 1; // no multi-threading
 
@@ -909,6 +1013,30 @@ void SpectraSTSearchParams::setDefault() {
   // use tierwise open modifications search
   useTierwiseOpenModSearch = false;
 
+  // compute dot products with the plain (non-SIMD) reference code. The scores are bit-for-bit the same
+  // either way; this is only for verifying that.
+  useReferenceDotKernel = false;
+
+  // search up to this many sorted queries with overlapping precursor m/z windows together, scoring them against the
+  // library entries tile by tile (0 or 1 = one query at a time). Only for .mzXML files searched in sorted order.
+  searchBlockSize = 0;
+
+  // read (and decode) the query spectra from the .mzXML files ahead of the search on this many background threads
+  // (0 = read them on the searching thread)
+  numPrefetchThreads = 0;
+
+  // whether or not to save the scan headers of the .mzXML files in a .spscan file next to each, and use them in
+  // later searches instead of reading all the scan headers again
+  useScanHeaderIndex = false;
+
+  // skip the candidates whose dot product with the query, estimated from small sketches of the two spectra (their most
+  // intense bins or peaks), is below this (0 = score all candidates)
+  sketchFilterMinDot = 0.0;
+  
+  // score the candidates skipped by the sketch filter anyway (without keeping them), to count how many would have
+  // reached the minimum dot product, and how many top hits were lost; reported in the search metrics (-s_MET)
+  sketchFilterVerify = false;
+
   // use peak quota in a sliding window for rank transform
   useRankTransformWithQuota = false;
   useRankTransformWithQuotaNumberOfPeaks = 8;
@@ -951,6 +1079,9 @@ void SpectraSTSearchParams::setDefault() {
   // Do decoy analysis and print result to the log file. For checking the validity of decoys.
   doDecoyAnalysis = false;
   
+  // Time the search stages and write a JSON report of them next to the output
+  printSearchMetrics = false;
+  
   // the enzyme to use for outputting to PepXML, and for calculating NTT and NMC (WON'T AFFECT WHAT CANDIDATES ARE SEARCHED!)
   enzymeForPepXMLOutput = "";
   
@@ -1084,6 +1215,19 @@ void SpectraSTSearchParams::readFromFile() {
       indexCacheAll = (value == "true");
       valid = true;	
       
+    } else if (param == "indexUsePreparedLib") {
+      indexUsePreparedLib = (value == "true");
+      valid = true;
+      
+    } else if (param == "indexCacheMemoryMB") {
+      if (!value.empty()) {
+	k = atoi(value.c_str());
+	if (k >= 0) {
+	  indexCacheMemoryMB = (unsigned int)k;
+	  valid = true;
+	}
+      }
+      
             			
     } else if (param == "numThreadsUsed") {
       if (!value.empty()) {
@@ -1162,6 +1306,45 @@ void SpectraSTSearchParams::readFromFile() {
     } else if (param == "usePValue") {
       usePValue = (value == "true");
       valid = true;
+      
+    } else if (param == "useReferenceDotKernel") {
+      useReferenceDotKernel = (value == "true");
+      valid = true;
+
+    } else if (param == "searchBlockSize") {
+      if (!value.empty()) {
+	k = atoi(value.c_str());
+	if (k >= 0) {
+	  searchBlockSize = (unsigned int)k;
+	  valid = true;
+	}
+      }
+
+    } else if (param == "numPrefetchThreads") {
+      if (!value.empty()) {
+	k = atoi(value.c_str());
+	if (k >= 0) {
+	  numPrefetchThreads = (unsigned int)k;
+	  valid = true;
+	}
+      }
+
+    } else if (param == "useScanHeaderIndex") {
+      useScanHeaderIndex = (value == "true");
+      valid = true;
+
+    } else if (param == "sketchFilterMinDot") {
+      if (!value.empty()) {
+	f = atof(value.c_str());
+	if (f >= 0.0 && f <= 1.0) {
+	  sketchFilterMinDot = f;
+	  valid = true;
+	}
+      }
+
+    } else if (param == "sketchFilterVerify") {
+      sketchFilterVerify = (value == "true");
+      valid = true;
     
     // OUTPUT DISPLAY
       
@@ -1228,6 +1411,10 @@ void SpectraSTSearchParams::readFromFile() {
       doDecoyAnalysis = (value == "true");
       valid = true;
       
+    } else if (param == "printSearchMetrics") {
+      printSearchMetrics = (value == "true");
+      valid = true;
+      
     // SPECTRUM FILTERING AND PROCESSING
     
     } else if (param == "peakScalingMzPower") {
@@ -1488,6 +1675,30 @@ void SpectraSTSearchParams::printPepXMLSearchParams(ofstream& fout) {
 
 }
 
+// calcPreparationKey - a hash of all the parameters that affect how a library spectrum is prepared for search
+// (see SpectraSTPeakList::prepareForSearch). Library spectra prepared with the same key are the same.
+unsigned long long SpectraSTSearchParams::calcPreparationKey() {
+  
+  stringstream ss;
+  ss.precision(17);
+  
+  ss << SPECTRAST_VERSION << '.' << SPECTRAST_SUB_VERSION << ' ';
+  ss << filterITRAQReporterPeaks << ' ' << filterTMTReporterPeaks << ' ' << useSp4Scoring << ' ';
+  ss << peakScalingMzPower << ' ' << peakScalingIntensityPower << ' ' << peakScalingUnassignedPeaks << ' ';
+  ss << filterLightIonsMzThreshold << ' ' << filterLibMaxPeaksUsed << ' ';
+  ss << useRankTransformWithQuota << ' ' << useRankTransformWithQuotaWindowSize << ' ' << useRankTransformWithQuotaNumberOfPeaks << ' ';
+  ss << peakNoBinning << ' ' << peakBinningNumBinsPerMzUnit << ' ' << peakBinningFractionToNeighbor;
+  
+  // 64-bit FNV-1a
+  string key = ss.str();
+  unsigned long long hash = 14695981039346656037ULL;
+  for (string::size_type i = 0; i < key.length(); i++) {
+    hash ^= (unsigned long long)((unsigned char)(key[i]));
+    hash *= 1099511628211ULL;
+  }
+  return (hash);
+}
+
 void SpectraSTSearchParams::printAdvancedOptions(ostream& out) {
   
   out << "Spectrast (version " << SPECTRAST_VERSION << "." << SPECTRAST_SUB_VERSION << ", " << szTPPVersionInfo << ") by Henry Lam." << endl;
@@ -1508,6 +1719,24 @@ void SpectraSTSearchParams::printAdvancedOptions(ostream& out) {
   out << "         -s_PVL          Compute P-value by fitting score distribution of lower hits, and use it for scoring. (Turn off with -s_PVL!)" << endl;
   out << "                           NOTE: Only applicable to new (SpectraST 5.0) scoring. Tested for low-resolution CID spectra only." << endl; 
   out << "         -s_OMT          Perform tier-wise open modification search for modifications within precursor m/z window. (Turn off with -s_OMT!)" << endl;
+  out << "         -s_PRP          Save library spectra prepared for search in a .spprep file next to the library, and reuse them. (Turn off with -s_PRP!)" << endl;
+  out << "                           The file is re-created whenever the library or any of the spectrum processing options change." << endl;
+  out << "         -s_MEM<size>    Use at most <size> MB of memory to cache library entries (0 = no limit). " << endl;
+  out << "                           Lets multi-threaded searches run without loading the entire library into memory." << endl;
+  out << "         -s_RDK          Compute dot products with the reference code instead of the SIMD (SSE2/AVX2) code. (Turn off with -s_RDK!)" << endl;
+  out << "                           NOTE: The scores are identical either way. For verification only." << endl;
+  out << "         -s_BLK<size>    Search up to <size> queries with overlapping precursor m/z windows as a block (0 or 1 = off)," << endl;
+  out << "                           scoring them against the library spectra tile by tile to reuse them from the CPU cache." << endl;
+  out << "                           NOTE: Only for .mzXML files searched in sorted order (i.e. not with all entries cached). Same scores." << endl;
+  out << "         -s_PRF<num>     Read and decode the query spectra from .mzXML files ahead of the search on <num> background threads" << endl;
+  out << "                           (0 = off). The results are the same." << endl;
+  out << "         -s_SCN          Save the scan headers of .mzXML files in a .spscan file next to each, and reuse them. (Turn off with -s_SCN!)" << endl;
+  out << "                           The file is re-created whenever the .mzXML file changes." << endl;
+  out << "         -s_SKD<dot>     Skip the candidates whose dot product with the query, estimated from the 16 most intense" << endl;
+  out << "                           bins (or peaks) of each, is below <dot> (0 = off). Much faster for open modification searches." << endl;
+  out << "                           NOTE: Can miss a few hits. Check how many with -s_SKV and -s_MET." << endl;
+  out << "         -s_SKV          Score the candidates skipped by -s_SKD anyway, and count how many would have reached <dot>, and how" << endl;
+  out << "                           many top hits were lost, in the search metrics (-s_MET). Slow; for checking -s_SKD. (Turn off with -s_SKV!)" << endl;
   out << endl;
 
   out << "         OUTPUT AND DISPLAY OPTIONS" << endl;
@@ -1524,6 +1753,8 @@ void SpectraSTSearchParams::printAdvancedOptions(ostream& out) {
   out << "                           NOTE: This does not affect searching; it only affects how the results are written to pepXML." << endl; 
   out << "         -s_FIN<file>    Print a text file of name <file> summarizing fingerprinting results." << endl;
   out << "         -s_DYA          Perform analysis of decoy hits and print decoy fractions and frequent decoys to log file. (Turn off with -s_DYA!)." << endl;
+  out << "         -s_MET          Time the stages of the search and write them, with cache and candidate counts, to a JSON file" << endl;
+  out << "                           (.metrics.json) next to the output. (Turn off with -s_MET!)" << endl;
   out << endl;
 
   out << "         SPECTRUM FILTERING OPTIONS" << endl;
@@ -1589,8 +1820,11 @@ void SpectraSTSearchParams::printUsage(ostream& out) {
   out << "                           <type> must be either \"AA\" or \"DNA\"." << endl;
   out << "         -sR          Cache all entries in RAM. (Turn off with -sR!)" << endl;
   out << "                           Requires a lot of memory (the library will usually be loaded almost in its entirety), but speeds up search for unsorted queries." << endl;
-  out << "         -sP<num>     Multi-threaded search (one thread per file). Specify the number of threads to use. (Turn off with -sP!)" << endl;
-  out << "                           If multi-threading is enabled, -sR (Cache all entries in RAM) is automatically turned on." << endl;
+  out << "         -sP<num>     Multi-threaded search. Specify the number of threads to use. (Turn off with -sP!)" << endl;
+  out << "                           For .mgf and .msp files, the threads share the queries of each file. For .mzXML files, one thread" << endl;
+  out << "                           searches one file, unless -s_MEM is set: then the threads share the queries of all files, sorted by precursor m/z." << endl;
+  out << "                           Without -s_MEM, -sR (Cache all entries in RAM) is automatically turned on; with it, the threads share" << endl;
+  out << "                           the cache of at most that size instead." << endl;
   out << "         -sS<file>    Only search a subset of the query spectra in the search file." << endl;
   out << "                           Only query spectra with names matching a line of <file> will be searched." << endl; 
   
@@ -1657,17 +1891,27 @@ void SpectraSTSearchParams::determineNumThreads(vector<string>& fileNames) {
 
   if (numThreadsUsed == 0) numThreadsUsed = 4; // default
 
+  // mzXML files are searched one file per thread, unless the library cache is limited in memory. In that case, the queries in
+  // all files are sorted by precursor m/z and shared by the threads, as the queries in .mgf and .msp files are.
+  bool isSearchedByFile = (firstExt == ".mzXML" && indexCacheMemoryMB == 0);
+  
   int maxNumThreads = 32; // hard cap to avoid running out of memory
+  if (!isSearchedByFile) {
+    // searched query by query, so the memory used does not grow with the number of threads
+    maxNumThreads = 64;
+  }
   if (numThreadsUsed > maxNumThreads) {
     numThreadsUsed = maxNumThreads;
   }
     
-  // now set numThreadsUsed <= number of files
-  if (numThreadsUsed > fileNames.size()) {
+  // now set numThreadsUsed <= number of files if searched one file per thread;
+  // otherwise the threads share the queries, so even one file can be searched by many threads
+  if (isSearchedByFile && numThreadsUsed > fileNames.size()) {
     numThreadsUsed = fileNames.size();
   }
   
-  if (numThreadsUsed > 1) {
+  // with the cache limited in memory, the threads share a sliding window of cached library entries instead
+  if (numThreadsUsed > 1 && indexCacheMemoryMB == 0) {
     indexCacheAll = true;
   }
     
@@ -68,6 +68,8 @@ public:
 	string databaseFile;
 	string databaseType;
         bool indexCacheAll;
+	bool indexUsePreparedLib; // -s_PRP
+	unsigned int indexCacheMemoryMB; // -s_MEM
         string filterSelectedListFileName; 
 	int numThreadsUsed;
 	
@@ -85,6 +87,12 @@ public:
 	bool useSp4Scoring; // use SpectraST 4.0 scoring (sqrt intensity dot product, with dot bias)
 	bool usePValue;
 	bool useTierwiseOpenModSearch;
+	bool useReferenceDotKernel; // use the plain C++ dot product code instead of SSE2/AVX2 (same scores; for verification)
+	unsigned int searchBlockSize; // -s_BLK
+	unsigned int numPrefetchThreads; // -s_PRF
+	bool useScanHeaderIndex; // -s_SCN
+	double sketchFilterMinDot; // -s_SKD
+	bool sketchFilterVerify; // -s_SKV
         bool useRankTransformWithQuota;
 	int useRankTransformWithQuotaNumberOfPeaks;
 	int useRankTransformWithQuotaWindowSize;
@@ -100,6 +108,7 @@ public:
 	string enzymeForPepXMLOutput;
 	string printFingerprintingSummary;
 	bool doDecoyAnalysis;
+	bool printSearchMetrics; // -s_MET
 
         // SPECTRUM FILTERING AND PROCESSING 
         double filterAllPeaksBelowMz;
@@ -139,6 +148,8 @@ public:
         
         void printPepXMLSearchParams(ofstream& fout);
         
+        unsigned long long calcPreparationKey();
+        
 	static void printUsage(ostream& out);
         static void printAdvancedOptions(ostream& out);
 
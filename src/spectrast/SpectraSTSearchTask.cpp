@@ -61,7 +61,8 @@ SpectraSTSearchTask::SpectraSTSearchTask(vector<string>& searchFileNames, Spectr
   m_searchCount(0),
   m_searchTaskStats(),
   m_selectedList(),
-  m_searchAll(true) {
+  m_searchAll(true),
+  m_searchStartTime(0.0) {
   
   for (vector<string>::iterator f = searchFileNames.begin(); f != searchFileNames.end(); f++) {
     
@@ -180,14 +181,16 @@ SpectraSTSearchTask::~SpectraSTSearchTask() {
 // this is where to do it.
 void SpectraSTSearchTask::preSearch() {
   
-  // not doing anything
+  m_searchStartTime = SpectraSTSearchMetrics::now();
 }
 
 // preSearch - called after search() is called. if any finishing touch needs to be done after any search,
 // this is where to do it.
 void SpectraSTSearchTask::postSearch() {
 
- // not doing anything
+  if (m_params.printSearchMetrics) {
+    writeSearchMetrics();
+  }
 }
 
 // readSelectedListFile - reads in the selected queries. should be Common for any search file format.
@@ -263,6 +266,60 @@ void SpectraSTSearchTask::logSearchStats(string tag, bool showIndividualFile) {
 
 }
 
+// writeSearchMetrics - writes the timings and counters of the search (-s_MET) of each file, and of all files together,
+// to a JSON file next to the (first) output file
+void SpectraSTSearchTask::writeSearchMetrics() {
+  
+  if (m_outputs.empty()) return;
+  
+  FileName fn;
+  parseFileName(m_outputs[0]->getOutputFileName(), fn);
+  string metricsFileName(fn.path + fn.name + ".metrics.json");
+  
+  ofstream fout;
+  if (!myFileOpen(fout, metricsFileName)) {
+    g_log->error("SEARCH", "Cannot open file \"" + metricsFileName + "\" for writing search metrics. Metrics not written.");
+    return;
+  }
+  
+  SpectraSTSearchTaskStats* totalStats = SpectraSTSearchTaskStats::aggregateStats(m_searchTaskStats);
+  
+  fout.setf(ios::fixed);
+  fout.precision(3);
+  
+  fout << "{" << '\n';
+  fout << "  \"library_file\": \"" << SpectraSTSearchMetrics::escapeJSON(m_params.libraryFile) << "\"," << '\n';
+  fout << "  \"threads\": " << (m_params.numThreadsUsed > 1 ? m_params.numThreadsUsed : 1) << "," << '\n';
+  fout << "  \"wall_time_s\": " << SpectraSTSearchMetrics::now() - m_searchStartTime << "," << '\n';
+  
+  fout << "  \"files\": [" << '\n';
+  for (unsigned int n = 0; n < m_searchFileNames.size(); n++) {
+    fout << "    {" << '\n';
+    fout << "      \"search_file\": \"" << SpectraSTSearchMetrics::escapeJSON(m_searchFileNames[n]) << "\"," << '\n';
+    fout << "      \"output_file\": \"" << SpectraSTSearchMetrics::escapeJSON(m_outputs[n]->getOutputFileName()) << "\"," << '\n';
+    fout << "      \"scans\": " << m_searchTaskStats[n]->getScanStatsJSON() << "," << '\n';
+    fout << "      \"metrics\": ";
+    m_searchTaskStats[n]->m_metrics.writeJSON(fout, "      ");
+    fout << '\n' << "    }" << (n + 1 < m_searchFileNames.size() ? "," : "") << '\n';
+  }
+  fout << "  ]," << '\n';
+  
+  fout << "  \"total\": {" << '\n';
+  fout << "    \"scans\": " << totalStats->getScanStatsJSON() << "," << '\n';
+  fout << "    \"metrics\": ";
+  totalStats->m_metrics.writeJSON(fout, "    ");
+  fout << '\n' << "  }" << '\n';
+  fout << "}" << '\n';
+  
+  delete (totalStats);
+  
+  g_log->log("SEARCH", "Search metrics written to \"" + metricsFileName + "\".");
+  if (!g_quiet) {
+    cout << "Search metrics written to \"" << metricsFileName << "\"." << endl;
+  }
+  
+}
+
 // createSpectraSTSearchTask - factory method to create the proper search task object for different search file formats. Modify
 // if a subclass is implemented!
 SpectraSTSearchTask* SpectraSTSearchTask::createSpectraSTSearchTask(vector<string>& searchFileNames, SpectraSTSearchParams& params, SpectraSTLib* lib) {
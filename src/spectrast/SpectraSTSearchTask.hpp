@@ -99,10 +99,14 @@ protected:
   bool isInSelectedList(string name);
   
   void logSearchStats(string tag, bool showIndividualFile = true);
+  void writeSearchMetrics();
   
   // counters and flags
   bool m_searchAll;
   unsigned int m_searchCount;
+  
+  // when the search started (see SpectraSTSearchMetrics::now()), for the search metrics
+  double m_searchStartTime;
 
   
   
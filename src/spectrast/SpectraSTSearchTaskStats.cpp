@@ -61,7 +61,8 @@ SpectraSTSearchTaskStats::SpectraSTSearchTaskStats(bool doDecoyAnalysis) :
   m_numLowerHits(11, 0),
   m_numDecoyLowerHits(11, 0),
   m_numTotalLowerHits(0),
-  m_numTotalDecoyLowerHits(0) {
+  m_numTotalDecoyLowerHits(0),
+  m_metrics() {
 //  m_numTotalLowerSingletonHits(0), 
 //  m_numTotalDecoyLowerSingletonHits(0) {
 }
@@ -83,10 +84,23 @@ string SpectraSTSearchTaskStats::getScanStatsStr() {
 
   return (ss.str());
 }
+
+// getScanStatsJSON - same as getScanStatsStr(), as a JSON object
+string SpectraSTSearchTaskStats::getScanStatsJSON() {
+  
+  stringstream ss;
+  ss << "{ \"scans\": " << m_numScans << ", \"searched\": " << m_numSearched << ", \"likely_good\": " << m_numLikelyGood;
+  ss << ", \"not_selected\": " << m_numNotSelected << ", \"failed_filter\": " << m_numFailedFilter;
+  ss << ", \"missing\": " << m_numMissing << ", \"ms1\": " << m_numMS1 << " }";
+  
+  return (ss.str());
+}
     
 // processSearch - take the search results and store some interesting stats. TO BE EXPANDED
 void SpectraSTSearchTaskStats::processSearchResult(SpectraSTSearch* s) {
   
+  m_metrics.addSample(s->getMetricsSampleRef());
+  
   if (s->isNoMatch()) {
     return;
   }
@@ -247,6 +261,8 @@ SpectraSTSearchTaskStats* SpectraSTSearchTaskStats::aggregateStats(vector<Spectr
     
     aggregate->m_numTotalLowerHits += (*i)->m_numTotalLowerHits;
     aggregate->m_numTotalDecoyLowerHits += (*i)->m_numTotalDecoyLowerHits;
+    
+    aggregate->m_metrics.merge((*i)->m_metrics);
   
     for (map<string, int>::iterator decoy = (*i)->m_decoyCounts.begin(); decoy != (*i)->m_decoyCounts.end(); decoy++) {
       map<string, int>::iterator found = aggregate->m_decoyCounts.find(decoy->first);  
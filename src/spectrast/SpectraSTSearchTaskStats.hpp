@@ -55,6 +55,7 @@ public:
     ~SpectraSTSearchTaskStats();
     
     string getScanStatsStr();
+    string getScanStatsJSON();
 
     void processSearchResult(SpectraSTSearch* s);
     void logStats();
@@ -92,6 +93,9 @@ public:
     // unsigned int m_numTotalDecoyLowerSingletonHits;
   
     map<string, int> m_decoyCounts;
+    
+    // timings and counters of the searches (see SpectraSTSearchMetrics)
+    SpectraSTSearchMetrics m_metrics;
 
 };
 
@@ -314,25 +314,25 @@ void SpectraSTSimScores::printHeaderTabDelimited(ofstream& fout) {
 void SpectraSTSimScores::printHtml(ofstream& fout) {
   
   fout.precision(3);
-  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << fval << "</TT></TD>" << endl; 
+  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << fval << "</TT></TD>" << '\n'; 
   fout.precision(3);
-  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << dot << "</TT></TD>" << endl;
+  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << dot << "</TT></TD>" << '\n';
   fout.precision(3);
-  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << delta << "</TT></TD>" << endl;
+  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << delta << "</TT></TD>" << '\n';
   fout.precision(3);
-  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << dotBias << "</TT></TD>" << endl;
+  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << dotBias << "</TT></TD>" << '\n';
   fout.precision(4);
-  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << showpos << precursorMzDiff << noshowpos << "</TT></TD>" << endl;
+  fout << "  <TD BGCOLOR=\"" << NORMALCELLCOLOR << "\"><TT>" << fixed << showpos << precursorMzDiff << noshowpos << "</TT></TD>" << '\n';
   
 }
 
 void SpectraSTSimScores::printHeaderHtml(ofstream& fout) {
   
-  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Fval" << "</TT></TH>" << endl; 
-  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Dot" << "</TT></TH>" << endl;
-  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Delta" << "</TT></TH>" << endl;
-  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "DBias" << "</TT></TH>" << endl;
-  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "MzDiff" << "</TT></TH>" << endl;
+  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Fval" << "</TT></TH>" << '\n'; 
+  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Dot" << "</TT></TH>" << '\n';
+  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "Delta" << "</TT></TH>" << '\n';
+  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "DBias" << "</TT></TH>" << '\n';
+  fout << "  <TH BGCOLOR=\"" << HEADERCELLCOLOR << "\"><TT>" << "MzDiff" << "</TT></TH>" << '\n';
   
   
 }
@@ -341,31 +341,31 @@ void SpectraSTSimScores::printHeaderHtml(ofstream& fout) {
 void SpectraSTSimScores::printPepXML(ofstream& fout) {
   
   fout.precision(3);		
-  fout << "<search_score name=\"dot\" value=\"" << dot << "\"/>" << endl;	
+  fout << "<search_score name=\"dot\" value=\"" << dot << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"delta\" value=\"" << delta << "\"/>" << endl;	
+  fout << "<search_score name=\"delta\" value=\"" << delta << "\"/>" << '\n';	
   fout.precision(3);		 
-  fout << "<search_score name=\"dot_bias\" value=\"" << dotBias << "\"/>" << endl;	
+  fout << "<search_score name=\"dot_bias\" value=\"" << dotBias << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"precursor_mz_diff\" value=\"" << precursorMzDiff << "\"/>" << endl;
+  fout << "<search_score name=\"precursor_mz_diff\" value=\"" << precursorMzDiff << "\"/>" << '\n';
   fout.precision(3);		
-  fout << "<search_score name=\"hits_num\" value=\"" << hitsNum << "\"/>" << endl;	
+  fout << "<search_score name=\"hits_num\" value=\"" << hitsNum << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"hits_mean\" value=\"" << hitsMean << "\"/>" << endl;	
+  fout << "<search_score name=\"hits_mean\" value=\"" << hitsMean << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"hits_stdev\" value=\"" << hitsStDev << "\"/>" << endl;	
+  fout << "<search_score name=\"hits_stdev\" value=\"" << hitsStDev << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"fval\" value=\"" << fval << "\"/>" << endl;
+  fout << "<search_score name=\"fval\" value=\"" << fval << "\"/>" << '\n';
   fout.precision(3);		
-  fout << "<search_score name=\"p_value\" value=\"" << scientific << pValue << "\"/>" << endl;	
+  fout << "<search_score name=\"p_value\" value=\"" << scientific << pValue << "\"/>" << '\n';	
   fout.precision(3);		
-  fout << "<search_score name=\"KS_score\" value=\"" << fixed << KSScore << "\"/>" << endl;	  
+  fout << "<search_score name=\"KS_score\" value=\"" << fixed << KSScore << "\"/>" << '\n';	  
   fout.precision(2);
-  fout << "<search_score name=\"first_non_homolog\" value=\"" << firstNonHomolog << "\"/>" << endl;
+  fout << "<search_score name=\"first_non_homolog\" value=\"" << firstNonHomolog << "\"/>" << '\n';
   fout.precision(3);		
-  fout << "<search_score name=\"open_mod_mass\" value=\"" << openMod.first << "\"/>" << endl;
+  fout << "<search_score name=\"open_mod_mass\" value=\"" << openMod.first << "\"/>" << '\n';
   fout.precision(2);
-  fout << "<search_score name=\"open_mod_locations\" value=\"" << openMod.second << "\"/>" << endl;
+  fout << "<search_score name=\"open_mod_locations\" value=\"" << openMod.second << "\"/>" << '\n';
 
   
 	
@@ -0,0 +1,560 @@
+#include "SpectraSTSimilarityClusterer.hpp"
+#include "SpectraSTLog.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+
+/* Class: SpectraSTSimilarityClusterer
+ *
+ * Clusters the entries of a library by spectral similarity, sweeping through the library bin by bin.
+ *
+ */
+
+extern SpectraSTLog* g_log;
+
+// CLUSTER_WINDOW_HALF_WIDTH - a cluster takes in entries in the bins within this many Th of the precursor m/z of the root
+static const double CLUSTER_WINDOW_HALF_WIDTH = 2.5;
+
+// CLUSTER_TASK_CHUNK_SIZE - the number of items a thread takes at a time from a task. Smaller tasks are not shared out.
+static const unsigned int CLUSTER_TASK_CHUNK_SIZE = 16;
+
+// constructor - spawns the worker threads
+SpectraSTSimilarityClusterer::SpectraSTSimilarityClusterer(SpectraSTMzLibIndex* mzIndex, SpectraSTCreateParams& params, unsigned int numThreads) :
+  m_mzIndex(mzIndex),
+  m_params(params),
+  m_numBins(mzIndex->getNumBins()),
+  m_offsets(),
+  m_entries(),
+  m_isClustered(),
+  m_isGoodSingleton(),
+  m_isBinLoaded(),
+  m_binRoots(),
+  m_nextBin(0),
+  m_curRoots(),
+  m_nextRoot(0),
+  m_numVisited(0),
+  m_windowFirst(0),
+  m_windowLowBin(0),
+  m_windowHighBin(0),
+  m_windowStates(),
+  m_cluster(),
+  m_task(PREPARE_ENTRIES),
+  m_taskItems(),
+  m_taskResults(),
+  m_dotMember(NULL),
+  m_numWorkers(numThreads > 1 ? numThreads - 1 : 0),
+  m_nextTaskItem(0),
+  m_numTaskItemsDone(0),
+  m_taskGeneration(0),
+  m_stop(false),
+  m_workerData(NULL),
+  m_threads(NULL) {
+
+  m_mzIndex->getFileOrderOffsets(m_offsets);
+  m_entries.assign(m_offsets.size(), (SpectraSTLibEntry*)NULL);
+  m_isClustered.assign(m_offsets.size(), 0);
+  m_isGoodSingleton.assign(m_offsets.size(), 0);
+  m_isBinLoaded.assign(m_numBins, 0);
+  m_binRoots.resize(m_numBins);
+
+  if (m_numWorkers == 0) return;
+
+#ifdef MSVC
+  InitializeCriticalSection(&m_taskLock);
+  InitializeConditionVariable(&m_taskAvailable);
+  InitializeConditionVariable(&m_taskFinished);
+  m_threads = new HANDLE[m_numWorkers];
+#else
+  pthread_mutex_init(&m_taskLock, NULL);
+  pthread_cond_init(&m_taskAvailable, NULL);
+  pthread_cond_init(&m_taskFinished, NULL);
+  m_threads = new pthread_t[m_numWorkers];
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+#endif
+
+  m_workerData = new struct clusterWorkerData[m_numWorkers];
+
+  for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+    m_workerData[ti].clustererPtr = this;
+    m_workerData[ti].workerIndex = ti;
+
+#ifdef MSVC
+    int returnCode = 0;
+    m_threads[ti] = CreateThread(NULL, 0, runWorkerThread, (void*)&m_workerData[ti], 0, NULL);
+    if (!m_threads[ti]) {
+      returnCode = ti + 1;
+    }
+#else
+    int returnCode = pthread_create(&m_threads[ti], &attr, runWorkerThread, (void*)(&(m_workerData[ti])));
+#endif
+
+    if (returnCode != 0) {
+      stringstream msg;
+      msg << "Cannot spawn new thread #" << ti << "; return code from pthread_create() is " << returnCode;
+      g_log->error("SIMILARITY_CLUSTERING", msg.str());
+      g_log->crash();
+    }
+  }
+
+#ifndef MSVC
+  pthread_attr_destroy(&attr);
+#endif
+
+}
+
+// destructor - stops the worker threads, and frees the entries still in the window
+SpectraSTSimilarityClusterer::~SpectraSTSimilarityClusterer() {
+
+  if (m_numWorkers > 0) {
+
+    lockTask();
+    m_stop = true;
+#ifdef MSVC
+    WakeAllConditionVariable(&m_taskAvailable);
+#else
+    pthread_cond_broadcast(&m_taskAvailable);
+#endif
+    unlockTask();
+
+    for (unsigned int ti = 0; ti < m_numWorkers; ti++) {
+
+#ifdef MSVC
+      WaitForSingleObject(m_threads[ti], INFINITE);
+      CloseHandle(m_threads[ti]);
+#else
+      void* status;
+      int returnCode = pthread_join(m_threads[ti], &status);
+      if (returnCode != 0) {
+	stringstream msg;
+	msg << "Cannot join thread #" << ti << "; return code from pthread_join() is " << returnCode;
+	g_log->error("SIMILARITY_CLUSTERING", msg.str());
+	g_log->crash();
+      }
+#endif
+
+    }
+
+#ifdef MSVC
+    DeleteCriticalSection(&m_taskLock);
+#else
+    pthread_cond_destroy(&m_taskFinished);
+    pthread_cond_destroy(&m_taskAvailable);
+    pthread_mutex_destroy(&m_taskLock);
+#endif
+
+    delete[] m_threads;
+    delete[] m_workerData;
+  }
+
+  for (unsigned int bin = 0; bin < m_numBins; bin++) {
+    if (m_isBinLoaded[bin]) freeBin(bin);
+  }
+
+}
+
+// nextCluster - builds the next cluster, and returns the file offsets of its members in ascending order. For a singleton,
+// isGoodSingleton says whether the entry is good enough to be kept by itself: it is a consensus of several replicates,
+// or its Xrea (of the simplified spectrum) reaches params.unidentifiedSingletonXreaThreshold. Returns false when all entries
+// are clustered.
+bool SpectraSTSimilarityClusterer::nextCluster(vector<fstream::off_type>& members, bool& isGoodSingleton) {
+
+  while (true) {
+
+    while (m_nextRoot >= (unsigned int)(m_curRoots.size())) {
+      if (m_nextBin >= m_numBins) return (false);
+      startBin(m_nextBin++);
+    }
+
+    unsigned int root = m_curRoots[m_nextRoot++];
+    m_numVisited++;
+
+    if (m_isClustered[root]) {
+      // already in a cluster
+      continue;
+    }
+
+    buildCluster(root);
+
+    members.clear();
+    for (vector<unsigned int>::iterator i = m_cluster.begin(); i != m_cluster.end(); i++) {
+      m_isClustered[*i] = 1;
+      members.push_back(m_offsets[*i]);
+    }
+    sort(members.begin(), members.end());
+
+    isGoodSingleton = (m_cluster.size() == 1 && m_isGoodSingleton[root]);
+    return (true);
+  }
+
+}
+
+// startBin - moves the sweep on to a bin: frees the bins that no cluster from here on can reach, and reads the bin in
+// (if not already) to get its roots
+void SpectraSTSimilarityClusterer::startBin(unsigned int bin) {
+
+  // a root in this bin or above has a precursor m/z of at least (that of the bin) - 0 ... so its window starts 
+  // at most 3 bins below (windows reaching further down only occur at the clamped bottom bin, and are read in again if so)
+  unsigned int reach = (unsigned int)(CLUSTER_WINDOW_HALF_WIDTH) + 1;
+  for (unsigned int b = 0; b + reach < bin; b++) {
+    if (m_isBinLoaded[b]) freeBin(b);
+  }
+
+  loadBins(bin, bin);
+  m_curRoots.swap(m_binRoots[bin]);
+  m_binRoots[bin].clear();
+  m_nextRoot = 0;
+}
+
+// loadBins - reads in the entries of the bins from lowBin to highBin that are not already in the window, and prepares
+// them for comparison. The entries of each bin are then ordered by S/N as roots, exactly as 
+// SpectraSTMzLibIndex::sortEntriesBySN() orders them.
+void SpectraSTSimilarityClusterer::loadBins(unsigned int lowBin, unsigned int highBin) {
+
+  m_taskItems.clear();
+  vector<unsigned int> newBins;
+
+  for (unsigned int bin = lowBin; bin <= highBin && bin < m_numBins; bin++) {
+    if (m_isBinLoaded[bin]) continue;
+    for (unsigned int i = m_mzIndex->getBinStart(bin); i < m_mzIndex->getBinStart(bin + 1); i++) {
+      m_entries[i] = m_mzIndex->readEntry(m_offsets[i]);
+      m_taskItems.push_back(i);
+    }
+    m_isBinLoaded[bin] = 1;
+    newBins.push_back(bin);
+  }
+
+  if (newBins.empty()) return;
+
+  // the S/N of each entry comes back in m_taskResults
+  runTask(PREPARE_ENTRIES);
+
+  unsigned int k = 0;
+  for (vector<unsigned int>::iterator b = newBins.begin(); b != newBins.end(); b++) {
+
+    unsigned int binStart = m_mzIndex->getBinStart(*b);
+    unsigned int binEnd = m_mzIndex->getBinStart(*b + 1);
+
+    vector<pair<fstream::off_type, double> > entriesInBin;
+    for (unsigned int i = binStart; i < binEnd; i++, k++) {
+      entriesInBin.push_back(pair<fstream::off_type, double>(m_offsets[i], m_taskResults[k]));
+    }
+    sort(entriesInBin.begin(), entriesInBin.end(), SpectraSTMzLibIndex::sortEntriesDesc);
+
+    // within a bin, the entries are in file order, so the position of an entry is found by its offset
+    vector<unsigned int>& roots = m_binRoots[*b];
+    roots.clear();
+    for (vector<pair<fstream::off_type, double> >::iterator en = entriesInBin.begin(); en != entriesInBin.end(); en++) {
+      roots.push_back((unsigned int)(lower_bound(m_offsets.begin() + binStart, m_offsets.begin() + binEnd, en->first) - m_offsets.begin()));
+    }
+  }
+
+}
+
+// freeBin - deletes the entries of a bin
+void SpectraSTSimilarityClusterer::freeBin(unsigned int bin) {
+
+  for (unsigned int i = m_mzIndex->getBinStart(bin); i < m_mzIndex->getBinStart(bin + 1); i++) {
+    if (m_entries[i]) delete (m_entries[i]);
+    m_entries[i] = NULL;
+  }
+  m_isBinLoaded[bin] = 0;
+  vector<unsigned int>().swap(m_binRoots[bin]);
+}
+
+// prepareEntry - simplifies and bins an entry for comparison, once and for all, and decides if it is good enough to be
+// kept as a singleton. Returns the S/N, for ordering the roots. 
+double SpectraSTSimilarityClusterer::prepareEntry(SpectraSTLibEntry* entry, char& isGoodSingleton) {
+
+  SpectraSTPeakList* pl = entry->getPeakList();
+
+  // S/N of the spectrum as read
+  double sn = pl->calcSignalToNoise();
+
+  pl->quickSimplify(50, 99999, true, 0.0);
+
+  double xrea = 0.0;
+  if (!(entry->getOneComment("Xrea", xrea))) {
+    xrea = pl->calcXrea(true);
+  }
+  isGoodSingleton = (entry->getNrepsUsed() > 1 || xrea >= m_params.unidentifiedSingletonXreaThreshold) ? 1 : 0;
+
+  // the same binning as SpectraSTPeakList::compare()
+  pl->binPeaksWithScaling(0.0, 0.5, 1.0, 1, 0.5, false, true, 0.0);
+
+  return (sn);
+}
+
+// buildCluster - builds the cluster of a root, in m_cluster
+void SpectraSTSimilarityClusterer::buildCluster(unsigned int root) {
+
+  double rootPrecursorMz = m_entries[root]->getPrecursorMz();
+
+  m_windowLowBin = m_mzIndex->calcBinNumber(rootPrecursorMz - CLUSTER_WINDOW_HALF_WIDTH);
+  m_windowHighBin = m_mzIndex->calcBinNumber(rootPrecursorMz + CLUSTER_WINDOW_HALF_WIDTH);
+  loadBins(m_windowLowBin, m_windowHighBin);
+
+  m_windowFirst = m_mzIndex->getBinStart(m_windowLowBin);
+  unsigned int windowLast = m_mzIndex->getBinStart(m_windowHighBin + 1);
+
+  // entries that are already members of other clusters are not considered
+  m_windowStates.assign(windowLast - m_windowFirst, WINDOW_ALIVE);
+  for (unsigned int i = m_windowFirst; i < windowLast; i++) {
+    if (m_isClustered[i]) m_windowStates[i - m_windowFirst] = WINDOW_DEAD;
+  }
+
+  m_cluster.clear();
+  m_cluster.push_back(root);
+  m_windowStates[root - m_windowFirst] = WINDOW_IN_CLUSTER;
+
+  findSpectralNeighbors(root, rootPrecursorMz, 0);
+}
+
+// findSpectralNeighbors - adds to the cluster the entries in the window within 2.5 - round Th of rootPrecursorMz that are
+// similar enough to a member, then does the same for each entry added, in the next round around the mean precursor m/z
+// of the cluster. An entry with a dot product below 0.3 with any member is not considered again for this cluster.
+void SpectraSTSimilarityClusterer::findSpectralNeighbors(unsigned int member, double rootPrecursorMz, unsigned int round) {
+
+  double lowMz = rootPrecursorMz - CLUSTER_WINDOW_HALF_WIDTH + (double)round;
+  double highMz = rootPrecursorMz + CLUSTER_WINDOW_HALF_WIDTH - (double)round;
+
+  // the candidates, in window order. Only the bins overlapping [lowMz, highMz] need to be looked at; one bin more
+  // on either side, in case the precursor m/z of an entry differs slightly from its m/z in the index.
+  unsigned int lowBin = m_mzIndex->calcBinNumber(lowMz);
+  unsigned int highBin = m_mzIndex->calcBinNumber(highMz) + 1;
+  lowBin = (lowBin > m_windowLowBin + 1 ? lowBin - 1 : m_windowLowBin);
+  if (highBin > m_windowHighBin) highBin = m_windowHighBin;
+
+  m_taskItems.clear();
+  for (unsigned int i = m_mzIndex->getBinStart(lowBin); i < m_mzIndex->getBinStart(highBin + 1); i++) {
+    if (m_windowStates[i - m_windowFirst] != WINDOW_ALIVE) continue;
+    double precursorMz = m_entries[i]->getPrecursorMz();
+    if (precursorMz < lowMz || precursorMz > highMz) continue;
+    m_taskItems.push_back(i);
+  }
+
+  m_dotMember = m_entries[member]->getPeakList();
+  runTask(CALC_DOTS);
+
+  unsigned int numInCluster = (unsigned int)(m_cluster.size());
+  double sumMzInCluster = rootPrecursorMz * (double)(m_cluster.size());
+  vector<unsigned int> hits;
+
+  for (unsigned int k = 0; k < (unsigned int)(m_taskItems.size()); k++) {
+
+    unsigned int i = m_taskItems[k];
+    double dot = m_taskResults[k];
+
+    if (dot >= m_params.unidentifiedClusterMinimumDot - (double)round * 0.05) {
+
+      m_windowStates[i - m_windowFirst] = WINDOW_IN_CLUSTER;
+      m_cluster.push_back(i);
+      hits.push_back(i);
+
+      numInCluster++;
+      sumMzInCluster += m_entries[i]->getPrecursorMz();
+
+    } else if (dot < 0.3) {
+      // hopeless, remove from consideration in subsequent rounds
+      m_windowStates[i - m_windowFirst] = WINDOW_DEAD;
+    }
+  }
+
+  if (round >= 2) return;
+
+  double meanMzInCluster = sumMzInCluster / (double)numInCluster;
+
+  for (vector<unsigned int>::iterator h = hits.begin(); h != hits.end(); h++) {
+    findSpectralNeighbors(*h, meanMzInCluster, round + 1);
+  }
+
+}
+
+// runTask - does the task for all of m_taskItems, putting a result for each in m_taskResults. Shared out among the threads
+// if big enough; returns when all is done.
+void SpectraSTSimilarityClusterer::runTask(clusterTask task) {
+
+  unsigned int numItems = (unsigned int)(m_taskItems.size());
+  m_taskResults.assign(numItems, 0.0);
+
+  if (m_numWorkers == 0 || numItems < 2 * CLUSTER_TASK_CHUNK_SIZE) {
+    for (unsigned int k = 0; k < numItems; k++) {
+      doTaskItem(task, k);
+    }
+    return;
+  }
+
+  lockTask();
+  m_task = task;
+  m_nextTaskItem = 0;
+  m_numTaskItemsDone = 0;
+  m_taskGeneration++;
+#ifdef MSVC
+  WakeAllConditionVariable(&m_taskAvailable);
+#else
+  pthread_cond_broadcast(&m_taskAvailable);
+#endif
+  unlockTask();
+
+  workOnTask();
+
+  lockTask();
+  while (m_numTaskItemsDone < numItems) {
+#ifdef MSVC
+    SleepConditionVariableCS(&m_taskFinished, &m_taskLock, INFINITE);
+#else
+    pthread_cond_wait(&m_taskFinished, &m_taskLock);
+#endif
+  }
+  unlockTask();
+
+}
+
+// workOnTask - takes chunks of the current task until there is none left
+void SpectraSTSimilarityClusterer::workOnTask() {
+
+  while (true) {
+
+    lockTask();
+    unsigned int numItems = (unsigned int)(m_taskItems.size());
+    if (m_nextTaskItem >= numItems) {
+      unlockTask();
+      return;
+    }
+    clusterTask task = m_task;
+    unsigned int first = m_nextTaskItem;
+    unsigned int last = first + CLUSTER_TASK_CHUNK_SIZE;
+    if (last > numItems) last = numItems;
+    m_nextTaskItem = last;
+    unlockTask();
+
+    for (unsigned int k = first; k < last; k++) {
+      doTaskItem(task, k);
+    }
+
+    lockTask();
+    m_numTaskItemsDone += last - first;
+    if (m_numTaskItemsDone >= numItems) {
+#ifdef MSVC
+      WakeConditionVariable(&m_taskFinished);
+#else
+      pthread_cond_signal(&m_taskFinished);
+#endif
+    }
+    unlockTask();
+  }
+
+}
+
+// doTaskItem - does the task for item k
+void SpectraSTSimilarityClusterer::doTaskItem(clusterTask task, unsigned int k) {
+
+  unsigned int i = m_taskItems[k];
+
+  if (task == PREPARE_ENTRIES) {
+    m_taskResults[k] = prepareEntry(m_entries[i], m_isGoodSingleton[i]);
+  } else {
+    // the same as SpectraSTPeakList::compare(), the entries being binned already
+    m_taskResults[k] = m_dotMember->calcDot(m_entries[i]->getPeakList());
+  }
+}
+
+#ifdef MSVC
+DWORD WINAPI SpectraSTSimilarityClusterer::runWorkerThread(LPVOID threadArg) {
+#else
+void* SpectraSTSimilarityClusterer::runWorkerThread(void* threadArg) {
+#endif
+
+  struct clusterWorkerData* workerData = (struct clusterWorkerData*)threadArg;
+
+  workerData->clustererPtr->workerLoop();
+
+  long ti = (long)(workerData->workerIndex);
+
+#ifdef MSVC
+  ExitThread(0);
+#else
+  pthread_exit((void*)ti);
+#endif
+
+}
+
+// workerLoop - waits for a task, and helps with it
+void SpectraSTSimilarityClusterer::workerLoop() {
+
+  unsigned long seenGeneration = 0;
+
+  while (true) {
+
+    lockTask();
+    while (m_taskGeneration == seenGeneration && !m_stop) {
+#ifdef MSVC
+      SleepConditionVariableCS(&m_taskAvailable, &m_taskLock, INFINITE);
+#else
+      pthread_cond_wait(&m_taskAvailable, &m_taskLock);
+#endif
+    }
+    if (m_stop) {
+      unlockTask();
+      return;
+    }
+    seenGeneration = m_taskGeneration;
+    unlockTask();
+
+    workOnTask();
+  }
+
+}
+
+// lockTask - locks the progress of the current task
+void SpectraSTSimilarityClusterer::lockTask() {
+#ifdef MSVC
+  EnterCriticalSection(&m_taskLock);
+#else
+  pthread_mutex_lock(&m_taskLock);
+#endif
+}
+
+// unlockTask - unlocks the progress of the current task
+void SpectraSTSimilarityClusterer::unlockTask() {
+#ifdef MSVC
+  LeaveCriticalSection(&m_taskLock);
+#else
+  pthread_mutex_unlock(&m_taskLock);
+#endif
+}
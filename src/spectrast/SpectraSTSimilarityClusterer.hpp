@@ -0,0 +1,181 @@
+#ifndef SPECTRASTSIMILARITYCLUSTERER_HPP_
+#define SPECTRASTSIMILARITYCLUSTERER_HPP_
+
+#include "SpectraSTMzLibIndex.hpp"
+#include "SpectraSTCreateParams.hpp"
+
+#include <vector>
+#include <fstream>
+
+#ifdef __MINGW__
+#define MSVC
+#endif
+
+#ifdef MSVC
+#include "windows.h"
+#else
+#include <pthread.h>
+#endif
+
+/*
+
+Program       : Spectrast
+Author        : Henry Lam <hlam@systemsbiology.org>
+Date          : 03.06.06
+
+
+Copyright (C) 2006 Henry Lam
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA
+
+Henry Lam
+Institute for Systems Biology
+401 Terry Avenue North
+Seattle, WA  98109  USA
+hlam@systemsbiology.org
+
+*/
+
+
+/* Class: SpectraSTSimilarityClusterer
+ *
+ * Clusters the entries of a library by spectral similarity, for the build action SIMILARITY_CLUSTERING. The clusters are those
+ * of the greedy procedure: going through the 1-Th precursor m/z bins in order, and through the entries of each bin in descending
+ * order of S/N, every entry not yet clustered starts a new cluster. The cluster takes in the unclustered entries in the bins 
+ * within 2.5 Th of this root that are similar enough to the root, then those similar enough to the new members, and so on 
+ * for 2 more rounds, each with a narrower precursor m/z window and a lower minimum dot product.
+ *
+ * Since the roots are visited bin by bin, only the bins around the current one are needed at any time. They are read in as 
+ * a sliding window, each entry is prepared for comparison (simplified and binned) once when read, and the bins are freed once
+ * the sweep has moved past them. Whether an entry is clustered is a flat array over all entries, indexed by the entry's 
+ * position in the library (bin by bin, in file order); the state of the entries in the window while a cluster is built
+ * is a flat array over the window. The dot products of a member with all its candidates, and the preparation of the 
+ * entries read, are shared out among the threads. Which candidates get compared to which member does not depend on
+ * the threads, so the clusters are the same with any number of threads.
+ *
+ */
+
+using namespace std;
+
+struct clusterWorkerData;
+
+class SpectraSTSimilarityClusterer {
+
+public:
+  SpectraSTSimilarityClusterer(SpectraSTMzLibIndex* mzIndex, SpectraSTCreateParams& params, unsigned int numThreads);
+  ~SpectraSTSimilarityClusterer();
+
+  bool nextCluster(vector<fstream::off_type>& members, bool& isGoodSingleton);
+  unsigned int getNumVisited() { return (m_numVisited); }
+
+#ifdef MSVC
+  static DWORD WINAPI runWorkerThread(LPVOID threadArg);
+#else
+  static void* runWorkerThread(void* threadArg);
+#endif
+
+private:
+
+  // the states of the entries in the window while a cluster is built
+  enum windowState { WINDOW_ALIVE = 0, WINDOW_DEAD, WINDOW_IN_CLUSTER };
+
+  // the tasks shared out among the threads
+  enum clusterTask { PREPARE_ENTRIES = 0, CALC_DOTS };
+
+  // the index of the library - NOT a property of this class. Used for reading the entries.
+  SpectraSTMzLibIndex* m_mzIndex;
+
+  SpectraSTCreateParams& m_params;
+
+  unsigned int m_numBins;
+
+  // the flat arrays over all entries, in the order of SpectraSTMzLibIndex::getFileOrderOffsets(): the file offsets,
+  // the entries prepared for comparison (NULL unless in a bin in the sliding window), whether each entry is already 
+  // in a cluster, and whether it is good enough to be kept as a singleton (only known while in the window)
+  vector<fstream::off_type> m_offsets;
+  vector<SpectraSTLibEntry*> m_entries;
+  vector<char> m_isClustered;
+  vector<char> m_isGoodSingleton;
+
+  // the bins in the sliding window, and the entries of each bin in the order they are visited as roots
+  vector<char> m_isBinLoaded;
+  vector<vector<unsigned int> > m_binRoots;
+
+  // where the sweep is: the next bin to visit, the roots of the current bin and the next one of them,
+  // and the number of roots visited so far
+  unsigned int m_nextBin;
+  vector<unsigned int> m_curRoots;
+  unsigned int m_nextRoot;
+  unsigned int m_numVisited;
+
+  // the cluster being built: the window of entries it can take in, their states, and the members so far
+  unsigned int m_windowFirst;
+  unsigned int m_windowLowBin;
+  unsigned int m_windowHighBin;
+  vector<char> m_windowStates;
+  vector<unsigned int> m_cluster;
+
+  // the task being shared out: the items (entries) to work on, and a result for each. For CALC_DOTS,
+  // the peak list of the member to compare to.
+  clusterTask m_task;
+  vector<unsigned int> m_taskItems;
+  vector<double> m_taskResults;
+  SpectraSTPeakList* m_dotMember;
+
+  // the worker threads (one fewer than the threads used; the caller's thread works on the tasks too).
+  // m_nextTaskItem, m_numTaskItemsDone, m_taskGeneration and m_stop are guarded by the task lock.
+  unsigned int m_numWorkers;
+  unsigned int m_nextTaskItem;
+  unsigned int m_numTaskItemsDone;
+  unsigned long m_taskGeneration;
+  bool m_stop;
+  struct clusterWorkerData* m_workerData;
+
+  void startBin(unsigned int bin);
+  void loadBins(unsigned int lowBin, unsigned int highBin);
+  void freeBin(unsigned int bin);
+  double prepareEntry(SpectraSTLibEntry* entry, char& isGoodSingleton);
+
+  void buildCluster(unsigned int root);
+  void findSpectralNeighbors(unsigned int member, double rootPrecursorMz, unsigned int round);
+
+  void runTask(clusterTask task);
+  void workOnTask();
+  void doTaskItem(clusterTask task, unsigned int k);
+  void workerLoop();
+
+  void lockTask();
+  void unlockTask();
+
+#ifdef MSVC
+  CRITICAL_SECTION m_taskLock;
+  CONDITION_VARIABLE m_taskAvailable;
+  CONDITION_VARIABLE m_taskFinished;
+  HANDLE* m_threads;
+#else
+  pthread_mutex_t m_taskLock;
+  pthread_cond_t m_taskAvailable;
+  pthread_cond_t m_taskFinished;
+  pthread_t* m_threads;
+#endif
+
+};
+
+struct clusterWorkerData {
+  SpectraSTSimilarityClusterer* clustererPtr;
+  unsigned int workerIndex;
+};
+
+#endif /*SPECTRASTSIMILARITYCLUSTERER_HPP_*/
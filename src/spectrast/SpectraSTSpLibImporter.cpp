@@ -1,5 +1,6 @@
 #include "SpectraSTSpLibImporter.hpp"
 #include "SpectraSTReplicates.hpp"
+#include "SpectraSTSimilarityClusterer.hpp"
 #include "SpectraSTFastaFileHandler.hpp"
 #include "SpectraSTLog.hpp"
 #include "SpectraSTConstants.hpp"
@@ -71,6 +72,7 @@ SpectraSTSpLibImporter::SpectraSTSpLibImporter(vector<string>& impFileNames, Spe
   m_splibFins(), 
   m_pepIndices(),
   m_mzIndices(),
+  m_mappedLibs(),
   m_plotPath(""),
   m_QFSearchParams(NULL),
   m_QFSearchLib(NULL),
@@ -137,6 +139,11 @@ SpectraSTSpLibImporter::~SpectraSTSpLibImporter() {
   for (vector<SpectraSTMzLibIndex*>::iterator k = m_mzIndices.begin(); k != m_mzIndices.end(); k++) {
     if (*k) delete (*k);
   }
+  
+  // unmaps the mapped libraries
+  for (vector<SpectraSTMappedLibFile*>::iterator l = m_mappedLibs.begin(); l != m_mappedLibs.end(); l++) {
+    if (*l) delete (*l);
+  }
 
   if (m_ppMappings) {
     for (map<string, vector<pair<string, string> >* >::iterator m = m_ppMappings->begin(); m != m_ppMappings->end(); m++) {
@@ -246,6 +253,15 @@ void SpectraSTSpLibImporter::import() {
   SpectraSTPeptideLibIndex* pepIndex = m_pepIndices[curPepIndex];
   if (!pepIndex) return; // require the first file to be okay
 
+  // with -c_THR, the consensus/best-replicate spectra are built on worker threads, and inserted in order as they come back.
+  // not while training the denoiser though, which learns from each consensus spectrum as it is built.
+  SpectraSTBuildScheduler* scheduler = NULL;
+  if (m_params.numThreadsUsed > 1 && (m_params.buildAction == "CONSENSUS" || m_params.buildAction == "BEST_REPLICATE") &&
+      !(m_denoisers && !((*m_denoisers)[0]->isFilterReady()))) {
+    scheduler = new SpectraSTBuildScheduler(m_params, m_denoisers, m_plotPath, m_params.numThreadsUsed,
+					    m_params.numThreadsUsed * MAX_NUM_PENDING_BUILDS_PER_THREAD);
+  }
+
   ProgressCount pc(!g_quiet && !g_verbose, 500, 0);
   pc.start("Importing ions");
 
@@ -316,6 +332,20 @@ void SpectraSTSpLibImporter::import() {
 	  cout << " (" << entries.size() << " replicates)" << endl;
 	}
 	
+        if (scheduler) {
+	  // hand the replicates to the workers, and insert whatever has been built in the meantime
+	  if (scheduler->isFull()) {
+	    insertBuiltGroup(scheduler->retrieve(true));
+	  }
+	  scheduler->submit(entries);
+
+	  replicateGroup* group = NULL;
+	  while ((group = scheduler->retrieve(false))) {
+	    insertBuiltGroup(group);
+	  }
+	  continue;
+	}
+
         // perform the build actions
         doBuildAction(entries);
          
@@ -329,6 +359,13 @@ void SpectraSTSpLibImporter::import() {
       
     } // while (nextPeptide)
     
+    if (scheduler) {
+      // everything of this pass must be in the library before the next pass checks what is already included
+      while (!(scheduler->isEmpty())) {
+	insertBuiltGroup(scheduler->retrieve(true));
+      }
+    }
+    
  //   cerr << "Ave B/Y Assigned Ratio = " << m_totBYRatio / (float)(m_lib->getCount()) << endl;
   
     
@@ -344,6 +381,8 @@ void SpectraSTSpLibImporter::import() {
 
   pc.done();
 
+  if (scheduler) delete (scheduler);
+
   if (m_denoisers && m_params.trainBayesianDenoiser) {
 
     for (unsigned int charge = 0; charge <= MAX_CHARGE; charge++) {
@@ -480,37 +519,13 @@ void SpectraSTSpLibImporter::doSubtractHomologs() {
 // doBuildAction - performs the build actions BEST_REPLICATE and CONSENSUS
 void SpectraSTSpLibImporter::doBuildAction(vector<SpectraSTLibEntry*>& entries) {
   
-  if (m_params.buildAction == "BEST_REPLICATE") {
-	  
-    SpectraSTReplicates* replicates = new SpectraSTReplicates(entries, m_params);
-    replicates->setPlotPath(m_plotPath);
-    
-    // pick the best replicate and only insert that one into the library
-    SpectraSTLibEntry* best = replicates->findBestReplicate();
-    if (best) {
-    //  best->getPeakList()->rankTransformWithQuota(50, true, 180.0);
-      insertOneEntry(best, "BEST_REPLICATE");
-    }  
-    delete (replicates);
-	  
-  } else if (m_params.buildAction == "CONSENSUS") {
-    SpectraSTReplicates* replicates = new SpectraSTReplicates(entries, m_params, m_denoisers);
-    replicates->setPlotPath(m_plotPath);
-    // make a consensus spectrum of replicates and insert that into the library
-    SpectraSTLibEntry* consensus = replicates->makeConsensusSpectrum(); 
-    
-    if (consensus) {
-      if (m_denoisers && !((*m_denoisers)[0]->isFilterReady()) && consensus->getNrepsUsed() == 1) {
-        // just remember this peptide ion, don't write to library yet
-	pair<string, string> p;
-	p.first = consensus->getPeptidePtr()->stripped;
-	p.second = SpectraSTPeptideLibIndex::constructSubkey(consensus);
-	m_singletonPeptideIons.push_back(p);
-      } else {
-	insertOneEntry(consensus, "CONSENSUS");
-      }
+  if (m_params.buildAction == "BEST_REPLICATE" || m_params.buildAction == "CONSENSUS") {
+
+    // pick the best replicate, or make a consensus spectrum of replicates, and insert that into the library
+    SpectraSTLibEntry* built = SpectraSTBuildScheduler::build(entries, m_params, m_denoisers, m_plotPath, m_params.numThreadsUsed);
+    if (built) {
+      insertBuiltEntry(built);
     }
-    delete (replicates);
 
   } else {
     
@@ -526,6 +541,33 @@ void SpectraSTSpLibImporter::doBuildAction(vector<SpectraSTLibEntry*>& entries)
   
 }
 
+// insertBuiltEntry - inserts the best replicate or consensus spectrum built from the replicates of a peptide ion
+void SpectraSTSpLibImporter::insertBuiltEntry(SpectraSTLibEntry* built) {
+
+  if (m_params.buildAction == "CONSENSUS" && m_denoisers && !((*m_denoisers)[0]->isFilterReady()) && built->getNrepsUsed() == 1) {
+    // just remember this peptide ion, don't write to library yet
+    pair<string, string> p;
+    p.first = built->getPeptidePtr()->stripped;
+    p.second = SpectraSTPeptideLibIndex::constructSubkey(built);
+    m_singletonPeptideIons.push_back(p);
+  } else {
+    insertOneEntry(built, m_params.buildAction);
+  }
+}
+
+// insertBuiltGroup - inserts the entry built by the build scheduler from a group of replicates, then deletes the replicates
+void SpectraSTSpLibImporter::insertBuiltGroup(replicateGroup* group) {
+
+  if (group->built) {
+    insertBuiltEntry(group->built);
+  }
+
+  for (vector<SpectraSTLibEntry*>::iterator den = group->entries.begin(); den != group->entries.end(); den++) {
+    delete (*den);
+  }
+  delete (group);
+}
+
 
 // doQualityFilter - performs the quality filters on all library entries
 void SpectraSTSpLibImporter::doQualityFilter() {
@@ -2488,6 +2530,7 @@ void SpectraSTSpLibImporter::openSplibs(bool openMzIndex, double mzIndexCacheRan
       m_splibFins.push_back(NULL);
       m_pepIndices.push_back(NULL);
       m_mzIndices.push_back(NULL);
+      m_mappedLibs.push_back(NULL);
       continue;
     }  
 
@@ -2500,8 +2543,15 @@ void SpectraSTSpLibImporter::openSplibs(bool openMzIndex, double mzIndexCacheRan
 
     m_splibFins.push_back(splibFin);
     
+    // a library in the mappable binary format is mapped into memory, and entries are read from there
+    SpectraSTMappedLibFile* mappedLib = NULL;
+    if (binary && SpectraSTMappedLibFile::skipHeader(*splibFin)) {
+      mappedLib = new SpectraSTMappedLibFile(*f);
+    }
+    m_mappedLibs.push_back(mappedLib);
+    
     if (openPepIndex || checkUniqueness || (refresh && !(m_params.refreshDatabase.empty()))) {
-      SpectraSTPeptideLibIndex* pepIndex = new SpectraSTPeptideLibIndex(fn.path + fn.name + ".pepidx", splibFin, binary); 	
+      SpectraSTPeptideLibIndex* pepIndex = new SpectraSTPeptideLibIndex(fn.path + fn.name + ".pepidx", splibFin, binary, mappedLib); 	
       if (checkUniqueness && !pepIndex->isUniqueLibrary()) {
 	// non-unique library, i.e. some peptide ions have multiple spectra.
 	delete (pepIndex);
@@ -2523,7 +2573,7 @@ void SpectraSTSpLibImporter::openSplibs(bool openMzIndex, double mzIndexCacheRan
     }
 
     if (openMzIndex) {      
-      SpectraSTMzLibIndex* mzIndex = new SpectraSTMzLibIndex(fn.path + fn.name + ".spidx", splibFin, mzIndexCacheRange, binary, false);      
+      SpectraSTMzLibIndex* mzIndex = new SpectraSTMzLibIndex(fn.path + fn.name + ".spidx", splibFin, mzIndexCacheRange, binary, false, mappedLib);      
       m_mzIndices.push_back(mzIndex);
     } else {
       m_mzIndices.push_back(NULL);
@@ -2562,98 +2612,42 @@ void SpectraSTSpLibImporter::doSimilarityClustering() {
     cout.flush();
   }
   
-  map<fstream::off_type, int> clusteredEntries;
-  vector<set<fstream::off_type>* > multiclusters;
+  vector<vector<fstream::off_type> > multiclusters;
 
   ProgressCount pc(!g_quiet && !g_verbose, 1, (int)(mzIndex->getEntryCount()));
   pc.start("Clustering");
   
-  mzIndex->sortEntriesBySN();
-  
-  fstream::off_type offset = 0;
-  while (mzIndex->nextSortedFileOffset(offset)) {
- 
-    pc.increment();
-  
-    if (clusteredEntries.find(offset) != clusteredEntries.end()) {
-      // already in a cluster
-      continue;
-    }
+  // the clusters come out in the same order as the entries are visited as roots: by precursor m/z bin, then by S/N
+  SpectraSTSimilarityClusterer clusterer(mzIndex, m_params, m_params.numThreadsUsed);
 
-    SpectraSTLibEntry* entry = mzIndex->thisSortedEntry();
+  unsigned int numCounted = 0;
+  vector<fstream::off_type> cluster;
+  bool isGoodSingleton = false;
+  while (clusterer.nextCluster(cluster, isGoodSingleton)) {
 
-    if (entry->getLibFileOffset() != offset) {
-      cerr << "Something is wrong!!" << endl;
-      exit(1);
-    }
-
-    // if (!(entry->getPeakList()->passFilterUnidentified())) {
-    //  // this is just double-checking, should have been removed in MzXMLLibImporter
-    //  delete (entry);
-    //  continue;
-    // }
-    
-    set<fstream::off_type>* cluster = new set<fstream::off_type>;
-    cluster->insert(entry->getLibFileOffset());
-
-    vector<SpectraSTLibEntry*> isobaricEntries;
-    double rootPrecursorMz = entry->getPrecursorMz();
-    mzIndex->retrieve(isobaricEntries, rootPrecursorMz - 2.5, rootPrecursorMz + 2.5, true);
-    
-    // remove spectra that are already members of other clusters
-    for (vector<SpectraSTLibEntry*>::iterator ie = isobaricEntries.begin(); ie != isobaricEntries.end(); ie++) {
-      if (clusteredEntries.find((*ie)->getLibFileOffset()) != clusteredEntries.end()) {
-	// already member of other clusters
-	(*ie) = NULL;
-      }
+    for ( ; numCounted < clusterer.getNumVisited(); numCounted++) {
+      pc.increment();
     }
-        
-    findSpectralNeighbors(entry, rootPrecursorMz, 0, isobaricEntries, cluster);
     
-    if (cluster->size() == 1) {
+    if (cluster.size() == 1) {
       // singleton, just copy this entry and be done with it
-            
-      string xreaStr("");
-      double xrea = 0.0;
-      if (entry->getOneComment("Xrea", xreaStr)) {
-	xrea = atof(xreaStr.c_str());
-      } else {
-	xrea = entry->getPeakList()->calcXrea(true);
-	stringstream xreass;
-	xreass.precision(3);
-        xreass << fixed << xrea;
-        entry->setOneComment("Xrea", xreass.str());
-      }
-	
-      //string snStr("");
-      //double sn = 0.0;
-      //if (entry->getOneComment("SN", snStr)) {
-      //  sn = atof(snStr.c_str());
-      //} 
-      
-      if (entry->getNrepsUsed() > 1 || xrea >= m_params.unidentifiedSingletonXreaThreshold) {
+      if (isGoodSingleton) {
   	// re-read unprocessed entry from library
-	splibFin->seekg(entry->getLibFileOffset());
-	SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*splibFin, true, false);
+	SpectraSTLibEntry* newEntry = mzIndex->readEntry(cluster[0]);
         insertOneEntry(newEntry, "SIMILARITY_CLUSTERING");
 	delete (newEntry);
       } 
-
-      clusteredEntries[entry->getLibFileOffset()] = -1; // don't belong to any multicluster
-      delete (cluster);
     
     } else {
-      int clusterIndex = (int)(multiclusters.size());
-      for (set<fstream::off_type>::iterator i = cluster->begin(); i != cluster->end(); i++) {
-	clusteredEntries[*i] = clusterIndex;
-      }
       multiclusters.push_back(cluster);      
     }
     
-    delete (entry);
-    
   }
-  
+
+  for ( ; numCounted < clusterer.getNumVisited(); numCounted++) {
+    pc.increment();
+  }
+
   pc.done();
   
   cout << "Found " << multiclusters.size() << " clusters of 2+ members." << endl;
@@ -2662,18 +2656,17 @@ void SpectraSTSpLibImporter::doSimilarityClustering() {
   pc2.start("Generating merged spectra from clusters");
   
   // now deal with true clusters of more than 1 members
-  for (vector<set<fstream::off_type>* >::iterator cl = multiclusters.begin(); cl != multiclusters.end(); cl++) {
+  for (vector<vector<fstream::off_type> >::iterator cl = multiclusters.begin(); cl != multiclusters.end(); cl++) {
     
     pc2.increment();
       
     vector<SpectraSTLibEntry*> entries;
-    for (set<fstream::off_type>::iterator os = (*cl)->begin(); os != (*cl)->end(); os++) {
-      splibFin->seekg(*os);
-      SpectraSTLibEntry* newEntry = new SpectraSTLibEntry(*splibFin, true, false);
+    for (vector<fstream::off_type>::iterator os = cl->begin(); os != cl->end(); os++) {
+      SpectraSTLibEntry* newEntry = mzIndex->readEntry(*os);
       entries.push_back(newEntry);
     }
     
-    SpectraSTReplicates* replicates = new SpectraSTReplicates(entries, m_params);
+    SpectraSTReplicates* replicates = new SpectraSTReplicates(entries, m_params, NULL, m_params.numThreadsUsed);
     
     SpectraSTLibEntry* consensus = replicates->makeConsensusSpectrum();
         
@@ -2687,8 +2680,6 @@ void SpectraSTSpLibImporter::doSimilarityClustering() {
       delete (*en);
     }
     
-    delete (*cl);
-    
   }
   
   pc2.done();
@@ -2696,75 +2687,6 @@ void SpectraSTSpLibImporter::doSimilarityClustering() {
   
 }
 
-void SpectraSTSpLibImporter::findSpectralNeighbors(SpectraSTLibEntry* entry, double rootPrecursorMz, unsigned int round, 
-						   vector<SpectraSTLibEntry*>& isobaricEntries, 
-						   set<fstream::off_type>* cluster) {
-    
-  SpectraSTPeakList* pl = entry->getPeakList();
-  pl->quickSimplify(50, 99999, true, 0.0);
-//    int level = cluster->size();
-  
-  double lowMz = rootPrecursorMz - 2.5 + (double)round;
-  double highMz = rootPrecursorMz + 2.5 - (double)round;
-  
-  unsigned int numInCluster = (unsigned int)(cluster->size());
-  double sumMzInCluster = rootPrecursorMz * (double)(cluster->size());
-  vector<SpectraSTLibEntry*> hits;
-  //  double sumDot = 0.0;
-  //  double sumDotSquare = 0.0;
-  // multimap<double, SpectraSTLibEntry*> hits;
-  
-  for (vector<SpectraSTLibEntry*>::iterator en = isobaricEntries.begin(); en != isobaricEntries.end(); en++) {
-
-    if (!(*en)) {
-      // do not consider, set to NULL because it is already member of another cluster, or
-      // already matches one of the spectrum in this cluster with dot < 0.3
-      continue;
-    }
-
-    if ((cluster->find((*en)->getLibFileOffset()) != cluster->end())) {
-      // already in this cluster
-      (*en) = NULL;
-      continue;
-    }
- 
-    double precursorMz = (*en)->getPrecursorMz();
- 
-    if (precursorMz < lowMz || precursorMz > highMz) {
-      continue;
-    }
-
-    (*en)->getPeakList()->quickSimplify(50, 99999, true, 0.0);
-    double dot = pl->compare((*en)->getPeakList());
-    
-    if (dot >= m_params.unidentifiedClusterMinimumDot - (double)round * 0.05) {
-
-      cluster->insert((*en)->getLibFileOffset());
-      hits.push_back(*en);
-      
-      numInCluster++;
-      sumMzInCluster += precursorMz;
-      
-    } else if (dot < 0.3) {
-      // hopeless, remove these from consideration in subsequent rounds
-      (*en) = NULL;
-      
-    }
-     
-  }
-  
-  if (round >= 2) return;
-  
-  double meanMzInCluster = sumMzInCluster / (double)numInCluster;
-  
-  for (vector<SpectraSTLibEntry*>::iterator h = hits.begin(); h != hits.end(); h++) {
-  
-    findSpectralNeighbors(*h, meanMzInCluster, round + 1, isobaricEntries, cluster);
-
-  }
- 
-}
-
 bool SpectraSTSpLibImporter::hackDeamidation(SpectraSTLibEntry* entry) {
   
   int numDeamidation = entry->getMassDiffInt();
@@ -3049,7 +2971,7 @@ void SpectraSTSpLibImporter::doBuildSemiEmpiricalSplib() {
       
     } else if (predicts.size() > 1) {
 
-      SpectraSTReplicates* replicates = new SpectraSTReplicates(predicts, m_params, m_denoisers);
+      SpectraSTReplicates* replicates = new SpectraSTReplicates(predicts, m_params, m_denoisers, m_params.numThreadsUsed);
       // make a consensus spectrum of replicates and insert that into the library
       SpectraSTLibEntry* consensus = replicates->makeConsensusSpectrum();   
       
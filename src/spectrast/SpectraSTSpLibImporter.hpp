@@ -3,6 +3,7 @@
 
 #include "SpectraSTLibImporter.hpp"
 #include "SpectraSTDenoiser.hpp"
+#include "SpectraSTBuildScheduler.hpp"
 #include <map>
 #include <set>
 
@@ -90,6 +91,10 @@ private:
   // these are properties of this class  
   vector<SpectraSTMzLibIndex*> m_mzIndices;
 
+  // the memory-mapped .splib files, for those in the mappable binary format (NULL for the others)
+  // these are properties of this class  
+  vector<SpectraSTMappedLibFile*> m_mappedLibs;
+
   // a map to store all peptide-protein mappings during database refresh
   map<string, vector<pair<string, string> >* >* m_ppMappings;
 
@@ -113,6 +118,8 @@ private:
   
   // uniquify methods
   void doBuildAction(vector<SpectraSTLibEntry*>& entries);
+  void insertBuiltEntry(SpectraSTLibEntry* built);
+  void insertBuiltGroup(replicateGroup* group);
   SpectraSTLibEntry* findBestReplicate(vector<SpectraSTLibEntry*>& entries);
   SpectraSTLibEntry* makeConsensusSpectrum(vector<SpectraSTLibEntry*>& entries);
 
@@ -150,7 +157,6 @@ private:
   
   // similarity clustering
   void doSimilarityClustering();
-  void findSpectralNeighbors(SpectraSTLibEntry* entry, double rootPrecursorMz, unsigned int round, vector<SpectraSTLibEntry*>& isobaricEntries, set<fstream::off_type>* cluster);
   
   // refresh peptide-protein mappings
   void addSequencesForRefresh(vector<string>& seqs);
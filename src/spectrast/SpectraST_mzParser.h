@@ -1173,6 +1173,7 @@ private:
 #define INSTRUMENT_LENGTH 2000
 #define SCANTYPE_LENGTH 32
 #define CHARGEARRAY_LENGTH 128
+#define PRECURSORARRAY_LENGTH 512
 
 typedef double RAMPREAL; 
 typedef f_off ramp_fileoffset_t;
@@ -1227,6 +1228,7 @@ struct ScanHeaderStruct {
 	int						numPossibleCharges;
 	int						peaksCount;
 	int						precursorCharge;  /* only if MS level > 1 */
+	int						precursorCount;
 	int						precursorScanNum; /* only if MS level > 1 */
 	int						scanIndex; //a sequential index for non-sequential scan numbers (1-based)
 	int						seqNum; // number in sequence observed file (1-based)
@@ -1236,23 +1238,27 @@ struct ScanHeaderStruct {
 	double					collisionEnergy;
 	double					compensationVoltage;  /* only if MS level > 1 */
 	double					highMZ;
+	double					ionInjectionTime;
 	double					ionisationEnergy;
 	double					lowMZ;
 	double					precursorIntensity;  /* only if MS level > 1 */
   double          precursorMonoMZ;
 	double					precursorMZ;  /* only if MS level > 1 */
 	double					retentionTime;        /* in seconds */
+	double					selectionWindowLower;  /* the range of ions acquired */
+	double					selectionWindowUpper;  /* in DDA, for example, +/-1 Da around precursor */
 	double					totIonCurrent;
-   
+	 
 	char					activationMethod[SCANTYPE_LENGTH];
+	char					additionalPrecursors[PRECURSORARRAY_LENGTH];
 	char					filterLine[CHARGEARRAY_LENGTH];
+	char					idString[CHARGEARRAY_LENGTH];
 	char					possibleCharges[SCANTYPE_LENGTH];
 	char					scanType[SCANTYPE_LENGTH];
-	char					idString[CHARGEARRAY_LENGTH];
-   
+	 
 	bool					centroid; //true if spectrum is centroided
 	bool					possibleChargesArray[CHARGEARRAY_LENGTH]; /* NOTE: does NOT include "precursorCharge" information; only from "possibleCharges" */
-   
+	 
 	ramp_fileoffset_t		filePosition; /* where in the file is this header? */
 };
 